@@ -6,6 +6,8 @@ HINSTANCE Application::s_hInst = NULL;
 
 Application::Application(HINSTANCE hInst)
 {
+	m_replay.speed = 1.0;
+
 	s_hInst = hInst;
 
 	_ASSERT(!s_pInst);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "General.h"
+#include "ReplayThread.h"
+
 #include <memory>
 
 class MainDialog;
@@ -15,6 +17,10 @@ public:
 
 	HWND GetMainWindow();
 
+	//set from the command line before the dialog shows: no segments means the driver is the source
+	void SetReplay(const ReplayOptions& replay) {m_replay = replay;}
+	const ReplayOptions& GetReplay() const {return m_replay;}
+
 public:
 	static HINSTANCE GetHInstance() {_ASSERT(s_pInst); return s_hInst;}
 	static Application* GetInst() {_ASSERT(s_pInst); return s_pInst;}
@@ -24,6 +30,8 @@ private:
 	static Application*	s_pInst;
 
 	std::unique_ptr<MainDialog>	m_pMainDlg;
+
+	ReplayOptions	m_replay;
 };
 
 #define theApp Application::GetInst()
\ No newline at end of file
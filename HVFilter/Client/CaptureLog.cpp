@@ -0,0 +1,293 @@
+#include "CaptureLog.h"
+
+#include <cstdio>
+
+//the index following the highest of the segments in directory, 0 if there is none
+static ULONG next_segment_index(const std::wstring& directory)
+{
+	WIN32_FIND_DATAW data;
+	ULONG next = 0;
+
+	HANDLE hFind = FindFirstFileW((directory + L"\\capture-*.hvr").c_str(), &data);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return 0;
+
+	do {
+		ULONG index;
+
+		if (swscanf_s(data.cFileName, L"capture-%u.hvr", &index) == 1 && index >= next)
+			next = index + 1;
+	} while (FindNextFileW(hFind, &data));
+
+	FindClose(hFind);
+
+	return next;
+}
+
+CaptureLog::CaptureLog()
+	: m_pQueue(NULL),
+	m_head(0), m_tail(0),
+	m_pending(0), m_dropped(0),
+	m_hWakeEvent(NULL),
+	m_hThread(NULL),
+	m_bStop(false),
+	m_segmentIndex(0),
+	m_hSegment(INVALID_HANDLE_VALUE),
+	m_hMapping(NULL),
+	m_lastSync(0)
+{
+	memset(&m_segment, 0, sizeof(m_segment));
+}
+
+CaptureLog::~CaptureLog()
+{
+	Close();
+}
+
+bool CaptureLog::Open(const std::wstring& directory)
+{
+	if (m_hThread)
+		return false;
+
+	CreateDirectoryW(directory.c_str(), NULL);
+
+	m_directory = directory;
+	m_segmentIndex = next_segment_index(directory);
+
+	//committed up front: the producer never waits on the allocator
+	m_pQueue = (BYTE*)VirtualAlloc(NULL, CAPTURE_QUEUE_LENGTH, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (!m_pQueue || !m_hWakeEvent || !OpenSegment()) {
+		Close();
+		return false;
+	}
+
+	m_head = m_tail = 0;
+	m_pending = 0;
+	m_bStop = false;
+
+	m_hThread = CreateThread(NULL, 0, WriterThread, this, 0, NULL);
+	if (!m_hThread) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void CaptureLog::Close()
+{
+	if (m_hThread) {
+		Commit();
+
+		//the writer empties the queue before it leaves
+		m_bStop = true;
+		SetEvent(m_hWakeEvent);
+
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+	}
+
+	CloseSegment();
+
+	if (m_hWakeEvent) {
+		CloseHandle(m_hWakeEvent);
+		m_hWakeEvent = NULL;
+	}
+
+	if (m_pQueue) {
+		VirtualFree(m_pQueue, 0, MEM_RELEASE);
+		m_pQueue = NULL;
+	}
+}
+
+bool CaptureLog::Append(const HV_RECORD_HEADER* pRecord)
+{
+	ULONG length = pRecord->Length;
+
+	//the writer walks the queue by these lengths
+	if (!m_pQueue || length < sizeof(HV_RECORD_HEADER) || (length & (HV_RECORD_ALIGNMENT - 1)))
+		return false;
+
+	//volatile read: the writer is done with the bytes before m_tail
+	if (length > CAPTURE_QUEUE_LENGTH - (m_pending - (ULONG64)m_tail)) {
+		InterlockedIncrement64(&m_dropped);
+		return false;
+	}
+
+	ULONG offset = (ULONG)(m_pending & (CAPTURE_QUEUE_LENGTH - 1));
+	ULONG first = min(length, (ULONG)CAPTURE_QUEUE_LENGTH - offset);
+
+	memcpy(m_pQueue + offset, pRecord, first);
+	memcpy(m_pQueue, (const BYTE*)pRecord + first, length - first);
+
+	m_pending += length;
+
+	return true;
+}
+
+void CaptureLog::Commit()
+{
+	if (m_pending == (ULONG64)m_head)
+		return;
+
+	//the records are complete before the writer can see them; one wakeup per batch
+	InterlockedExchange64(&m_head, (LONG64)m_pending);
+	SetEvent(m_hWakeEvent);
+}
+
+DWORD WINAPI CaptureLog::WriterThread(LPVOID lpParameter)
+{
+	CaptureLog* pThis = (CaptureLog*)lpParameter;
+
+	pThis->Write();
+
+	return 0;
+}
+
+void CaptureLog::CopyOut(ULONG64 position, void* pTarget, ULONG length) const
+{
+	ULONG offset = (ULONG)(position & (CAPTURE_QUEUE_LENGTH - 1));
+	ULONG first = min(length, (ULONG)CAPTURE_QUEUE_LENGTH - offset);
+
+	memcpy(pTarget, m_pQueue + offset, first);
+	memcpy((BYTE*)pTarget + first, m_pQueue, length - first);
+}
+
+void CaptureLog::Write()
+{
+	bool stopping = false;
+
+	m_lastSync = GetTickCount();
+
+	while (!stopping) {
+		//the flag is read before the queue: nothing committed before Close is left behind
+		stopping = m_bStop;
+
+		ULONG64 tail = (ULONG64)m_tail;
+		ULONG64 head = (ULONG64)m_head;
+
+		//a segment that could not be created is tried again on the next wakeup
+		bool failed = false;
+
+		while (tail != head) {
+			HV_RECORD_HEADER header;
+
+			CopyOut(tail, &header, sizeof(header));
+
+			PHV_RECORD_HEADER pTarget = m_segment.Buffer ?
+				HvRecordAppend(&m_segment, header.Type, header.Length, header.PortId, header.Timestamp) : NULL;
+
+			//the segment is full, or there is none: the record starts the next one
+			if (!pTarget && !failed) {
+				CloseSegment();
+
+				failed = !OpenSegment();
+				if (!failed)
+					pTarget = HvRecordAppend(&m_segment, header.Type, header.Length, header.PortId, header.Timestamp);
+			}
+
+			//without a segment the records are lost rather than block the producer
+			if (pTarget)
+				CopyOut(tail, pTarget, header.Length);
+			else
+				InterlockedIncrement64(&m_dropped);
+
+			tail += header.Length;
+		}
+
+		InterlockedExchange64(&m_tail, (LONG64)tail);
+
+		if (GetTickCount() - m_lastSync >= CAPTURE_SYNC_INTERVAL)
+			Sync();
+
+		if (!stopping)
+			WaitForSingleObject(m_hWakeEvent, CAPTURE_SYNC_INTERVAL);
+	}
+}
+
+bool CaptureLog::OpenSegment()
+{
+	WCHAR name[32];
+
+	swprintf_s(name, L"\\capture-%06u.hvr", m_segmentIndex);
+
+	std::wstring path = m_directory + name;
+
+	//never over a segment of another run
+	m_hSegment = CreateFileW(path.c_str(), GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	//a file that showed up since is skipped; other failures are tried again with the same name
+	if (m_hSegment == INVALID_HANDLE_VALUE) {
+		if (GetLastError() == ERROR_FILE_EXISTS)
+			++m_segmentIndex;
+
+		return false;
+	}
+
+	//sizing the mapping allocates the file
+	m_hMapping = CreateFileMapping(m_hSegment, NULL, PAGE_READWRITE, 0, CAPTURE_SEGMENT_LENGTH, NULL);
+
+	PVOID pView = m_hMapping ? MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, CAPTURE_SEGMENT_LENGTH) : NULL;
+
+	if (!pView) {
+		if (m_hMapping) {
+			CloseHandle(m_hMapping);
+			m_hMapping = NULL;
+		}
+
+		//the retry creates it again
+		CloseHandle(m_hSegment);
+		m_hSegment = INVALID_HANDLE_VALUE;
+		DeleteFileW(path.c_str());
+		return false;
+	}
+
+	HvRecordWriterInit(&m_segment, pView, CAPTURE_SEGMENT_LENGTH);
+	HvRecordWriterFinish(&m_segment);
+
+	++m_segmentIndex;
+
+	return true;
+}
+
+void CaptureLog::Sync()
+{
+	if (m_segment.Buffer) {
+		HvRecordWriterFinish(&m_segment);
+
+		FlushViewOfFile(m_segment.Buffer, m_segment.Offset);
+		FlushFileBuffers(m_hSegment);
+	}
+
+	m_lastSync = GetTickCount();
+}
+
+void CaptureLog::CloseSegment()
+{
+	if (!m_segment.Buffer)
+		return;
+
+	Sync();
+
+	ULONG length = m_segment.Offset;
+
+	UnmapViewOfFile(m_segment.Buffer);
+	CloseHandle(m_hMapping);
+	m_hMapping = NULL;
+
+	memset(&m_segment, 0, sizeof(m_segment));
+
+	//give back what the segment did not use
+	LARGE_INTEGER end;
+	end.QuadPart = length;
+
+	if (SetFilePointerEx(m_hSegment, end, NULL, FILE_BEGIN))
+		SetEndOfFile(m_hSegment);
+
+	CloseHandle(m_hSegment);
+	m_hSegment = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "General.h"
+
+#include "../HVService/HVService/HVRecord.h"
+
+#include <string>
+
+//bytes of records the producer can be ahead of the writer; a power of 2
+#define CAPTURE_QUEUE_LENGTH (4 * 1024 * 1024)
+
+//size of a segment file, allocated when it is created
+#define CAPTURE_SEGMENT_LENGTH (64 * 1024 * 1024)
+
+//the segment is flushed to disk at least this often, in ms
+#define CAPTURE_SYNC_INTERVAL 1000
+
+//
+// Binary capture log: records (see HVRecord.h) are handed over through a
+// single producer / single consumer queue to a writer thread, which appends
+// them to memory mapped segment files (capture-NNNNNN.hvr); a run numbers its
+// segments on from the highest one already in the directory, so the segments
+// of earlier runs are never overwritten.  Every segment is a
+// record stream; its header is brought up to date whenever the segment is
+// flushed, so a segment cut short by a crash is readable up to the last flush.
+// The files are rendered offline (HVTool dump).
+//
+class CaptureLog
+{
+public:
+	CaptureLog();
+	~CaptureLog();
+
+	bool Open(const std::wstring& directory);
+	void Close();
+
+	//producer side, one thread: records are queued by Append and handed to the writer by Commit
+	bool Append(const HV_RECORD_HEADER* pRecord);
+	void Commit();
+
+	//records the queue had no room for, or that came while no segment could be created
+	ULONG64 GetDropped() const { return (ULONG64)m_dropped; }
+
+private:
+	static DWORD WINAPI WriterThread(LPVOID lpParameter);
+	void Write();
+	void CopyOut(ULONG64 position, void* pTarget, ULONG length) const;
+
+	bool OpenSegment();
+	void CloseSegment();
+	void Sync();
+
+private:
+	BYTE*			m_pQueue;
+
+	//free running byte counts: m_head is published by Commit, m_tail by the writer
+	volatile LONG64	m_head;
+	volatile LONG64	m_tail;
+
+	//producer only: the end of the records appended since the last Commit
+	ULONG64			m_pending;
+
+	//counted by the producer and by the writer
+	volatile LONG64	m_dropped;
+
+	HANDLE			m_hWakeEvent;
+	HANDLE			m_hThread;
+	volatile bool	m_bStop;
+
+	//writer only; m_segmentIndex is the index of the next segment
+	std::wstring	m_directory;
+	ULONG			m_segmentIndex;
+	HANDLE			m_hSegment;
+	HANDLE			m_hMapping;
+	HV_RECORD_WRITER	m_segment;
+	DWORD			m_lastSync;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Thread.h"
+#include "Seqlock.h"
+
+#include "../HVService/HVService/HVStats.h"
+
+//totals since the thread started, or the source's own
+struct DataCounters
+{
+	ULONG64		inboundCount;
+	ULONG64		inboundSize;
+	ULONG64		outboundCount;
+	ULONG64		outboundSize;
+};
+
+//
+// A thread the main dialog renders the totals of: it counts frames as its
+// source hands them over, or takes the totals the source keeps, and publishes
+// them when it sees fit.  The source is the service's data stream
+// (DataDeviceThread) or a recorded capture (ReplayThread).
+//
+class CountersThread : public Thread
+{
+public:
+	CountersThread() { memset(&m_counters, 0, sizeof(m_counters)); }
+
+	//latest totals, for the UI; never waits on the thread.  Returns their
+	//sequence, which only changes when new totals are published
+	LONG GetCounters(DataCounters& counters) const { return m_published.Read(counters); }
+
+protected:
+	//direction is HV_STATS_DIRECTION_*
+	void CountFrame(ULONG direction, ULONG frameLength)
+	{
+		if (direction == HV_STATS_DIRECTION_INBOUND) {
+			++m_counters.inboundCount;
+			m_counters.inboundSize += frameLength;
+		} else {
+			++m_counters.outboundCount;
+			m_counters.outboundSize += frameLength;
+		}
+	}
+
+	//totals the source keeps itself
+	void SetCounters(const DataCounters& counters) { m_counters = counters; }
+
+	//the UI renders on its own timer: the thread never waits on the message loop
+	void PublishCounters() { m_published.Publish(m_counters); }
+
+private:
+	//updated by the thread, published by PublishCounters
+	DataCounters			m_counters;
+	Seqlock<DataCounters>	m_published;
+};
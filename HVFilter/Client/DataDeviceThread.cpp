@@ -1,9 +1,11 @@
 #include "DataDeviceThread.h"
 #include "Application.h"
 
+#include "../HVService/HVService/HVStats.h"
+
 #include <cstdlib>
+#include <cstdio>
 #include <iostream>
-#include <fstream>
 
 ////TODO: already defined in driver
 //struct PacketInfo
@@ -12,24 +14,10 @@
 //	ULONG ulSize;
 //};
 
-DataDeviceThread::
-	DataDeviceThread(HWND hInboundPackageCountWnd, HWND hInboundPackageSizeWnd,
-	HWND hOutboundPackageCountWnd, HWND hOutboundPackageSizeWnd)
-	: m_hInboundPackageCountWnd(hInboundPackageCountWnd),
-	m_hInboundPackageSizeWnd(hInboundPackageSizeWnd),
-	m_hOutboundPackageCountWnd(hOutboundPackageCountWnd),
-	m_hOutboundPackageSizeWnd(hOutboundPackageSizeWnd),
-	m_hConn(INVALID_HANDLE_VALUE),
-	m_bOrderStop(false)
-{
-}
-
 DataDeviceThread::DataDeviceThread(void)
-	: m_hInboundPackageCountWnd(NULL),
-	m_hInboundPackageSizeWnd(NULL),
-	m_hOutboundPackageCountWnd(NULL),
-	m_hOutboundPackageSizeWnd(NULL),
-	m_hConn(INVALID_HANDLE_VALUE),
+	: m_hData(INVALID_HANDLE_VALUE),
+	m_hStreamEvent(NULL),
+	m_pStream(NULL),
 	m_bOrderStop(false)
 {
 }
@@ -37,147 +25,164 @@ DataDeviceThread::DataDeviceThread(void)
 
 DataDeviceThread::~DataDeviceThread(void)
 {
-	if (m_hConn) {
-		CloseHandle(m_hConn);
-		m_hConn = INVALID_HANDLE_VALUE;
-	}
+	//the thread sees the stop within DATA_STOP_LATENCY and disconnects itself
+	Stop();
+	Wait();
+
+	Disconnect();
 }
 
 bool DataDeviceThread::Connect()
 {
-	while (INVALID_HANDLE_VALUE == m_hConn)
+	while (!m_bOrderStop)
 	{
-		m_hConn = CreateFileA("\\\\.\\OSRMSPassthroughExtData", GENERIC_READ|GENERIC_WRITE,
+		//overlapped: the read stays pending while the thread checks for a stop
+		m_hData = CreateFileA("\\\\.\\OSRMSPassthroughExtData", GENERIC_READ|GENERIC_WRITE,
 			NULL,NULL,OPEN_EXISTING,
-			FILE_ATTRIBUTE_NORMAL,NULL);
+			FILE_ATTRIBUTE_NORMAL|FILE_FLAG_OVERLAPPED,NULL);
 
-		if(m_hConn == INVALID_HANDLE_VALUE) {
-			std::cerr << "could not create pipe: " << GetLastError() << std::endl;
+		if(m_hData == INVALID_HANDLE_VALUE) {
+			std::cerr << "could not open data device: " << GetLastError() << std::endl;
+		} else {
+			m_hStreamEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			m_pStream = new BYTE[DATA_STREAM_LENGTH];
+
+			return true;
 		}
 
 		Sleep(1000);
 	}
 
-	return true;
+	return false;
 }
 
-void DataDeviceThread::Stop()
-{
-	m_bOrderStop = true;
-}
-
-void DataDeviceThread::OnStart()
+void DataDeviceThread::Disconnect()
 {
-#ifdef _DEBUG
-	Sleep(10000);
-#endif
+	//also fails the read in flight; the stream buffer is only freed once it is over
+	if (m_hData != INVALID_HANDLE_VALUE) {
+		DWORD bytesRead = 0;
 
-	m_bOrderStop = false;
-	bool first_time = true;
-
-	if (!Connect())
-		return;
+		CancelIo(m_hData);
+		GetOverlappedResult(m_hData, &m_streamOverlapped, &bytesRead, TRUE);
 
-	LARGE_INTEGER time0, time1, freq;
-
-	QueryPerformanceFrequency(&freq);
-	QueryPerformanceCounter(&time0);
-
-	//TODO: if exit is being requested, must exit the loop.
+		CloseHandle(m_hData);
+		m_hData = INVALID_HANDLE_VALUE;
+	}
 
-	//ULONGLONG value;
-	int     nRetCode = 0;
+	if (m_hStreamEvent) {
+		CloseHandle(m_hStreamEvent);
+		m_hStreamEvent = NULL;
+	}
 
-	WCHAR cur_dir_path[MAX_PATH];
+	delete[] m_pStream;
+	m_pStream = NULL;
+}
 
-	GetCurrentDirectoryW(MAX_PATH, cur_dir_path);
-	std::wstring path = cur_dir_path;
-	path += L"\\info.txt";
+void DataDeviceThread::Stop()
+{
+	m_bOrderStop = true;
+}
 
-	std::ofstream of(path);
-	BYTE* data = new BYTE[2000 * 2];
+bool DataDeviceThread::StartRead()
+{
+	DWORD bytesRead = 0;
 
-	while (!m_bOrderStop) {
-		QueryPerformanceCounter(&time1);
-		double elapsed = double(time1.QuadPart - time0.QuadPart) / freq.QuadPart;
-		if (elapsed >= 1) {
+	memset(&m_streamOverlapped, 0, sizeof(m_streamOverlapped));
+	m_streamOverlapped.hEvent = m_hStreamEvent;
+	ResetEvent(m_hStreamEvent);
 
-			//char dataBuffer[65535];
-			DWORD index = 0;
-			DWORD bytesWritten, bytesRead;
+	//answered at once: the event is set all the same
+	return ReadFile(m_hData, m_pStream, DATA_STREAM_LENGTH, &bytesRead, &m_streamOverlapped) ||
+		GetLastError() == ERROR_IO_PENDING;
+}
 
-			//memset(&dataBuffer[0], 2, sizeof(dataBuffer));
+void DataDeviceThread::DecodeStream(DWORD length)
+{
+	HV_RECORD_READER reader;
+	DataCounters totals;
 
-			/*if(!WriteFile(m_hConn, &dataBuffer[0], sizeof(dataBuffer), &bytesWritten, NULL)) {
+	if (!HvRecordReaderInit(&reader, m_pStream, length)) {
+		std::cerr << "bad record stream from data device" << std::endl;
+		return;
+	}
 
-				nRetCode = GetLastError();
-				CloseHandle(m_hConn);
-				std::cerr << "Error Writing to Data Device. " << nRetCode << std::endl;
-				return;
+	memset(&totals, 0, sizeof(totals));
 
-			}*/
+	//the stream is already made of records: they go to the log as they are
+	for (const HV_RECORD_HEADER* pRecord = HvRecordNext(&reader); pRecord; pRecord = HvRecordNext(&reader)) {
+		m_log.Append(pRecord);
 
-			//memset(&dataBuffer[0], index, sizeof(dataBuffer));
+		if (pRecord->Type != HV_RECORD_COUNTERS || !HV_RECORD_HOLDS(pRecord, HV_RECORD_COUNTERS_DATA, Bytes))
+			continue;
 
-			if(!ReadFile(m_hConn, data, 2000 * 2, &bytesRead, NULL)) {
+		//the totals of every port, by direction; the switch record carries drops only
+		const HV_RECORD_COUNTERS_DATA* pCounters = (const HV_RECORD_COUNTERS_DATA*)pRecord;
 
-				nRetCode = GetLastError();
-				CloseHandle(m_hConn);
-				std::cerr << "Error Writing to Data Device. " << nRetCode << std::endl;
-				return;
+		if (pCounters->Direction == HV_STATS_DIRECTION_INBOUND) {
+			totals.inboundCount += pCounters->Frames;
+			totals.inboundSize += pCounters->Bytes;
+		} else if (pCounters->Direction == HV_STATS_DIRECTION_OUTBOUND) {
+			totals.outboundCount += pCounters->Frames;
+			totals.outboundSize += pCounters->Bytes;
+		}
+	}
 
-			}
+	SetCounters(totals);
+}
 
-			BYTE inbound_source[4], inbound_destination[4], outbound_source[4], outbound_destination[4];
+void DataDeviceThread::OnStart()
+{
+	m_bOrderStop = false;
 
-			memcpy(inbound_source, data, 4);
-			memcpy(inbound_destination, data + 4, 4);
-			WORD inbound_size = 0;
-			memcpy(&inbound_size, data + 8, 2);
+	if (!Connect())
+		return;
 
-			of << "inbound source: " << (ULONG)inbound_source[0] << '.' << (ULONG)inbound_source[1] << '.'
-				<< (ULONG)inbound_source[2] << '.' << (ULONG)inbound_source[3] << std::endl;
+	WCHAR cur_dir_path[MAX_PATH];
 
-			of << "inbound destination: " << (ULONG)inbound_destination[0] << '.' << (ULONG)inbound_destination[1] << '.' <<
-				(ULONG)inbound_destination[2] << '.' << (ULONG)inbound_destination[3] << std::endl;
-			of << "inbound data size: " << inbound_size << std::endl;
+	GetCurrentDirectoryW(MAX_PATH, cur_dir_path);
+	std::wstring path = cur_dir_path;
+	path += DATA_CAPTURE_DIRECTORY;
 
-			if (inbound_size > 0) {
-				char* inbound_data = new char[inbound_size];
-				memcpy(&inbound_data, data + 10, inbound_size);
+	if (!m_log.Open(path))
+		std::cerr << "could not open capture log: " << GetLastError() << std::endl;
 
-				of << "inbound data: " << inbound_data << std::endl << std::endl;
+	bool bPending = false;
 
-				delete[] inbound_data;
+	while (!m_bOrderStop) {
+		if (!bPending) {
+			//the data device only takes reads while the service runs
+			if (!StartRead()) {
+				WaitForSingleObject(m_hStreamEvent, 1000);
+				continue;
 			}
 
-			//----------------------------
-			data += 2000;
+			bPending = true;
+		}
 
-			memcpy(outbound_source, data, 4);
-			memcpy(outbound_destination, data + 4, 4);
-			WORD outbound_size = 0;
-			memcpy(&outbound_size, data + 8, 2);
+		//the service answers after its next drain of the rings
+		if (WaitForSingleObject(m_hStreamEvent, DATA_STOP_LATENCY) != WAIT_OBJECT_0)
+			continue;
 
-			of << "outbound source: " << (ULONG)outbound_source[0] << '.' << (ULONG)outbound_source[1] << '.' <<
-				(ULONG)outbound_source[2] << '.' << (ULONG)outbound_source[3] << std::endl;
+		DWORD bytesRead = 0;
 
-			of << "outbound destination: " << (ULONG)outbound_destination[0] << '.' << (ULONG)outbound_destination[1] << '.' <<
-				(ULONG)outbound_destination[2] << '.' << (ULONG)outbound_destination[3] << std::endl;
-			of << "outbound data size: " << outbound_size << std::endl;
+		bPending = false;
 
-			if (outbound_size > 0) {
-				char* outbound_data = new char[outbound_size];
-				memcpy(&outbound_data, data + 10, outbound_size);
+		if (!GetOverlappedResult(m_hData, &m_streamOverlapped, &bytesRead, FALSE))
+			continue;
 
-				of << "outbound data: " << outbound_data << std::endl << std::endl;
+		DecodeStream(bytesRead);
 
-				delete[] outbound_data;
-			}
+		//one handoff to the writer per read
+		m_log.Commit();
 
-			of << "-------------------------------------" << std::endl;
-		}
+		//and one to the UI
+		PublishCounters();
 	}
 
-	delete data;
-}
\ No newline at end of file
+	m_log.Close();
+
+	if (m_log.GetDropped())
+		std::cerr << "capture log dropped " << m_log.GetDropped() << " records" << std::endl;
+
+	Disconnect();
+}
@@ -1,46 +1,52 @@
 #pragma once
 
-#include "Thread.h"
+#include "CountersThread.h"
 
-class DataDeviceThread : public Thread
+#include "../HVService/HVService/HVRecord.h"
+#include "CaptureLog.h"
+
+//size of a data device read: the record stream of as many ports as fit
+#define DATA_STREAM_LENGTH (64 * 1024)
+
+//capture segments go in this directory, under the current one
+#define DATA_CAPTURE_DIRECTORY L"\\capture"
+
+//longest a stop request waits for the thread
+#define DATA_STOP_LATENCY 500
+
+//
+// Reader of the data device.  The service owns the record rings (the driver
+// takes one registration) and holds our reads until its next drain, or a
+// second at most, so each read brings back fresh totals without polling.  The
+// record stream goes to the capture log as it is, and the port totals in it
+// to the counters.
+//
+class DataDeviceThread : public CountersThread
 {
 public:
-	DataDeviceThread(HWND hInboundPackageCountWnd, HWND hInboundPackageSizeWnd,
-		HWND hOutboundPackageCountWnd, HWND hOutboundPackageSizeWnd);
 	DataDeviceThread();
 	~DataDeviceThread(void);
 
-	void SetControls(HWND hInboundPackageCountWnd, HWND hInboundPackageSizeWnd, 
-		HWND hOutboundPackageCountWnd, HWND hOutboundPackageSizeWnd)
-	{
-			m_hInboundPackageCountWnd = hInboundPackageCountWnd;
-			m_hInboundPackageSizeWnd = hInboundPackageSizeWnd;
-
-			m_hOutboundPackageCountWnd = hOutboundPackageCountWnd;
-			m_hOutboundPackageSizeWnd = hOutboundPackageSizeWnd;
-	}
-
 	void Stop() override;
 
 private:
 	void OnStart() override;
 	bool Connect();
+	void Disconnect();
 
-private:
-	HWND		m_hInboundPackageCountWnd;
-	HWND		m_hInboundPackageSizeWnd;
-
-	HWND		m_hOutboundPackageCountWnd;
-	HWND		m_hOutboundPackageSizeWnd;
-
-	HANDLE		m_hConn;
+	//keeps one read in flight; false if it failed
+	bool StartRead();
+	void DecodeStream(DWORD length);
 
-	char		m_sInboundCountText[20];
-	char		m_sInboundSizeText[20];
+private:
+	//data device: one read of the record stream is kept in flight, it is answered through the service
+	HANDLE		m_hData;
+	HANDLE		m_hStreamEvent;
+	OVERLAPPED	m_streamOverlapped;
+	BYTE*		m_pStream;
 
-	char		m_sOutboundCountText[20];
-	char		m_sOutboundSizeText[20];
+	//everything received, in binary; rendered offline
+	CaptureLog	m_log;
 
-	bool		m_bOrderStop;
+	volatile bool	m_bOrderStop;
 };
-
@@ -2,21 +2,31 @@
 #include "resource.h"
 
 #include "Application.h"
+#include "DataDeviceThread.h"
+#include "ReplayThread.h"
 
 #include <algorithm>
+#include <cstdio>
 
 MainDialog::MainDialog() 
 	: Dialog(nullptr, IDD_MAINDLG),
 	m_hInboundPackageCountEdit(NULL),
 	m_hInboundPackageSizeEdit(NULL),
 	m_hOutboundPackageCountEdit(NULL),
-	m_hOutboundPackageSizeEdit(NULL)
+	m_hOutboundPackageSizeEdit(NULL),
+	m_hServiceStatusEdit(NULL),
+	m_renderedSequence(0),
+	m_renderedServiceSequence(0)
 {}
 
 void MainDialog::OnCommand(WORD source, WORD id, HWND /*hControl*/) 
 {
 	if (id == IDCLOSE) {
-		m_dataDeviceThread.Stop();
+		KillTimer(m_hWnd, UI_TIMER_ID);
+		m_pCountersThread->Stop();
+
+		if (m_pPipeThread)
+			m_pPipeThread->Stop();
 
 		OnClose();
 		return;
@@ -33,8 +43,77 @@ void MainDialog::OnInitDialog()
 	m_hOutboundPackageCountEdit = GetDlgItem(m_hWnd, IDC_PACKETS_COUNT_OUTBOUND);
 	m_hOutboundPackageSizeEdit = GetDlgItem(m_hWnd, IDC_PACKETS_SIZE_OUTBOUND);
 
-	m_dataDeviceThread.SetControls(m_hInboundPackageCountEdit, m_hInboundPackageSizeEdit,
-		m_hOutboundPackageCountEdit, m_hOutboundPackageSizeEdit);
+	m_hServiceStatusEdit = GetDlgItem(m_hWnd, IDC_SERVICE_STATUS);
+
+	if (theApp->GetReplay().paths.empty()) {
+		m_pCountersThread.reset(new DataDeviceThread);
+
+		//a replay has no service behind it
+		m_pPipeThread.reset(new PipeThread);
+		m_pPipeThread->Start();
+	} else {
+		m_pCountersThread.reset(new ReplayThread(theApp->GetReplay()));
+
+		SetWindowTextA(m_hServiceStatusEdit, "replay");
+	}
+
+	m_pCountersThread->Start();
+
+	SetTimer(m_hWnd, UI_TIMER_ID, UI_FRAME_INTERVAL, NULL);
+}
+
+INT_PTR MainDialog::OnDialogProcedure(UINT uMsg, WPARAM wParam, LPARAM /*lParam*/)
+{
+	if (uMsg == WM_TIMER && wParam == UI_TIMER_ID) {
+		OnTimer();
+		return TRUE;
+	}
+
+	return 0;
+}
+
+void MainDialog::RenderService()
+{
+	PipeCounters counters;
+	char text[128];
+
+	if (!m_pPipeThread)
+		return;
+
+	LONG sequence = m_pPipeThread->GetCounters(counters);
+
+	if (sequence == m_renderedServiceSequence)
+		return;
+
+	m_renderedServiceSequence = sequence;
+
+	sprintf_s(text, "%I64u frames, %I64u bytes, %u flows%s", counters.count, counters.size, counters.flows,
+		counters.flowsSynchronized ? "" : " (syncing)");
+	SetWindowTextA(m_hServiceStatusEdit, text);
+}
+
+void MainDialog::OnTimer()
+{
+	RenderService();
+
+	DataCounters counters;
+	LONG sequence = m_pCountersThread->GetCounters(counters);
+
+	//nothing new: the controls are left alone
+	if (sequence == m_renderedSequence)
+		return;
+
+	m_renderedSequence = sequence;
+
+	sprintf_s(m_sTextBuffer, "%I64u", counters.inboundCount);
+	SetWindowTextA(m_hInboundPackageCountEdit, m_sTextBuffer);
+
+	sprintf_s(m_sTextBuffer, "%I64u", counters.inboundSize);
+	SetWindowTextA(m_hInboundPackageSizeEdit, m_sTextBuffer);
+
+	sprintf_s(m_sTextBuffer, "%I64u", counters.outboundCount);
+	SetWindowTextA(m_hOutboundPackageCountEdit, m_sTextBuffer);
 
-	m_dataDeviceThread.Start();
+	sprintf_s(m_sTextBuffer, "%I64u", counters.outboundSize);
+	SetWindowTextA(m_hOutboundPackageSizeEdit, m_sTextBuffer);
 }
\ No newline at end of file
@@ -3,10 +3,16 @@
 #include "resource.h"
 
 #include "Dialog.h"
-#include "DataDeviceThread.h"
+#include "CountersThread.h"
+#include "PipeThread.h"
 
+#include <memory>
 #include <string>
 
+//the counters are rendered by a dialog timer, this many ms apart
+#define UI_TIMER_ID 1
+#define UI_FRAME_INTERVAL 100
+
 class MainDialog : public Dialog
 {
 public:
@@ -25,6 +31,9 @@ private:
 	void CreateConnection();
 	//called when the user presses the "Browse" button
 	void OnBrowse();
+	//called by the UI timer: renders what the threads published since the last frame
+	void OnTimer();
+	void RenderService();
 
 public:
 	HWND GetInboundPackageCountEdit() {return m_hInboundPackageCountEdit;}
@@ -35,6 +44,7 @@ public:
 
 private:
 	void OnCommand(WORD source, WORD id, HWND hControl) override;
+	INT_PTR OnDialogProcedure(UINT uMsg, WPARAM wParam, LPARAM lParam) override;
 
 private:
 	HWND	m_hInboundPackageCountEdit;
@@ -43,6 +53,18 @@ private:
 	HWND	m_hOutboundPackageCountEdit;
 	HWND	m_hOutboundPackageSizeEdit;
 
+	HWND	m_hServiceStatusEdit;
+
 	//TODO: it's not the best place for a thread obj here.
-	DataDeviceThread			m_dataDeviceThread;
+	//the driver, or a replay of recorded segments
+	std::unique_ptr<CountersThread>	m_pCountersThread;
+
+	//the service's totals and flows, while the driver is the source
+	std::unique_ptr<PipeThread>		m_pPipeThread;
+
+	//sequence of the counters on screen
+	LONG	m_renderedSequence;
+	LONG	m_renderedServiceSequence;
+
+	char	m_sTextBuffer[24];
 };
\ No newline at end of file
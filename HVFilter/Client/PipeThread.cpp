@@ -4,28 +4,21 @@
 #include <cstdlib>
 #include <iostream>
 
-//todo: duplicate string literal... there's also one in Pipes.h
-#define PIPE_SERVER_NAME "\\\\.\\pipe\\HV_NDIS_UniquePipeName"
-
-PipeThread::PipeThread(HWND hPackageCountWnd, HWND hPackageSizeWnd)
-	: m_hPackageCountWnd(hPackageCountWnd),
-	m_hPackageSizeWnd(hPackageSizeWnd),
-	m_hPipeConn(INVALID_HANDLE_VALUE)
-{}
-
 PipeThread::PipeThread()
-	: m_hPackageCountWnd(NULL),
-	m_hPackageSizeWnd(NULL),
-	m_hPipeConn(INVALID_HANDLE_VALUE)
+	: m_hPipeConn(INVALID_HANDLE_VALUE),
+	m_bOrderStop(false),
+	m_hReadEvent(CreateEvent(NULL, TRUE, FALSE, NULL)),
+	m_hStopEvent(CreateEvent(NULL, TRUE, FALSE, NULL)),
+	m_flowExport(FLOW_EXPORT_MAX_LENGTH(FLOW_TABLE_MAX_FLOWS))
 {
 }
 
 bool PipeThread::Connect()
 {
-	while (INVALID_HANDLE_VALUE == m_hPipeConn)
+	while (INVALID_HANDLE_VALUE == m_hPipeConn && !m_bOrderStop)
 	{
 		m_hPipeConn = CreateFileA(PIPE_SERVER_NAME, GENERIC_READ, /*sharing*/0, /*sec attrs*/NULL, OPEN_EXISTING, 
-			/*flags & attrs*/0, /*template */NULL);
+			/*flags & attrs*/FILE_FLAG_OVERLAPPED, /*template */NULL);
 
 		if (m_hPipeConn == INVALID_HANDLE_VALUE) {
 			std::cerr << "could not create pipe: " << GetLastError() << std::endl;
@@ -39,18 +32,87 @@ bool PipeThread::Connect()
 			}
 		}
 
-		Sleep(1000);
+		if (INVALID_HANDLE_VALUE == m_hPipeConn)
+			WaitForSingleObject(m_hStopEvent, 1000);
 	}
 
-	return true;
+	return INVALID_HANDLE_VALUE != m_hPipeConn;
 }
 
 PipeThread::~PipeThread(void)
 {
-	if (m_hPipeConn) {
+	//the pipe is only closed once no read is left on it
+	Stop();
+	Wait();
+
+	if (m_hPipeConn != INVALID_HANDLE_VALUE) {
 		CloseHandle(m_hPipeConn);
 		m_hPipeConn = INVALID_HANDLE_VALUE;
 	}
+
+	CloseHandle(m_hReadEvent);
+	CloseHandle(m_hStopEvent);
+}
+
+void PipeThread::Stop()
+{
+	m_bOrderStop = true;
+	SetEvent(m_hStopEvent);
+}
+
+//a frame may arrive in pieces: a byte mode pipe keeps no boundaries
+bool PipeThread::ReadExact(void* pBuffer, DWORD length)
+{
+	BYTE* pTarget = (BYTE*)pBuffer;
+
+	while (length) {
+		OVERLAPPED overlapped = {0};
+		DWORD cbRead = 0;
+
+		overlapped.hEvent = m_hReadEvent;
+		ResetEvent(m_hReadEvent);
+
+		if (!ReadFile(m_hPipeConn, pTarget, length, NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+			return false;
+
+		//a stop cancels the read; the buffer is ours again once it is over
+		HANDLE handles[] = {m_hStopEvent, m_hReadEvent};
+
+		if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+			CancelIo(m_hPipeConn);
+			GetOverlappedResult(m_hPipeConn, &overlapped, &cbRead, TRUE);
+			return false;
+		}
+
+		if (!GetOverlappedResult(m_hPipeConn, &overlapped, &cbRead, FALSE) || !cbRead)
+			return false;
+
+		pTarget += cbRead;
+		length -= cbRead;
+	}
+
+	return true;
+}
+
+bool PipeThread::ReadFlows(const PIPE_FRAME_HEADER* pHeader, PipeCounters& counters)
+{
+	DWORD length = pHeader->Length - sizeof(*pHeader);
+
+	if (!ReadExact(&m_flowExport[0], length))
+		return false;
+
+	//a malformed export leaves the copy unsynchronized until the next keyframe
+	m_flows.Apply(&m_flowExport[0], length, NULL, NULL);
+
+	counters.flows = 0;
+	for (ULONG slot = 0; slot < FLOW_TABLE_MAX_FLOWS; ++slot) {
+		if (m_flows.GetFlow(slot))
+			++counters.flows;
+	}
+
+	counters.flowsSynchronized = m_flows.IsSynchronized() != FALSE;
+
+	return true;
 }
 
 void PipeThread::OnStart()
@@ -58,35 +120,49 @@ void PipeThread::OnStart()
 	if (!Connect())
 		return;
 
-	LARGE_INTEGER time0, time1, freq;
+	PIPE_FRAME_HEADER* pHeader = (PIPE_FRAME_HEADER*)m_frame;
+	PipeCounters counters = {0};
+
+	while (!m_bOrderStop) {
+		if (!ReadExact(pHeader, sizeof(*pHeader))) {
+			std::cerr << "failed reading from pipe: " << GetLastError() << std::endl;
+			return;
+		}
+
+		if (pHeader->Magic == PIPE_FLOW_FRAME_MAGIC) {
+			if (pHeader->Length < sizeof(*pHeader) || pHeader->Length - sizeof(*pHeader) > m_flowExport.size()) {
+				std::cerr << "bad flow frame on pipe" << std::endl;
+				return;
+			}
 
-	QueryPerformanceFrequency(&freq);
-	QueryPerformanceCounter(&time0);
+			if (!ReadFlows(pHeader, counters)) {
+				std::cerr << "failed reading from pipe: " << GetLastError() << std::endl;
+				return;
+			}
 
-	ULONGLONG value;
+			m_published.Publish(counters);
+			continue;
+		}
 
-	for (;;) {
-		DWORD cbRead = 0;
-		BOOL succeeded  = ReadFile(m_hPipeConn, &value, sizeof(value), &cbRead, /*overlapped*/ NULL);
+		if (pHeader->Magic != PIPE_FRAME_MAGIC || pHeader->Length > sizeof(m_frame) ||
+			pHeader->Length != sizeof(*pHeader) + pHeader->RecordCount * sizeof(PIPE_COUNTERS) || !pHeader->RecordCount) {
+			std::cerr << "bad frame on pipe" << std::endl;
+			return;
+		}
 
-		if (!succeeded || cbRead != sizeof(value)) {
+		if (!ReadExact(pHeader + 1, pHeader->Length - sizeof(*pHeader))) {
 			std::cerr << "failed reading from pipe: " << GetLastError() << std::endl;
 			return;
 		}
 
-		QueryPerformanceCounter(&time1);
-		double elapsed = double(time1.QuadPart - time0.QuadPart) / freq.QuadPart;
-		if (elapsed >= 1) {
-			time0 = time1;
-			
-			ULONG count = HIDWORD(value);
-			ULONG size = LODWORD(value);
-			//WM_SETTEXT
-			_ultoa(count, m_sCountText, 10);
-			_ultoa(size, m_sSizeText, 10);
-
-			SetWindowTextA(m_hPackageCountWnd, m_sCountText);
-			SetWindowTextA(m_hPackageSizeWnd, m_sSizeText);
-		}
+		//the records are totals: only the latest of the batch matters to the UI
+		const PIPE_COUNTERS* pLast = (const PIPE_COUNTERS*)(pHeader + 1) + pHeader->RecordCount - 1;
+
+		counters.timestamp = pLast->Timestamp;
+		counters.count = pLast->Count;
+		counters.size = pLast->Size;
+		counters.dropped += pHeader->Dropped;
+
+		m_published.Publish(counters);
 	}
-}
\ No newline at end of file
+}
@@ -1,28 +1,68 @@
 #pragma once
 
 #include "Thread.h"
+#include "Seqlock.h"
 
+#include "../Pipes/Pipes.h"
+#include "../HVService/HVService/FlowExport.h"
+
+#include <vector>
+
+//latest totals sent by the service
+struct PipeCounters
+{
+	ULONG64		timestamp;
+	ULONG64		count;
+	ULONG64		size;
+
+	//records the service dropped for us because we were slow
+	ULONG64		dropped;
+
+	//flows the service tracks, as of its latest flow frame
+	ULONG		flows;
+
+	//false until the first keyframe, and after an export was lost or malformed
+	bool		flowsSynchronized;
+};
+
+//
+// Reader of the service's pipe (see Pipes.h): keeps the latest counters and
+// its copy of the flows for the main dialog.  The thread waits for the
+// service until it is there, and ends when the pipe breaks.
+//
 class PipeThread : public Thread
 {
 public:
-	PipeThread(HWND hPackageCountWnd, HWND hPackageSizeWnd);
 	PipeThread();
 	~PipeThread(void);
 
-	void SetControls(HWND hPackageCountWnd, HWND hPackageSizeWnd)
-	{m_hPackageCountWnd = hPackageCountWnd; m_hPackageSizeWnd = hPackageSizeWnd;}
+	//also cancels a read in progress
+	void Stop() override;
+
+	//for the UI; never waits on the thread
+	LONG GetCounters(PipeCounters& counters) const { return m_published.Read(counters); }
 
 private:
 	void OnStart() override;
 	bool Connect();
+	bool ReadExact(void* pBuffer, DWORD length);
+
+	//reads the export that follows a flow frame header and applies it; false if the pipe broke
+	bool ReadFlows(const PIPE_FRAME_HEADER* pHeader, PipeCounters& counters);
 
 private:
-	HWND		m_hPackageCountWnd;
-	HWND		m_hPackageSizeWnd;
+	HANDLE			m_hPipeConn;
+	volatile bool	m_bOrderStop;
 
-	HANDLE		m_hPipeConn;
+	//the pipe is overlapped: a read waits on both
+	HANDLE			m_hReadEvent;
+	HANDLE			m_hStopEvent;
 
-	char		m_sCountText[20];
-	char		m_sSizeText[20];
-};
+	BYTE		m_frame[PIPE_FRAME_MAX_LENGTH];
+
+	//our copy of the service's flows, and the export being read
+	FlowDecoder			m_flows;
+	std::vector<BYTE>	m_flowExport;
 
+	Seqlock<PipeCounters>	m_published;
+};
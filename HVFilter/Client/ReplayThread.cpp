@@ -0,0 +1,110 @@
+#include "ReplayThread.h"
+
+#include "../HVTool/CaptureFile.h"
+
+#include <mmsystem.h>
+
+#include <iostream>
+
+ReplayThread::ReplayThread(const ReplayOptions& options)
+	: m_options(options),
+	m_bOrderStop(false)
+{
+}
+
+void ReplayThread::Stop()
+{
+	m_bOrderStop = true;
+}
+
+void ReplayThread::WaitUntil(LONGLONG due)
+{
+	LARGE_INTEGER frequency, now;
+
+	PublishCounters();
+
+	QueryPerformanceFrequency(&frequency);
+
+	for (QueryPerformanceCounter(&now); now.QuadPart < due && !m_bOrderStop; QueryPerformanceCounter(&now)) {
+		//rounded up: waking early would only mean another wait
+		LONGLONG ms = ((due - now.QuadPart) * 1000 + frequency.QuadPart - 1) / frequency.QuadPart;
+
+		Sleep((DWORD)min(ms, (LONGLONG)REPLAY_STOP_LATENCY));
+	}
+}
+
+void ReplayThread::OnStart()
+{
+	LARGE_INTEGER frequency, start, now;
+	ULONG64 origin = 0, reached = 0, records = 0;
+	ULONG unpublished = 0;
+	bool bStarted = false;
+
+	m_bOrderStop = false;
+
+	//Sleep to the millisecond, or the records come in 15.6ms bursts
+	timeBeginPeriod(1);
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (size_t i = 0; i < m_options.paths.size() && !m_bOrderStop; ++i) {
+		CaptureFile file;
+
+		if (!file.Open(m_options.paths[i].c_str())) {
+			std::cerr << m_options.paths[i] << ": not a capture segment" << std::endl;
+			continue;
+		}
+
+		for (const HV_RECORD_HEADER* pRecord = file.Next(); pRecord && !m_bOrderStop; pRecord = file.Next()) {
+			if (pRecord->Type != HV_RECORD_PACKET || !HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, FrameLength))
+				continue;
+
+			const HV_RECORD_PACKET_DATA* pPacket = (const HV_RECORD_PACKET_DATA*)pRecord;
+
+			//the schedule starts at the first record
+			if (!bStarted) {
+				bStarted = true;
+				origin = reached = pRecord->Timestamp;
+				QueryPerformanceCounter(&start);
+			}
+
+			//reached is the record time the wall clock was known to be past: up to there nothing is looked up
+			if (m_options.speed > 0 && pRecord->Timestamp > reached) {
+				double offset = (pRecord->Timestamp - origin) / 10000000.0 / m_options.speed;
+				LONGLONG due = start.QuadPart + (LONGLONG)(offset * frequency.QuadPart);
+
+				QueryPerformanceCounter(&now);
+
+				if (now.QuadPart < due) {
+					WaitUntil(due);
+					unpublished = 0;
+					QueryPerformanceCounter(&now);
+				}
+
+				reached = origin + (ULONG64)((double)(now.QuadPart - start.QuadPart) / frequency.QuadPart * m_options.speed * 10000000.0);
+			}
+
+			CountFrame(pPacket->Direction, pPacket->FrameLength);
+			++records;
+
+			if (++unpublished == REPLAY_PUBLISH_RECORDS) {
+				PublishCounters();
+				unpublished = 0;
+			}
+		}
+	}
+
+	PublishCounters();
+
+	QueryPerformanceCounter(&now);
+
+	timeEndPeriod(1);
+
+	double seconds = (double)(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+	std::cerr << "replayed " << records << " packet records in " << seconds << "s";
+	if (seconds > 0)
+		std::cerr << " (" << (ULONG64)(records / seconds) << " records/s)";
+	std::cerr << std::endl;
+}
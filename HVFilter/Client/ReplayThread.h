@@ -0,0 +1,53 @@
+#pragma once
+
+#include "CountersThread.h"
+
+#include <string>
+#include <vector>
+
+//totals are handed to the UI at least every this many records, when nothing makes the thread wait
+#define REPLAY_PUBLISH_RECORDS 4096
+
+//longest a stop request waits for the thread while it paces the replay, in ms
+#define REPLAY_STOP_LATENCY 100
+
+//what to replay instead of listening to the driver (Client --replay)
+struct ReplayOptions
+{
+	//multiple of the recorded speed, 0 for as fast as possible
+	double						speed;
+
+	//capture segments, in order
+	std::vector<std::string>	paths;
+};
+
+//
+// Feeds the packet records of capture segments (capture-NNNNNN.hvr, written
+// by the CaptureLog of an earlier run) to the main dialog as if the driver
+// sent them again: the records are counted and published like the ones of
+// DataDeviceThread.  A record is counted once its time since the first record,
+// divided by the speed, has elapsed; the schedule is kept against the start of
+// the replay, so late wakeups do not add up.  At most speed nothing waits and
+// the thread reports how many records per second it got through, which is
+// what the user mode pipeline can sustain.
+//
+// The packet records of the data device stream are in the segments too (one
+// per port and direction and read): they are counted as frames as well.
+//
+class ReplayThread : public CountersThread
+{
+public:
+	ReplayThread(const ReplayOptions& options);
+
+	void Stop() override;
+
+private:
+	void OnStart() override;
+
+	//publishes what was counted so far, then sleeps until the performance counter reaches due
+	void WaitUntil(LONGLONG due);
+
+private:
+	ReplayOptions	m_options;
+	volatile bool	m_bOrderStop;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <atomic>
+#include <cstring>
+
+//
+// Hands the latest value of T from one writer thread to any number of
+// readers without locks: the writer never waits, and a reader retries while a
+// Publish overlaps its copy.  The sequence is odd while the value is being
+// written.  T must be plain data.  The fences are the standard library's, so
+// the ordering holds on any compiler and processor, not only MSVC on x86.
+//
+template <typename T>
+class Seqlock
+{
+public:
+	Seqlock() : m_sequence(0) { memset(&m_value, 0, sizeof(m_value)); }
+
+	//writer side, one thread
+	void Publish(const T& value)
+	{
+		LONG sequence = m_sequence.load(std::memory_order_relaxed);
+
+		//the odd sequence is visible before the copy starts
+		m_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		memcpy(&m_value, &value, sizeof(T));
+
+		//and the copy is complete before the sequence is even again
+		m_sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	//reader side; returns the sequence the value was read at, 0 if nothing was published yet
+	LONG Read(T& value) const
+	{
+		for (;;) {
+			LONG before = m_sequence.load(std::memory_order_acquire);
+
+			if (before & 1) {
+				YieldProcessor();
+				continue;
+			}
+
+			memcpy(&value, &m_value, sizeof(T));
+
+			//the copy is done before the sequence is read again
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (m_sequence.load(std::memory_order_relaxed) == before)
+				return before / 2;
+		}
+	}
+
+private:
+	Seqlock(const Seqlock&);
+	Seqlock& operator=(const Seqlock&);
+
+private:
+	std::atomic<LONG>	m_sequence;
+	T					m_value;
+};
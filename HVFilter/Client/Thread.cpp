@@ -31,7 +31,10 @@ DWORD Thread::StartProc(void* param)
 
 void Thread::Start()
 {
-	CreateThread(0, 0, (LPTHREAD_START_ROUTINE)StartProc, this, 0, 0);
+	m_hThread = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)StartProc, this, 0, 0);
+
+	if (!m_hThread)
+		m_hThread = INVALID_HANDLE_VALUE;
 }
 
 void Thread::Stop()
@@ -47,5 +50,9 @@ void Thread::Close()
 
 void Thread::Wait(int msecs)
 {
+	//never started
+	if (m_hThread == INVALID_HANDLE_VALUE)
+		return;
+
 	WaitForSingleObject(m_hThread, msecs);
 }
\ No newline at end of file
@@ -7,6 +7,31 @@
 #include "MainDialog.h"
 #include "resource.h"
 
+#include <cstdlib>
+#include <cstring>
+
+//Client --replay [--speed <n|max>] <segment file>...
+static void parse_replay(int argc, char* argv[], ReplayOptions& replay)
+{
+	int i = 1;
+
+	if (i >= argc || strcmp(argv[i], "--replay"))
+		return;
+
+	++i;
+
+	if (i + 1 < argc && !strcmp(argv[i], "--speed")) {
+		replay.speed = strcmp(argv[i + 1], "max") ? atof(argv[i + 1]) : 0.0;
+		if (replay.speed < 0)
+			replay.speed = 1.0;
+
+		i += 2;
+	}
+
+	for (; i < argc; ++i)
+		replay.paths.push_back(argv[i]);
+}
+
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
@@ -20,6 +45,10 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
 	try {
 		Application app(hInstance);
+		ReplayOptions replay = app.GetReplay();
+
+		parse_replay(__argc, __argv, replay);
+		app.SetReplay(replay);
 
 		app.ShowMainDialog();
 
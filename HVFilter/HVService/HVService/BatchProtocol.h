@@ -0,0 +1,296 @@
+#pragma once
+
+#include "HVioctl.h"
+
+//
+// Writing and reading the batches of OSR_COMM_CONTROL_EXCHANGE_BATCH (see
+// HVioctl.h).  The driver fills an OSR_COMM_BATCH_REQUEST with a writer while
+// it takes requests off its queue, and checks the OSR_COMM_BATCH_RESPONSE that
+// comes down; the service walks the entries with a reader that never trusts a
+// length it did not check.  Only the Windows base types are needed, so the
+// tests under tests/ build these routines outside the WDK.
+//
+
+#define OSR_COMM_BATCH_RESPONSE_LENGTH(Count) \
+  (FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) + (Count) * sizeof(OSR_COMM_BATCH_COMPLETION))
+
+//
+// Smallest buffer a batch can be written to: the header and one entry
+//
+#define OSR_COMM_BATCH_MIN_LENGTH (sizeof(OSR_COMM_BATCH_REQUEST) + sizeof(OSR_COMM_BATCH_ENTRY))
+
+typedef struct _OSR_COMM_BATCH_WRITER {
+
+  POSR_COMM_BATCH_REQUEST Batch;
+
+  //
+  // Where the next entry goes
+  //
+  POSR_COMM_BATCH_ENTRY Next;
+
+  //
+  // Bytes left for entries, a multiple of OSR_COMM_BATCH_ALIGNMENT
+  //
+  ULONG Space;
+
+} OSR_COMM_BATCH_WRITER, *POSR_COMM_BATCH_WRITER;
+
+typedef struct _OSR_COMM_BATCH_READER {
+
+  PUCHAR Next;
+
+  //
+  // Bytes of entries not read yet
+  //
+  ULONG Remaining;
+
+  //
+  // Entries not read yet
+  //
+  ULONG Left;
+
+} OSR_COMM_BATCH_READER, *POSR_COMM_BATCH_READER;
+
+//
+// OsrCommBatchWriterInit
+//
+//  This routine starts an empty batch in a buffer
+//
+// Inputs:
+//  Writer - this is the writer to set up
+//  Buffer - this is the batch buffer, OSR_COMM_BATCH_ALIGNMENT aligned
+//  Length - this is the size of the buffer, at least OSR_COMM_BATCH_MIN_LENGTH
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+static __inline VOID OsrCommBatchWriterInit(POSR_COMM_BATCH_WRITER Writer, PVOID Buffer, ULONG Length)
+{
+  Writer->Batch = (POSR_COMM_BATCH_REQUEST) Buffer;
+
+  Writer->Next = (POSR_COMM_BATCH_ENTRY) (Writer->Batch + 1);
+
+  Writer->Space = (ULONG) (Length - sizeof(OSR_COMM_BATCH_REQUEST)) & ~(OSR_COMM_BATCH_ALIGNMENT - 1);
+
+  Writer->Batch->Count = 0;
+
+  Writer->Batch->Length = 0;
+}
+
+//
+// OsrCommBatchWriterFit
+//
+//  This routine tells whether the next request goes into the batch
+//
+// Inputs:
+//  Writer - this is the writer of the batch
+//  Payload - this is the write payload of the request (0 for a read)
+//
+// Outputs:
+//  Payload - this is the part of the payload that goes into the batch
+//
+// Returns:
+//  TRUE - the request goes into the batch, with Payload bytes of payload
+//  FALSE - the batch is complete; the request is left for the next one
+//
+// Notes:
+//  A write whose payload does not fit is left for the next batch, unless the
+//  batch is empty: it is then truncated, the way a single control request
+//  truncates it to RequestBufferLength.
+//
+static __inline BOOLEAN OsrCommBatchWriterFit(POSR_COMM_BATCH_WRITER Writer, PULONG Payload)
+{
+  if (Writer->Batch->Count >= OSR_COMM_BATCH_MAX_REQUESTS || Writer->Space < sizeof(OSR_COMM_BATCH_ENTRY)) {
+
+    return FALSE;
+
+  }
+
+  if (*Payload > Writer->Space - sizeof(OSR_COMM_BATCH_ENTRY)) {
+
+    if (Writer->Batch->Count) {
+
+      return FALSE;
+
+    }
+
+    *Payload = Writer->Space - sizeof(OSR_COMM_BATCH_ENTRY);
+
+  }
+
+  return TRUE;
+}
+
+//
+// OsrCommBatchWriterAppend
+//
+//  This routine adds the entry of a request to the batch
+//
+// Inputs:
+//  Writer - this is the writer of the batch
+//  RequestID - this is the ID of the request
+//  RequestType - this is OSR_COMM_READ_REQUEST or OSR_COMM_WRITE_REQUEST
+//  RequestBufferLength - this is the read length, or the payload of a write
+//  Payload - this is the payload the caller copied behind Writer->Next, as
+//            allowed by OsrCommBatchWriterFit
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - there is room for another entry
+//  FALSE - the batch is full
+//
+static __inline BOOLEAN OsrCommBatchWriterAppend(POSR_COMM_BATCH_WRITER Writer, ULONG RequestID, ULONG RequestType,
+                                                 ULONG RequestBufferLength, ULONG Payload)
+{
+  ULONG entryLength = (ULONG) (sizeof(OSR_COMM_BATCH_ENTRY) + Payload + OSR_COMM_BATCH_ALIGNMENT - 1) &
+                      ~(OSR_COMM_BATCH_ALIGNMENT - 1);
+
+  Writer->Next->RequestID = RequestID;
+
+  Writer->Next->RequestType = RequestType;
+
+  Writer->Next->RequestBufferLength = RequestBufferLength;
+
+  Writer->Next->EntryLength = entryLength;
+
+  Writer->Batch->Count++;
+
+  Writer->Batch->Length += entryLength;
+
+  Writer->Space -= entryLength;
+
+  Writer->Next = (POSR_COMM_BATCH_ENTRY) ((PUCHAR) Writer->Next + entryLength);
+
+  return Writer->Batch->Count < OSR_COMM_BATCH_MAX_REQUESTS && Writer->Space >= sizeof(OSR_COMM_BATCH_ENTRY);
+}
+
+//
+// OsrCommBatchWriterLength
+//
+//  This routine tells how much of the buffer the batch takes
+//
+// Inputs:
+//  Writer - this is the writer of the batch
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The bytes to return to the service, header included
+//
+static __inline ULONG OsrCommBatchWriterLength(POSR_COMM_BATCH_WRITER Writer)
+{
+  return sizeof(OSR_COMM_BATCH_REQUEST) + Writer->Batch->Length;
+}
+
+//
+// OsrCommBatchReaderInit
+//
+//  This routine starts reading a batch returned by the driver
+//
+// Inputs:
+//  Reader - this is the reader to set up
+//  Buffer - this is the batch buffer
+//  Length - this is the number of bytes the exchange returned
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - the header is consistent with Length
+//  FALSE - the batch is malformed; Reader returns no entry
+//
+static __inline BOOLEAN OsrCommBatchReaderInit(POSR_COMM_BATCH_READER Reader, PVOID Buffer, ULONG Length)
+{
+  POSR_COMM_BATCH_REQUEST batch = (POSR_COMM_BATCH_REQUEST) Buffer;
+
+  Reader->Next = (PUCHAR) (batch + 1);
+
+  Reader->Remaining = 0;
+
+  Reader->Left = 0;
+
+  if (Length < sizeof(OSR_COMM_BATCH_REQUEST) || batch->Length > Length - sizeof(OSR_COMM_BATCH_REQUEST)) {
+
+    return FALSE;
+
+  }
+
+  Reader->Remaining = batch->Length;
+
+  Reader->Left = batch->Count < OSR_COMM_BATCH_MAX_REQUESTS ? batch->Count : OSR_COMM_BATCH_MAX_REQUESTS;
+
+  return TRUE;
+}
+
+//
+// OsrCommBatchReaderNext
+//
+//  This routine returns the next entry of a batch
+//
+// Inputs:
+//  Reader - this is the reader of the batch
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The entry, or NULL after the last one or at the first malformed one
+//
+// Notes:
+//  The entry and RequestBufferLength bytes of write payload behind it lie
+//  within the batch.
+//
+static __inline POSR_COMM_BATCH_ENTRY OsrCommBatchReaderNext(POSR_COMM_BATCH_READER Reader)
+{
+  POSR_COMM_BATCH_ENTRY entry = (POSR_COMM_BATCH_ENTRY) Reader->Next;
+
+  if (0 == Reader->Left ||
+      Reader->Remaining < sizeof(OSR_COMM_BATCH_ENTRY) ||
+      entry->EntryLength < sizeof(OSR_COMM_BATCH_ENTRY) ||
+      entry->EntryLength > Reader->Remaining ||
+      (OSR_COMM_WRITE_REQUEST == entry->RequestType &&
+       entry->RequestBufferLength > entry->EntryLength - sizeof(OSR_COMM_BATCH_ENTRY))) {
+
+    Reader->Left = 0;
+
+    return NULL;
+
+  }
+
+  Reader->Left--;
+
+  Reader->Next += entry->EntryLength;
+
+  Reader->Remaining -= entry->EntryLength;
+
+  return entry;
+}
+
+//
+// OsrCommBatchResponseValid
+//
+//  This routine checks the completions that come down with an exchange
+//
+// Inputs:
+//  Response - this is the input buffer
+//  Length - this is the size of the input buffer, not 0
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - Count completions lie within the buffer
+//  FALSE - the buffer does not hold a valid OSR_COMM_BATCH_RESPONSE
+//
+static __inline BOOLEAN OsrCommBatchResponseValid(POSR_COMM_BATCH_RESPONSE Response, ULONG Length)
+{
+  return Length >= FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) &&
+         Response->Count <= OSR_COMM_BATCH_MAX_REQUESTS &&
+         Length >= OSR_COMM_BATCH_RESPONSE_LENGTH(Response->Count);
+}
@@ -0,0 +1,683 @@
+#include "FlowExport.h"
+
+#define FLOW_ETHERTYPE_IPV4 0x800
+
+namespace
+{
+    //
+    // Bounded writer: once it ran out of room it only keeps count of that
+    //
+    struct ExportWriter
+    {
+        BYTE*   pNext;
+        BYTE*   pEnd;
+        BOOL    bFull;
+
+        void Byte(BYTE value)
+        {
+            if(pNext == pEnd) {
+
+                bFull = TRUE;
+                return;
+
+            }
+
+            *pNext++ = value;
+        }
+
+        void Bytes(const void* pData, DWORD dwLength)
+        {
+            if((DWORD) (pEnd - pNext) < dwLength) {
+
+                bFull = TRUE;
+                return;
+
+            }
+
+            memcpy(pNext,pData,dwLength);
+            pNext += dwLength;
+        }
+
+        void Varint(ULONG64 value)
+        {
+            while(value >= 0x80) {
+
+                Byte((BYTE) (value | 0x80));
+                value >>= 7;
+
+            }
+
+            Byte((BYTE) value);
+        }
+    };
+
+    //
+    // Bounded reader: once it ran past the end everything it returns is 0
+    //
+    struct ExportReader
+    {
+        const BYTE* pNext;
+        const BYTE* pEnd;
+        BOOL        bBad;
+
+        BYTE Byte()
+        {
+            if(pNext == pEnd) {
+
+                bBad = TRUE;
+                return 0;
+
+            }
+
+            return *pNext++;
+        }
+
+        void Bytes(void* pData, DWORD dwLength)
+        {
+            if((DWORD) (pEnd - pNext) < dwLength) {
+
+                bBad = TRUE;
+                memset(pData,0,dwLength);
+                return;
+
+            }
+
+            memcpy(pData,pNext,dwLength);
+            pNext += dwLength;
+        }
+
+        ULONG64 Varint()
+        {
+            ULONG64 value = 0;
+
+            for(ULONG shift = 0; shift < 64; shift += 7) {
+
+                BYTE b = Byte();
+
+                value |= (ULONG64) (b & 0x7F) << shift;
+
+                if(!(b & 0x80)) {
+
+                    return value;
+
+                }
+
+            }
+
+            bBad = TRUE;
+            return 0;
+        }
+    };
+
+    ULONG64 Age(ULONG64 ullNow, ULONG64 ullThen)
+    {
+        return ullNow > ullThen ? ullNow - ullThen : 0;
+    }
+}
+
+/************************ FlowTable ******************************/
+
+FlowTable::FlowTable(void) :m_lFree(-1),m_ullSequence(0),m_ullOverflow(0)
+{
+    InitializeCriticalSection(&m_Lock);
+
+    //
+    // Both come zeroed
+    //
+    m_pEntries = (FlowEntry*) VirtualAlloc(NULL,FLOW_TABLE_MAX_FLOWS * sizeof(FlowEntry),
+                                           MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    m_plBuckets = (LONG*) VirtualAlloc(NULL,FLOW_TABLE_BUCKETS * sizeof(LONG),
+                                       MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    if(m_pEntries == NULL || m_plBuckets == NULL) {
+
+        return;
+
+    }
+
+    for(LONG bucket = 0; bucket < FLOW_TABLE_BUCKETS; bucket++) {
+
+        m_plBuckets[bucket] = -1;
+
+    }
+
+    for(LONG slot = FLOW_TABLE_MAX_FLOWS - 1; slot >= 0; slot--) {
+
+        m_pEntries[slot].lNext = m_lFree;
+        m_lFree = slot;
+
+    }
+}
+
+FlowTable::~FlowTable(void)
+{
+    if(m_pEntries != NULL) {
+
+        VirtualFree(m_pEntries,0,MEM_RELEASE);
+
+    }
+
+    if(m_plBuckets != NULL) {
+
+        VirtualFree(m_plBuckets,0,MEM_RELEASE);
+
+    }
+
+    DeleteCriticalSection(&m_Lock);
+}
+
+ULONG FlowTable::Hash(const FLOW_KEY* pKey)
+{
+    ULONG hash = pKey->SourceAddress * 0x9E3779B1;
+
+    hash = (hash ^ pKey->DestinationAddress) * 0x85EBCA6B;
+    hash = (hash ^ ((ULONG) pKey->SourcePort << 16 | pKey->DestinationPort)) * 0xC2B2AE35;
+    hash = (hash ^ pKey->PortId ^ pKey->IpProtocol) * 0x9E3779B1;
+
+    return (hash ^ (hash >> 15)) & (FLOW_TABLE_BUCKETS - 1);
+}
+
+LONG FlowTable::Find(const FLOW_KEY* pKey, ULONG ulBucket) const
+{
+    for(LONG slot = m_plBuckets[ulBucket]; slot >= 0; slot = m_pEntries[slot].lNext) {
+
+        //
+        // A flow that ended stays in its bucket until its slot is freed, but
+        // its next packet starts a new flow
+        //
+        if(!m_pEntries[slot].bEnded && memcmp(&m_pEntries[slot].State.Key,pKey,sizeof(FLOW_KEY)) == 0) {
+
+            return slot;
+
+        }
+
+    }
+
+    return -1;
+}
+
+void FlowTable::Unlink(LONG lSlot)
+{
+    LONG* plLink = &m_plBuckets[Hash(&m_pEntries[lSlot].State.Key)];
+
+    while(*plLink != lSlot) {
+
+        plLink = &m_pEntries[*plLink].lNext;
+
+    }
+
+    *plLink = m_pEntries[lSlot].lNext;
+}
+
+void FlowTable::Update(const HV_RING_RECORD* pRecord)
+{
+    FLOW_KEY key;
+    ULONG bucket;
+    LONG slot;
+
+    if(m_pEntries == NULL || pRecord->EtherType != FLOW_ETHERTYPE_IPV4) {
+
+        return;
+
+    }
+
+    memset(&key,0,sizeof(key));
+
+    key.PortId = pRecord->PortId;
+    key.SourceAddress = pRecord->SourceAddress;
+    key.DestinationAddress = pRecord->DestinationAddress;
+    key.SourcePort = pRecord->SourcePort;
+    key.DestinationPort = pRecord->DestinationPort;
+    key.IpProtocol = pRecord->IpProtocol;
+
+    bucket = Hash(&key);
+
+    slot = Find(&key,bucket);
+
+    if(slot < 0) {
+
+        if(m_lFree < 0) {
+
+            m_ullOverflow++;
+            return;
+
+        }
+
+        slot = m_lFree;
+
+        FlowEntry* pEntry = &m_pEntries[slot];
+
+        m_lFree = pEntry->lNext;
+
+        memset(&pEntry->State,0,sizeof(pEntry->State));
+
+        pEntry->State.Key = key;
+        pEntry->State.FirstSeen = pRecord->Timestamp;
+        pEntry->ulGeneration++;
+        pEntry->bInUse = TRUE;
+        pEntry->bEnded = FALSE;
+
+        pEntry->lNext = m_plBuckets[bucket];
+        m_plBuckets[bucket] = slot;
+
+    }
+
+    FlowEntry* pEntry = &m_pEntries[slot];
+
+    pEntry->State.Packets++;
+    pEntry->State.Bytes += pRecord->FrameLength;
+
+    if(pRecord->Timestamp > pEntry->State.LastSeen) {
+
+        pEntry->State.LastSeen = pRecord->Timestamp;
+
+    }
+
+    pEntry->ullChanged = ++m_ullSequence;
+}
+
+void FlowTable::Expire(ULONG64 ullNow)
+{
+    if(m_pEntries == NULL) {
+
+        return;
+
+    }
+
+    EnterCriticalSection(&m_Lock);
+
+    for(LONG slot = 0; slot < FLOW_TABLE_MAX_FLOWS; slot++) {
+
+        FlowEntry* pEntry = &m_pEntries[slot];
+
+        if(!pEntry->bInUse) {
+
+            continue;
+
+        }
+
+        if(!pEntry->bEnded) {
+
+            if(Age(ullNow,pEntry->State.LastSeen) > FLOW_TABLE_IDLE_TIMEOUT) {
+
+                //
+                // Readers hear of the end with their next export; the slot is
+                // only reused once they had the time to
+                //
+                pEntry->bEnded = TRUE;
+                pEntry->ullEnded = ullNow;
+                pEntry->ullChanged = ++m_ullSequence;
+
+            }
+
+        } else if(Age(ullNow,pEntry->ullEnded) > FLOW_TABLE_IDLE_TIMEOUT) {
+
+            Unlink(slot);
+
+            pEntry->bInUse = FALSE;
+            pEntry->lNext = m_lFree;
+            m_lFree = slot;
+
+        }
+
+    }
+
+    LeaveCriticalSection(&m_Lock);
+}
+
+/************************ FlowEncoder ******************************/
+
+FlowEncoder::FlowEncoder(FlowTable& table) :m_Table(table),m_ullCursor(0),m_dwExports(0)
+{
+    m_pBaseline = (Baseline*) VirtualAlloc(NULL,FLOW_TABLE_MAX_FLOWS * sizeof(Baseline),
+                                           MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+}
+
+FlowEncoder::~FlowEncoder(void)
+{
+    if(m_pBaseline != NULL) {
+
+        VirtualFree(m_pBaseline,0,MEM_RELEASE);
+
+    }
+}
+
+BOOL FlowEncoder::Selected(LONG lSlot, BOOL bKeyframe) const
+{
+    const FlowTable::FlowEntry* pEntry = &m_Table.m_pEntries[lSlot];
+
+    //
+    // A keyframe has every live flow.  Otherwise the flows that changed since
+    // the cursor go, and the ones the reader knows of whose slot was freed
+    // meanwhile are ended.
+    //
+    if(bKeyframe) {
+
+        return pEntry->bInUse && !pEntry->bEnded;
+
+    }
+
+    if(pEntry->bInUse) {
+
+        return pEntry->ullChanged > m_ullCursor;
+
+    }
+
+    return m_pBaseline[lSlot].ulGeneration != 0;
+}
+
+DWORD FlowEncoder::Export(BYTE* pBuffer, DWORD dwLength, ULONG64 ullNow)
+{
+    ExportWriter writer;
+    BOOL keyframe = (m_dwExports % FLOW_EXPORT_KEYFRAME_INTERVAL) == 0;
+    const FlowTable::FlowEntry* pEntries = m_Table.m_pEntries;
+    ULONG count = 0;
+    LONG previous = -1;
+
+    if(m_pBaseline == NULL || pEntries == NULL) {
+
+        return 0;
+
+    }
+
+    writer.pNext = pBuffer;
+    writer.pEnd = pBuffer + dwLength;
+    writer.bFull = FALSE;
+
+    EnterCriticalSection(&m_Table.m_Lock);
+
+    for(LONG slot = 0; slot < FLOW_TABLE_MAX_FLOWS; slot++) {
+
+        if(Selected(slot,keyframe)) {
+
+            count++;
+
+        }
+
+    }
+
+    writer.Byte(FLOW_EXPORT_VERSION);
+    writer.Byte(keyframe ? FLOW_EXPORT_KEYFRAME : 0);
+    writer.Varint(ullNow);
+    writer.Varint(count);
+
+    //
+    // The baseline is left alone until the whole export fits
+    //
+    for(LONG slot = 0; slot < FLOW_TABLE_MAX_FLOWS && !writer.bFull; slot++) {
+
+        const FlowTable::FlowEntry* pEntry = &pEntries[slot];
+        const Baseline* pBaseline = &m_pBaseline[slot];
+        BYTE tag = 0;
+
+        if(!Selected(slot,keyframe)) {
+
+            continue;
+
+        }
+
+        writer.Varint((ULONG64) (slot - (previous + 1)));
+        previous = slot;
+
+        if(!pEntry->bInUse) {
+
+            //
+            // Gone while the reader was not looking
+            //
+            writer.Byte(FLOW_EXPORT_TAG_END);
+            writer.Varint(0);
+            writer.Varint(0);
+            writer.Varint(0);
+            continue;
+
+        }
+
+        if(keyframe || pEntry->ulGeneration != pBaseline->ulGeneration) {
+
+            tag |= FLOW_EXPORT_TAG_NEW;
+
+        }
+
+        if(pEntry->bEnded) {
+
+            tag |= FLOW_EXPORT_TAG_END;
+
+        }
+
+        writer.Byte(tag);
+
+        if(tag & FLOW_EXPORT_TAG_NEW) {
+
+            const FLOW_KEY* pKey = &pEntry->State.Key;
+
+            writer.Varint(pKey->PortId);
+            writer.Bytes(&pKey->SourceAddress,4);
+            writer.Bytes(&pKey->DestinationAddress,4);
+            writer.Bytes(&pKey->SourcePort,2);
+            writer.Bytes(&pKey->DestinationPort,2);
+            writer.Byte(pKey->IpProtocol);
+            writer.Varint(Age(ullNow,pEntry->State.FirstSeen));
+
+            writer.Varint(pEntry->State.Packets);
+            writer.Varint(pEntry->State.Bytes);
+
+        } else {
+
+            writer.Varint(pEntry->State.Packets - pBaseline->ullPackets);
+            writer.Varint(pEntry->State.Bytes - pBaseline->ullBytes);
+
+        }
+
+        writer.Varint(Age(ullNow,pEntry->State.LastSeen));
+
+    }
+
+    if(writer.bFull) {
+
+        LeaveCriticalSection(&m_Table.m_Lock);
+        return 0;
+
+    }
+
+    for(LONG slot = 0; slot < FLOW_TABLE_MAX_FLOWS; slot++) {
+
+        Baseline* pBaseline = &m_pBaseline[slot];
+
+        if(!Selected(slot,keyframe)) {
+
+            //
+            // After a keyframe the reader knows of nothing else
+            //
+            if(keyframe) {
+
+                pBaseline->ulGeneration = 0;
+
+            }
+
+            continue;
+
+        }
+
+        if(!pEntries[slot].bInUse || pEntries[slot].bEnded) {
+
+            pBaseline->ulGeneration = 0;
+
+        } else {
+
+            pBaseline->ulGeneration = pEntries[slot].ulGeneration;
+            pBaseline->ullPackets = pEntries[slot].State.Packets;
+            pBaseline->ullBytes = pEntries[slot].State.Bytes;
+
+        }
+
+    }
+
+    m_ullCursor = m_Table.m_ullSequence;
+    m_dwExports++;
+
+    LeaveCriticalSection(&m_Table.m_Lock);
+
+    return (DWORD) (writer.pNext - pBuffer);
+}
+
+/************************ FlowDecoder ******************************/
+
+FlowDecoder::FlowDecoder(void) :m_bSynchronized(FALSE)
+{
+    m_pFlows = (FLOW_STATE*) VirtualAlloc(NULL,FLOW_TABLE_MAX_FLOWS * sizeof(FLOW_STATE),
+                                          MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    m_pbLive = (BYTE*) VirtualAlloc(NULL,FLOW_TABLE_MAX_FLOWS,
+                                    MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+}
+
+FlowDecoder::~FlowDecoder(void)
+{
+    if(m_pFlows != NULL) {
+
+        VirtualFree(m_pFlows,0,MEM_RELEASE);
+
+    }
+
+    if(m_pbLive != NULL) {
+
+        VirtualFree(m_pbLive,0,MEM_RELEASE);
+
+    }
+}
+
+BOOL FlowDecoder::Apply(const BYTE* pBuffer, DWORD dwLength, FlowCallback pfnFlow, PVOID pContext)
+{
+    ExportReader reader;
+    ULONG64 now;
+    ULONG64 count;
+    LONG64 slot = -1;
+    BYTE flags;
+
+    if(m_pFlows == NULL || m_pbLive == NULL) {
+
+        return FALSE;
+
+    }
+
+    reader.pNext = pBuffer;
+    reader.pEnd = pBuffer + dwLength;
+    reader.bBad = FALSE;
+
+    if(reader.Byte() != FLOW_EXPORT_VERSION) {
+
+        m_bSynchronized = FALSE;
+        return FALSE;
+
+    }
+
+    flags = reader.Byte();
+    now = reader.Varint();
+    count = reader.Varint();
+
+    if(reader.bBad) {
+
+        m_bSynchronized = FALSE;
+        return FALSE;
+
+    }
+
+    if(flags & FLOW_EXPORT_KEYFRAME) {
+
+        memset(m_pbLive,0,FLOW_TABLE_MAX_FLOWS);
+        m_bSynchronized = TRUE;
+
+    }
+
+    for(ULONG64 index = 0; index < count; index++) {
+
+        FLOW_STATE* pFlow;
+        BYTE tag;
+        ULONG64 packets;
+        ULONG64 bytes;
+        ULONG64 idle;
+
+        slot += (LONG64) reader.Varint() + 1;
+        tag = reader.Byte();
+
+        if(reader.bBad || slot >= FLOW_TABLE_MAX_FLOWS) {
+
+            m_bSynchronized = FALSE;
+            return FALSE;
+
+        }
+
+        pFlow = &m_pFlows[slot];
+
+        if(tag & FLOW_EXPORT_TAG_NEW) {
+
+            memset(pFlow,0,sizeof(*pFlow));
+
+            pFlow->Key.PortId = (ULONG) reader.Varint();
+            reader.Bytes(&pFlow->Key.SourceAddress,4);
+            reader.Bytes(&pFlow->Key.DestinationAddress,4);
+            reader.Bytes(&pFlow->Key.SourcePort,2);
+            reader.Bytes(&pFlow->Key.DestinationPort,2);
+            pFlow->Key.IpProtocol = reader.Byte();
+            pFlow->FirstSeen = now - reader.Varint();
+
+            m_pbLive[slot] = 1;
+
+        } else if(!m_pbLive[slot] && !(tag & FLOW_EXPORT_TAG_END)) {
+
+            //
+            // An update for a flow this copy never heard of: an export was lost
+            //
+            m_bSynchronized = FALSE;
+
+        }
+
+        packets = reader.Varint();
+        bytes = reader.Varint();
+        idle = reader.Varint();
+
+        if(reader.bBad) {
+
+            m_bSynchronized = FALSE;
+            return FALSE;
+
+        }
+
+        if(!m_pbLive[slot]) {
+
+            continue;
+
+        }
+
+        pFlow->Packets += packets;
+        pFlow->Bytes += bytes;
+        pFlow->LastSeen = now - idle;
+
+        if(tag & FLOW_EXPORT_TAG_END) {
+
+            m_pbLive[slot] = 0;
+
+        }
+
+        if(pfnFlow != NULL) {
+
+            pfnFlow((ULONG) slot,pFlow,(tag & FLOW_EXPORT_TAG_END) != 0,pContext);
+
+        }
+
+    }
+
+    return TRUE;
+}
+
+const FLOW_STATE* FlowDecoder::GetFlow(ULONG ulSlot) const
+{
+    if(m_pFlows == NULL || ulSlot >= FLOW_TABLE_MAX_FLOWS || !m_pbLive[ulSlot]) {
+
+        return NULL;
+
+    }
+
+    return &m_pFlows[ulSlot];
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "HVRing.h"
+
+//
+// Flows (5-tuple and vPort) seen in the shared record rings, and their
+// export.  A reader does not get every flow at every interval: its
+// FlowEncoder remembers what it sent last and only encodes the flows that
+// changed since, as varint deltas against the previous export.  Every
+// FLOW_EXPORT_KEYFRAME_INTERVAL exports it sends a keyframe with the absolute
+// values of every flow instead, so a reader that lost track catches up.  A
+// FlowDecoder on the reader's side rebuilds the absolute values.
+//
+// Export format (varints are LEB128, unsigned):
+//  BYTE version, BYTE flags (FLOW_EXPORT_KEYFRAME), varint timestamp,
+//  varint flow count, then per flow in ascending slot order:
+//   varint slot - (previous slot + 1)
+//   BYTE tag (FLOW_EXPORT_TAG_*)
+//   if FLOW_EXPORT_TAG_NEW: varint port ID, the addresses (4 + 4 bytes),
+//     ports (2 + 2) and protocol (1) in network byte order, varint
+//     timestamp - first seen
+//   varint packets and varint bytes since the previous export (absolute
+//   for a new flow), varint timestamp - last seen
+//
+
+#define FLOW_TABLE_MAX_FLOWS 16384
+#define FLOW_TABLE_BUCKETS (2 * FLOW_TABLE_MAX_FLOWS)
+
+// 100ns units: a flow idle this long ends, and its slot is reused as long after that
+#define FLOW_TABLE_IDLE_TIMEOUT (30 * 10000000ULL)
+
+#define FLOW_EXPORT_VERSION 1
+#define FLOW_EXPORT_KEYFRAME 0x1
+#define FLOW_EXPORT_KEYFRAME_INTERVAL 16
+
+#define FLOW_EXPORT_TAG_NEW 0x1
+#define FLOW_EXPORT_TAG_END 0x2
+
+// Longest encoding of a flow, and of an export of Flows flows
+#define FLOW_EXPORT_MAX_FLOW_LENGTH 64
+#define FLOW_EXPORT_MAX_LENGTH(Flows) (2 + 10 + 5 + (Flows) * FLOW_EXPORT_MAX_FLOW_LENGTH)
+
+typedef struct _FLOW_KEY {
+    ULONG PortId;
+
+    // Network byte order
+    ULONG SourceAddress;
+    ULONG DestinationAddress;
+    USHORT SourcePort;
+    USHORT DestinationPort;
+
+    UCHAR IpProtocol;
+    UCHAR Reserved[3];
+
+} FLOW_KEY, *PFLOW_KEY;
+
+typedef struct _FLOW_STATE {
+    FLOW_KEY Key;
+
+    ULONG64 Packets;
+    ULONG64 Bytes;
+    ULONG64 FirstSeen;
+    ULONG64 LastSeen;
+
+} FLOW_STATE, *PFLOW_STATE;
+
+class FlowEncoder;
+
+class FlowTable
+{
+    friend class FlowEncoder;
+
+public:
+    FlowTable(void);
+    ~FlowTable(void);
+
+    // A drain's records are accounted under one hold of the table lock:
+    // Update is only called between BeginUpdate and EndUpdate
+    void BeginUpdate() {EnterCriticalSection(&m_Lock);}
+    void EndUpdate() {LeaveCriticalSection(&m_Lock);}
+
+    // Accounts a ring record; records that are not IPv4 are ignored
+    void Update(const HV_RING_RECORD* pRecord);
+
+    // Ends the flows idle since before ullNow - FLOW_TABLE_IDLE_TIMEOUT, and
+    // frees the slots of the ones that ended as long ago
+    void Expire(ULONG64 ullNow);
+
+    // Records for which no slot was free
+    ULONG64 GetOverflow() const {return m_ullOverflow;}
+
+private:
+    struct FlowEntry
+    {
+        FLOW_STATE  State;
+
+        // Table sequence of the last change; bumped when the flow ends
+        ULONG64     ullChanged;
+        ULONG64     ullEnded;
+
+        // Bumped whenever the slot is given to a new flow
+        ULONG       ulGeneration;
+        BOOL        bInUse;
+        BOOL        bEnded;
+
+        // Next slot in the hash bucket, or on the free list; -1 ends the list
+        LONG        lNext;
+    };
+
+    static ULONG Hash(const FLOW_KEY* pKey);
+    LONG Find(const FLOW_KEY* pKey, ULONG ulBucket) const;
+    void Unlink(LONG lSlot);
+
+    CRITICAL_SECTION    m_Lock;
+
+    FlowEntry*  m_pEntries;
+    LONG*       m_plBuckets;
+    LONG        m_lFree;
+
+    // Incremented by every change
+    ULONG64     m_ullSequence;
+    ULONG64     m_ullOverflow;
+};
+
+//
+// One per reader
+//
+class FlowEncoder
+{
+public:
+    FlowEncoder(FlowTable& table);
+    ~FlowEncoder(void);
+
+    // Encodes the flows that changed since the previous export, or a keyframe;
+    // returns the bytes written.  dwLength should hold a keyframe
+    // (FLOW_EXPORT_MAX_LENGTH(FLOW_TABLE_MAX_FLOWS)): if the export does not
+    // fit, 0 is returned and the next call tries again from the same cursor.
+    DWORD Export(BYTE* pBuffer, DWORD dwLength, ULONG64 ullNow);
+
+    // Makes the next export a keyframe
+    void ForceKeyframe() {m_dwExports = 0;}
+
+private:
+    // What the reader was last told about a slot
+    struct Baseline
+    {
+        ULONG       ulGeneration;
+        ULONG64     ullPackets;
+        ULONG64     ullBytes;
+    };
+
+    // TRUE if the slot goes in the export; the table lock must be held
+    BOOL Selected(LONG lSlot, BOOL bKeyframe) const;
+
+    FlowTable&  m_Table;
+    Baseline*   m_pBaseline;
+
+    // Table sequence the reader is up to date with
+    ULONG64     m_ullCursor;
+    DWORD       m_dwExports;
+};
+
+//
+// Reader side: applies exports, in order, to its copy of the flows
+//
+class FlowDecoder
+{
+public:
+    // bEnded is TRUE for the last report of a flow
+    typedef void (*FlowCallback)(ULONG ulSlot, const FLOW_STATE* pFlow, BOOL bEnded, PVOID pContext);
+
+    FlowDecoder(void);
+    ~FlowDecoder(void);
+
+    // Hands every flow of the export to pfnFlow (if any); FALSE if the export
+    // is malformed, in which case the copy is only right again after a keyframe
+    BOOL Apply(const BYTE* pBuffer, DWORD dwLength, FlowCallback pfnFlow, PVOID pContext);
+
+    const FLOW_STATE* GetFlow(ULONG ulSlot) const;
+    BOOL IsSynchronized() const {return m_bSynchronized;}
+
+private:
+    FLOW_STATE* m_pFlows;
+    BYTE*       m_pbLive;
+    BOOL        m_bSynchronized;
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+//
+// Packet capture exported by the extension.  Frames matching HV_CAPTURE_FILTER
+// are sampled, truncated to Snaplen bytes and written to per-processor rings,
+// which user mode drains with OSR_COMM_CONTROL_DRAIN_CAPTURE.  This header is
+// shared between the driver and the user mode components.
+//
+
+#define HV_CAPTURE_ANY_PORT 0xFFFFFFFF
+
+#define HV_CAPTURE_DIRECTION_INBOUND 0x1
+#define HV_CAPTURE_DIRECTION_OUTBOUND 0x2
+
+#define HV_CAPTURE_DEFAULT_SNAPLEN 128
+#define HV_CAPTURE_MAX_SNAPLEN 9216
+
+typedef struct _HV_CAPTURE_FILTER {
+  //
+  // NDIS_SWITCH_PORT_ID the frame is accounted to, or HV_CAPTURE_ANY_PORT
+  //
+  ULONG PortId;
+
+  //
+  // HV_CAPTURE_DIRECTION_* mask
+  //
+  ULONG Directions;
+
+  //
+  // Host byte order; 0 matches any
+  //
+  USHORT EtherType;
+
+  //
+  // IPv4 protocol / IPv6 next header; 0 matches any
+  //
+  UCHAR IpProtocol;
+  UCHAR Reserved;
+
+  //
+  // TCP / UDP source or destination port, host byte order; 0 matches any
+  //
+  USHORT L4Port;
+  USHORT Reserved2;
+
+  //
+  // IPv4 source or destination network, network byte order; a 0 mask matches any
+  //
+  ULONG Ipv4Address;
+  ULONG Ipv4Mask;
+
+} HV_CAPTURE_FILTER, *PHV_CAPTURE_FILTER;
+
+typedef struct _HV_CAPTURE_CONFIG {
+  //
+  // Non-zero to capture
+  //
+  ULONG Enabled;
+
+  //
+  // Bytes kept from the start of each frame (at most HV_CAPTURE_MAX_SNAPLEN)
+  //
+  ULONG Snaplen;
+
+  //
+  // 1 in SampleRate matching frames (on average) is captured
+  //
+  ULONG SampleRate;
+
+  HV_CAPTURE_FILTER Filter;
+
+} HV_CAPTURE_CONFIG, *PHV_CAPTURE_CONFIG;
+
+//
+// Each captured frame is a record header followed by CapturedLength bytes of
+// the frame, padded to RecordLength (a multiple of 8).
+//
+typedef struct _HV_CAPTURE_RECORD {
+  //
+  // Time the NBL chain was indicated, in 100ns units
+  //
+  ULONG64 Timestamp;
+
+  ULONG PortId;
+
+  //
+  // HV_STATS_DIRECTION_*
+  //
+  USHORT Direction;
+  USHORT Flags;
+
+  ULONG OriginalLength;
+  ULONG CapturedLength;
+  ULONG RecordLength;
+
+  //
+  // Processor whose ring held the record
+  //
+  ULONG Cpu;
+
+} HV_CAPTURE_RECORD, *PHV_CAPTURE_RECORD;
+
+#define HV_CAPTURE_RECORD_ALIGNMENT 8
+
+//
+// Output of OSR_COMM_CONTROL_DRAIN_CAPTURE: this header, then Length bytes of
+// records.  The counters are totals over all processors since the driver was
+// loaded.
+//
+typedef struct _HV_CAPTURE_BATCH {
+  ULONG Count;
+  ULONG Length;
+
+  //
+  // Frames written to the rings
+  //
+  ULONG64 Captured;
+
+  //
+  // Sampled frames lost because their ring was full
+  //
+  ULONG64 Dropped;
+
+  //
+  // Matching frames skipped by the sampling
+  //
+  ULONG64 SampledOut;
+
+} HV_CAPTURE_BATCH, *PHV_CAPTURE_BATCH;
@@ -0,0 +1,167 @@
+#pragma once
+
+//
+// Read-only counters page.  OSR_COMM_CONTROL_MAP_COUNTERS maps a page owned by
+// the driver into the address space of the caller, read-only, and returns its
+// address in an HV_COUNTERS_MAPPING.  While at least one view is mapped the
+// driver sums its per-processor counters into the page every
+// HV_COUNTERS_PUBLISH_INTERVAL, so a reader polls the totals without a system
+// call.  The view goes away with OSR_COMM_CONTROL_UNMAP_COUNTERS, or when the
+// handle that mapped it is cleaned up; the reader never unmaps it itself.  The
+// driver never reads the page back.  This header is shared between the driver
+// and the user mode components.
+//
+// Snapshot protocol (a seqlock; HvCountersSnapshot below implements it):
+//  1. read Sequence; while it is odd the driver is writing the page
+//  2. copy the page
+//  3. read Sequence again: if it changed, the copy may be torn, start over
+// The driver makes Sequence odd before it writes and even again once it is
+// done; it is never 0 once the page is mapped.
+//
+// The counters are free running totals since the driver was loaded, of every
+// frame the extension saw (not weighted by the sampling governor); rates are
+// differences between two snapshots over the difference of their Timestamps.
+//
+
+#define HV_COUNTERS_VERSION 1
+
+//
+// Publication period, in 100ns units (10ms)
+//
+#define HV_COUNTERS_PUBLISH_INTERVAL 100000
+
+//
+// Protocol classes
+//
+#define HV_COUNTERS_PROTOCOL_TCP 0
+#define HV_COUNTERS_PROTOCOL_UDP 1
+#define HV_COUNTERS_PROTOCOL_ICMP 2
+#define HV_COUNTERS_PROTOCOL_OTHER_IP 3
+#define HV_COUNTERS_PROTOCOL_ARP 4
+#define HV_COUNTERS_PROTOCOL_OTHER 5
+#define HV_COUNTERS_PROTOCOLS 6
+
+typedef struct _HV_COUNTERS_MAPPING {
+  //
+  // Start and size of the view; a ULONG64 so 32 bit callers use the same layout
+  //
+  ULONG64 Address;
+  ULONG Length;
+  ULONG Reserved;
+
+} HV_COUNTERS_MAPPING, *PHV_COUNTERS_MAPPING;
+
+typedef struct _HV_COUNTER {
+  ULONG64 Frames;
+  ULONG64 Bytes;
+} HV_COUNTER, *PHV_COUNTER;
+
+typedef struct _HV_COUNTERS_PORT {
+  //
+  // NDIS_SWITCH_PORT_ID bound to the slot (see HVStats.h), HV_STATS_UNKNOWN_PORT_ID
+  // for the unknown slot
+  //
+  ULONG PortId;
+
+  //
+  // Non-zero if the slot is currently bound to a vPort
+  //
+  ULONG InUse;
+
+  HV_COUNTER Direction[HV_STATS_DIRECTIONS];
+
+} HV_COUNTERS_PORT, *PHV_COUNTERS_PORT;
+
+typedef struct _HV_COUNTERS_DROPS {
+  //
+  // Records the shared rings (HVRing.h) had no room for, since the ring buffer
+  // was registered
+  //
+  ULONG64 RingRecords;
+
+  //
+  // Records the capture rings (HVCapture.h) had no room for
+  //
+  ULONG64 CaptureRecords;
+
+} HV_COUNTERS_DROPS, *PHV_COUNTERS_DROPS;
+
+typedef struct _HV_COUNTERS_PAGE {
+  //
+  // Odd while the driver writes the page
+  //
+  volatile LONG Sequence;
+
+  //
+  // HV_COUNTERS_VERSION, and sizeof(HV_COUNTERS_PAGE): a newer driver only
+  // appends fields
+  //
+  ULONG Version;
+  ULONG Length;
+
+  //
+  // Entries in Ports and Protocols
+  //
+  USHORT PortCount;
+  USHORT ProtocolCount;
+
+  //
+  // Clock of the driver when the page was last written, in 100ns units
+  //
+  ULONG64 Timestamp;
+
+  HV_COUNTERS_PORT Ports[HV_STATS_PORT_SLOTS];
+
+  HV_COUNTER Protocols[HV_COUNTERS_PROTOCOLS][HV_STATS_DIRECTIONS];
+
+  HV_COUNTERS_DROPS Drops;
+
+} HV_COUNTERS_PAGE, *PHV_COUNTERS_PAGE;
+
+//
+// A full barrier: MemoryBarrier where the Windows headers are available,
+// the compiler's own fence elsewhere
+//
+#ifdef _MSC_VER
+#define HV_COUNTERS_BARRIER() MemoryBarrier()
+#else
+#define HV_COUNTERS_BARRIER() __sync_synchronize()
+#endif
+
+/************************ reader ******************************/
+
+//
+// Copies a consistent snapshot of Page to Snapshot, retrying at most Attempts
+// times while the driver writes it.  Returns FALSE if every attempt overlapped
+// a write, or if Page was never written.
+//
+__inline BOOLEAN HvCountersSnapshot(const HV_COUNTERS_PAGE* Page, PHV_COUNTERS_PAGE Snapshot, ULONG Attempts)
+{
+  LONG before;
+
+  while (Attempts--) {
+
+    before = Page->Sequence;
+
+    if (!before || (before & 1)) {
+
+      continue;
+
+    }
+
+    HV_COUNTERS_BARRIER();
+
+    memcpy(Snapshot, (const void*) Page, sizeof(HV_COUNTERS_PAGE));
+
+    HV_COUNTERS_BARRIER();
+
+    if (Page->Sequence == before) {
+
+      return TRUE;
+
+    }
+
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+//
+// Record stream returned by the reads of the data device.  A read brings back
+// one HV_RECORD_STREAM header followed by as many records as fit in the read
+// buffer.  Every record starts with an HV_RECORD_HEADER giving its type and its
+// length, so a reader skips the types it does not know and a newer driver can
+// grow a record at its end without breaking older readers.  Records are 8 byte
+// aligned and never split across reads.  This header is shared between the
+// driver and the user mode components; the encoder and the decoder below work
+// in place, on the caller's buffer.
+//
+
+#define HV_RECORD_MAGIC 0x52535648 // 'HVSR'
+#define HV_RECORD_VERSION 1
+
+#define HV_RECORD_ALIGNMENT 8
+#define HV_RECORD_ALIGN(Length) (((Length) + HV_RECORD_ALIGNMENT - 1) & ~(HV_RECORD_ALIGNMENT - 1))
+
+//
+// Record types
+//
+#define HV_RECORD_PACKET 1
+// 2 is not used: the flows are exported by the service (see FlowExport.h)
+#define HV_RECORD_COUNTERS 3
+#define HV_RECORD_HISTOGRAM 4
+#define HV_RECORD_EVENT 5
+
+typedef struct _HV_RECORD_STREAM {
+  //
+  // HV_RECORD_MAGIC and HV_RECORD_VERSION
+  //
+  ULONG Magic;
+  USHORT Version;
+
+  //
+  // sizeof(HV_RECORD_STREAM): the first record follows
+  //
+  USHORT HeaderLength;
+
+  //
+  // Bytes of the stream, this header included
+  //
+  ULONG Length;
+  ULONG RecordCount;
+
+} HV_RECORD_STREAM, *PHV_RECORD_STREAM;
+
+typedef struct _HV_RECORD_HEADER {
+  //
+  // HV_RECORD_*
+  //
+  USHORT Type;
+
+  //
+  // Bytes of the record, this header and the padding included
+  //
+  USHORT Length;
+
+  //
+  // NDIS_SWITCH_PORT_ID the record is about, HV_STATS_UNKNOWN_PORT_ID if none
+  //
+  ULONG PortId;
+
+  //
+  // In 100ns units
+  //
+  ULONG64 Timestamp;
+
+} HV_RECORD_HEADER, *PHV_RECORD_HEADER;
+
+//
+// Summary of a frame, followed by the part of its payload that was kept
+//
+typedef struct _HV_RECORD_PACKET_DATA {
+  HV_RECORD_HEADER Header;
+
+  //
+  // HV_STATS_DIRECTION_*
+  //
+  USHORT Direction;
+
+  //
+  // Host byte order, 0 if not known
+  //
+  USHORT EtherType;
+
+  //
+  // IPv4 protocol / IPv6 next header, 0 if not known
+  //
+  UCHAR IpProtocol;
+  UCHAR Reserved[3];
+
+  ULONG FrameLength;
+
+  //
+  // Network byte order, 0 if not known
+  //
+  ULONG SourceAddress;
+  ULONG DestinationAddress;
+  USHORT SourcePort;
+  USHORT DestinationPort;
+
+  ULONG PayloadLength;
+  ULONG Reserved2;
+
+  UCHAR Payload[1];
+
+} HV_RECORD_PACKET_DATA, *PHV_RECORD_PACKET_DATA;
+
+//
+// Totals of a port in one direction.  A read also carries one record for the
+// whole switch (PortId HV_STATS_UNKNOWN_PORT_ID, Direction
+// HV_RECORD_DIRECTION_SWITCH): its Frames and Bytes are 0 and its Dropped
+// counts the records of the shared rings and of the capture that the driver
+// dropped since it started.  The driver does not count drops per port.
+//
+#define HV_RECORD_DIRECTION_SWITCH 0xFFFF
+
+typedef struct _HV_RECORD_COUNTERS_DATA {
+  HV_RECORD_HEADER Header;
+
+  //
+  // HV_STATS_DIRECTION_* or HV_RECORD_DIRECTION_SWITCH
+  //
+  USHORT Direction;
+  USHORT Reserved;
+  ULONG Reserved2;
+
+  ULONG64 Frames;
+  ULONG64 Bytes;
+  ULONG64 Dropped;
+
+} HV_RECORD_COUNTERS_DATA, *PHV_RECORD_COUNTERS_DATA;
+
+//
+// Histogram of a port in one direction (see HVStats.h for the buckets)
+//
+#define HV_RECORD_HISTOGRAM_SIZE 1
+#define HV_RECORD_HISTOGRAM_GAP 2
+
+typedef struct _HV_RECORD_HISTOGRAM_DATA {
+  HV_RECORD_HEADER Header;
+
+  //
+  // HV_STATS_DIRECTION_* and HV_RECORD_HISTOGRAM_*
+  //
+  USHORT Direction;
+  USHORT Kind;
+
+  ULONG BucketCount;
+
+  ULONG64 Buckets[1];
+
+} HV_RECORD_HISTOGRAM_DATA, *PHV_RECORD_HISTOGRAM_DATA;
+
+//
+// Something that happened at Timestamp; what the values mean depends on Code
+//
+#define HV_RECORD_EVENT_MICROBURST 1 // Value[0] bytes, Value[1] frames; Timestamp is the start of the burst
+
+typedef struct _HV_RECORD_EVENT_DATA {
+  HV_RECORD_HEADER Header;
+
+  ULONG Code;
+  ULONG Reserved;
+
+  ULONG64 Value[2];
+
+} HV_RECORD_EVENT_DATA, *PHV_RECORD_EVENT_DATA;
+
+//
+// Lengths of the variable sized records
+//
+#define HV_RECORD_PACKET_LENGTH(PayloadLength) (FIELD_OFFSET(HV_RECORD_PACKET_DATA, Payload) + (PayloadLength))
+#define HV_RECORD_HISTOGRAM_LENGTH(BucketCount) \
+  (FIELD_OFFSET(HV_RECORD_HISTOGRAM_DATA, Buckets) + (BucketCount) * sizeof(ULONG64))
+
+//
+// TRUE if Record (a record header) is long enough to hold Type up to Field:
+// a reader checks this before it looks at Field
+//
+#define HV_RECORD_HOLDS(Record, Type, Field) ((Record)->Length >= RTL_SIZEOF_THROUGH_FIELD(Type, Field))
+
+/************************ encoder ******************************/
+
+typedef struct _HV_RECORD_WRITER {
+  PUCHAR Buffer;
+  ULONG Length;
+  ULONG Offset;
+  ULONG RecordCount;
+} HV_RECORD_WRITER, *PHV_RECORD_WRITER;
+
+//
+// Returns FALSE if the buffer cannot even hold the stream header
+//
+__inline BOOLEAN HvRecordWriterInit(PHV_RECORD_WRITER Writer, PVOID Buffer, ULONG Length)
+{
+  Writer->Buffer = (PUCHAR) Buffer;
+  Writer->Length = Length;
+  Writer->Offset = sizeof(HV_RECORD_STREAM);
+  Writer->RecordCount = 0;
+
+  return Length >= sizeof(HV_RECORD_STREAM);
+}
+
+//
+// Appends a record of Length bytes (header included) and returns it with the
+// header filled in and the rest zeroed, or returns NULL if it does not fit
+//
+__inline PHV_RECORD_HEADER HvRecordAppend(PHV_RECORD_WRITER Writer, USHORT Type, ULONG Length,
+                                          ULONG PortId, ULONG64 Timestamp)
+{
+  PHV_RECORD_HEADER header;
+  ULONG aligned = HV_RECORD_ALIGN(Length);
+
+  if (Length < sizeof(HV_RECORD_HEADER) || aligned > 0xFFFF ||
+      Writer->Offset > Writer->Length || aligned > Writer->Length - Writer->Offset) {
+
+    return NULL;
+
+  }
+
+  header = (PHV_RECORD_HEADER) (Writer->Buffer + Writer->Offset);
+
+  RtlZeroMemory(header, aligned);
+
+  header->Type = Type;
+  header->Length = (USHORT) aligned;
+  header->PortId = PortId;
+  header->Timestamp = Timestamp;
+
+  Writer->Offset += aligned;
+  Writer->RecordCount++;
+
+  return header;
+}
+
+//
+// Writes the stream header; returns the bytes of the stream
+//
+__inline ULONG HvRecordWriterFinish(PHV_RECORD_WRITER Writer)
+{
+  PHV_RECORD_STREAM stream = (PHV_RECORD_STREAM) Writer->Buffer;
+
+  stream->Magic = HV_RECORD_MAGIC;
+  stream->Version = HV_RECORD_VERSION;
+  stream->HeaderLength = sizeof(HV_RECORD_STREAM);
+  stream->Length = Writer->Offset;
+  stream->RecordCount = Writer->RecordCount;
+
+  return Writer->Offset;
+}
+
+/************************ decoder ******************************/
+
+typedef struct _HV_RECORD_READER {
+  const UCHAR* Buffer;
+  ULONG Length;
+  ULONG Offset;
+} HV_RECORD_READER, *PHV_RECORD_READER;
+
+//
+// Returns FALSE unless Buffer starts with a stream of a version this header
+// knows, contained in its Length bytes
+//
+__inline BOOLEAN HvRecordReaderInit(PHV_RECORD_READER Reader, const VOID* Buffer, ULONG Length)
+{
+  const HV_RECORD_STREAM* stream = (const HV_RECORD_STREAM*) Buffer;
+
+  Reader->Buffer = (const UCHAR*) Buffer;
+  Reader->Length = 0;
+  Reader->Offset = 0;
+
+  if (Length < sizeof(HV_RECORD_STREAM) || stream->Magic != HV_RECORD_MAGIC ||
+      stream->Version != HV_RECORD_VERSION || stream->HeaderLength < sizeof(HV_RECORD_STREAM) ||
+      stream->Length > Length || stream->HeaderLength > stream->Length) {
+
+    return FALSE;
+
+  }
+
+  Reader->Length = stream->Length;
+  Reader->Offset = HV_RECORD_ALIGN(stream->HeaderLength);
+
+  return TRUE;
+}
+
+//
+// Returns the next record, pointing into the stream, or NULL at the end of the
+// stream.  A malformed record ends the stream.
+//
+__inline const HV_RECORD_HEADER* HvRecordNext(PHV_RECORD_READER Reader)
+{
+  const HV_RECORD_HEADER* header;
+
+  if (Reader->Offset >= Reader->Length || Reader->Length - Reader->Offset < sizeof(HV_RECORD_HEADER)) {
+
+    return NULL;
+
+  }
+
+  header = (const HV_RECORD_HEADER*) (Reader->Buffer + Reader->Offset);
+
+  if (header->Length < sizeof(HV_RECORD_HEADER) || (header->Length & (HV_RECORD_ALIGNMENT - 1)) ||
+      header->Length > Reader->Length - Reader->Offset) {
+
+    Reader->Offset = Reader->Length;
+    return NULL;
+
+  }
+
+  Reader->Offset += header->Length;
+
+  return header;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+//
+// Shared-memory record rings.  The service registers one buffer with
+// OSR_COMM_CONTROL_REGISTER_RING; the driver locks it once, lays out an
+// HV_RING_AREA in it and from then on appends an HV_RING_RECORD per frame to
+// the ring of the processor the frame was seen on.  Every ring has exactly one
+// producer (its processor) and one consumer (the service), so neither side
+// takes a lock.  IRPs are only used to sleep: OSR_COMM_CONTROL_WAIT_RING pends
+// until a record is published.  This header is shared between the driver and
+// the user mode components.
+//
+// Consumer protocol:
+//  1. copy the records between Tail and Head of each ring, then store Tail
+//  2. when every ring is empty, set ConsumerWaiting to 1, look at the rings
+//     again and only if they are still empty issue OSR_COMM_CONTROL_WAIT_RING
+//  3. the driver clears ConsumerWaiting when it completes the wait
+//
+// A wait given an HV_RING_WAIT as input is only completed once MinRecords
+// records are waiting, or MaxLatency ms after the first of them was published,
+// so one wakeup takes a batch of records rather than a single one.  Without an
+// input buffer it completes on the first record.
+//
+// Head and Tail are free running record counts; the record at position p of
+// ring r is HV_RING_RECORDS(area, r)[p & (RecordsPerRing - 1)].
+//
+
+#define HV_RING_VERSION 1
+
+#define HV_RING_CACHE_LINE 64
+
+//
+// Smallest ring the driver accepts, and the largest buffer it locks
+//
+#define HV_RING_MIN_RECORDS 64
+#define HV_RING_MAX_BUFFER (64 * 1024 * 1024)
+
+typedef struct _HV_RING_REGISTER {
+  //
+  // Start and size of the buffer; a ULONG64 so 32 bit callers use the same layout
+  //
+  ULONG64 Buffer;
+  ULONG Length;
+  ULONG Reserved;
+
+} HV_RING_REGISTER, *PHV_RING_REGISTER;
+
+//
+// Optional input of OSR_COMM_CONTROL_WAIT_RING
+//
+typedef struct _HV_RING_WAIT {
+  //
+  // Records (over all the rings) that complete the wait; 0 counts as 1
+  //
+  ULONG MinRecords;
+
+  //
+  // Longest a published record keeps the wait pending, in ms; 0 for no bound
+  //
+  ULONG MaxLatency;
+
+} HV_RING_WAIT, *PHV_RING_WAIT;
+
+typedef struct _HV_RING_CONTROL {
+  //
+  // Written by the driver only
+  //
+  volatile ULONG64 Head;
+
+  //
+  // Records lost because the ring was full
+  //
+  volatile ULONG64 Dropped;
+  UCHAR Reserved[HV_RING_CACHE_LINE - 2 * sizeof(ULONG64)];
+
+  //
+  // Written by the service only, on its own cache line
+  //
+  volatile ULONG64 Tail;
+  UCHAR Reserved2[HV_RING_CACHE_LINE - sizeof(ULONG64)];
+
+} HV_RING_CONTROL, *PHV_RING_CONTROL;
+
+typedef struct _HV_RING_AREA {
+  //
+  // HV_RING_VERSION; the geometry is written by the driver at registration
+  //
+  ULONG Version;
+
+  //
+  // One ring per processor
+  //
+  ULONG RingCount;
+
+  //
+  // Power of 2
+  //
+  ULONG RecordsPerRing;
+  ULONG RecordSize;
+
+  //
+  // From the start of the area to the records of ring 0; the rings follow
+  // each other
+  //
+  ULONG RecordsOffset;
+
+  //
+  // Set by the service before it waits, cleared by the driver when it wakes it
+  //
+  volatile LONG ConsumerWaiting;
+  UCHAR Reserved[HV_RING_CACHE_LINE - 6 * sizeof(ULONG)];
+
+  HV_RING_CONTROL Rings[1];
+
+} HV_RING_AREA, *PHV_RING_AREA;
+
+//
+// Fixed-format summary of one frame
+//
+typedef struct _HV_RING_RECORD {
+  //
+  // Time the NBL chain was indicated, in 100ns units
+  //
+  ULONG64 Timestamp;
+
+  ULONG PortId;
+  ULONG FrameLength;
+
+  //
+  // HV_STATS_DIRECTION_*
+  //
+  USHORT Direction;
+
+  //
+  // Host byte order
+  //
+  USHORT EtherType;
+
+  //
+  // IPv4 protocol / IPv6 next header, 0 for other frames
+  //
+  UCHAR IpProtocol;
+  UCHAR Reserved[3];
+
+  //
+  // IPv4 only, network byte order; 0 otherwise
+  //
+  ULONG SourceAddress;
+  ULONG DestinationAddress;
+
+  //
+  // TCP / UDP only, network byte order; 0 otherwise
+  //
+  USHORT SourcePort;
+  USHORT DestinationPort;
+
+  ULONG Reserved2;
+
+} HV_RING_RECORD, *PHV_RING_RECORD;
+
+#define HV_RING_RECORDS(Area, Ring) \
+  ((PHV_RING_RECORD)((PUCHAR)(Area) + (Area)->RecordsOffset) + (SIZE_T)(Ring) * (Area)->RecordsPerRing)
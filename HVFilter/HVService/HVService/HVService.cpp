@@ -1,6 +1,7 @@
 #include "HVService.h"
 
 #include "Stuff.h"
+#include "../../Pipes/Pipes.h"
 #include <crtdbg.h>
 //#include "appsrv.h"
 //#include "reflectorservice.h"
@@ -8,27 +9,50 @@
 //#include <devguid.h>
 //#include <winioctl.h>
 
-typedef struct _CommRequest {
+//
+// Bytes of a flow frame: the pipe frame header, then an export that holds a keyframe
+//
+#define HV_SERVICE_FLOW_FRAME_LENGTH (sizeof(PIPE_FRAME_HEADER) + FLOW_EXPORT_MAX_LENGTH(FLOW_TABLE_MAX_FLOWS))
 
-    OSR_COMM_CONTROL_REQUEST    CommRequest;
-    char                        CommRequestBuffer[65536];
-
-} COMMREQUEST, *PCOMMREQUEST;
+namespace
+{
+    //
+    // What a pipe reader was told about the flows, and the frame it is sent
+    //
+    struct FlowReader
+    {
+        FlowReader(HVService* pService,FlowTable& table) :pService(pService),Encoder(table),pbFrame(NULL) {}
+
+        HVService*  pService;
+        FlowEncoder Encoder;
+        BYTE*       pbFrame;
+    };
+}
 
-typedef struct _CommResponse {
+HVService::~HVService(void)
+{
+    if(m_hStopEvent != NULL) {
 
-    OSR_COMM_CONTROL_RESPONSE  CommResponse;
-    char                       CommResponseBuffer[65536];
+        CloseHandle(m_hStopEvent);
 
-} COMMRESPONSE, *PCOMMRESPONSE;
+    }
 
-HVService::~HVService(void)
-{
+    DeleteCriticalSection(&m_HeldReadsLock);
 }
 
 HVService::HVService() :Service(L"HVService", L"Service for HV driver"),
-                                        m_bConnected(FALSE),m_hOsrControl(INVALID_HANDLE_VALUE)
+                                        m_bConnected(FALSE),m_hOsrControl(INVALID_HANDLE_VALUE),
+                                        m_dwRingLength(HV_SERVICE_DEFAULT_RING_LENGTH),m_hRingThread(NULL),m_bRingStop(FALSE),m_ullRingRecords(0),m_ullRingBytes(0),m_ullRingTime(0),
+                                        m_dwNotifyRecords(HV_SERVICE_DEFAULT_NOTIFY_RECORDS),
+                                        m_dwNotifyLatency(HV_SERVICE_DEFAULT_NOTIFY_LATENCY),
+                                        m_Engine(m_dbgMsg),m_dwOutstanding(HV_SERVICE_DEFAULT_OUTSTANDING),
+                                        m_dwWorkers(HV_SERVICE_DEFAULT_WORKERS),
+                                        m_bHoldReads(FALSE),m_dwHeldReads(0)
 {
+    m_hStopEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+    InitializeCriticalSection(&m_HeldReadsLock);
+
 	  m_iStartParam = 0;
 	  m_iIncParam = 1;
 	  m_iState = m_iStartParam;
@@ -55,6 +79,22 @@ BOOL HVService::OnInit()
 
 		dwSize = sizeof(m_iIncParam);
 		RegQueryValueEx(hkey, L"Inc", NULL, &dwType, (BYTE*)&m_iIncParam, &dwSize);
+
+		dwSize = sizeof(m_dwRingLength);
+		RegQueryValueEx(hkey, L"RingLength", NULL, &dwType, (BYTE*)&m_dwRingLength, &dwSize);
+
+		dwSize = sizeof(m_dwNotifyRecords);
+		RegQueryValueEx(hkey, L"NotifyRecords", NULL, &dwType, (BYTE*)&m_dwNotifyRecords, &dwSize);
+
+		dwSize = sizeof(m_dwNotifyLatency);
+		RegQueryValueEx(hkey, L"NotifyLatency", NULL, &dwType, (BYTE*)&m_dwNotifyLatency, &dwSize);
+
+		dwSize = sizeof(m_dwOutstanding);
+		RegQueryValueEx(hkey, L"Outstanding", NULL, &dwType, (BYTE*)&m_dwOutstanding, &dwSize);
+
+		dwSize = sizeof(m_dwWorkers);
+		RegQueryValueEx(hkey, L"Workers", NULL, &dwType, (BYTE*)&m_dwWorkers, &dwSize);
+
 		RegCloseKey(hkey);
 	}
 
@@ -82,20 +122,28 @@ BOOL HVService::OnInit()
 
 void HVService::Run()
 {
-    OVERLAPPED                  CommRequestOverlapped;
-    COMMREQUEST                 CommRequest;
-    COMMRESPONSE                CommResponse;
-    BOOL                        ret;
-
 	m_dbgMsg(L"HVService::Run Entered.");
 
     //DebugBreak();
 
-    while (m_bIsRunning) {
+    //
+    // Readers of the counters and of the flows connect to the pipe; the service
+    // runs without it
+    //
+    PIPE_FLOW_EXPORT flowExport;
+
+    flowExport.Open = OpenFlowReader;
+    flowExport.Export = ExportFlows;
+    flowExport.Close = CloseFlowReader;
+    flowExport.context = this;
+
+    if(!create_pipe_server(&flowExport)) {
 
-        // Sleep for a while
-        m_dbgMsg(L"HVService is sleeping (%lu)...", m_iState);
-        Sleep(1000);
+        m_dbgMsg(L"HVService Can't Create Pipe Server (%lu)...", GetLastError());
+
+    }
+
+    while (m_bIsRunning) {
 
         if(!m_bConnected) {
 
@@ -110,145 +158,319 @@ void HVService::Run()
             } else {
 
                 m_dbgMsg(L"HVService Can't Connect to Control (%lu)...", GetLastError());
+
+                //
+                // The driver may not be loaded yet: try again in a second,
+                // unless we are stopped first
+                //
+                WaitForSingleObject(m_hStopEvent,1000);
                 continue;
 
             }
 
         }
 
-        // Update the current state
-        m_iState += m_iIncParam;
+        if(m_dwRingLength != 0 && !m_Ring.IsAttached()) {
+
+            if(!m_Ring.Attach(m_hOsrControl,m_dwRingLength)) {
+
+                m_dbgMsg(L"HVService Can't Register Ring (%lu)...", GetLastError());
+
+            } else {
+
+                m_Ring.SetNotify(m_dwNotifyRecords,m_dwNotifyLatency);
+
+            }
+
+        }
+
+        if(m_hRingThread == NULL) {
+
+            //
+            // The ring is drained on its own thread.  It runs without a ring
+            // too: the pipe readers and the held reads go by its drains
+            //
+            m_bRingStop = FALSE;
+            m_bHoldReads = TRUE;
+            m_hRingThread = CreateThread(NULL,0,RingThread,this,0,NULL);
+
+            if(m_hRingThread == NULL) {
+
+                m_dbgMsg(L"HVService Can't Start Ring Thread (%lu)...", GetLastError());
+
+                m_bHoldReads = FALSE;
+
+            }
+
+        }
 
         //
-        // See if there is any work to do.....
+        // From here on the requests are answered on the engine's workers
         //
+        if(!m_Engine.Start(m_hOsrControl,m_dwOutstanding,m_dwWorkers,HandleRequest,this)) {
 
-        memset(&CommRequestOverlapped,0,sizeof(CommRequestOverlapped));
+            m_dbgMsg(L"HVService Can't Start Request Engine (%lu)...", GetLastError());
 
-        CommRequestOverlapped.hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
-
-        if(CommRequestOverlapped.hEvent == INVALID_HANDLE_VALUE) {
+            Disconnect();
 
+            WaitForSingleObject(m_hStopEvent,1000);
             continue;
 
         }
 
-        memset(&CommRequest,0,sizeof(CommRequest));
+        WaitForSingleObject(m_hStopEvent,INFINITE);
 
-        CommRequest.CommRequest.RequestBuffer = &CommRequest.CommRequestBuffer[0];
-        CommRequest.CommRequest.RequestBufferLength = sizeof(CommRequest.CommRequestBuffer);
+    }
 
-        m_dbgMsg(L"HVService: Getting Request: CommRequest RequestBuffer %x, Length %x", 
-                 CommRequest.CommRequest.RequestBuffer,
-                 CommRequest.CommRequest.RequestBufferLength);
+    Disconnect();
 
-        ret = GetRequest(&CommRequest.CommRequest,&CommRequestOverlapped);
+    uninit_pipe_server();
 
-        if(!ret) {
+}
 
-            CloseHandle(CommRequestOverlapped.hEvent);
-            continue;
+void HVService::Disconnect()
+{
+    if(m_hRingThread != NULL) {
 
-        } else {
+        //
+        // Disconnect also runs while the service keeps running (the engine
+        // did not start): the thread sees m_bRingStop within a second
+        //
+        m_bRingStop = TRUE;
+        WaitForSingleObject(m_hRingThread,INFINITE);
+        CloseHandle(m_hRingThread);
+        m_hRingThread = NULL;
 
-            BOOL running = TRUE;
+    }
 
-            while(!HasOverlappedIoCompleted(&CommRequestOverlapped)) {
+    m_Ring.Detach();
 
-                if(!m_bIsRunning) {
+    if(m_Engine.IsStarted()) {
 
-                    goto exitStageLeft;                    
+        //
+        // Closes the control handle: that is what gives back the exchanges
+        // still in flight
+        //
+        m_Engine.Stop();
 
-                } 
+    } else if(m_hOsrControl != INVALID_HANDLE_VALUE) {
 
-                Sleep(100);
+        CloseHandle(m_hOsrControl);
 
-            }
+    }
 
-            if(running) {
+    m_hOsrControl = INVALID_HANDLE_VALUE;
+    m_bConnected = FALSE;
+}
 
-                DWORD   bytesTransferred;
+BOOL HVService::HandleRequest(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+{
+    HVService* pService = (HVService*) pContext;
 
-                //
-                // Process Request.
-                //
-                running = GetOverlappedResult(m_hOsrControl,&CommRequestOverlapped,&bytesTransferred,FALSE);
-                
-                _ASSERT(running);
-
-                //DebugBreak();
-
-                m_dbgMsg(L"HVService: GetRequest Completed"); 
-                m_dbgMsg(L"HVService: GetRequest Completed: Id= %x, Type = %x, CommRequest RequestBuffer %x, Length %x", 
-                         CommRequest.CommRequest.RequestID,
-                         CommRequest.CommRequest.RequestType,
-                         CommRequest.CommRequest.RequestBuffer,
-                         CommRequest.CommRequest.RequestBufferLength);
-
-                CommResponse.CommResponse.RequestID = CommRequest.CommRequest.RequestID;
-                CommResponse.CommResponse.ResponseType = CommRequest.CommRequest.RequestType;
-                CommResponse.CommResponse.ResponseBuffer = &CommResponse.CommResponseBuffer[0];
-                CommResponse.CommResponse.ResponseBufferLength = CommRequest.CommRequest.RequestBufferLength;
-
-                memcpy(&CommResponse.CommResponseBuffer[0],
-                       &CommRequest.CommRequestBuffer[0],
-                       CommRequest.CommRequest.RequestBufferLength);
-
-                ResetEvent(CommRequestOverlapped.hEvent);
-                
-                m_dbgMsg(L"HVService: Sending Response: Id= %x, Type = %x, CommRequest RequestBuffer %x, Length %x", 
-                         CommResponse.CommResponse.RequestID,
-                         CommResponse.CommResponse.ResponseType,
-                         CommResponse.CommResponse.ResponseBuffer,
-                         CommResponse.CommResponse.ResponseBufferLength);
+    //
+    // Echo the request back, like the single request loop always did: the
+    // response types have the values of the request types
+    //
+    pCompletion->RequestID = pEntry->RequestID;
+    pCompletion->ResponseType = pEntry->RequestType;
+    pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+    pCompletion->Reserved = 0;
 
-                //
-                // Send Response.
-                //
-                ret = SendResponse(&CommResponse.CommResponse,&CommRequestOverlapped);
+    InterlockedExchangeAdd((volatile LONG*) &pService->m_iState,pService->m_iIncParam);
+
+    if(pEntry->RequestType == OSR_COMM_READ_REQUEST) {
+
+        BOOL held = FALSE;
 
-                if(!ret) {
+        //
+        // The driver fills a read with the records it has when the answer
+        // arrives: answered after the next drain, a read gets a batch of
+        // fresh traffic instead of returning right away with next to nothing.
+        // The held read costs no worker and no exchange slot meanwhile.
+        //
+        EnterCriticalSection(&pService->m_HeldReadsLock);
 
-                    //DebugBreak();
-                    CloseHandle(CommRequestOverlapped.hEvent);
-                    continue;
+        if(pService->m_bHoldReads && pService->m_dwHeldReads < HV_SERVICE_MAX_HELD_READS) {
 
-                } else {
+            pService->m_HeldReads[pService->m_dwHeldReads++] = *pCompletion;
+            held = TRUE;
 
-                    BOOL running = TRUE;
+        }
 
-                    while(!HasOverlappedIoCompleted(&CommRequestOverlapped)) {
+        LeaveCriticalSection(&pService->m_HeldReadsLock);
 
-                        if(!m_bIsRunning) {
+        if(held) {
 
-                            goto exitStageLeft;                    
+            return FALSE;
 
-                        } 
+        }
 
-                        Sleep(100);
+    }
 
-                    }
+    return TRUE;
+}
 
-                    m_dbgMsg(L"HVService: SendResponse Completed.\n");
+void HVService::AnswerHeldReads(BOOL bKeepHolding)
+{
+    OSR_COMM_BATCH_COMPLETION reads[HV_SERVICE_MAX_HELD_READS];
+    DWORD count;
 
-                    CloseHandle(CommRequestOverlapped.hEvent);
+    //
+    // Copied out, so the workers can hold new reads while these go down
+    //
+    EnterCriticalSection(&m_HeldReadsLock);
 
-                }
+    count = m_dwHeldReads;
+    memcpy(reads,m_HeldReads,count * sizeof(OSR_COMM_BATCH_COMPLETION));
+    m_dwHeldReads = 0;
+    m_bHoldReads = bKeepHolding;
+
+    LeaveCriticalSection(&m_HeldReadsLock);
+
+    //
+    // Dropped once the engine is stopped: the driver fails the requests when
+    // the control handle is cleaned up
+    //
+    for(DWORD index = 0; index < count; index++) {
+
+        m_Engine.Complete(&reads[index]);
+
+    }
+}
+
+void HVService::OnStop()
+{
+    //
+    // Run is blocked on this event; it must see m_bIsRunning cleared when it
+    // wakes up
+    //
+    m_bIsRunning = FALSE;
+    SetEvent(m_hStopEvent);
+}
+
+DWORD WINAPI HVService::RingThread(LPVOID lpParameter)
+{
+    HVService* pService = (HVService*) lpParameter;
+
+    while (pService->m_bIsRunning && !pService->m_bRingStop) {
+
+        if(!pService->m_Ring.IsAttached()) {
+
+            //
+            // No ring: every second is a quiet one
+            //
+            WaitForSingleObject(pService->m_hStopEvent,1000);
+
+        } else if(pService->m_Ring.Wait(1000)) {
+
+            //
+            // The driver wakes us once a batch of records is published.  The
+            // flow table lock is held for the whole drain rather than taken
+            // per record: an export waits for one drain at most
+            //
+            pService->m_Flows.BeginUpdate();
+            pService->m_ullRingRecords += pService->m_Ring.Drain(OnRingRecord,pService);
+            pService->m_Flows.EndUpdate();
+
+            //
+            // Flows age on the clock of the records
+            //
+            pService->m_Flows.Expire(pService->m_ullRingTime);
 
-            }
         }
+
+        //
+        // After a drain or a quiet second: held reads do not wait for traffic any longer
+        //
+        pService->AnswerHeldReads(TRUE);
+
+        //
+        // One record per drain to every pipe reader; a slow one loses the oldest
+        //
+        pipe_server_write(pService->m_ullRingTime,pService->m_ullRingRecords,pService->m_ullRingBytes);
+
     }
 
-exitStageLeft:
+    //
+    // No more drains: nothing may be left waiting for one
+    //
+    pService->AnswerHeldReads(FALSE);
 
-    if(m_hOsrControl != INVALID_HANDLE_VALUE) {
+    pService->m_dbgMsg(L"HVService: %I64u ring records, %I64u dropped, %I64u without a flow slot",
+                       pService->m_ullRingRecords,
+                       pService->m_Ring.GetDropped(),
+                       pService->m_Flows.GetOverflow());
 
-        CloseHandle(m_hOsrControl);
-        m_hOsrControl = INVALID_HANDLE_VALUE;
-        m_bConnected = FALSE;
+    return 0;
+}
+
+void* HVService::OpenFlowReader(void* pContext)
+{
+    HVService* pService = (HVService*) pContext;
+    FlowReader* pReader = new FlowReader(pService,pService->m_Flows);
+
+    pReader->pbFrame = (BYTE*) VirtualAlloc(NULL,HV_SERVICE_FLOW_FRAME_LENGTH,MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    if(pReader->pbFrame == NULL) {
+
+        delete pReader;
+        return NULL;
 
     }
 
+    return pReader;
+}
+
+void* HVService::ExportFlows(void* pReader,unsigned long* pulLength)
+{
+    FlowReader* pFlowReader = (FlowReader*) pReader;
+    DWORD dwLength;
+
+    //
+    // The clock of the ring thread: a stale value only makes the ages of the
+    // export a drain older
+    //
+    dwLength = pFlowReader->Encoder.Export(pFlowReader->pbFrame + sizeof(PIPE_FRAME_HEADER),
+                                           FLOW_EXPORT_MAX_LENGTH(FLOW_TABLE_MAX_FLOWS),
+                                           pFlowReader->pService->m_ullRingTime);
+
+    if(dwLength == 0) {
+
+        return NULL;
+
+    }
+
+    *pulLength = sizeof(PIPE_FRAME_HEADER) + dwLength;
+
+    return pFlowReader->pbFrame;
+}
+
+void HVService::CloseFlowReader(void* pReader)
+{
+    FlowReader* pFlowReader = (FlowReader*) pReader;
+
+    if(pFlowReader->pbFrame != NULL) {
+
+        VirtualFree(pFlowReader->pbFrame,0,MEM_RELEASE);
+
+    }
+
+    delete pFlowReader;
+}
+
+void HVService::OnRingRecord(const HV_RING_RECORD* pRecord, PVOID pContext)
+{
+    HVService* pService = (HVService*) pContext;
+
+    pService->m_Flows.Update(pRecord);
+
+    pService->m_ullRingBytes += pRecord->FrameLength;
+
+    if(pRecord->Timestamp > pService->m_ullRingTime) {
+
+        pService->m_ullRingTime = pRecord->Timestamp;
+
+    }
 }
 
 void HVService::OnDeviceEvent(DWORD dwEventType,LPVOID lpEventData)
@@ -2,6 +2,23 @@
 
 #include "Service.h"
 #include "HVioctl.h"
+#include "RingConsumer.h"
+#include "FlowExport.h"
+#include "RequestEngine.h"
+
+// Batched control requests kept in flight, and the threads answering them
+#define HV_SERVICE_DEFAULT_OUTSTANDING 4
+#define HV_SERVICE_DEFAULT_WORKERS 2
+
+// Shared ring length; RingLength 0 in the registry leaves the rings to the driver alone
+#define HV_SERVICE_DEFAULT_RING_LENGTH (1024 * 1024)
+
+// The ring thread is woken for this many records, or when the first is this many ms old
+#define HV_SERVICE_DEFAULT_NOTIFY_RECORDS 256
+#define HV_SERVICE_DEFAULT_NOTIFY_LATENCY 20
+
+// Data device reads held until the next ring drain, or a second; more are answered right away
+#define HV_SERVICE_MAX_HELD_READS 1024
 
 class HVService : public Service
 {
@@ -11,6 +28,7 @@ public:
 
 	BOOL OnInit() /*override*/;
     void Run() /*override*/;
+    void OnStop() /*override*/;
     BOOL OnUserControl(DWORD dwOpcode) /*override*/;
     void OnDeviceEvent(DWORD dwEventType,LPVOID lpEventData) /*override*/;
 
@@ -22,6 +40,16 @@ public:
 
 private:
     void SaveStatus();
+    void Disconnect();
+    static DWORD WINAPI RingThread(LPVOID lpParameter);
+    static void OnRingRecord(const HV_RING_RECORD* pRecord, PVOID pContext);
+    static BOOL HandleRequest(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext);
+    void AnswerHeldReads(BOOL bKeepHolding);
+
+    // PIPE_FLOW_EXPORT callbacks: every pipe reader gets a FlowEncoder
+    static void* OpenFlowReader(void* pContext);
+    static void* ExportFlows(void* pReader,unsigned long* pulLength);
+    static void CloseFlowReader(void* pReader);
 
     // Control parameters
     int	m_iStartParam;
@@ -32,5 +60,34 @@ private:
 
     BOOL	m_bConnected;
     HANDLE	m_hOsrControl;
+
+    // Shared record rings: the driver takes one registration, and the service is
+    // its only owner.  Without them (RingLength 0, or the registration failed)
+    // the ring thread still runs, once a second
+    DWORD           m_dwRingLength;
+    RingConsumer    m_Ring;
+    HANDLE          m_hRingThread;
+    volatile BOOL   m_bRingStop;
+    ULONG64         m_ullRingRecords;
+    ULONG64         m_ullRingBytes;
+    DWORD           m_dwNotifyRecords;
+    DWORD           m_dwNotifyLatency;
+
+    // Flows of the ring records, exported to readers through FlowEncoders
+    FlowTable       m_Flows;
+    ULONG64         m_ullRingTime;
+
+    RequestEngine   m_Engine;
+    DWORD           m_dwOutstanding;
+    DWORD           m_dwWorkers;
+
+    // While the ring thread runs, reads are answered after its drains, or its quiet seconds
+    CRITICAL_SECTION            m_HeldReadsLock;
+    BOOL                        m_bHoldReads;
+    DWORD                       m_dwHeldReads;
+    OSR_COMM_BATCH_COMPLETION   m_HeldReads[HV_SERVICE_MAX_HELD_READS];
+
+    // Set by OnStop; Run blocks on it
+    HANDLE          m_hStopEvent;
 };
 
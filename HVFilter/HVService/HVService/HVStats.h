@@ -0,0 +1,247 @@
+#pragma once
+
+//
+// Statistics exported by the extension through OSR_COMM_CONTROL_QUERY_HISTOGRAMS.
+// This header is shared between the driver and the user mode components, so it
+// must only use types available in both.
+//
+
+//
+// Number of vPorts that get their own histogram slot.  Traffic of ports that
+// could not be given a slot is accounted in the "unknown port" slot.
+//
+#define HV_STATS_MAX_PORTS 64
+#define HV_STATS_UNKNOWN_PORT_SLOT HV_STATS_MAX_PORTS
+#define HV_STATS_PORT_SLOTS (HV_STATS_MAX_PORTS + 1)
+#define HV_STATS_UNKNOWN_PORT_ID 0xFFFFFFFF
+
+#define HV_STATS_DIRECTION_INBOUND 0
+#define HV_STATS_DIRECTION_OUTBOUND 1
+#define HV_STATS_DIRECTIONS 2
+
+//
+// Frame sizes: bucket i holds frames of [2^i, 2^(i+1)) bytes, the last bucket
+// also holds everything larger (jumbo / RSC coalesced frames).
+//
+#define HV_STATS_SIZE_BUCKETS 17
+
+//
+// Inter-arrival gaps, in 100ns units: bucket 0 holds gaps below 100ns (frames
+// delivered in the same NBL chain), bucket i holds [2^(i-1), 2^i) * 100ns.
+// Gaps are measured per vPort, direction and processor (RSS queue); the first
+// frame of a slot on each processor has no gap, so the gap buckets sum to
+// slightly less than Frames.
+//
+#define HV_STATS_GAP_BUCKETS 28
+
+typedef struct _HV_PORT_HISTOGRAM {
+  //
+  // Total frames and bytes seen by this slot
+  //
+  ULONG64 Frames;
+  ULONG64 Bytes;
+
+  ULONG64 SizeBuckets[HV_STATS_SIZE_BUCKETS];
+  ULONG64 GapBuckets[HV_STATS_GAP_BUCKETS];
+
+} HV_PORT_HISTOGRAM, *PHV_PORT_HISTOGRAM;
+
+typedef struct _HV_PORT_HISTOGRAMS {
+  //
+  // NDIS_SWITCH_PORT_ID of the vPort, HV_STATS_UNKNOWN_PORT_ID for the unknown slot
+  //
+  ULONG PortId;
+
+  //
+  // Non-zero if the slot is currently bound to a vPort
+  //
+  ULONG InUse;
+
+  HV_PORT_HISTOGRAM Direction[HV_STATS_DIRECTIONS];
+
+} HV_PORT_HISTOGRAMS, *PHV_PORT_HISTOGRAMS;
+
+#define HV_HISTOGRAM_SNAPSHOT_VERSION 1
+
+typedef struct _HV_HISTOGRAM_SNAPSHOT {
+  //
+  // HV_HISTOGRAM_SNAPSHOT_VERSION
+  //
+  ULONG Version;
+
+  //
+  // Number of entries in Ports (always HV_STATS_PORT_SLOTS for version 1)
+  //
+  ULONG PortCount;
+
+  //
+  // Time the snapshot was taken, in 100ns units
+  //
+  ULONG64 Timestamp;
+
+  HV_PORT_HISTOGRAMS Ports[HV_STATS_PORT_SLOTS];
+
+} HV_HISTOGRAM_SNAPSHOT, *PHV_HISTOGRAM_SNAPSHOT;
+
+/************************ microbursts ******************************/
+
+//
+// Traffic is accounted in 100us buckets (1000 units of 100ns).  A burst is a run
+// of consecutive buckets whose byte count reaches the configured threshold.
+//
+#define HV_MICROBURST_BUCKET_TIME 1000
+
+//
+// Default threshold: half of a 10Gbps link, in bytes per bucket
+//
+#define HV_MICROBURST_DEFAULT_THRESHOLD 62500
+
+typedef struct _HV_MICROBURST_CONFIG {
+  //
+  // Bytes per 100us bucket at or above which a bucket counts as bursting
+  //
+  ULONG ThresholdBytes;
+
+} HV_MICROBURST_CONFIG, *PHV_MICROBURST_CONFIG;
+
+typedef struct _HV_MICROBURST_EVENT {
+  //
+  // Start of the first bursting bucket, in 100ns units
+  //
+  ULONG64 StartTime;
+
+  //
+  // Bytes and frames seen during the burst
+  //
+  ULONG64 Bytes;
+  ULONG Packets;
+
+  ULONG PortId;
+
+  //
+  // Burst length in 100ns units (a multiple of HV_MICROBURST_BUCKET_TIME)
+  //
+  ULONG Duration;
+
+  //
+  // Content of the busiest bucket
+  //
+  ULONG PeakBytes;
+  ULONG PeakPackets;
+
+  ULONG Direction;
+
+} HV_MICROBURST_EVENT, *PHV_MICROBURST_EVENT;
+
+//
+// OSR_COMM_CONTROL_READ_MICROBURSTS takes the sequence number of the next event
+// the reader wants as input, and returns this header followed by the events.
+// The IRP stays pending until at least one event newer than the cursor exists.
+//
+typedef struct _HV_MICROBURST_READ {
+  ULONG64 Sequence;
+} HV_MICROBURST_READ, *PHV_MICROBURST_READ;
+
+typedef struct _HV_MICROBURST_EVENTS {
+  //
+  // Sequence number to pass in the next read
+  //
+  ULONG64 NextSequence;
+
+  //
+  // Events that were overwritten before the reader got to them
+  //
+  ULONG Lost;
+
+  ULONG Count;
+
+  HV_MICROBURST_EVENT Events[1];
+
+} HV_MICROBURST_EVENTS, *PHV_MICROBURST_EVENTS;
+
+/************************ sampling governor ******************************/
+
+//
+// How much work the extension does per frame.  Every processor picks its own
+// mode from the share of its time the extension used in the last interval:
+//  FULL    - headers and TCP options / payload are parsed for every frame, and
+//            VXLAN / NVGRE packets are parsed down to the inner frame
+//  HEADERS - only the Ethernet / IP / TCP headers are parsed
+//  SAMPLED - only 1 in SampleRate frames (on average) is parsed (IP addresses
+//            only) and accounted in the histograms, with a weight of SampleRate,
+//            so the exported totals stay unbiased
+//
+#define HV_GOVERNOR_MODE_FULL 0
+#define HV_GOVERNOR_MODE_HEADERS 1
+#define HV_GOVERNOR_MODE_SAMPLED 2
+#define HV_GOVERNOR_MODE_AUTO 0xFFFFFFFF
+
+#define HV_GOVERNOR_MAX_SAMPLE_RATE 1024
+
+//
+// Defaults: 5% of each processor, re-evaluated every 10ms
+//
+#define HV_GOVERNOR_DEFAULT_BUDGET 50000
+#define HV_GOVERNOR_DEFAULT_INTERVAL 100000
+#define HV_GOVERNOR_MIN_INTERVAL 10000
+
+typedef struct _HV_GOVERNOR_CONFIG {
+  //
+  // Share of a processor the extension may use, in parts per million.  The
+  // governor steps down when it is exceeded, and back up below half of it.
+  //
+  ULONG Budget;
+
+  //
+  // Evaluation interval, in 100ns units (at least HV_GOVERNOR_MIN_INTERVAL)
+  //
+  ULONG Interval;
+
+  //
+  // HV_GOVERNOR_MODE_AUTO, or a mode every processor is pinned to
+  //
+  ULONG ForcedMode;
+
+  //
+  // Sample rate used with ForcedMode == HV_GOVERNOR_MODE_SAMPLED (a power of 2)
+  //
+  ULONG ForcedSampleRate;
+
+} HV_GOVERNOR_CONFIG, *PHV_GOVERNOR_CONFIG;
+
+typedef struct _HV_GOVERNOR_CPU {
+  ULONG Mode;
+  ULONG SampleRate;
+
+  //
+  // Measured during the last complete interval
+  //
+  ULONG FramesPerSecond;
+  ULONG Busy;
+
+  //
+  // Frames seen and frames parsed / accounted since the driver was loaded
+  //
+  ULONG64 Frames;
+  ULONG64 SampledFrames;
+
+  ULONG ModeChanges;
+  ULONG Reserved;
+
+} HV_GOVERNOR_CPU, *PHV_GOVERNOR_CPU;
+
+#define HV_GOVERNOR_STATE_VERSION 1
+
+//
+// Returned by OSR_COMM_CONTROL_QUERY_GOVERNOR.  CpuCount is the number of
+// processors; only as many entries as fit in the output buffer are filled.
+//
+typedef struct _HV_GOVERNOR_STATE {
+  ULONG Version;
+  ULONG CpuCount;
+
+  HV_GOVERNOR_CONFIG Config;
+
+  HV_GOVERNOR_CPU Cpus[1];
+
+} HV_GOVERNOR_STATE, *PHV_GOVERNOR_STATE;
@@ -54,4 +54,113 @@ typedef struct _OSR_COMM_CONTROL_RESPONSE {
 } OSR_COMM_CONTROL_RESPONSE, *POSR_COMM_CONTROL_RESPONSE;
 
 #define OSR_COMM_READ_RESPONSE 0x10
-#define OSR_COMM_WRITE_RESPONSE 0x20
\ No newline at end of file
+#define OSR_COMM_WRITE_RESPONSE 0x20
+
+/************************ batches ******************************/
+
+//
+// OSR_COMM_CONTROL_EXCHANGE_BATCH carries the completions of earlier requests
+// in (OSR_COMM_BATCH_RESPONSE, optional) and returns the next queued requests
+// (OSR_COMM_BATCH_REQUEST), so one control IRP services many data requests.
+// Without an output buffer it only carries completions and never blocks.
+//
+#define OSR_COMM_BATCH_MAX_REQUESTS 256
+#define OSR_COMM_BATCH_ALIGNMENT 8
+
+typedef struct _OSR_COMM_BATCH_ENTRY {
+  ULONG RequestID;
+
+  //
+  // OSR_COMM_READ_REQUEST or OSR_COMM_WRITE_REQUEST
+  //
+  ULONG RequestType;
+
+  //
+  // Read: bytes requested.  Write: bytes of payload following this entry
+  //
+  ULONG RequestBufferLength;
+
+  //
+  // This entry plus its payload, padded to OSR_COMM_BATCH_ALIGNMENT
+  //
+  ULONG EntryLength;
+
+} OSR_COMM_BATCH_ENTRY, *POSR_COMM_BATCH_ENTRY;
+
+typedef struct _OSR_COMM_BATCH_REQUEST {
+  ULONG Count;
+
+  //
+  // Bytes of entries following this header
+  //
+  ULONG Length;
+
+} OSR_COMM_BATCH_REQUEST, *POSR_COMM_BATCH_REQUEST;
+
+typedef struct _OSR_COMM_BATCH_COMPLETION {
+  ULONG RequestID;
+
+  //
+  // OSR_COMM_READ_RESPONSE or OSR_COMM_WRITE_RESPONSE
+  //
+  ULONG ResponseType;
+
+  ULONG ResponseBufferLength;
+  ULONG Reserved;
+
+} OSR_COMM_BATCH_COMPLETION, *POSR_COMM_BATCH_COMPLETION;
+
+typedef struct _OSR_COMM_BATCH_RESPONSE {
+  //
+  // At most OSR_COMM_BATCH_MAX_REQUESTS
+  //
+  ULONG Count;
+
+  //
+  // 0, or the index + 1 of a buffer registered through the same handle: the
+  // next requests are then written there, and the exchange has no output buffer
+  //
+  ULONG RegisteredBuffer;
+
+  OSR_COMM_BATCH_COMPLETION Completions[1];
+
+} OSR_COMM_BATCH_RESPONSE, *POSR_COMM_BATCH_RESPONSE;
+
+/************************ registered buffers ******************************/
+
+//
+// OSR_COMM_CONTROL_REGISTER_BUFFERS locks and maps a set of service buffers
+// once, until OSR_COMM_CONTROL_UNREGISTER_BUFFERS or the handle is cleaned up.
+// A control request whose RequestBuffer is OSR_COMM_REGISTERED_BUFFER(n) then
+// receives its write payload in the n-th buffer, and a batched exchange whose
+// response names it in RegisteredBuffer receives its requests there.  User
+// addresses below 64 KB are never valid, so these values cannot be mistaken
+// for a real buffer.
+//
+#define OSR_COMM_MAX_REGISTERED_BUFFERS 64
+
+#define OSR_COMM_REGISTERED_BUFFER(Index) ((PVOID) (ULONG_PTR) ((Index) + 1))
+#define OSR_COMM_IS_REGISTERED_BUFFER(Buffer) ((ULONG_PTR) (Buffer) - 1 < OSR_COMM_MAX_REGISTERED_BUFFERS)
+#define OSR_COMM_REGISTERED_BUFFER_INDEX(Buffer) ((ULONG) ((ULONG_PTR) (Buffer) - 1))
+
+typedef struct _OSR_COMM_BUFFER_DESCRIPTOR {
+  //
+  // User address, as a ULONG64 so 32-bit services use the same layout
+  //
+  ULONG64 Buffer;
+
+  ULONG Length;
+  ULONG Reserved;
+
+} OSR_COMM_BUFFER_DESCRIPTOR, *POSR_COMM_BUFFER_DESCRIPTOR;
+
+typedef struct _OSR_COMM_BUFFER_REGISTRATION {
+  //
+  // At most OSR_COMM_MAX_REGISTERED_BUFFERS
+  //
+  ULONG Count;
+  ULONG Reserved;
+
+  OSR_COMM_BUFFER_DESCRIPTOR Buffers[1];
+
+} OSR_COMM_BUFFER_REGISTRATION, *POSR_COMM_BUFFER_REGISTRATION;
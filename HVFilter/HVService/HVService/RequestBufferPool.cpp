@@ -0,0 +1,127 @@
+#include "RequestBufferPool.h"
+
+RequestBufferPool::RequestBufferPool(void) :m_pBase(NULL),m_dwStride(0),m_dwSlots(0),
+                                        m_dwFree(REQUEST_BUFFER_POOL_NONE),m_dwStarved(0),m_dwStarvedTotal(0)
+{
+    InitializeCriticalSection(&m_Lock);
+}
+
+RequestBufferPool::~RequestBufferPool(void)
+{
+    DeleteCriticalSection(&m_Lock);
+}
+
+BOOL RequestBufferPool::Init(const VOID* pBase, DWORD dwStride, DWORD dwSlots, DWORD dwPosted)
+{
+    if(dwSlots > REQUEST_BUFFER_POOL_MAX_SLOTS || dwPosted > dwSlots) {
+
+        return FALSE;
+
+    }
+
+    m_pBase = (const BYTE*) pBase;
+    m_dwStride = dwStride;
+    m_dwSlots = dwSlots;
+    m_dwFree = REQUEST_BUFFER_POOL_NONE;
+    m_dwStarved = 0;
+    m_dwStarvedTotal = 0;
+
+    for(DWORD slot = 0; slot < dwSlots; slot++) {
+
+        m_lReferences[slot] = 0;
+
+    }
+
+    for(DWORD slot = dwSlots; slot-- > dwPosted;) {
+
+        m_dwNextFree[slot] = m_dwFree;
+        m_dwFree = slot;
+
+    }
+
+    return TRUE;
+}
+
+void RequestBufferPool::Posted(DWORD dwSlot)
+{
+    m_lReferences[dwSlot] = 1;
+}
+
+void RequestBufferPool::Retain(const VOID* pEntry)
+{
+    InterlockedIncrement(&m_lReferences[SlotOf(pEntry)]);
+}
+
+DWORD RequestBufferPool::Release(const VOID* pEntry)
+{
+    DWORD slot = SlotOf(pEntry);
+
+    if(InterlockedDecrement(&m_lReferences[slot]) != 0) {
+
+        return REQUEST_BUFFER_POOL_NONE;
+
+    }
+
+    EnterCriticalSection(&m_Lock);
+
+    if(m_dwStarved != 0) {
+
+        //
+        // An exchange went unposted for want of this buffer
+        //
+        m_dwStarved--;
+
+    } else {
+
+        m_dwNextFree[slot] = m_dwFree;
+        m_dwFree = slot;
+        slot = REQUEST_BUFFER_POOL_NONE;
+
+    }
+
+    LeaveCriticalSection(&m_Lock);
+
+    return slot;
+}
+
+DWORD RequestBufferPool::Recycle(DWORD dwSlot)
+{
+    DWORD spare;
+
+    if(InterlockedDecrement(&m_lReferences[dwSlot]) == 0) {
+
+        return dwSlot;
+
+    }
+
+    //
+    // Entries of this batch are retained: the buffer comes back with the
+    // last Release
+    //
+    EnterCriticalSection(&m_Lock);
+
+    spare = m_dwFree;
+
+    if(spare != REQUEST_BUFFER_POOL_NONE) {
+
+        m_dwFree = m_dwNextFree[spare];
+
+    } else {
+
+        m_dwStarved++;
+        m_dwStarvedTotal++;
+
+    }
+
+    LeaveCriticalSection(&m_Lock);
+
+    return spare;
+}
+
+DWORD RequestBufferPool::SlotOf(const VOID* pEntry) const
+{
+    //
+    // Entries only ever point into the slot array
+    //
+    return (DWORD) (((const BYTE*) pEntry - m_pBase) / m_dwStride);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Windows.h>
+
+#define REQUEST_BUFFER_POOL_MAX_SLOTS 128
+
+// No slot: returned where there is none to post
+#define REQUEST_BUFFER_POOL_NONE 0xFFFFFFFF
+
+//
+// Reference counts of the request buffers of the exchanges, so a handler can
+// keep an entry (and its payload) in place past its return instead of copying
+// it out.  The buffers are the slots of one array; some are in flight, the
+// rest are spares.  An exchange whose buffer is still retained goes back down
+// in a spare; without one, it waits for the last Release of a buffer.  No
+// buffer is allocated or copied per request.  RequestEngine keeps its slots
+// with it; the tests under tests/ drive it from a stand-in device.
+//
+class RequestBufferPool
+{
+public:
+    RequestBufferPool(void);
+    ~RequestBufferPool(void);
+
+    // dwSlots slots of dwStride bytes from pBase; the first dwPosted are in
+    // flight, the others are spares.  FALSE if there are too many.
+    BOOL Init(const VOID* pBase, DWORD dwStride, DWORD dwSlots, DWORD dwPosted);
+
+    // The exchange of dwSlot was posted: the engine holds the one reference
+    void Posted(DWORD dwSlot);
+
+    // Keeps the buffer pEntry lives in from being posted again
+    void Retain(const VOID* pEntry);
+
+    // Drops a Retain.  Returns the slot of an exchange that waited for a
+    // buffer, to be posted by the caller, or REQUEST_BUFFER_POOL_NONE.
+    DWORD Release(const VOID* pEntry);
+
+    // Drops the engine's reference once the batch in dwSlot is answered.
+    // Returns the slot to post the answers in: dwSlot, a spare if dwSlot is
+    // retained, or REQUEST_BUFFER_POOL_NONE if there is no spare (the
+    // exchange then waits for a Release, the answers for another exchange).
+    DWORD Recycle(DWORD dwSlot);
+
+    // Exchanges that had to wait for a buffer, since Init
+    DWORD GetStarved() const {return m_dwStarvedTotal;}
+
+private:
+    DWORD SlotOf(const VOID* pEntry) const;
+
+    const BYTE*     m_pBase;
+    DWORD           m_dwStride;
+    DWORD           m_dwSlots;
+
+    // One for the engine from the time it is posted, one per Retain
+    volatile LONG   m_lReferences[REQUEST_BUFFER_POOL_MAX_SLOTS];
+
+    // Spares, and exchanges left unposted for want of one
+    CRITICAL_SECTION    m_Lock;
+    DWORD               m_dwNextFree[REQUEST_BUFFER_POOL_MAX_SLOTS];
+    DWORD               m_dwFree;
+    DWORD               m_dwStarved;
+    DWORD               m_dwStarvedTotal;
+};
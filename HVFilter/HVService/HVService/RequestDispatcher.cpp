@@ -0,0 +1,129 @@
+#include "RequestDispatcher.h"
+
+RequestDispatcher::RequestDispatcher(void) :m_pfnHandler(NULL),m_pContext(NULL),
+                                        m_bOpen(FALSE),m_dwDeferred(0),m_bFlushPosted(FALSE)
+{
+    InitializeCriticalSection(&m_DeferredLock);
+}
+
+RequestDispatcher::~RequestDispatcher(void)
+{
+    DeleteCriticalSection(&m_DeferredLock);
+}
+
+void RequestDispatcher::Open(RequestHandler pfnHandler, PVOID pContext)
+{
+    EnterCriticalSection(&m_DeferredLock);
+
+    m_pfnHandler = pfnHandler;
+    m_pContext = pContext;
+    m_dwDeferred = 0;
+    m_bFlushPosted = FALSE;
+    m_bOpen = TRUE;
+
+    LeaveCriticalSection(&m_DeferredLock);
+}
+
+void RequestDispatcher::Close()
+{
+    EnterCriticalSection(&m_DeferredLock);
+
+    m_bOpen = FALSE;
+    m_dwDeferred = 0;
+    m_bFlushPosted = FALSE;
+
+    LeaveCriticalSection(&m_DeferredLock);
+}
+
+DWORD RequestDispatcher::HandleBatch(const VOID* pBatch, DWORD dwLength, POSR_COMM_BATCH_RESPONSE pResponse)
+{
+    OSR_COMM_BATCH_READER reader;
+    POSR_COMM_BATCH_ENTRY entry;
+    ULONG count = 0;
+
+    //
+    // A malformed batch reads as an empty one: only deferred answers go down
+    //
+    OsrCommBatchReaderInit(&reader,(PVOID) pBatch,dwLength);
+
+    while((entry = OsrCommBatchReaderNext(&reader)) != NULL) {
+
+        //
+        // A deferred request leaves its completion slot to the next one
+        //
+        if(m_pfnHandler(entry,&pResponse->Completions[count],m_pContext)) {
+
+            count++;
+
+        }
+
+    }
+
+    //
+    // Room left over carries answers given since the last exchange
+    //
+    count += TakeDeferred(&pResponse->Completions[count],OSR_COMM_BATCH_MAX_REQUESTS - count);
+
+    pResponse->Count = count;
+
+    return count ? OSR_COMM_BATCH_RESPONSE_LENGTH(count) : 0;
+}
+
+DeferStatus RequestDispatcher::Defer(const OSR_COMM_BATCH_COMPLETION* pCompletion)
+{
+    DeferStatus status;
+
+    EnterCriticalSection(&m_DeferredLock);
+
+    if(!m_bOpen) {
+
+        status = DeferClosed;
+
+    } else if(m_dwDeferred == REQUEST_DISPATCHER_MAX_DEFERRED) {
+
+        status = DeferFull;
+
+    } else {
+
+        m_Deferred[m_dwDeferred++] = *pCompletion;
+
+        status = m_bFlushPosted ? DeferQueued : DeferFlushNeeded;
+
+        m_bFlushPosted = TRUE;
+
+    }
+
+    LeaveCriticalSection(&m_DeferredLock);
+
+    return status;
+}
+
+ULONG RequestDispatcher::TakeDeferred(POSR_COMM_BATCH_COMPLETION pCompletions, ULONG ulMax)
+{
+    ULONG count;
+
+    EnterCriticalSection(&m_DeferredLock);
+
+    count = m_dwDeferred < ulMax ? m_dwDeferred : ulMax;
+
+    if(count != 0) {
+
+        //
+        // Oldest first
+        //
+        memcpy(pCompletions,m_Deferred,count * sizeof(OSR_COMM_BATCH_COMPLETION));
+        memmove(m_Deferred,&m_Deferred[count],(m_dwDeferred - count) * sizeof(OSR_COMM_BATCH_COMPLETION));
+        m_dwDeferred -= count;
+
+    }
+
+    if(m_dwDeferred == 0) {
+
+        m_bFlushPosted = FALSE;
+
+    }
+
+    LeaveCriticalSection(&m_DeferredLock);
+
+    return count;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "BatchProtocol.h"
+
+// Answers given after their handler returned, waiting to go down
+#define REQUEST_DISPATCHER_MAX_DEFERRED 4096
+
+//
+// What Defer did with an answer
+//
+enum DeferStatus
+{
+    // Queued; it goes down with the next exchange or flush
+    DeferQueued,
+
+    // Queued, and the first since the last flush: the caller arranges one
+    DeferFlushNeeded,
+
+    // Not queued: flush and try again
+    DeferFull,
+
+    // Not queued: the dispatcher is closed, the driver fails the request
+    DeferClosed
+};
+
+//
+// The part of RequestEngine that does not depend on how exchanges reach the
+// driver: it answers the entries of a batch through the handler, keeps the
+// answers of deferred requests until an exchange or a flush takes them down,
+// and builds the responses.  RequestEngine drives it from an I/O completion
+// port; the tests under tests/ drive it from a stand-in device.
+//
+class RequestDispatcher
+{
+public:
+    // Fills pCompletion for pEntry and returns TRUE, or returns FALSE to answer
+    // later through Defer.  pEntry (and its payload) is only valid during
+    // the call.  Called on several threads at once.
+    typedef BOOL (*RequestHandler)(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext);
+
+    RequestDispatcher(void);
+    ~RequestDispatcher(void);
+
+    // Answers go to pfnHandler, deferred ones are accepted until Close
+    void Open(RequestHandler pfnHandler, PVOID pContext);
+
+    // Deferred answers are dropped and no longer accepted
+    void Close();
+
+    // Answers the batch in pBatch (dwLength bytes returned by an exchange)
+    // into pResponse, room for OSR_COMM_BATCH_MAX_REQUESTS answers, then adds
+    // deferred answers to the room left.  Returns the length of the response
+    // to send, 0 if there are no answers.
+    DWORD HandleBatch(const VOID* pBatch, DWORD dwLength, POSR_COMM_BATCH_RESPONSE pResponse);
+
+    // Queues the answer to a request its handler deferred; any thread
+    DeferStatus Defer(const OSR_COMM_BATCH_COMPLETION* pCompletion);
+
+    // Moves up to ulMax deferred answers, oldest first, to pCompletions;
+    // once none are left the next Defer asks for a flush again
+    ULONG TakeDeferred(POSR_COMM_BATCH_COMPLETION pCompletions, ULONG ulMax);
+
+private:
+    RequestHandler  m_pfnHandler;
+    PVOID           m_pContext;
+
+    CRITICAL_SECTION            m_DeferredLock;
+    BOOL                        m_bOpen;
+    OSR_COMM_BATCH_COMPLETION   m_Deferred[REQUEST_DISPATCHER_MAX_DEFERRED];
+    DWORD                       m_dwDeferred;
+    BOOL                        m_bFlushPosted;
+};
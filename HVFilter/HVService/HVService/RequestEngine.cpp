@@ -0,0 +1,596 @@
+#include "RequestEngine.h"
+
+#include "Stuff.h"
+
+RequestEngine::RequestEngine(DebugMessage& dbgMsg) :m_dbgMsg(dbgMsg),
+                                        m_hOsrControl(INVALID_HANDLE_VALUE),m_hPort(NULL),
+                                        m_pSlots(NULL),m_dwSlots(0),m_bRegistered(FALSE),m_dwWorkers(0),
+                                        m_lOutstanding(0),m_bStopping(FALSE),m_hFlushEvent(NULL)
+{
+    InitializeCriticalSection(&m_FlushLock);
+}
+
+RequestEngine::~RequestEngine(void)
+{
+    Stop();
+
+    DeleteCriticalSection(&m_FlushLock);
+}
+
+BOOL RequestEngine::Start(HANDLE hOsrControl, DWORD dwOutstanding, DWORD dwWorkers, RequestHandler pfnHandler, PVOID pContext)
+{
+    if(m_hPort != NULL || dwOutstanding == 0 || dwWorkers == 0) {
+
+        return FALSE;
+
+    }
+
+    if(dwWorkers > REQUEST_ENGINE_MAX_WORKERS) {
+
+        dwWorkers = REQUEST_ENGINE_MAX_WORKERS;
+
+    }
+
+    if(dwOutstanding > REQUEST_ENGINE_MAX_OUTSTANDING) {
+
+        dwOutstanding = REQUEST_ENGINE_MAX_OUTSTANDING;
+
+    }
+
+    //
+    // Page aligned: the driver locks the request buffers for every exchange.
+    // Allocated once, spares included; nothing is allocated per request.
+    //
+    m_dwSlots = dwOutstanding * (1 + REQUEST_ENGINE_SPARE_SLOTS);
+
+    m_pSlots = (RequestSlot*) VirtualAlloc(NULL,m_dwSlots * sizeof(RequestSlot),
+                                           MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    if(m_pSlots == NULL) {
+
+        m_dwSlots = 0;
+        return FALSE;
+
+    }
+
+    m_Pool.Init(m_pSlots,sizeof(RequestSlot),m_dwSlots,dwOutstanding);
+
+    //
+    // Without it (only one handle can register) the exchanges pass their
+    // buffers as output buffers
+    //
+    m_bRegistered = RegisterSlots(hOsrControl);
+
+    m_hFlushEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+    //
+    // Every overlapped operation on the handle now completes to the port,
+    // unless its event handle is tagged (see RingConsumer)
+    //
+    m_hPort = m_hFlushEvent == NULL ? NULL :
+              CreateIoCompletionPort(hOsrControl,NULL,REQUEST_ENGINE_KEY_EXCHANGE,dwWorkers);
+
+    if(m_hPort == NULL) {
+
+        if(m_hFlushEvent != NULL) {
+
+            CloseHandle(m_hFlushEvent);
+            m_hFlushEvent = NULL;
+
+        }
+
+        //
+        // The handle stays the caller's: it must not keep the buffers locked
+        //
+        if(m_bRegistered) {
+
+            Control(hOsrControl,OSR_COMM_CONTROL_UNREGISTER_BUFFERS,NULL,0);
+            m_bRegistered = FALSE;
+
+        }
+
+        VirtualFree(m_pSlots,0,MEM_RELEASE);
+        m_pSlots = NULL;
+        m_dwSlots = 0;
+        return FALSE;
+
+    }
+
+    m_hOsrControl = hOsrControl;
+    m_lOutstanding = 0;
+    m_bStopping = FALSE;
+
+    m_Dispatcher.Open(pfnHandler,pContext);
+
+    for(m_dwWorkers = 0; m_dwWorkers < dwWorkers; m_dwWorkers++) {
+
+        m_hWorkers[m_dwWorkers] = CreateThread(NULL,0,WorkerThread,this,0,NULL);
+
+        if(m_hWorkers[m_dwWorkers] == NULL) {
+
+            break;
+
+        }
+
+    }
+
+    //
+    // Without any answers to carry, the first exchanges only fetch requests
+    //
+    for(DWORD slot = 0; slot < dwOutstanding; slot++) {
+
+        m_pSlots[slot].dwResponseLength = 0;
+
+        if(m_dwWorkers == 0 || !Post(&m_pSlots[slot])) {
+
+            m_dbgMsg(L"RequestEngine: Can't Post Exchange (%lu)...", GetLastError());
+
+        }
+
+    }
+
+    if(m_lOutstanding == 0) {
+
+        //
+        // Nothing will ever complete: undo everything but the handle, which
+        // stays the caller's
+        //
+        if(m_bRegistered) {
+
+            Control(m_hOsrControl,OSR_COMM_CONTROL_UNREGISTER_BUFFERS,NULL,0);
+
+        }
+
+        m_hOsrControl = INVALID_HANDLE_VALUE;
+        Stop();
+        return FALSE;
+
+    }
+
+    m_dbgMsg(L"RequestEngine: %lu exchanges in flight, %lu workers%s", m_lOutstanding, m_dwWorkers,
+             m_bRegistered ? L", buffers registered" : L"");
+
+    return TRUE;
+}
+
+void RequestEngine::Stop()
+{
+    if(m_hPort == NULL) {
+
+        return;
+
+    }
+
+    m_bStopping = TRUE;
+
+    //
+    // Completed exchanges are no longer posted again, and deferred answers no
+    // longer accepted
+    //
+    for(DWORD worker = 0; worker < m_dwWorkers; worker++) {
+
+        PostQueuedCompletionStatus(m_hPort,0,REQUEST_ENGINE_KEY_QUIT,NULL);
+
+    }
+
+    for(DWORD worker = 0; worker < m_dwWorkers; worker++) {
+
+        WaitForSingleObject(m_hWorkers[worker],INFINITE);
+        CloseHandle(m_hWorkers[worker]);
+
+    }
+
+    m_dwWorkers = 0;
+
+    //
+    // The driver has no cancel routines: the exchanges in flight only come
+    // back when the control handle is cleaned up
+    //
+    if(m_hOsrControl != INVALID_HANDLE_VALUE) {
+
+        CloseHandle(m_hOsrControl);
+        m_hOsrControl = INVALID_HANDLE_VALUE;
+
+    }
+
+    while(m_lOutstanding > 0) {
+
+        DWORD bytesTransferred;
+        ULONG_PTR key;
+        LPOVERLAPPED pOverlapped = NULL;
+
+        GetQueuedCompletionStatus(m_hPort,&bytesTransferred,&key,&pOverlapped,INFINITE);
+
+        if(pOverlapped != NULL) {
+
+            InterlockedDecrement(&m_lOutstanding);
+
+        }
+
+    }
+
+    CloseHandle(m_hPort);
+    m_hPort = NULL;
+
+    CloseHandle(m_hFlushEvent);
+    m_hFlushEvent = NULL;
+
+    //
+    // Answers still deferred are lost with the handle: the driver failed
+    // their requests at cleanup
+    //
+    m_Dispatcher.Close();
+
+    //
+    // The driver let go of the registration when the handle was cleaned up
+    //
+    VirtualFree(m_pSlots,0,MEM_RELEASE);
+    m_pSlots = NULL;
+    m_dwSlots = 0;
+    m_bRegistered = FALSE;
+}
+
+DWORD WINAPI RequestEngine::WorkerThread(LPVOID lpParameter)
+{
+    ((RequestEngine*) lpParameter)->Work();
+
+    return 0;
+}
+
+void RequestEngine::Work()
+{
+    for(;;) {
+
+        DWORD bytesTransferred = 0;
+        ULONG_PTR key;
+        LPOVERLAPPED pOverlapped = NULL;
+        BOOL status;
+
+        status = GetQueuedCompletionStatus(m_hPort,&bytesTransferred,&key,&pOverlapped,INFINITE);
+
+        if(pOverlapped == NULL) {
+
+            if(status && key == REQUEST_ENGINE_KEY_FLUSH) {
+
+                Flush();
+                continue;
+
+            }
+
+            //
+            // Told to leave (or the port is gone)
+            //
+            break;
+
+        }
+
+        RequestSlot* pSlot = CONTAINING_RECORD(pOverlapped, RequestSlot, Overlapped);
+
+        InterlockedDecrement(&m_lOutstanding);
+
+        pSlot->dwResponseLength = 0;
+
+        if(!status) {
+
+            m_dbgMsg(L"RequestEngine: Exchange Failed (%lu)...", GetLastError());
+
+            //
+            // Posted again, or the exchanges in flight would dwindle with every
+            // failure; the pause keeps a persistent one from spinning.  Answers
+            // it carried are lost, the driver fails their requests at cleanup.
+            //
+            if(!m_bStopping) {
+
+                Sleep(REQUEST_ENGINE_RETRY_DELAY);
+
+            }
+
+        } else {
+
+            pSlot->dwResponseLength = m_Dispatcher.HandleBatch(pSlot->RequestBuffer,bytesTransferred,&pSlot->Response);
+
+        }
+
+        if(m_bStopping) {
+
+            //
+            // The answers are lost; the driver fails their requests at cleanup
+            //
+            continue;
+
+        }
+
+        DWORD slot = m_Pool.Recycle((DWORD) (pSlot - m_pSlots));
+
+        if(slot == REQUEST_BUFFER_POOL_NONE) {
+
+            //
+            // Retained, and no spare: the answers wait for the next exchange,
+            // this one for a Release
+            //
+            ULONG count = pSlot->dwResponseLength ? pSlot->Response.Count : 0;
+
+            for(ULONG index = 0; index < count; index++) {
+
+                Complete(&pSlot->Response.Completions[index]);
+
+            }
+
+            continue;
+
+        }
+
+        if(&m_pSlots[slot] != pSlot) {
+
+            //
+            // Only the completions are copied, never a request or its payload
+            //
+            m_pSlots[slot].dwResponseLength = pSlot->dwResponseLength;
+            memcpy(&m_pSlots[slot].Response,&pSlot->Response,pSlot->dwResponseLength);
+
+            pSlot = &m_pSlots[slot];
+
+        }
+
+        if(!Post(pSlot)) {
+
+            m_dbgMsg(L"RequestEngine: Can't Post Exchange (%lu)...", GetLastError());
+
+        }
+
+    }
+}
+
+BOOL RequestEngine::Post(RequestSlot* pSlot)
+{
+    BOOL status;
+
+    memset(&pSlot->Overlapped,0,sizeof(pSlot->Overlapped));
+
+    m_Pool.Posted((DWORD) (pSlot - m_pSlots));
+
+    InterlockedIncrement(&m_lOutstanding);
+
+    if(m_bRegistered) {
+
+        //
+        // The response names the request buffer, so it always goes down,
+        // if only with no answers
+        //
+        if(pSlot->dwResponseLength == 0) {
+
+            pSlot->Response.Count = 0;
+            pSlot->dwResponseLength = FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions);
+
+        }
+
+        pSlot->Response.RegisteredBuffer = (ULONG) (pSlot - m_pSlots) + 1;
+
+        status = DeviceIoControl(m_hOsrControl,OSR_COMM_CONTROL_EXCHANGE_BATCH,
+                                 &pSlot->Response,pSlot->dwResponseLength,
+                                 NULL,0,
+                                 NULL,
+                                 &pSlot->Overlapped);
+
+    } else {
+
+        pSlot->Response.RegisteredBuffer = 0;
+
+        status = DeviceIoControl(m_hOsrControl,OSR_COMM_CONTROL_EXCHANGE_BATCH,
+                                 pSlot->dwResponseLength ? &pSlot->Response : NULL,pSlot->dwResponseLength,
+                                 pSlot->RequestBuffer,sizeof(pSlot->RequestBuffer),
+                                 NULL,
+                                 &pSlot->Overlapped);
+
+    }
+
+    //
+    // Even an exchange that completes right away is queued to the port
+    //
+    if(!status && GetLastError() != ERROR_IO_PENDING) {
+
+        InterlockedDecrement(&m_lOutstanding);
+        return FALSE;
+
+    }
+
+    return TRUE;
+}
+
+BOOL RequestEngine::RegisterSlots(HANDLE hOsrControl)
+{
+    union {
+        OSR_COMM_BUFFER_REGISTRATION Registration;
+        BYTE    RegistrationBuffer[FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) +
+                                   OSR_COMM_MAX_REGISTERED_BUFFERS * sizeof(OSR_COMM_BUFFER_DESCRIPTOR)];
+    };
+    BOOL status;
+
+    if(m_dwSlots > OSR_COMM_MAX_REGISTERED_BUFFERS) {
+
+        return FALSE;
+
+    }
+
+    //
+    // Slot n is registered as buffer n, which the exchanges name as n + 1
+    //
+    Registration.Count = m_dwSlots;
+    Registration.Reserved = 0;
+
+    for(DWORD slot = 0; slot < m_dwSlots; slot++) {
+
+        Registration.Buffers[slot].Buffer = (ULONG64) (ULONG_PTR) m_pSlots[slot].RequestBuffer;
+        Registration.Buffers[slot].Length = sizeof(m_pSlots[slot].RequestBuffer);
+        Registration.Buffers[slot].Reserved = 0;
+
+    }
+
+    status = Control(hOsrControl,OSR_COMM_CONTROL_REGISTER_BUFFERS,
+                     &Registration,FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) +
+                                   m_dwSlots * sizeof(OSR_COMM_BUFFER_DESCRIPTOR));
+
+    if(!status) {
+
+        m_dbgMsg(L"RequestEngine: Can't Register Request Buffers (%lu)...", GetLastError());
+
+    }
+
+    return status;
+}
+
+BOOL RequestEngine::Control(HANDLE hOsrControl, DWORD dwCode, PVOID pInput, DWORD dwInputLength)
+{
+    OVERLAPPED overlapped;
+    DWORD bytesReturned;
+    HANDLE hEvent;
+    BOOL status;
+
+    hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+    if(hEvent == NULL) {
+
+        return FALSE;
+
+    }
+
+    //
+    // Waited for here, whether or not the handle is bound to the port yet
+    //
+    memset(&overlapped,0,sizeof(overlapped));
+    overlapped.hEvent = TAG_EVENT(hEvent);
+
+    status = DeviceIoControl(hOsrControl,dwCode,
+                             pInput,dwInputLength,
+                             NULL,0,
+                             &bytesReturned,
+                             &overlapped);
+
+    if(!status && GetLastError() == ERROR_IO_PENDING) {
+
+        status = GetOverlappedResult(hOsrControl,&overlapped,&bytesReturned,TRUE);
+
+    }
+
+    CloseHandle(hEvent);
+
+    return status;
+}
+
+void RequestEngine::Complete(const OSR_COMM_BATCH_COMPLETION* pCompletion)
+{
+    if(m_hPort == NULL || m_bStopping) {
+
+        return;
+
+    }
+
+    for(;;) {
+
+        switch(m_Dispatcher.Defer(pCompletion)) {
+
+        case DeferFull:
+
+            //
+            // Whoever produces answers faster than they drain pays for the
+            // flush.  Flush empties the queue (even when the driver refuses the
+            // answers), but other threads may have filled it again by the time
+            // we are back.
+            //
+            Flush();
+            break;
+
+        case DeferFlushNeeded:
+
+            PostQueuedCompletionStatus(m_hPort,0,REQUEST_ENGINE_KEY_FLUSH,NULL);
+            return;
+
+        default:
+
+            return;
+
+        }
+
+    }
+}
+
+void RequestEngine::Release(const OSR_COMM_BATCH_ENTRY* pEntry)
+{
+    DWORD slot = m_Pool.Release(pEntry);
+
+    if(slot == REQUEST_BUFFER_POOL_NONE || m_bStopping) {
+
+        return;
+
+    }
+
+    //
+    // An exchange went unposted for want of this buffer: post it here, with
+    // whatever answers have piled up
+    //
+    RequestSlot* pSlot = &m_pSlots[slot];
+    ULONG count = m_Dispatcher.TakeDeferred(pSlot->Response.Completions,OSR_COMM_BATCH_MAX_REQUESTS);
+
+    pSlot->Response.Count = count;
+    pSlot->dwResponseLength = count ? OSR_COMM_BATCH_RESPONSE_LENGTH(count) : 0;
+
+    if(!Post(pSlot)) {
+
+        m_dbgMsg(L"RequestEngine: Can't Post Exchange (%lu)...", GetLastError());
+
+    }
+}
+
+void RequestEngine::Flush()
+{
+    EnterCriticalSection(&m_FlushLock);
+
+    for(;;) {
+
+        OVERLAPPED overlapped;
+        DWORD bytesTransferred;
+        ULONG count;
+        BOOL status;
+
+        count = m_Dispatcher.TakeDeferred(m_FlushResponse.Completions,OSR_COMM_BATCH_MAX_REQUESTS);
+
+        if(count == 0) {
+
+            break;
+
+        }
+
+        m_FlushResponse.Count = count;
+        m_FlushResponse.RegisteredBuffer = 0;
+
+        memset(&overlapped,0,sizeof(overlapped));
+        overlapped.hEvent = TAG_EVENT(m_hFlushEvent);
+        ResetEvent(m_hFlushEvent);
+
+        //
+        // No output buffer: the driver applies the answers and completes the
+        // exchange right away
+        //
+        status = DeviceIoControl(m_hOsrControl,OSR_COMM_CONTROL_EXCHANGE_BATCH,
+                                 &m_FlushResponse,FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) +
+                                                  count * sizeof(OSR_COMM_BATCH_COMPLETION),
+                                 NULL,0,
+                                 &bytesTransferred,
+                                 &overlapped);
+
+        if(!status && GetLastError() == ERROR_IO_PENDING) {
+
+            status = GetOverlappedResult(m_hOsrControl,&overlapped,&bytesTransferred,TRUE);
+
+        }
+
+        if(!status) {
+
+            m_dbgMsg(L"RequestEngine: Can't Send Deferred Answers (%lu)...", GetLastError());
+
+        }
+
+    }
+
+    LeaveCriticalSection(&m_FlushLock);
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "DebugMsg.h"
+#include "RequestDispatcher.h"
+#include "RequestBufferPool.h"
+
+#define REQUEST_ENGINE_MAX_WORKERS 64
+
+// Bytes of requests (and inline write payloads) one batch can bring back
+#define REQUEST_ENGINE_BATCH_LENGTH 65536
+
+// Spare request buffers per exchange in flight, for batches still retained
+#define REQUEST_ENGINE_SPARE_SLOTS 1
+
+#define REQUEST_ENGINE_MAX_OUTSTANDING (REQUEST_BUFFER_POOL_MAX_SLOTS / (1 + REQUEST_ENGINE_SPARE_SLOTS))
+
+// A failed exchange is posted again after this many ms
+#define REQUEST_ENGINE_RETRY_DELAY 100
+
+// Completion keys: the control handle is bound with the first one
+#define REQUEST_ENGINE_KEY_EXCHANGE 0
+#define REQUEST_ENGINE_KEY_FLUSH 1
+#define REQUEST_ENGINE_KEY_QUIT 2
+
+//
+// Once the control handle is bound to the port, an event handle with the low
+// bit set keeps a synchronous caller's completion off it
+//
+#define TAG_EVENT(hEvent) ((HANDLE) ((ULONG_PTR) (hEvent) | 1))
+
+//
+// Completion port engine for the control device.  A number of batched control
+// requests (OSR_COMM_CONTROL_EXCHANGE_BATCH) are kept in flight; the worker
+// that picks up a completed one answers its requests and posts it again with
+// the answers, so no thread ever waits on the driver other than in the port.
+// The request buffers are registered with the driver once
+// (OSR_COMM_CONTROL_REGISTER_BUFFERS) when the handle lets us: the exchanges
+// then name them instead of passing an output buffer, and no pages are locked
+// per exchange.
+//
+// A handler that cannot answer right away returns FALSE and keeps the request
+// ID; whatever finishes the request later calls Complete.  Such requests hold
+// no thread and no slot while they wait, so many more than the exchanges in
+// flight can be pending.  Rather than copy a request out, the handler can
+// Retain its entry: the buffer the entry lives in is then set aside until the
+// last Release, and a spare one takes its place in the exchange.
+//
+// Answering the batches is left to a RequestDispatcher; this class only moves
+// them between the driver and the port.
+//
+class RequestEngine
+{
+public:
+    // See RequestDispatcher; a deferred request is answered through Complete
+    typedef RequestDispatcher::RequestHandler RequestHandler;
+
+    RequestEngine(DebugMessage& dbgMsg);
+    ~RequestEngine(void);
+
+    // Takes hOsrControl over if it succeeds; Stop closes it
+    BOOL Start(HANDLE hOsrControl, DWORD dwOutstanding, DWORD dwWorkers, RequestHandler pfnHandler, PVOID pContext);
+    void Stop();
+    BOOL IsStarted() const {return m_hPort != NULL;}
+
+    // Answers a request its handler deferred; any thread, until Stop is called
+    void Complete(const OSR_COMM_BATCH_COMPLETION* pCompletion);
+
+    // Keep an entry handed to the handler (and its payload) valid until the
+    // matching Release; every entry must be released before Stop
+    void Retain(const OSR_COMM_BATCH_ENTRY* pEntry) {m_Pool.Retain(pEntry);}
+    void Release(const OSR_COMM_BATCH_ENTRY* pEntry);
+
+private:
+    struct RequestSlot
+    {
+        // First: a completion hands back a pointer to it
+        OVERLAPPED  Overlapped;
+
+        // Answers to the previous batch, sent with the next exchange
+        DWORD       dwResponseLength;
+        union {
+            OSR_COMM_BATCH_RESPONSE Response;
+            BYTE    ResponseBuffer[FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) +
+                                   OSR_COMM_BATCH_MAX_REQUESTS * sizeof(OSR_COMM_BATCH_COMPLETION)];
+        };
+
+        BYTE        RequestBuffer[REQUEST_ENGINE_BATCH_LENGTH];
+    };
+
+    static DWORD WINAPI WorkerThread(LPVOID lpParameter);
+    void Work();
+    BOOL Post(RequestSlot* pSlot);
+    BOOL RegisterSlots(HANDLE hOsrControl);
+    BOOL Control(HANDLE hOsrControl, DWORD dwCode, PVOID pInput, DWORD dwInputLength);
+    void Flush();
+
+    DebugMessage&   m_dbgMsg;
+
+    HANDLE          m_hOsrControl;
+    HANDLE          m_hPort;
+
+    // The first ones are in flight, the others spares
+    RequestSlot*        m_pSlots;
+    DWORD               m_dwSlots;
+    RequestBufferPool   m_Pool;
+
+    // The slots' request buffers are registered with the driver
+    BOOL            m_bRegistered;
+
+    HANDLE          m_hWorkers[REQUEST_ENGINE_MAX_WORKERS];
+    DWORD           m_dwWorkers;
+
+    // Exchanges the driver has not completed yet
+    volatile LONG   m_lOutstanding;
+    volatile BOOL   m_bStopping;
+
+    // Deferred answers ride along with the next exchange posted, or are sent
+    // on their own by a worker woken with REQUEST_ENGINE_KEY_FLUSH
+    RequestDispatcher           m_Dispatcher;
+
+    // One flush at a time
+    CRITICAL_SECTION            m_FlushLock;
+    HANDLE                      m_hFlushEvent;
+    union {
+        OSR_COMM_BATCH_RESPONSE m_FlushResponse;
+        BYTE                    m_FlushBuffer[FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) +
+                                              OSR_COMM_BATCH_MAX_REQUESTS * sizeof(OSR_COMM_BATCH_COMPLETION)];
+    };
+};
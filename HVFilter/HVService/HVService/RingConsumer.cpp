@@ -0,0 +1,243 @@
+#include "RingConsumer.h"
+
+#include "Stuff.h"
+#include "RequestEngine.h"
+
+RingConsumer::RingConsumer(void) :m_hOsrControl(INVALID_HANDLE_VALUE),m_pArea(NULL),m_hWaitEvent(NULL),m_bWaitPending(FALSE),m_hControlEvent(NULL)
+{
+    memset(&m_WaitOverlapped,0,sizeof(m_WaitOverlapped));
+
+    m_Notify.MinRecords = 1;
+    m_Notify.MaxLatency = 0;
+}
+
+RingConsumer::~RingConsumer(void)
+{
+    Detach();
+}
+
+BOOL RingConsumer::Attach(HANDLE hOsrControl, DWORD dwLength)
+{
+    HV_RING_REGISTER registration;
+    PVOID buffer;
+
+    if(m_pArea != NULL) {
+
+        return FALSE;
+
+    }
+
+    //
+    // Page aligned, and never touched by the heap: the driver keeps it locked
+    //
+    buffer = VirtualAlloc(NULL,dwLength,MEM_COMMIT|MEM_RESERVE,PAGE_READWRITE);
+
+    if(buffer == NULL) {
+
+        return FALSE;
+
+    }
+
+    memset(&m_WaitOverlapped,0,sizeof(m_WaitOverlapped));
+
+    //
+    // Both events live as long as the registration: no call creates its own
+    //
+    m_hWaitEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+    m_hControlEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+
+    if(m_hWaitEvent == NULL || m_hControlEvent == NULL) {
+
+        CloseEvents();
+        VirtualFree(buffer,0,MEM_RELEASE);
+        return FALSE;
+
+    }
+
+    m_hOsrControl = hOsrControl;
+
+    registration.Buffer = (ULONG64) (ULONG_PTR) buffer;
+    registration.Length = dwLength;
+    registration.Reserved = 0;
+
+    if(!Control(OSR_COMM_CONTROL_REGISTER_RING,&registration,sizeof(registration))) {
+
+        CloseEvents();
+        m_hOsrControl = INVALID_HANDLE_VALUE;
+
+        VirtualFree(buffer,0,MEM_RELEASE);
+        return FALSE;
+
+    }
+
+    m_pArea = (PHV_RING_AREA) buffer;
+
+    return TRUE;
+}
+
+void RingConsumer::Detach()
+{
+    if(m_pArea == NULL) {
+
+        return;
+
+    }
+
+    //
+    // Also fails a pending wait.  If the driver still uses the buffer it is
+    // leaked rather than freed under it.
+    //
+    if(Control(OSR_COMM_CONTROL_UNREGISTER_RING,NULL,0)) {
+
+        if(m_bWaitPending) {
+
+            DWORD bytesTransferred;
+
+            GetOverlappedResult(m_hOsrControl,&m_WaitOverlapped,&bytesTransferred,TRUE);
+
+        }
+
+        VirtualFree(m_pArea,0,MEM_RELEASE);
+
+    }
+
+    CloseEvents();
+
+    m_bWaitPending = FALSE;
+    m_pArea = NULL;
+    m_hOsrControl = INVALID_HANDLE_VALUE;
+}
+
+ULONG RingConsumer::Drain(RecordCallback pfnRecord, PVOID pContext)
+{
+    ULONG count = 0;
+
+    if(m_pArea == NULL) {
+
+        return 0;
+
+    }
+
+    for(ULONG ring = 0; ring < m_pArea->RingCount; ring++) {
+
+        count += HvRingConsume(m_pArea,ring,pfnRecord,pContext);
+
+    }
+
+    return count;
+}
+
+BOOL RingConsumer::Wait(DWORD dwTimeout)
+{
+    DWORD bytesTransferred;
+
+    if(m_pArea == NULL) {
+
+        return FALSE;
+
+    }
+
+    if(!m_bWaitPending) {
+
+        if(!HvRingPrepareWait(m_pArea,m_Notify.MinRecords)) {
+
+            return TRUE;
+
+        }
+
+        memset(&m_WaitOverlapped,0,sizeof(m_WaitOverlapped));
+        m_WaitOverlapped.hEvent = TAG_EVENT(m_hWaitEvent);
+        ResetEvent(m_hWaitEvent);
+
+        if(DeviceIoControl(m_hOsrControl,OSR_COMM_CONTROL_WAIT_RING,
+                           &m_Notify,sizeof(m_Notify),NULL,0,
+                           &bytesTransferred,
+                           &m_WaitOverlapped)) {
+
+            return TRUE;
+
+        }
+
+        if(GetLastError() != ERROR_IO_PENDING) {
+
+            return FALSE;
+
+        }
+
+        m_bWaitPending = TRUE;
+
+    }
+
+    if(WaitForSingleObject(m_hWaitEvent,dwTimeout) != WAIT_OBJECT_0) {
+
+        return FALSE;
+
+    }
+
+    m_bWaitPending = FALSE;
+
+    return GetOverlappedResult(m_hOsrControl,&m_WaitOverlapped,&bytesTransferred,FALSE);
+}
+
+void RingConsumer::SetNotify(ULONG ulMinRecords, ULONG ulMaxLatency)
+{
+    m_Notify.MinRecords = ulMinRecords != 0 ? ulMinRecords : 1;
+    m_Notify.MaxLatency = ulMaxLatency;
+}
+
+ULONG64 RingConsumer::GetDropped() const
+{
+    if(m_pArea == NULL) {
+
+        return 0;
+
+    }
+
+    return HvRingDropped(m_pArea);
+}
+
+BOOL RingConsumer::Control(DWORD dwIoControlCode, PVOID pInput, DWORD dwInputLength)
+{
+    OVERLAPPED overlapped;
+    DWORD bytesReturned;
+    BOOL status;
+
+    memset(&overlapped,0,sizeof(overlapped));
+
+    overlapped.hEvent = TAG_EVENT(m_hControlEvent);
+    ResetEvent(m_hControlEvent);
+
+    //
+    // The control device is opened for overlapped I/O
+    //
+    status = DeviceIoControl(m_hOsrControl,dwIoControlCode,
+                             pInput,dwInputLength,
+                             NULL,0,
+                             &bytesReturned,
+                             &overlapped);
+
+    if(!status && GetLastError() == ERROR_IO_PENDING) {
+
+        status = GetOverlappedResult(m_hOsrControl,&overlapped,&bytesReturned,TRUE);
+
+    }
+
+    return status;
+}
+
+void RingConsumer::CloseEvents()
+{
+    if(m_hWaitEvent != NULL) {
+
+        CloseHandle(m_hWaitEvent);
+        m_hWaitEvent = NULL;
+
+    }
+
+    if(m_hControlEvent != NULL) {
+
+        CloseHandle(m_hControlEvent);
+        m_hControlEvent = NULL;
+
+    }
+}
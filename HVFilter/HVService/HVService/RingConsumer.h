@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "RingProtocol.h"
+
+//
+// Consumer side of the shared-memory record rings (see HVRing.h).  The buffer
+// is registered once; after that records are read straight out of it and the
+// control device is only used to sleep while every ring is empty.
+//
+class RingConsumer
+{
+public:
+    typedef void (*RecordCallback)(const HV_RING_RECORD* pRecord, PVOID pContext);
+
+    RingConsumer(void);
+    ~RingConsumer(void);
+
+    BOOL Attach(HANDLE hOsrControl, DWORD dwLength);
+    void Detach();
+    BOOL IsAttached() const {return m_pArea != NULL;}
+
+    // Hands every published record to pfnRecord (if any); returns the record count
+    ULONG Drain(RecordCallback pfnRecord, PVOID pContext);
+
+    // Returns TRUE once records are published, FALSE after dwTimeout ms
+    BOOL Wait(DWORD dwTimeout);
+
+    // Makes Wait hold out for ulMinRecords records, or until the first one is
+    // ulMaxLatency ms old (see HV_RING_WAIT); takes effect with the next wait
+    void SetNotify(ULONG ulMinRecords, ULONG ulMaxLatency);
+
+    ULONG64 GetDropped() const;
+
+private:
+    BOOL Control(DWORD dwIoControlCode, PVOID pInput, DWORD dwInputLength);
+    void CloseEvents();
+
+    HANDLE          m_hOsrControl;
+    PHV_RING_AREA   m_pArea;
+
+    // The wait IRP outlives a timed out Wait, it is reused by the next one
+    HANDLE          m_hWaitEvent;
+    OVERLAPPED      m_WaitOverlapped;
+    BOOL            m_bWaitPending;
+    HV_RING_WAIT    m_Notify;
+
+    // Register/unregister run one at a time on the service thread
+    HANDLE          m_hControlEvent;
+};
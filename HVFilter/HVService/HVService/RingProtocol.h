@@ -0,0 +1,442 @@
+#pragma once
+
+#include "HVRing.h"
+
+//
+// Both sides of the ring protocol described in HVRing.h: the layout the driver
+// writes at registration, the producer (one per ring, in the driver) and the
+// consumer (the service).  SharedRing.cpp and RingConsumer.cpp are built on
+// these routines; they only need the Windows base types and Interlocked
+// functions, so the tests under tests/ run them between two processes outside
+// the WDK.
+//
+
+//
+// A volatile read of the other side's position orders the reads behind it:
+// MSVC gives volatile reads acquire semantics
+//
+#ifdef _MSC_VER
+#define HV_RING_ACQUIRE()
+#else
+#define HV_RING_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+typedef VOID (*PHV_RING_RECORD_ROUTINE)(const HV_RING_RECORD* Record, PVOID Context);
+
+//
+// The producer's own copy of the geometry and positions of its ring: nothing
+// the consumer can write to is trusted
+//
+typedef struct _HV_RING_PRODUCER {
+
+  PHV_RING_CONTROL Control;
+
+  PHV_RING_RECORD Records;
+
+  //
+  // RecordsPerRing - 1
+  //
+  ULONG64 Mask;
+
+  ULONG64 Head;
+
+  ULONG64 Dropped;
+
+} HV_RING_PRODUCER, *PHV_RING_PRODUCER;
+
+//
+// HvRingLayout
+//
+//  This routine works out the geometry of the rings in a buffer
+//
+// Inputs:
+//  Length - this is the size of the buffer
+//  RingCount - this is the number of rings, one per processor
+//
+// Outputs:
+//  RecordsOffset - this is where the records of ring 0 start
+//  RecordsPerRing - this is the number of records of each ring
+//
+// Returns:
+//  TRUE - the buffer holds at least HV_RING_MIN_RECORDS records per ring
+//  FALSE - the buffer is too small
+//
+// Notes:
+//  Positions are masked, so the rings hold a power of 2 records.
+//
+static __inline BOOLEAN HvRingLayout(ULONG Length, ULONG RingCount, PULONG RecordsOffset, PULONG RecordsPerRing)
+{
+  ULONG offset = (ULONG) (FIELD_OFFSET(HV_RING_AREA, Rings) + RingCount * sizeof(HV_RING_CONTROL) +
+                          HV_RING_CACHE_LINE - 1) & ~(HV_RING_CACHE_LINE - 1);
+  ULONG available;
+  ULONG records;
+
+  if (0 == RingCount || Length < offset) {
+
+    return FALSE;
+
+  }
+
+  available = (Length - offset) / RingCount / sizeof(HV_RING_RECORD);
+
+  if (available < HV_RING_MIN_RECORDS) {
+
+    return FALSE;
+
+  }
+
+  records = HV_RING_MIN_RECORDS;
+
+  while (records * 2 <= available) {
+
+    records *= 2;
+
+  }
+
+  *RecordsOffset = offset;
+
+  *RecordsPerRing = records;
+
+  return TRUE;
+}
+
+//
+// HvRingInitArea
+//
+//  This routine writes the header of the area and empties the rings
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//  RingCount, RecordsPerRing, RecordsOffset - these are the geometry from HvRingLayout
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+static __inline VOID HvRingInitArea(PHV_RING_AREA Area, ULONG RingCount, ULONG RecordsPerRing, ULONG RecordsOffset)
+{
+  RtlZeroMemory(Area, RecordsOffset);
+
+  Area->Version = HV_RING_VERSION;
+
+  Area->RingCount = RingCount;
+
+  Area->RecordsPerRing = RecordsPerRing;
+
+  Area->RecordSize = sizeof(HV_RING_RECORD);
+
+  Area->RecordsOffset = RecordsOffset;
+}
+
+//
+// HvRingProducerInit
+//
+//  This routine sets up the producer of one ring of an area it laid out
+//
+// Inputs:
+//  Producer - this is the producer to set up
+//  Area - this is the start of the buffer
+//  Ring - this is the index of the ring
+//  RecordsPerRing, RecordsOffset - these are the geometry from HvRingLayout, not read back from the area
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+static __inline VOID HvRingProducerInit(PHV_RING_PRODUCER Producer, PHV_RING_AREA Area, ULONG Ring,
+                                        ULONG RecordsPerRing, ULONG RecordsOffset)
+{
+  Producer->Control = &Area->Rings[Ring];
+
+  Producer->Records = (PHV_RING_RECORD) ((PUCHAR) Area + RecordsOffset) + (SIZE_T) Ring * RecordsPerRing;
+
+  Producer->Mask = RecordsPerRing - 1;
+
+  Producer->Head = 0;
+
+  Producer->Dropped = 0;
+}
+
+//
+// HvRingProducerTail
+//
+//  This routine reads how far the consumer got
+//
+// Inputs:
+//  Producer - this is the producer of the ring
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The consumer's Tail; the records before it are free to overwrite
+//
+static __inline ULONG64 HvRingProducerTail(PHV_RING_PRODUCER Producer)
+{
+  ULONG64 tail = Producer->Control->Tail;
+
+  HV_RING_ACQUIRE();
+
+  return tail;
+}
+
+//
+// HvRingProducerSlot
+//
+//  This routine finds where the record at a position goes
+//
+// Inputs:
+//  Producer - this is the producer of the ring
+//  Head - this is the position of the record
+//  Tail - this is the Tail read by HvRingProducerTail
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The slot of the record, or NULL if the ring is full and the record is dropped
+//
+// Notes:
+//  Also returns NULL for a Tail the consumer moved past Head: nothing is
+//  written until it is sane again.
+//
+static __inline PHV_RING_RECORD HvRingProducerSlot(PHV_RING_PRODUCER Producer, ULONG64 Head, ULONG64 Tail)
+{
+  if (Head - Tail > Producer->Mask) {
+
+    return NULL;
+
+  }
+
+  return &Producer->Records[Head & Producer->Mask];
+}
+
+//
+// HvRingProducerPublish
+//
+//  This routine hands the records written up to a position to the consumer
+//
+// Inputs:
+//  Producer - this is the producer of the ring
+//  Head - this is the position after the last record written
+//  Dropped - this is the number of records dropped since the last publish
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The exchange of Head orders the records before it: they are complete
+//  before the consumer can see them.
+//
+static __inline VOID HvRingProducerPublish(PHV_RING_PRODUCER Producer, ULONG64 Head, ULONG Dropped)
+{
+  if (Dropped) {
+
+    Producer->Dropped += Dropped;
+
+    Producer->Control->Dropped = Producer->Dropped;
+
+  }
+
+  if (Head != Producer->Head) {
+
+    Producer->Head = Head;
+
+    InterlockedExchange64((volatile LONG64*) &Producer->Control->Head, (LONG64) Head);
+
+  }
+}
+
+//
+// HvRingProducerPending
+//
+//  This routine counts the records the consumer has not taken yet
+//
+// Inputs:
+//  Producer - this is the producer of the ring
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The record count; a Tail the consumer moved past Head counts for nothing
+//
+static __inline ULONG64 HvRingProducerPending(PHV_RING_PRODUCER Producer)
+{
+  ULONG64 count = Producer->Head - Producer->Control->Tail;
+
+  return count <= Producer->Mask + 1 ? count : 0;
+}
+
+//
+// HvRingClaimWakeup
+//
+//  This routine takes the wakeup of a waiting consumer
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - ConsumerWaiting was set and the caller cleared it: the caller wakes the consumer
+//  FALSE - the consumer is not waiting, or someone else wakes it
+//
+static __inline BOOLEAN HvRingClaimWakeup(PHV_RING_AREA Area)
+{
+  return InterlockedExchange(&Area->ConsumerWaiting, 0) != 0;
+}
+
+//
+// HvRingConsume
+//
+//  This routine takes the published records of one ring
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//  Ring - this is the index of the ring
+//  Routine - this is called for every record, if not NULL
+//  Context - this is passed to Routine
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The number of records taken
+//
+// Notes:
+//  The record a call of Routine is given is only valid during the call: the
+//  slots are handed back to the producer when the routine returns.
+//
+static __inline ULONG HvRingConsume(PHV_RING_AREA Area, ULONG Ring, PHV_RING_RECORD_ROUTINE Routine, PVOID Context)
+{
+  PHV_RING_CONTROL control = &Area->Rings[Ring];
+  PHV_RING_RECORD records = HV_RING_RECORDS(Area, Ring);
+  ULONG64 mask = Area->RecordsPerRing - 1;
+  ULONG64 tail = control->Tail;
+  ULONG64 head;
+  ULONG count = 0;
+
+  //
+  // The records up to Head are complete
+  //
+  head = control->Head;
+
+  HV_RING_ACQUIRE();
+
+  for (; tail != head; tail++, count++) {
+
+    if (Routine) {
+
+      Routine(&records[tail & mask], Context);
+
+    }
+
+  }
+
+  //
+  // Hand the slots back to the producer, after the records were read
+  //
+  InterlockedExchange64((volatile LONG64*) &control->Tail, (LONG64) tail);
+
+  return count;
+}
+
+//
+// HvRingPending
+//
+//  This routine counts the published records the consumer has not taken, over all the rings
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The record count
+//
+static __inline ULONG64 HvRingPending(PHV_RING_AREA Area)
+{
+  ULONG64 pending = 0;
+  ULONG ring;
+
+  for (ring = 0; ring < Area->RingCount; ring++) {
+
+    pending += Area->Rings[ring].Head - Area->Rings[ring].Tail;
+
+  }
+
+  return pending;
+}
+
+//
+// HvRingPrepareWait
+//
+//  This routine announces that the consumer is about to sleep
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//  MinRecords - this is the number of records that make sleeping pointless
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - ConsumerWaiting is set: sleep until the producer claims the wakeup
+//  FALSE - enough records are waiting already; ConsumerWaiting is clear
+//
+// Notes:
+//  A record published before the producer could see the flag would not wake
+//  the consumer, so the rings are looked at again once it is set.
+//
+static __inline BOOLEAN HvRingPrepareWait(PHV_RING_AREA Area, ULONG64 MinRecords)
+{
+  InterlockedExchange(&Area->ConsumerWaiting, 1);
+
+  if (HvRingPending(Area) >= MinRecords) {
+
+    InterlockedExchange(&Area->ConsumerWaiting, 0);
+
+    return FALSE;
+
+  }
+
+  return TRUE;
+}
+
+//
+// HvRingDropped
+//
+//  This routine adds up the records the rings had no room for
+//
+// Inputs:
+//  Area - this is the start of the buffer
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The record count
+//
+static __inline ULONG64 HvRingDropped(PHV_RING_AREA Area)
+{
+  ULONG64 dropped = 0;
+  ULONG ring;
+
+  for (ring = 0; ring < Area->RingCount; ring++) {
+
+    dropped += Area->Rings[ring].Dropped;
+
+  }
+
+  return dropped;
+}
@@ -9,4 +9,19 @@
 
 #define OSR_COMM_CONTROL_GET_REQUEST CTL_CODE(OSR_COMM_CONTROL_TYPE, 3192, METHOD_BUFFERED, FILE_READ_ACCESS)
 #define OSR_COMM_CONTROL_SEND_RESPONSE CTL_CODE(OSR_COMM_CONTROL_TYPE, 3193, METHOD_BUFFERED, FILE_WRITE_ACCESS)
-#define OSR_COMM_CONTROL_GET_AND_SEND CTL_CODE(OSR_COMM_CONTROL_TYPE, 3194, METHOD_BUFFERED, FILE_READ_ACCESS|FILE_WRITE_ACCESS)
\ No newline at end of file
+#define OSR_COMM_CONTROL_GET_AND_SEND CTL_CODE(OSR_COMM_CONTROL_TYPE, 3194, METHOD_BUFFERED, FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_QUERY_HISTOGRAMS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3195, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_READ_MICROBURSTS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3196, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_SET_MICROBURST_CONFIG CTL_CODE(OSR_COMM_CONTROL_TYPE, 3197, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_QUERY_GOVERNOR CTL_CODE(OSR_COMM_CONTROL_TYPE, 3198, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_SET_GOVERNOR_CONFIG CTL_CODE(OSR_COMM_CONTROL_TYPE, 3199, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_SET_CAPTURE_CONFIG CTL_CODE(OSR_COMM_CONTROL_TYPE, 3200, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_DRAIN_CAPTURE CTL_CODE(OSR_COMM_CONTROL_TYPE, 3201, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_REGISTER_RING CTL_CODE(OSR_COMM_CONTROL_TYPE, 3202, METHOD_BUFFERED, FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_UNREGISTER_RING CTL_CODE(OSR_COMM_CONTROL_TYPE, 3203, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_WAIT_RING CTL_CODE(OSR_COMM_CONTROL_TYPE, 3204, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_EXCHANGE_BATCH CTL_CODE(OSR_COMM_CONTROL_TYPE, 3205, METHOD_OUT_DIRECT, FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_REGISTER_BUFFERS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3206, METHOD_BUFFERED, FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_UNREGISTER_BUFFERS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3207, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_COMM_CONTROL_MAP_COUNTERS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3208, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define OSR_COMM_CONTROL_UNMAP_COUNTERS CTL_CODE(OSR_COMM_CONTROL_TYPE, 3209, METHOD_BUFFERED, FILE_READ_ACCESS)
\ No newline at end of file
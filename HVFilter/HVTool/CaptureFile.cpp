@@ -0,0 +1,75 @@
+#include "CaptureFile.h"
+
+CaptureFile::CaptureFile()
+	: m_hFile(INVALID_HANDLE_VALUE),
+	m_hMapping(NULL),
+	m_pView(NULL),
+	m_length(0)
+{
+	memset(&m_reader, 0, sizeof(m_reader));
+}
+
+CaptureFile::~CaptureFile()
+{
+	Close();
+}
+
+bool CaptureFile::Open(const char* path)
+{
+	LARGE_INTEGER size;
+
+	Close();
+
+	//the Client may still be writing the segment
+	m_hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart < sizeof(HV_RECORD_STREAM) || size.HighPart) {
+		Close();
+		return false;
+	}
+
+	m_length = size.LowPart;
+	m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (m_hMapping)
+		m_pView = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+
+	//the stream header tells how much of the file holds records
+	if (!m_pView || !HvRecordReaderInit(&m_reader, m_pView, m_length)) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void CaptureFile::Rewind()
+{
+	if (m_pView)
+		HvRecordReaderInit(&m_reader, m_pView, m_length);
+}
+
+void CaptureFile::Close()
+{
+	if (m_pView) {
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+
+	if (m_hMapping) {
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+
+	m_length = 0;
+	memset(&m_reader, 0, sizeof(m_reader));
+}
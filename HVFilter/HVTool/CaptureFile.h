@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../HVService/HVService/HVRecord.h"
+#include "../HVService/HVService/HVStats.h"
+
+//
+// Read only view of a capture segment written by the Client (capture-NNNNNN.hvr):
+// a record stream (see HVRecord.h) walked where it lies in the mapped file
+//
+class CaptureFile
+{
+public:
+	CaptureFile();
+	~CaptureFile();
+
+	bool Open(const char* path);
+	void Close();
+
+	//the next record, or NULL at the end of the segment
+	const HV_RECORD_HEADER* Next() { return HvRecordNext(&m_reader); }
+
+	//restarts from the first record
+	void Rewind();
+
+private:
+	HANDLE				m_hFile;
+	HANDLE				m_hMapping;
+	const BYTE*			m_pView;
+	ULONG				m_length;
+	HV_RECORD_READER	m_reader;
+};
+
+//names used when records are rendered
+inline const char* direction_name(ULONG direction)
+{
+	if (direction == HV_RECORD_DIRECTION_SWITCH)
+		return "switch";
+
+	return direction == HV_STATS_DIRECTION_INBOUND ? "inbound" : "outbound";
+}
+
+inline const char* record_type_name(USHORT type)
+{
+	switch (type) {
+	case HV_RECORD_PACKET:		return "packet";
+	case HV_RECORD_COUNTERS:	return "counters";
+	case HV_RECORD_HISTOGRAM:	return "histogram";
+	case HV_RECORD_EVENT:		return "event";
+	default:					return "unknown";
+	}
+}
+
+inline const char* histogram_kind_name(USHORT kind)
+{
+	return kind == HV_RECORD_HISTOGRAM_SIZE ? "size" : "gap";
+}
+
+//the buckets a histogram record really holds
+inline ULONG histogram_bucket_count(const HV_RECORD_HISTOGRAM_DATA* pHistogram)
+{
+	ULONG count = (pHistogram->Header.Length - FIELD_OFFSET(HV_RECORD_HISTOGRAM_DATA, Buckets)) / sizeof(ULONG64);
+
+	return count < pHistogram->BucketCount ? count : pHistogram->BucketCount;
+}
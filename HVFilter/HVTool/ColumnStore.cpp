@@ -0,0 +1,437 @@
+#include "ColumnStore.h"
+
+#include <emmintrin.h>
+
+//networks of an address that go in the Bloom filter
+static const ULONG bloom_prefixes[] = {8, 16, 24, 32};
+
+static ULONG prefix_mask(ULONG prefix)
+{
+	return prefix ? 0xFFFFFFFF << (32 - prefix) : 0;
+}
+
+//three bit positions out of one 64 bit hash of the network and its prefix
+static ULONG64 bloom_hash(ULONG address, ULONG prefix)
+{
+	ULONG64 hash = ((ULONG64)(address & prefix_mask(prefix)) << 8 | prefix) * 0x9E3779B97F4A7C15ull;
+
+	return hash ^ (hash >> 29);
+}
+
+static void bloom_add(ULONG64* pBloom, ULONG address)
+{
+	for (ULONG i = 0; i < _countof(bloom_prefixes); ++i) {
+		ULONG64 hash = bloom_hash(address, bloom_prefixes[i]);
+
+		for (int k = 0; k < 3; ++k, hash >>= 16) {
+			ULONG bit = (ULONG)hash & (STORE_BLOOM_BITS - 1);
+
+			pBloom[bit / 64] |= 1ull << (bit % 64);
+		}
+	}
+}
+
+static bool bloom_test(const ULONG64* pBloom, ULONG network, ULONG prefix)
+{
+	ULONG64 hash = bloom_hash(network, prefix);
+
+	for (int k = 0; k < 3; ++k, hash >>= 16) {
+		ULONG bit = (ULONG)hash & (STORE_BLOOM_BITS - 1);
+
+		if (!(pBloom[bit / 64] & (1ull << (bit % 64))))
+			return false;
+	}
+
+	return true;
+}
+
+/************************ writer ******************************/
+
+ColumnStoreWriter::ColumnStoreWriter()
+	: m_hFile(INVALID_HANDLE_VALUE),
+	m_pBlock(NULL)
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+ColumnStoreWriter::~ColumnStoreWriter()
+{
+	Close();
+}
+
+bool ColumnStoreWriter::Create(const char* path)
+{
+	m_hFile = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	m_pBlock = (STORE_BLOCK*)VirtualAlloc(NULL, sizeof(STORE_BLOCK), MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+
+	if (!m_pBlock) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	memset(&m_header, 0, sizeof(m_header));
+	m_header.Magic = STORE_MAGIC;
+	m_header.Version = STORE_VERSION;
+	m_header.BlockLength = sizeof(STORE_BLOCK);
+	m_header.BlockRecords = STORE_BLOCK_RECORDS;
+
+	//the header is written last, once the counts are known
+	LARGE_INTEGER first;
+	first.QuadPart = STORE_HEADER_LENGTH;
+
+	return SetFilePointerEx(m_hFile, first, NULL, FILE_BEGIN) != FALSE;
+}
+
+bool ColumnStoreWriter::Add(const HV_RECORD_PACKET_DATA* pPacket)
+{
+	STORE_BLOCK_HEADER& header = m_pBlock->Header;
+	ULONG i = header.RecordCount;
+
+	ULONG64 timestamp = pPacket->Header.Timestamp;
+	ULONG portId = pPacket->Header.PortId;
+	ULONG source = _byteswap_ulong(pPacket->SourceAddress);
+	ULONG destination = _byteswap_ulong(pPacket->DestinationAddress);
+	USHORT sourcePort = _byteswap_ushort(pPacket->SourcePort);
+	USHORT destinationPort = _byteswap_ushort(pPacket->DestinationPort);
+
+	if (!i) {
+		header.MinTimestamp = header.MaxTimestamp = timestamp;
+		header.MinPortId = header.MaxPortId = portId;
+		header.MinSourceAddress = header.MaxSourceAddress = source;
+		header.MinDestinationAddress = header.MaxDestinationAddress = destination;
+		header.MinSourcePort = header.MaxSourcePort = sourcePort;
+		header.MinDestinationPort = header.MaxDestinationPort = destinationPort;
+	} else {
+		header.MinTimestamp = min(header.MinTimestamp, timestamp);
+		header.MaxTimestamp = max(header.MaxTimestamp, timestamp);
+		header.MinPortId = min(header.MinPortId, portId);
+		header.MaxPortId = max(header.MaxPortId, portId);
+		header.MinSourceAddress = min(header.MinSourceAddress, source);
+		header.MaxSourceAddress = max(header.MaxSourceAddress, source);
+		header.MinDestinationAddress = min(header.MinDestinationAddress, destination);
+		header.MaxDestinationAddress = max(header.MaxDestinationAddress, destination);
+		header.MinSourcePort = min(header.MinSourcePort, sourcePort);
+		header.MaxSourcePort = max(header.MaxSourcePort, sourcePort);
+		header.MinDestinationPort = min(header.MinDestinationPort, destinationPort);
+		header.MaxDestinationPort = max(header.MaxDestinationPort, destinationPort);
+	}
+
+	bloom_add(m_pBlock->Bloom, source);
+	bloom_add(m_pBlock->Bloom, destination);
+
+	m_pBlock->Timestamp[i] = timestamp;
+	m_pBlock->PortId[i] = portId;
+	m_pBlock->SourceAddress[i] = pPacket->SourceAddress;
+	m_pBlock->DestinationAddress[i] = pPacket->DestinationAddress;
+	m_pBlock->FrameLength[i] = pPacket->FrameLength;
+	m_pBlock->SourcePort[i] = pPacket->SourcePort;
+	m_pBlock->DestinationPort[i] = pPacket->DestinationPort;
+	m_pBlock->IpProtocol[i] = pPacket->IpProtocol;
+	m_pBlock->Direction[i] = (UCHAR)pPacket->Direction;
+
+	++m_header.RecordCount;
+
+	if (++header.RecordCount == STORE_BLOCK_RECORDS)
+		return WriteBlock();
+
+	return true;
+}
+
+bool ColumnStoreWriter::WriteBlock()
+{
+	DWORD written = 0;
+
+	if (!WriteFile(m_hFile, m_pBlock, sizeof(STORE_BLOCK), &written, NULL) || written != sizeof(STORE_BLOCK))
+		return false;
+
+	++m_header.BlockCount;
+	memset(m_pBlock, 0, sizeof(STORE_BLOCK));
+
+	return true;
+}
+
+bool ColumnStoreWriter::Close()
+{
+	bool result = true;
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (m_pBlock->Header.RecordCount)
+		result = WriteBlock();
+
+	LARGE_INTEGER first;
+	first.QuadPart = 0;
+
+	BYTE* pHeader = new BYTE[STORE_HEADER_LENGTH];
+	DWORD written = 0;
+
+	memset(pHeader, 0, STORE_HEADER_LENGTH);
+	memcpy(pHeader, &m_header, sizeof(m_header));
+
+	if (!SetFilePointerEx(m_hFile, first, NULL, FILE_BEGIN) ||
+		!WriteFile(m_hFile, pHeader, STORE_HEADER_LENGTH, &written, NULL) || written != STORE_HEADER_LENGTH)
+		result = false;
+
+	delete[] pHeader;
+
+	VirtualFree(m_pBlock, 0, MEM_RELEASE);
+	m_pBlock = NULL;
+
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+
+	return result;
+}
+
+/************************ reader ******************************/
+
+ColumnStore::ColumnStore()
+	: m_hFile(INVALID_HANDLE_VALUE),
+	m_hMapping(NULL),
+	m_pWindow(NULL),
+	m_windowFirst(0),
+	m_windowCount(0)
+{
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+ColumnStore::~ColumnStore()
+{
+	Close();
+}
+
+bool ColumnStore::Open(const char* path)
+{
+	DWORD bytesRead = 0;
+	LARGE_INTEGER size;
+
+	Close();
+
+	m_hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!ReadFile(m_hFile, &m_header, sizeof(m_header), &bytesRead, NULL) || bytesRead != sizeof(m_header) ||
+		m_header.Magic != STORE_MAGIC || m_header.Version != STORE_VERSION ||
+		m_header.BlockLength != sizeof(STORE_BLOCK) || m_header.BlockRecords != STORE_BLOCK_RECORDS ||
+		!GetFileSizeEx(m_hFile, &size) ||
+		(ULONG64)size.QuadPart < STORE_HEADER_LENGTH + m_header.BlockCount * sizeof(STORE_BLOCK)) {
+		Close();
+		return false;
+	}
+
+	//an empty store has nothing to map
+	if (m_header.BlockCount) {
+		m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (!m_hMapping) {
+			Close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ColumnStore::Close()
+{
+	if (m_pWindow) {
+		UnmapViewOfFile(m_pWindow);
+		m_pWindow = NULL;
+	}
+
+	m_windowFirst = 0;
+	m_windowCount = 0;
+
+	if (m_hMapping) {
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+
+	memset(&m_header, 0, sizeof(m_header));
+}
+
+const STORE_BLOCK* ColumnStore::GetBlock(ULONG64 index)
+{
+	if (index >= m_header.BlockCount)
+		return NULL;
+
+	if (!m_pWindow || index < m_windowFirst || index >= m_windowFirst + m_windowCount) {
+		if (m_pWindow)
+			UnmapViewOfFile(m_pWindow);
+
+		m_windowFirst = index;
+		m_windowCount = (ULONG)min((ULONG64)STORE_WINDOW_BLOCKS, m_header.BlockCount - index);
+
+		//only the pages a query touches are read: the header of a skipped block and nothing else
+		ULONG64 offset = STORE_HEADER_LENGTH + index * sizeof(STORE_BLOCK);
+
+		m_pWindow = (BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset,
+			m_windowCount * sizeof(STORE_BLOCK));
+
+		if (!m_pWindow)
+			return NULL;
+	}
+
+	const STORE_BLOCK* pBlock = (const STORE_BLOCK*)(m_pWindow + (index - m_windowFirst) * sizeof(STORE_BLOCK));
+
+	//the scans size their masks by it
+	if (pBlock->Header.RecordCount > STORE_BLOCK_RECORDS) {
+		SetLastError(ERROR_FILE_CORRUPT);
+		return NULL;
+	}
+
+	return pBlock;
+}
+
+bool ColumnStore::MayMatch(const STORE_BLOCK* pBlock, const StoreQuery& query)
+{
+	const STORE_BLOCK_HEADER& header = pBlock->Header;
+
+	if (!header.RecordCount)
+		return false;
+
+	if (query.bTime && (header.MaxTimestamp < query.ullFrom || header.MinTimestamp > query.ullTo))
+		return false;
+
+	if (query.bPortId && (query.ulPortId < header.MinPortId || query.ulPortId > header.MaxPortId))
+		return false;
+
+	if (query.bPort &&
+		(query.usPort < header.MinSourcePort || query.usPort > header.MaxSourcePort) &&
+		(query.usPort < header.MinDestinationPort || query.usPort > header.MaxDestinationPort))
+		return false;
+
+	if (query.bNetwork) {
+		ULONG first = query.ulNetwork & prefix_mask(query.ulPrefix);
+		ULONG last = first | ~prefix_mask(query.ulPrefix);
+
+		if ((last < header.MinSourceAddress || first > header.MaxSourceAddress) &&
+			(last < header.MinDestinationAddress || first > header.MaxDestinationAddress))
+			return false;
+
+		//the longest network of the filter that the records put in it
+		for (int i = _countof(bloom_prefixes) - 1; i >= 0; --i) {
+			if (bloom_prefixes[i] <= query.ulPrefix)
+				return bloom_test(pBlock->Bloom, query.ulNetwork, bloom_prefixes[i]);
+		}
+	}
+
+	return true;
+}
+
+//
+// Column scans, 16 records per step: pMatch[i] is 0xFF where the column matches
+//
+static void match_32(const ULONG* pColumn, ULONG mask, ULONG value, BYTE* pMatch)
+{
+	const __m128i vmask = _mm_set1_epi32((int)mask);
+	const __m128i vvalue = _mm_set1_epi32((int)value);
+
+	for (ULONG i = 0; i < STORE_BLOCK_RECORDS; i += 16) {
+		const __m128i* p = (const __m128i*)(pColumn + i);
+
+		__m128i a = _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128(p), vmask), vvalue);
+		__m128i b = _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128(p + 1), vmask), vvalue);
+		__m128i c = _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128(p + 2), vmask), vvalue);
+		__m128i d = _mm_cmpeq_epi32(_mm_and_si128(_mm_load_si128(p + 3), vmask), vvalue);
+
+		//-1 / 0 lanes narrow to 0xFF / 0 bytes
+		_mm_storeu_si128((__m128i*)(pMatch + i), _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+	}
+}
+
+static void match_16(const USHORT* pColumn, USHORT value, BYTE* pMatch)
+{
+	const __m128i vvalue = _mm_set1_epi16((short)value);
+
+	for (ULONG i = 0; i < STORE_BLOCK_RECORDS; i += 16) {
+		const __m128i* p = (const __m128i*)(pColumn + i);
+
+		__m128i a = _mm_cmpeq_epi16(_mm_load_si128(p), vvalue);
+		__m128i b = _mm_cmpeq_epi16(_mm_load_si128(p + 1), vvalue);
+
+		_mm_storeu_si128((__m128i*)(pMatch + i), _mm_packs_epi16(a, b));
+	}
+}
+
+static void match_or(BYTE* pMatch, const BYTE* pOther)
+{
+	for (ULONG i = 0; i < STORE_BLOCK_RECORDS; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(pMatch + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(pOther + i));
+
+		_mm_storeu_si128((__m128i*)(pMatch + i), _mm_or_si128(a, b));
+	}
+}
+
+static void match_and(BYTE* pMatch, const BYTE* pOther)
+{
+	for (ULONG i = 0; i < STORE_BLOCK_RECORDS; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(pMatch + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(pOther + i));
+
+		_mm_storeu_si128((__m128i*)(pMatch + i), _mm_and_si128(a, b));
+	}
+}
+
+ULONG ColumnStore::Scan(const STORE_BLOCK* pBlock, const StoreQuery& query, BYTE* pMatch)
+{
+	const STORE_BLOCK_HEADER& header = pBlock->Header;
+	BYTE column[STORE_BLOCK_RECORDS];
+	BYTE other[STORE_BLOCK_RECORDS];
+	ULONG count = 0;
+
+	memset(pMatch, 0xFF, header.RecordCount);
+	memset(pMatch + header.RecordCount, 0, STORE_BLOCK_RECORDS - header.RecordCount);
+
+	//SSE2 has no 64 bit compare; the time filter is only applied to the blocks it splits
+	if (query.bTime && (header.MinTimestamp < query.ullFrom || header.MaxTimestamp > query.ullTo)) {
+		for (ULONG i = 0; i < header.RecordCount; ++i) {
+			if (pBlock->Timestamp[i] < query.ullFrom || pBlock->Timestamp[i] > query.ullTo)
+				pMatch[i] = 0;
+		}
+	}
+
+	if (query.bPortId) {
+		match_32(pBlock->PortId, 0xFFFFFFFF, query.ulPortId, column);
+		match_and(pMatch, column);
+	}
+
+	//the address and port columns are in network byte order
+	if (query.bNetwork) {
+		ULONG mask = _byteswap_ulong(prefix_mask(query.ulPrefix));
+		ULONG network = _byteswap_ulong(query.ulNetwork) & mask;
+
+		match_32(pBlock->SourceAddress, mask, network, column);
+		match_32(pBlock->DestinationAddress, mask, network, other);
+		match_or(column, other);
+		match_and(pMatch, column);
+	}
+
+	if (query.bPort) {
+		USHORT port = _byteswap_ushort(query.usPort);
+
+		match_16(pBlock->SourcePort, port, column);
+		match_16(pBlock->DestinationPort, port, other);
+		match_or(column, other);
+		match_and(pMatch, column);
+	}
+
+	for (ULONG i = 0; i < header.RecordCount; ++i)
+		count += pMatch[i] != 0;
+
+	return count;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "../HVService/HVService/HVRecord.h"
+
+//
+// Column store of packet records, built from capture segments (hvtool store)
+// and queried in place (hvtool query).  The file is a STORE_HEADER followed by
+// fixed size blocks of STORE_BLOCK_RECORDS records.  A block keeps every field
+// in its own array (timestamps, port IDs, addresses...), so a query only reads
+// the columns it filters on and compares them 16 records at a time.  Its
+// header has the range of every filtered column, and a Bloom filter of the
+// addresses (and of their /8, /16 and /24 networks): a block that cannot hold
+// a match is skipped without reading its columns.  Blocks are 64KB aligned
+// and mapped a window at a time, so a store can be larger than the address
+// space.
+//
+
+#define STORE_MAGIC 0x53435648 // 'HVCS'
+#define STORE_VERSION 1
+
+#define STORE_HEADER_LENGTH (64 * 1024)
+
+#define STORE_BLOCK_RECORDS 4096
+#define STORE_BLOCK_HEADER_LENGTH 4096
+#define STORE_BLOOM_BITS 32768
+
+//blocks mapped together while a store is read
+#define STORE_WINDOW_BLOCKS 64
+
+typedef struct _STORE_HEADER {
+	ULONG	Magic;
+	USHORT	Version;
+	USHORT	Reserved;
+
+	//sizeof(STORE_BLOCK) and STORE_BLOCK_RECORDS
+	ULONG	BlockLength;
+	ULONG	BlockRecords;
+
+	ULONG64	BlockCount;
+	ULONG64	RecordCount;
+
+} STORE_HEADER, *PSTORE_HEADER;
+
+//
+// Ranges of the records of a block; addresses and ports in host byte order
+//
+typedef struct _STORE_BLOCK_HEADER {
+	ULONG	RecordCount;
+	ULONG	Reserved;
+
+	ULONG64	MinTimestamp;
+	ULONG64	MaxTimestamp;
+
+	ULONG	MinPortId;
+	ULONG	MaxPortId;
+
+	ULONG	MinSourceAddress;
+	ULONG	MaxSourceAddress;
+	ULONG	MinDestinationAddress;
+	ULONG	MaxDestinationAddress;
+
+	USHORT	MinSourcePort;
+	USHORT	MaxSourcePort;
+	USHORT	MinDestinationPort;
+	USHORT	MaxDestinationPort;
+
+} STORE_BLOCK_HEADER, *PSTORE_BLOCK_HEADER;
+
+//
+// Columns are in the byte order of the records (see HV_RECORD_PACKET_DATA);
+// the slots past RecordCount are zero
+//
+typedef struct _STORE_BLOCK {
+	union {
+		STORE_BLOCK_HEADER Header;
+		BYTE HeaderSpace[STORE_BLOCK_HEADER_LENGTH];
+	};
+
+	ULONG64	Bloom[STORE_BLOOM_BITS / 64];
+
+	ULONG64	Timestamp[STORE_BLOCK_RECORDS];
+	ULONG	PortId[STORE_BLOCK_RECORDS];
+	ULONG	SourceAddress[STORE_BLOCK_RECORDS];
+	ULONG	DestinationAddress[STORE_BLOCK_RECORDS];
+	ULONG	FrameLength[STORE_BLOCK_RECORDS];
+	USHORT	SourcePort[STORE_BLOCK_RECORDS];
+	USHORT	DestinationPort[STORE_BLOCK_RECORDS];
+	UCHAR	IpProtocol[STORE_BLOCK_RECORDS];
+	UCHAR	Direction[STORE_BLOCK_RECORDS];
+
+} STORE_BLOCK, *PSTORE_BLOCK;
+
+//a whole number of allocation granules: blocks can be mapped one by one
+C_ASSERT(sizeof(STORE_BLOCK) % (64 * 1024) == 0);
+
+//
+// Filters of a query; the ones not set match everything
+//
+struct StoreQuery
+{
+	StoreQuery() { memset(this, 0, sizeof(*this)); }
+
+	//[ullFrom, ullTo], 100ns units
+	bool	bTime;
+	ULONG64	ullFrom;
+	ULONG64	ullTo;
+
+	//source or destination in ulNetwork/ulPrefix, host byte order
+	bool	bNetwork;
+	ULONG	ulNetwork;
+	ULONG	ulPrefix;
+
+	//source or destination port, host byte order
+	bool	bPort;
+	USHORT	usPort;
+
+	bool	bPortId;
+	ULONG	ulPortId;
+};
+
+class ColumnStoreWriter
+{
+public:
+	ColumnStoreWriter();
+	~ColumnStoreWriter();
+
+	bool Create(const char* path);
+	bool Add(const HV_RECORD_PACKET_DATA* pPacket);
+
+	//writes the last block and the header
+	bool Close();
+
+	ULONG64 GetRecordCount() const { return m_header.RecordCount; }
+
+private:
+	bool WriteBlock();
+
+	HANDLE			m_hFile;
+	STORE_BLOCK*	m_pBlock;
+	STORE_HEADER	m_header;
+};
+
+class ColumnStore
+{
+public:
+	ColumnStore();
+	~ColumnStore();
+
+	bool Open(const char* path);
+	void Close();
+
+	ULONG64 GetBlockCount() const { return m_header.BlockCount; }
+	ULONG64 GetRecordCount() const { return m_header.RecordCount; }
+
+	//NULL with the last error set if the block cannot be mapped or holds more
+	//than STORE_BLOCK_RECORDS records; valid until the next call
+	const STORE_BLOCK* GetBlock(ULONG64 index);
+
+	//false if the header of the block rules out every record
+	static bool MayMatch(const STORE_BLOCK* pBlock, const StoreQuery& query);
+
+	//sets pMatch[i] to nonzero for the records that match; returns their count
+	static ULONG Scan(const STORE_BLOCK* pBlock, const StoreQuery& query, BYTE* pMatch);
+
+private:
+	HANDLE			m_hFile;
+	HANDLE			m_hMapping;
+	STORE_HEADER	m_header;
+
+	//the mapped window: blocks [m_windowFirst, m_windowFirst + m_windowCount)
+	BYTE*			m_pWindow;
+	ULONG64			m_windowFirst;
+	ULONG			m_windowCount;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+//
+// hvtool commands: argv[0] is the command name, the rest are its arguments;
+// the result is the exit code of the tool
+//
+
+//prints the records of capture segments as text
+int dump_command(int argc, const char* argv[]);
+
+//renders the records of capture segments as CSV or NDJSON
+int export_command(int argc, const char* argv[]);
+
+//builds a column store from the packet records of capture segments
+int store_command(int argc, const char* argv[]);
+
+//prints the packets of a column store that match a filter
+int query_command(int argc, const char* argv[]);
+
+//shows per vPort and per flow rates, from the driver or replayed from capture segments
+int top_command(int argc, const char* argv[]);
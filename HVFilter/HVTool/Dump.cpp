@@ -0,0 +1,152 @@
+#include "Commands.h"
+#include "CaptureFile.h"
+#include "Render.h"
+
+#include <cstdio>
+
+static void put_endpoints(TextBuffer& out, ULONG source, USHORT sourcePort, ULONG destination, USHORT destinationPort)
+{
+	out.PutAddress(source);
+	out.Put(':');
+	out.PutPort(sourcePort);
+	out.Put(" -> ");
+	out.PutAddress(destination);
+	out.Put(':');
+	out.PutPort(destinationPort);
+}
+
+void render_text(TextBuffer& out, const HV_RECORD_HEADER* pRecord)
+{
+	out.PutTimestamp(pRecord->Timestamp);
+	out.Put(" port ");
+	out.PutUnsigned(pRecord->PortId);
+	out.Put(' ');
+
+	switch (pRecord->Type) {
+	case HV_RECORD_PACKET:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, PayloadLength)) {
+			const HV_RECORD_PACKET_DATA* pPacket = (const HV_RECORD_PACKET_DATA*)pRecord;
+
+			out.Put("packet ");
+			out.Put(direction_name(pPacket->Direction));
+			out.Put(" ethertype 0x");
+			out.PutHex(pPacket->EtherType, 4);
+			out.Put(" proto ");
+			out.PutUnsigned(pPacket->IpProtocol);
+			out.Put(' ');
+			put_endpoints(out, pPacket->SourceAddress, pPacket->SourcePort, pPacket->DestinationAddress, pPacket->DestinationPort);
+			out.Put(" size ");
+			out.PutUnsigned(pPacket->FrameLength);
+			out.Put(" payload ");
+			out.PutUnsigned(pPacket->PayloadLength);
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_COUNTERS:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_COUNTERS_DATA, Dropped)) {
+			const HV_RECORD_COUNTERS_DATA* pCounters = (const HV_RECORD_COUNTERS_DATA*)pRecord;
+
+			out.Put("counters ");
+			out.Put(direction_name(pCounters->Direction));
+			out.Put(" frames ");
+			out.PutUnsigned(pCounters->Frames);
+			out.Put(" bytes ");
+			out.PutUnsigned(pCounters->Bytes);
+			out.Put(" dropped ");
+			out.PutUnsigned(pCounters->Dropped);
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_HISTOGRAM:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_HISTOGRAM_DATA, BucketCount)) {
+			const HV_RECORD_HISTOGRAM_DATA* pHistogram = (const HV_RECORD_HISTOGRAM_DATA*)pRecord;
+			ULONG count = histogram_bucket_count(pHistogram);
+
+			out.Put("histogram ");
+			out.Put(direction_name(pHistogram->Direction));
+			out.Put(' ');
+			out.Put(histogram_kind_name(pHistogram->Kind));
+
+			for (ULONG i = 0; i < count; ++i) {
+				out.Put(' ');
+				out.PutUnsigned(pHistogram->Buckets[i]);
+			}
+
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_EVENT:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_EVENT_DATA, Value)) {
+			const HV_RECORD_EVENT_DATA* pEvent = (const HV_RECORD_EVENT_DATA*)pRecord;
+
+			out.Put("event ");
+			out.PutUnsigned(pEvent->Code);
+			out.Put(" values ");
+			out.PutUnsigned(pEvent->Value[0]);
+			out.Put(' ');
+			out.PutUnsigned(pEvent->Value[1]);
+			out.Put('\n');
+			return;
+		}
+		break;
+	}
+
+	//types newer than the tool, and records too short for their type
+	out.Put("record type ");
+	out.PutUnsigned(pRecord->Type);
+	out.Put(" length ");
+	out.PutUnsigned(pRecord->Length);
+	out.Put('\n');
+}
+
+void render_stored_packet(TextBuffer& out, const HV_RECORD_PACKET_DATA* pPacket)
+{
+	out.PutTimestamp(pPacket->Header.Timestamp);
+	out.Put(" port ");
+	out.PutUnsigned(pPacket->Header.PortId);
+	out.Put(" packet ");
+	out.Put(direction_name(pPacket->Direction));
+	out.Put(" proto ");
+	out.PutUnsigned(pPacket->IpProtocol);
+	out.Put(' ');
+	put_endpoints(out, pPacket->SourceAddress, pPacket->SourcePort, pPacket->DestinationAddress, pPacket->DestinationPort);
+	out.Put(" size ");
+	out.PutUnsigned(pPacket->FrameLength);
+	out.Put('\n');
+}
+
+int dump_command(int argc, const char* argv[])
+{
+	int result = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: hvtool dump <segment file>...\n");
+		return 1;
+	}
+
+	TextBuffer out(GetStdHandle(STD_OUTPUT_HANDLE));
+
+	for (int i = 1; i < argc; ++i) {
+		CaptureFile file;
+
+		if (!file.Open(argv[i])) {
+			fprintf(stderr, "%s: not a capture segment\n", argv[i]);
+			result = 1;
+			continue;
+		}
+
+		for (const HV_RECORD_HEADER* pRecord = file.Next(); pRecord && out.Reserve(); pRecord = file.Next())
+			render_text(out, pRecord);
+	}
+
+	if (!out.Flush())
+		result = 1;
+
+	return result;
+}
@@ -0,0 +1,254 @@
+#include "Commands.h"
+#include "CaptureFile.h"
+#include "TextBuffer.h"
+
+#include <cstdio>
+#include <cstring>
+
+//
+// CSV: one row per record, the same columns for every type; a column a type
+// does not have is left empty.  packets / bytes are the frame of a packet or
+// the totals of the counters; extra is the payload length of a packet, the
+// dropped records of the counters (direction "switch"), kind;bucket;bucket...
+// for a histogram and code;value;value for an event.
+//
+static const char csv_header[] =
+	"type,timestamp,port_id,direction,ether_type,ip_protocol,"
+	"source,source_port,destination,destination_port,packets,bytes,extra\n";
+
+static void csv_endpoints(TextBuffer& out, ULONG source, USHORT sourcePort, ULONG destination, USHORT destinationPort)
+{
+	out.PutAddress(source);
+	out.Put(',');
+	out.PutPort(sourcePort);
+	out.Put(',');
+	out.PutAddress(destination);
+	out.Put(',');
+	out.PutPort(destinationPort);
+	out.Put(',');
+}
+
+static void csv_record(TextBuffer& out, const HV_RECORD_HEADER* pRecord)
+{
+	out.Put(record_type_name(pRecord->Type));
+	out.Put(',');
+	out.PutTimestamp(pRecord->Timestamp);
+	out.Put(',');
+	out.PutUnsigned(pRecord->PortId);
+	out.Put(',');
+
+	switch (pRecord->Type) {
+	case HV_RECORD_PACKET:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, PayloadLength)) {
+			const HV_RECORD_PACKET_DATA* pPacket = (const HV_RECORD_PACKET_DATA*)pRecord;
+
+			out.Put(direction_name(pPacket->Direction));
+			out.Put(",0x");
+			out.PutHex(pPacket->EtherType, 4);
+			out.Put(',');
+			out.PutUnsigned(pPacket->IpProtocol);
+			out.Put(',');
+			csv_endpoints(out, pPacket->SourceAddress, pPacket->SourcePort, pPacket->DestinationAddress, pPacket->DestinationPort);
+			out.Put("1,");
+			out.PutUnsigned(pPacket->FrameLength);
+			out.Put(',');
+			out.PutUnsigned(pPacket->PayloadLength);
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_COUNTERS:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_COUNTERS_DATA, Dropped)) {
+			const HV_RECORD_COUNTERS_DATA* pCounters = (const HV_RECORD_COUNTERS_DATA*)pRecord;
+
+			out.Put(direction_name(pCounters->Direction));
+			out.Put(",,,,,,,");
+			out.PutUnsigned(pCounters->Frames);
+			out.Put(',');
+			out.PutUnsigned(pCounters->Bytes);
+			out.Put(',');
+			out.PutUnsigned(pCounters->Dropped);
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_HISTOGRAM:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_HISTOGRAM_DATA, BucketCount)) {
+			const HV_RECORD_HISTOGRAM_DATA* pHistogram = (const HV_RECORD_HISTOGRAM_DATA*)pRecord;
+			ULONG count = histogram_bucket_count(pHistogram);
+
+			out.Put(direction_name(pHistogram->Direction));
+			out.Put(",,,,,,,,,");
+			out.Put(histogram_kind_name(pHistogram->Kind));
+
+			for (ULONG i = 0; i < count; ++i) {
+				out.Put(';');
+				out.PutUnsigned(pHistogram->Buckets[i]);
+			}
+
+			out.Put('\n');
+			return;
+		}
+		break;
+
+	case HV_RECORD_EVENT:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_EVENT_DATA, Value)) {
+			const HV_RECORD_EVENT_DATA* pEvent = (const HV_RECORD_EVENT_DATA*)pRecord;
+
+			out.Put(",,,,,,,,,");
+			out.PutUnsigned(pEvent->Code);
+			out.Put(';');
+			out.PutUnsigned(pEvent->Value[0]);
+			out.Put(';');
+			out.PutUnsigned(pEvent->Value[1]);
+			out.Put('\n');
+			return;
+		}
+		break;
+	}
+
+	//types newer than the tool, and records too short for their type: the common columns only
+	out.Put(",,,,,,,,,\n");
+}
+
+//
+// NDJSON: one object per record, with the fields of its type
+//
+static void json_field(TextBuffer& out, const char* name, ULONG64 value)
+{
+	out.Put(",\"");
+	out.Put(name);
+	out.Put("\":");
+	out.PutUnsigned(value);
+}
+
+static void json_field(TextBuffer& out, const char* name, const char* value)
+{
+	out.Put(",\"");
+	out.Put(name);
+	out.Put("\":\"");
+	out.Put(value);
+	out.Put('"');
+}
+
+static void json_endpoints(TextBuffer& out, ULONG source, USHORT sourcePort, ULONG destination, USHORT destinationPort)
+{
+	out.Put(",\"source\":\"");
+	out.PutAddress(source);
+	out.Put("\",\"source_port\":");
+	out.PutPort(sourcePort);
+	out.Put(",\"destination\":\"");
+	out.PutAddress(destination);
+	out.Put("\",\"destination_port\":");
+	out.PutPort(destinationPort);
+}
+
+static void json_record(TextBuffer& out, const HV_RECORD_HEADER* pRecord)
+{
+	out.Put("{\"type\":\"");
+	out.Put(record_type_name(pRecord->Type));
+	out.Put("\",\"timestamp\":");
+	out.PutTimestamp(pRecord->Timestamp);
+	json_field(out, "port_id", pRecord->PortId);
+
+	switch (pRecord->Type) {
+	case HV_RECORD_PACKET:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, PayloadLength)) {
+			const HV_RECORD_PACKET_DATA* pPacket = (const HV_RECORD_PACKET_DATA*)pRecord;
+
+			json_field(out, "direction", direction_name(pPacket->Direction));
+			json_field(out, "ether_type", pPacket->EtherType);
+			json_field(out, "ip_protocol", pPacket->IpProtocol);
+			json_endpoints(out, pPacket->SourceAddress, pPacket->SourcePort, pPacket->DestinationAddress, pPacket->DestinationPort);
+			json_field(out, "frame_length", pPacket->FrameLength);
+			json_field(out, "payload_length", pPacket->PayloadLength);
+		}
+		break;
+
+	case HV_RECORD_COUNTERS:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_COUNTERS_DATA, Dropped)) {
+			const HV_RECORD_COUNTERS_DATA* pCounters = (const HV_RECORD_COUNTERS_DATA*)pRecord;
+
+			json_field(out, "direction", direction_name(pCounters->Direction));
+			json_field(out, "frames", pCounters->Frames);
+			json_field(out, "bytes", pCounters->Bytes);
+			json_field(out, "dropped", pCounters->Dropped);
+		}
+		break;
+
+	case HV_RECORD_HISTOGRAM:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_HISTOGRAM_DATA, BucketCount)) {
+			const HV_RECORD_HISTOGRAM_DATA* pHistogram = (const HV_RECORD_HISTOGRAM_DATA*)pRecord;
+			ULONG count = histogram_bucket_count(pHistogram);
+
+			json_field(out, "direction", direction_name(pHistogram->Direction));
+			json_field(out, "kind", histogram_kind_name(pHistogram->Kind));
+			out.Put(",\"buckets\":[");
+
+			for (ULONG i = 0; i < count; ++i) {
+				if (i)
+					out.Put(',');
+
+				out.PutUnsigned(pHistogram->Buckets[i]);
+			}
+
+			out.Put(']');
+		}
+		break;
+
+	case HV_RECORD_EVENT:
+		if (HV_RECORD_HOLDS(pRecord, HV_RECORD_EVENT_DATA, Value)) {
+			const HV_RECORD_EVENT_DATA* pEvent = (const HV_RECORD_EVENT_DATA*)pRecord;
+
+			json_field(out, "code", pEvent->Code);
+			out.Put(",\"values\":[");
+			out.PutUnsigned(pEvent->Value[0]);
+			out.Put(',');
+			out.PutUnsigned(pEvent->Value[1]);
+			out.Put(']');
+		}
+		break;
+	}
+
+	out.Put("}\n");
+}
+
+int export_command(int argc, const char* argv[])
+{
+	int result = 0;
+	bool csv = argc >= 2 && !strcmp(argv[1], "csv");
+
+	if (argc < 3 || (!csv && strcmp(argv[1], "ndjson"))) {
+		fprintf(stderr, "usage: hvtool export <csv|ndjson> <segment file>...\n");
+		return 1;
+	}
+
+	TextBuffer out(GetStdHandle(STD_OUTPUT_HANDLE));
+
+	if (csv)
+		out.Put(csv_header, sizeof(csv_header) - 1);
+
+	for (int i = 2; i < argc; ++i) {
+		CaptureFile file;
+
+		if (!file.Open(argv[i])) {
+			fprintf(stderr, "%s: not a capture segment\n", argv[i]);
+			result = 1;
+			continue;
+		}
+
+		for (const HV_RECORD_HEADER* pRecord = file.Next(); pRecord && out.Reserve(); pRecord = file.Next()) {
+			if (csv)
+				csv_record(out, pRecord);
+			else
+				json_record(out, pRecord);
+		}
+	}
+
+	if (!out.Flush())
+		result = 1;
+
+	return result;
+}
@@ -0,0 +1,200 @@
+#include "Commands.h"
+#include "CaptureFile.h"
+#include "ColumnStore.h"
+#include "QueryParse.h"
+#include "Render.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int store_command(int argc, const char* argv[])
+{
+	ColumnStoreWriter store;
+	ULONG64 skipped = 0;
+	int result = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: hvtool store <store file> <segment file>...\n");
+		return 1;
+	}
+
+	if (!store.Create(argv[1])) {
+		fprintf(stderr, "%s: could not create store: %u\n", argv[1], GetLastError());
+		return 1;
+	}
+
+	for (int i = 2; i < argc && !result; ++i) {
+		CaptureFile file;
+
+		if (!file.Open(argv[i])) {
+			fprintf(stderr, "%s: not a capture segment\n", argv[i]);
+			result = 1;
+			continue;
+		}
+
+		for (const HV_RECORD_HEADER* pRecord = file.Next(); pRecord; pRecord = file.Next()) {
+			//the store only has packets
+			if (pRecord->Type != HV_RECORD_PACKET || !HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, DestinationPort)) {
+				++skipped;
+				continue;
+			}
+
+			if (!store.Add((const HV_RECORD_PACKET_DATA*)pRecord)) {
+				fprintf(stderr, "%s: write failed: %u\n", argv[1], GetLastError());
+				result = 1;
+				break;
+			}
+		}
+	}
+
+	ULONG64 records = store.GetRecordCount();
+
+	if (!store.Close())
+		result = 1;
+
+	fprintf(stderr, "%I64u packets stored, %I64u other records skipped\n", records, skipped);
+
+	return result;
+}
+
+static void query_usage()
+{
+	fprintf(stderr,
+		"usage: hvtool query <store file> [--from <s>] [--to <s>] [--net <a.b.c.d/n>]\n"
+		"                    [--port <port>] [--vport <port ID>] [--count]\n");
+}
+
+int query_command(int argc, const char* argv[])
+{
+	StoreQuery query;
+	bool countOnly = false;
+
+	if (argc < 2) {
+		query_usage();
+		return 1;
+	}
+
+	for (int i = 2; i < argc; ++i) {
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!strcmp(argv[i], "--count")) {
+			countOnly = true;
+			continue;
+		}
+
+		if (!value) {
+			query_usage();
+			return 1;
+		}
+
+		if (!strcmp(argv[i], "--from")) {
+			query.bTime = true;
+			query.ullFrom = parse_time(value);
+			if (!query.ullTo)
+				query.ullTo = ~0ull;
+		} else if (!strcmp(argv[i], "--to")) {
+			query.bTime = true;
+			query.ullTo = parse_time(value);
+		} else if (!strcmp(argv[i], "--net")) {
+			query.bNetwork = parse_network(value, &query.ulNetwork, &query.ulPrefix);
+			if (!query.bNetwork) {
+				query_usage();
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--port")) {
+			ULONG port;
+
+			query.bPort = parse_unsigned(value, 0xFFFF, &port);
+			if (!query.bPort) {
+				query_usage();
+				return 1;
+			}
+
+			query.usPort = (USHORT)port;
+		} else if (!strcmp(argv[i], "--vport")) {
+			query.bPortId = parse_unsigned(value, 0xFFFFFFFF, &query.ulPortId);
+			if (!query.bPortId) {
+				query_usage();
+				return 1;
+			}
+		} else {
+			query_usage();
+			return 1;
+		}
+
+		++i;
+	}
+
+	ColumnStore store;
+
+	if (!store.Open(argv[1])) {
+		fprintf(stderr, "%s: not a column store\n", argv[1]);
+		return 1;
+	}
+
+	TextBuffer out(GetStdHandle(STD_OUTPUT_HANDLE));
+	BYTE* pMatch = new BYTE[STORE_BLOCK_RECORDS];
+	ULONG64 matches = 0, scanned = 0;
+	int result = 0;
+
+	for (ULONG64 index = 0; index < store.GetBlockCount(); ++index) {
+		const STORE_BLOCK* pBlock = store.GetBlock(index);
+
+		if (!pBlock) {
+			fprintf(stderr, "%s: could not read block %I64u: %u\n", argv[1], index, GetLastError());
+			result = 1;
+			break;
+		}
+
+		if (!ColumnStore::MayMatch(pBlock, query))
+			continue;
+
+		++scanned;
+
+		ULONG count = ColumnStore::Scan(pBlock, query, pMatch);
+
+		matches += count;
+
+		if (countOnly || !count)
+			continue;
+
+		//the matches are put back together as packet records
+		for (ULONG i = 0; i < pBlock->Header.RecordCount; ++i) {
+			if (!pMatch[i])
+				continue;
+
+			HV_RECORD_PACKET_DATA packet;
+
+			memset(&packet, 0, sizeof(packet));
+			packet.Header.PortId = pBlock->PortId[i];
+			packet.Header.Timestamp = pBlock->Timestamp[i];
+			packet.Direction = pBlock->Direction[i];
+			packet.IpProtocol = pBlock->IpProtocol[i];
+			packet.FrameLength = pBlock->FrameLength[i];
+			packet.SourceAddress = pBlock->SourceAddress[i];
+			packet.DestinationAddress = pBlock->DestinationAddress[i];
+			packet.SourcePort = pBlock->SourcePort[i];
+			packet.DestinationPort = pBlock->DestinationPort[i];
+
+			if (!out.Reserve()) {
+				result = 1;
+				break;
+			}
+
+			render_stored_packet(out, &packet);
+		}
+	}
+
+	if (!out.Flush())
+		result = 1;
+
+	delete[] pMatch;
+
+	if (countOnly)
+		printf("%I64u\n", matches);
+
+	fprintf(stderr, "%I64u matches, %I64u of %I64u blocks scanned\n", matches, scanned, store.GetBlockCount());
+
+	return result;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Windows.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+//
+// Arguments of hvtool query
+//
+
+//seconds, as dump prints them, to 100ns units
+inline ULONG64 parse_time(const char* text)
+{
+	return (ULONG64)(strtod(text, NULL) * 10000000.0 + 0.5);
+}
+
+//a.b.c.d or a.b.c.d/n; false if malformed
+inline bool parse_network(const char* text, ULONG* pNetwork, ULONG* pPrefix)
+{
+	ULONG a, b, c, d, prefix = 32;
+	int fields = sscanf_s(text, "%u.%u.%u.%u/%u", &a, &b, &c, &d, &prefix);
+
+	if (fields < 4 || a > 255 || b > 255 || c > 255 || d > 255 || prefix > 32)
+		return false;
+
+	*pNetwork = a << 24 | b << 16 | c << 8 | d;
+	*pPrefix = prefix;
+
+	return true;
+}
+
+//a decimal number up to max; false if malformed
+inline bool parse_unsigned(const char* text, ULONG max, ULONG* pValue)
+{
+	char* end = NULL;
+
+	errno = 0;
+
+	//strtoul takes a sign and wraps a negative number around
+	if (*text < '0' || *text > '9')
+		return false;
+
+	//compared before it is narrowed: unsigned long is 64 bits outside Windows
+	unsigned long value = strtoul(text, &end, 10);
+
+	if (errno == ERANGE || *end || value > max)
+		return false;
+
+	*pValue = (ULONG)value;
+
+	return true;
+}
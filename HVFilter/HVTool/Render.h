@@ -0,0 +1,11 @@
+#pragma once
+
+#include "TextBuffer.h"
+#include "../HVService/HVService/HVRecord.h"
+
+//one line of text for a record, as hvtool dump prints it
+void render_text(TextBuffer& out, const HV_RECORD_HEADER* pRecord);
+
+//the line of a packet put back together from a column store: without the
+//EtherType and the payload length, which the store does not keep
+void render_stored_packet(TextBuffer& out, const HV_RECORD_PACKET_DATA* pPacket);
@@ -0,0 +1,153 @@
+#include "TextBuffer.h"
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+//"0." to "255.": the dotted text of every octet, and its length with the dot
+struct Octet
+{
+	char	text[4];
+	ULONG	length;
+};
+
+static Octet octets[256];
+
+static void init_octets()
+{
+	for (ULONG i = 0; i < 256; ++i) {
+		char* p = octets[i].text;
+
+		if (i >= 100)
+			*p++ = (char)('0' + i / 100);
+		if (i >= 10)
+			*p++ = (char)('0' + i / 10 % 10);
+
+		*p++ = (char)('0' + i % 10);
+		*p++ = '.';
+
+		octets[i].length = (ULONG)(p - octets[i].text);
+	}
+}
+
+TextBuffer::TextBuffer(HANDLE hOutput)
+	: m_hOutput(hOutput),
+	m_bFailed(false)
+{
+	if (!octets[0].length)
+		init_octets();
+
+	m_pBuffer = new char[TEXT_BUFFER_LENGTH];
+	m_pos = m_pBuffer;
+}
+
+TextBuffer::~TextBuffer()
+{
+	Flush();
+
+	delete[] m_pBuffer;
+}
+
+bool TextBuffer::Reserve()
+{
+	if (m_pos - m_pBuffer > TEXT_BUFFER_LENGTH - TEXT_RECORD_MAX_LENGTH)
+		return Flush();
+
+	return !m_bFailed;
+}
+
+bool TextBuffer::Flush()
+{
+	const char* p = m_pBuffer;
+
+	while (!m_bFailed && p < m_pos) {
+		DWORD written = 0;
+
+		if (!WriteFile(m_hOutput, p, (DWORD)(m_pos - p), &written, NULL) || !written)
+			m_bFailed = true;
+
+		p += written;
+	}
+
+	m_pos = m_pBuffer;
+
+	return !m_bFailed;
+}
+
+void TextBuffer::PutUnsigned(ULONG64 value)
+{
+	char digits[20];
+	char* p = digits + sizeof(digits);
+
+	while (value >= 100) {
+		const char* pair = digit_pairs + (value % 100) * 2;
+
+		value /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+
+	if (value >= 10) {
+		const char* pair = digit_pairs + value * 2;
+
+		*--p = pair[1];
+		*--p = pair[0];
+	} else {
+		*--p = (char)('0' + value);
+	}
+
+	Put(p, digits + sizeof(digits) - p);
+}
+
+void TextBuffer::PutPadded(ULONG64 value, ULONG digits)
+{
+	for (ULONG i = digits; i > 0; --i) {
+		m_pos[i - 1] = (char)('0' + value % 10);
+		value /= 10;
+	}
+
+	m_pos += digits;
+}
+
+void TextBuffer::PutHex(ULONG value, ULONG digits)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	for (ULONG i = digits; i > 0; --i) {
+		m_pos[i - 1] = hex[value & 0xF];
+		value >>= 4;
+	}
+
+	m_pos += digits;
+}
+
+void TextBuffer::PutAddress(ULONG address)
+{
+	const BYTE* bytes = (const BYTE*)&address;
+
+	for (int i = 0; i < 4; ++i) {
+		const Octet& octet = octets[bytes[i]];
+
+		//all 4 bytes are copied; only the used ones are kept
+		memcpy(m_pos, octet.text, sizeof(octet.text));
+		m_pos += octet.length;
+	}
+
+	//no dot after the last octet
+	--m_pos;
+}
+
+void TextBuffer::PutTimestamp(ULONG64 timestamp)
+{
+	PutUnsigned(timestamp / 10000000);
+	Put('.');
+	PutPadded(timestamp % 10000000, 7);
+}
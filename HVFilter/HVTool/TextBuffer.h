@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Windows.h>
+
+//size of the output buffer; it is written out in one piece when nearly full
+#define TEXT_BUFFER_LENGTH (1024 * 1024)
+
+//room a caller can count on after Reserve: the longest text of any record,
+//a 64KB histogram of 20 digit buckets
+#define TEXT_RECORD_MAX_LENGTH (256 * 1024)
+
+//
+// Text output without the CRT formatting: numbers are converted two digits at
+// a time and IPv4 octets come from a table, into a large buffer that goes to
+// the output handle in big writes
+//
+class TextBuffer
+{
+public:
+	TextBuffer(HANDLE hOutput);
+	~TextBuffer();
+
+	//makes room for a record; false once a write to the output has failed
+	bool Reserve();
+	bool Flush();
+
+	void Put(char c) { *m_pos++ = c; }
+	void Put(const char* s, size_t length) { memcpy(m_pos, s, length); m_pos += length; }
+	void Put(const char* s) { Put(s, strlen(s)); }
+
+	void PutUnsigned(ULONG64 value);
+
+	//value with leading zeros, digits long
+	void PutPadded(ULONG64 value, ULONG digits);
+	void PutHex(ULONG value, ULONG digits);
+
+	//address in network byte order, dotted
+	void PutAddress(ULONG address);
+
+	//port in network byte order
+	void PutPort(USHORT port) { PutUnsigned(_byteswap_ushort(port)); }
+
+	//100ns units: seconds and 7 decimals
+	void PutTimestamp(ULONG64 timestamp);
+
+private:
+	HANDLE	m_hOutput;
+	char*	m_pBuffer;
+	char*	m_pos;
+	bool	m_bFailed;
+};
@@ -0,0 +1,631 @@
+#include "Commands.h"
+#include "TopSource.h"
+#include "TextBuffer.h"
+
+#include <conio.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+//
+// hvtool top: the rates of every vPort and of the busiest flows, refreshed in
+// place up to 100 times a second.  Rates are exponentially weighted moving
+// averages on the clock of the source, whose weight follows the time between
+// two samples, so the smoothing does not depend on the sampling interval.
+// Only the lines that changed since the previous screen are written again.
+//
+
+#define TOP_DEFAULT_INTERVAL_MS 100
+#define TOP_MIN_INTERVAL_MS 10
+#define TOP_DEFAULT_SMOOTHING 1.0
+#define TOP_DEFAULT_FLOWS 10
+#define TOP_MAX_PORT_ROWS 16
+#define TOP_LINE_LENGTH 160
+
+//IP protocol numbers, without the socket headers
+#define TOP_PROTOCOL_ICMP 1
+#define TOP_PROTOCOL_TCP 6
+#define TOP_PROTOCOL_UDP 17
+
+//a vPort or flow that went quiet is forgotten once its rate decays below this, in bytes per second
+#define TOP_EVICT_BYTES_RATE 1.0
+
+//the console of the SDK this builds with may not know it yet
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+namespace
+{
+	//per second
+	struct TopRate
+	{
+		double	frames;
+		double	bytes;
+	};
+
+	struct PortRow
+	{
+		ULONG	portId;
+		TopRate	direction[HV_STATS_DIRECTIONS];
+		bool	bSeen;
+	};
+
+	struct FlowRow
+	{
+		const TopFlowKey*	pKey;
+		TopRate				rate;
+	};
+
+	volatile LONG g_stop = 0;
+
+	//
+	// The lines of a screen, written where they differ from what is shown.  On a
+	// console without escape sequences (or when the output is not a console)
+	// every screen is written in full, after the previous one.
+	//
+	class TopScreen
+	{
+	public:
+		TopScreen(HANDLE hOutput)
+			: m_hOutput(hOutput),
+			m_out(hOutput),
+			m_count(0),
+			m_mode(0),
+			m_bVirtual(false)
+		{
+		}
+
+		void Start();
+		void Stop();
+
+		//starts a new screen
+		void Begin() { m_count = 0; }
+		void Add(const char* text);
+
+		//false once the output is gone
+		bool Present();
+
+	private:
+		void PutCursor(size_t row);
+
+		HANDLE						m_hOutput;
+		TextBuffer					m_out;
+		std::vector<std::string>	m_next;
+		std::vector<std::string>	m_shown;
+		size_t						m_count;
+		DWORD						m_mode;
+		bool						m_bVirtual;
+	};
+
+	class TopView
+	{
+	public:
+		//smoothing is the time constant of the averages, in seconds
+		TopView(double smoothing) : m_smoothing(smoothing) {}
+
+		//folds in what the source counted over the last seconds
+		void Update(const TopSample& sample, double seconds);
+
+		void Render(TopScreen& screen, bool bFlows, ULONG flows);
+
+		size_t GetFlowCount() const { return m_flows.size(); }
+
+	private:
+		double										m_smoothing;
+		std::vector<PortRow>						m_ports;
+		std::unordered_map<TopFlowKey, TopRate, TopFlowKeyHash> m_flows;
+
+		//reused by every Render
+		std::vector<FlowRow>						m_order;
+	};
+}
+
+void TopScreen::Start()
+{
+	if (GetConsoleMode(m_hOutput, &m_mode) && SetConsoleMode(m_hOutput, m_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+		m_bVirtual = true;
+
+		//hides the cursor and clears the screen
+		m_out.Put("\x1b[?25l\x1b[H\x1b[2J");
+		m_out.Flush();
+	}
+}
+
+void TopScreen::Stop()
+{
+	if (!m_bVirtual)
+		return;
+
+	//leaves the last screen up, with the cursor under it
+	PutCursor(m_shown.size());
+	m_out.Put("\x1b[?25h");
+	m_out.Flush();
+
+	SetConsoleMode(m_hOutput, m_mode);
+}
+
+void TopScreen::Add(const char* text)
+{
+	if (m_count == m_next.size())
+		m_next.push_back(std::string());
+
+	//keeps the capacity of the string
+	m_next[m_count++].assign(text);
+}
+
+void TopScreen::PutCursor(size_t row)
+{
+	m_out.Put("\x1b[");
+	m_out.PutUnsigned(row + 1);
+	m_out.Put(";1H");
+}
+
+bool TopScreen::Present()
+{
+	if (!m_out.Reserve())
+		return false;
+
+	if (!m_bVirtual) {
+		for (size_t i = 0; i < m_count; ++i) {
+			m_out.Put(m_next[i].c_str(), m_next[i].size());
+			m_out.Put('\n');
+		}
+
+		m_out.Put('\n');
+
+		return m_out.Flush();
+	}
+
+	if (m_shown.size() < m_count)
+		m_shown.resize(m_count);
+
+	for (size_t i = 0; i < m_count; ++i) {
+		if (m_shown[i] == m_next[i])
+			continue;
+
+		//the rest of the old line is erased
+		PutCursor(i);
+		m_out.Put(m_next[i].c_str(), m_next[i].size());
+		m_out.Put("\x1b[K");
+
+		m_shown[i].assign(m_next[i]);
+	}
+
+	//and the lines the screen does not have any more
+	if (m_count < m_shown.size()) {
+		PutCursor(m_count);
+		m_out.Put("\x1b[J");
+
+		m_shown.resize(m_count);
+	}
+
+	return m_out.Flush();
+}
+
+void TopView::Update(const TopSample& sample, double seconds)
+{
+	//the weight of the new rates, for however long it has been since the previous sample
+	double alpha = m_smoothing > 0 ? 1.0 - exp(-seconds / m_smoothing) : 1.0;
+	double keep = 1.0 - alpha;
+	double weight = alpha / seconds;
+
+	for (size_t i = 0; i < m_ports.size(); ++i) {
+		for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+			m_ports[i].direction[direction].frames *= keep;
+			m_ports[i].direction[direction].bytes *= keep;
+		}
+
+		m_ports[i].bSeen = false;
+	}
+
+	for (size_t i = 0; i < sample.ports.size(); ++i) {
+		const TopPortDelta& delta = sample.ports[i];
+		PortRow* pRow = NULL;
+
+		for (size_t j = 0; j < m_ports.size(); ++j) {
+			if (m_ports[j].portId == delta.portId) {
+				pRow = &m_ports[j];
+				break;
+			}
+		}
+
+		if (!pRow) {
+			PortRow row;
+
+			memset(&row, 0, sizeof(row));
+			row.portId = delta.portId;
+			m_ports.push_back(row);
+			pRow = &m_ports.back();
+		}
+
+		for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+			pRow->direction[direction].frames += weight * delta.direction[direction].frames;
+			pRow->direction[direction].bytes += weight * delta.direction[direction].bytes;
+		}
+
+		pRow->bSeen = true;
+	}
+
+	//the vPorts the source stopped reporting fade out
+	size_t kept = 0;
+
+	for (size_t i = 0; i < m_ports.size(); ++i) {
+		const PortRow& row = m_ports[i];
+
+		if (row.bSeen || row.direction[HV_STATS_DIRECTION_INBOUND].bytes + row.direction[HV_STATS_DIRECTION_OUTBOUND].bytes >= TOP_EVICT_BYTES_RATE)
+			m_ports[kept++] = row;
+	}
+
+	m_ports.resize(kept);
+
+	//a flow that comes back below is added again
+	for (std::unordered_map<TopFlowKey, TopRate, TopFlowKeyHash>::iterator it = m_flows.begin(); it != m_flows.end();) {
+		it->second.frames *= keep;
+		it->second.bytes *= keep;
+
+		if (it->second.bytes < TOP_EVICT_BYTES_RATE)
+			it = m_flows.erase(it);
+		else
+			++it;
+	}
+
+	for (size_t i = 0; i < sample.flows.size(); ++i) {
+		const TopFlowDelta& delta = sample.flows[i];
+		TopRate& rate = m_flows[delta.key];
+
+		rate.frames += weight * delta.traffic.frames;
+		rate.bytes += weight * delta.traffic.bytes;
+	}
+}
+
+//a rate in 5 significant characters and a unit: "999.9K"
+static void format_rate(char* text, size_t length, double value)
+{
+	static const char units[] = " KMGTP";
+	int unit = 0;
+
+	while (value >= 999.95 && unit < 5) {
+		value /= 1000.0;
+		++unit;
+	}
+
+	sprintf_s(text, length, "%5.1f%c", value, units[unit]);
+}
+
+static void format_port_id(char* text, size_t length, ULONG portId)
+{
+	if (portId == HV_STATS_UNKNOWN_PORT_ID)
+		strcpy_s(text, length, "unknown");
+	else
+		sprintf_s(text, length, "%u", portId);
+}
+
+//address and port in network byte order; no port for the protocols without one
+static void format_endpoint(char* text, size_t length, ULONG address, USHORT port, UCHAR protocol)
+{
+	const BYTE* bytes = (const BYTE*)&address;
+
+	if (protocol == TOP_PROTOCOL_TCP || protocol == TOP_PROTOCOL_UDP)
+		sprintf_s(text, length, "%u.%u.%u.%u:%u", bytes[0], bytes[1], bytes[2], bytes[3], _byteswap_ushort(port));
+	else
+		sprintf_s(text, length, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+}
+
+static void format_protocol(char* text, size_t length, UCHAR protocol)
+{
+	switch (protocol) {
+	case TOP_PROTOCOL_TCP:	strcpy_s(text, length, "tcp"); break;
+	case TOP_PROTOCOL_UDP:	strcpy_s(text, length, "udp"); break;
+	case TOP_PROTOCOL_ICMP:	strcpy_s(text, length, "icmp"); break;
+	case 0:				strcpy_s(text, length, "-"); break;
+	default:			sprintf_s(text, length, "%u", protocol); break;
+	}
+}
+
+static bool port_busier(const PortRow& a, const PortRow& b)
+{
+	double aBytes = a.direction[HV_STATS_DIRECTION_INBOUND].bytes + a.direction[HV_STATS_DIRECTION_OUTBOUND].bytes;
+	double bBytes = b.direction[HV_STATS_DIRECTION_INBOUND].bytes + b.direction[HV_STATS_DIRECTION_OUTBOUND].bytes;
+
+	if (aBytes != bBytes)
+		return aBytes > bBytes;
+
+	return a.portId < b.portId;
+}
+
+static bool flow_busier(const FlowRow& a, const FlowRow& b)
+{
+	return a.rate.bytes > b.rate.bytes;
+}
+
+void TopView::Render(TopScreen& screen, bool bFlows, ULONG flows)
+{
+	char line[TOP_LINE_LENGTH];
+	char name[16], inFrames[16], inBits[16], outFrames[16], outBits[16];
+
+	screen.Add("");
+	sprintf_s(line, sizeof(line), "  %-10s %12s %12s %12s %12s", "vPort", "in frames/s", "in bits/s", "out frames/s", "out bits/s");
+	screen.Add(line);
+
+	std::sort(m_ports.begin(), m_ports.end(), port_busier);
+
+	for (size_t i = 0; i < m_ports.size() && i < TOP_MAX_PORT_ROWS; ++i) {
+		const PortRow& row = m_ports[i];
+
+		format_port_id(name, sizeof(name), row.portId);
+		format_rate(inFrames, sizeof(inFrames), row.direction[HV_STATS_DIRECTION_INBOUND].frames);
+		format_rate(inBits, sizeof(inBits), row.direction[HV_STATS_DIRECTION_INBOUND].bytes * 8.0);
+		format_rate(outFrames, sizeof(outFrames), row.direction[HV_STATS_DIRECTION_OUTBOUND].frames);
+		format_rate(outBits, sizeof(outBits), row.direction[HV_STATS_DIRECTION_OUTBOUND].bytes * 8.0);
+
+		sprintf_s(line, sizeof(line), "  %-10s %12s %12s %12s %12s", name, inFrames, inBits, outFrames, outBits);
+		screen.Add(line);
+	}
+
+	if (m_ports.size() > TOP_MAX_PORT_ROWS) {
+		sprintf_s(line, sizeof(line), "  (%u more)", (ULONG)(m_ports.size() - TOP_MAX_PORT_ROWS));
+		screen.Add(line);
+	}
+
+	screen.Add("");
+
+	if (!bFlows) {
+		screen.Add("  no flows from this source");
+		return;
+	}
+
+	sprintf_s(line, sizeof(line), "  %-10s %-5s %-21s %-21s %12s %12s", "vPort", "proto", "source", "destination", "frames/s", "bits/s");
+	screen.Add(line);
+
+	//only the busiest are put in order
+	m_order.clear();
+
+	for (std::unordered_map<TopFlowKey, TopRate, TopFlowKeyHash>::const_iterator it = m_flows.begin(); it != m_flows.end(); ++it) {
+		FlowRow row;
+
+		row.pKey = &it->first;
+		row.rate = it->second;
+		m_order.push_back(row);
+	}
+
+	size_t count = min((size_t)flows, m_order.size());
+
+	std::partial_sort(m_order.begin(), m_order.begin() + count, m_order.end(), flow_busier);
+
+	for (size_t i = 0; i < count; ++i) {
+		const TopFlowKey& key = *m_order[i].pKey;
+		char protocol[8], source[24], destination[24];
+
+		format_port_id(name, sizeof(name), key.portId);
+		format_protocol(protocol, sizeof(protocol), key.protocol);
+		format_endpoint(source, sizeof(source), key.sourceAddress, key.sourcePort, key.protocol);
+		format_endpoint(destination, sizeof(destination), key.destinationAddress, key.destinationPort, key.protocol);
+		format_rate(inFrames, sizeof(inFrames), m_order[i].rate.frames);
+		format_rate(inBits, sizeof(inBits), m_order[i].rate.bytes * 8.0);
+
+		sprintf_s(line, sizeof(line), "  %-10s %-5s %-21s %-21s %12s %12s", name, protocol, source, destination, inFrames, inBits);
+		screen.Add(line);
+	}
+}
+
+static BOOL WINAPI top_ctrl_handler(DWORD)
+{
+	InterlockedExchange(&g_stop, 1);
+	return TRUE;
+}
+
+//user and kernel time of the tool, in 100ns units
+static ULONG64 process_time()
+{
+	FILETIME creation, exit, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0;
+
+	return ((ULONG64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+		((ULONG64)user.dwHighDateTime << 32 | user.dwLowDateTime);
+}
+
+static void top_usage()
+{
+	fprintf(stderr,
+		"usage: hvtool top [--interval <ms>] [--smooth <s>] [--flows <n>]\n"
+		"                  [--speed <n|max> <segment file>...]\n\n"
+		"  without segment files the rates come from the counters page of the driver;\n"
+		"  with them, from their packet records replayed at --speed (1 by default)\n");
+}
+
+int top_command(int argc, const char* argv[])
+{
+	ULONG interval = TOP_DEFAULT_INTERVAL_MS;
+	double smoothing = TOP_DEFAULT_SMOOTHING;
+	ULONG flows = TOP_DEFAULT_FLOWS;
+	double speed = 1.0;
+	int first = argc;
+
+	for (int i = 1; i < argc; ++i) {
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		//the segment files come last
+		if (strncmp(argv[i], "--", 2)) {
+			first = i;
+			break;
+		}
+
+		if (!value) {
+			top_usage();
+			return 1;
+		}
+
+		if (!strcmp(argv[i], "--interval")) {
+			interval = strtoul(value, NULL, 10);
+		} else if (!strcmp(argv[i], "--smooth")) {
+			smoothing = strtod(value, NULL);
+		} else if (!strcmp(argv[i], "--flows")) {
+			flows = strtoul(value, NULL, 10);
+		} else if (!strcmp(argv[i], "--speed")) {
+			speed = strcmp(value, "max") ? strtod(value, NULL) : 0.0;
+			if (speed < 0) {
+				top_usage();
+				return 1;
+			}
+		} else {
+			top_usage();
+			return 1;
+		}
+
+		++i;
+	}
+
+	if (interval < TOP_MIN_INTERVAL_MS)
+		interval = TOP_MIN_INTERVAL_MS;
+
+	if (smoothing < 0)
+		smoothing = 0;
+
+	bool bReplay = first < argc;
+	TopSource* pSource;
+
+	if (bReplay) {
+		ReplaySource* pReplay = new ReplaySource(speed, (ULONG64)interval * 10000);
+
+		pSource = pReplay;
+
+		if (!pReplay->Open(argc - first, argv + first)) {
+			delete pSource;
+			return 1;
+		}
+	} else {
+		CountersSource* pCounters = new CountersSource;
+
+		pSource = pCounters;
+
+		if (!pCounters->Open()) {
+			fprintf(stderr, "could not map the counters page of the driver: %u\n", GetLastError());
+			delete pSource;
+			return 1;
+		}
+	}
+
+	SetConsoleCtrlHandler(top_ctrl_handler, TRUE);
+
+	//Sleep to the millisecond, or 10ms intervals come out every 15.6ms
+	timeBeginPeriod(1);
+
+	TopScreen screen(GetStdHandle(STD_OUTPUT_HANDLE));
+	TopView view(smoothing);
+	TopSample sample;
+	LARGE_INTEGER frequency, start, now, next, cpuWall;
+	ULONG64 firstTime = 0, lastTime = 0, cpuTime = process_time();
+	LONG64 step;
+	bool bStarted = false, bEnded = false, bFailed = false;
+	double cpu = 0;
+	char line[TOP_LINE_LENGTH];
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	step = frequency.QuadPart * interval / 1000;
+	next = cpuWall = start;
+
+	screen.Start();
+
+	while (!g_stop) {
+		if (!pSource->Sample(sample)) {
+			bEnded = true;
+			break;
+		}
+
+		if (!bStarted) {
+			bStarted = true;
+			firstTime = lastTime = sample.time;
+		} else if (sample.time > lastTime) {
+			view.Update(sample, (sample.time - lastTime) / 10000000.0);
+			lastTime = sample.time;
+		}
+
+		QueryPerformanceCounter(&now);
+
+		//at most speed the samples come as fast as the source gives them, the screens do not
+		if (now.QuadPart >= next.QuadPart) {
+			//the share of a processor the tool used, over the last second
+			if (now.QuadPart - cpuWall.QuadPart >= frequency.QuadPart) {
+				ULONG64 time = process_time();
+
+				cpu = (time - cpuTime) / 100000.0 / ((double)(now.QuadPart - cpuWall.QuadPart) / frequency.QuadPart);
+				cpuTime = time;
+				cpuWall = now;
+			}
+
+			sprintf_s(line, sizeof(line), "hvtool top - %s   elapsed %.2fs   interval %ums   smoothing %gs   %u flows   cpu %.1f%%",
+				pSource->Describe(), (lastTime - firstTime) / 10000000.0, interval, smoothing,
+				(ULONG)view.GetFlowCount(), cpu);
+
+			screen.Begin();
+			screen.Add(line);
+			view.Render(screen, pSource->HasFlows(), flows);
+
+			if (!screen.Present()) {
+				bFailed = true;
+				break;
+			}
+
+			//a late screen does not make the next ones come faster
+			next.QuadPart += step;
+			if (next.QuadPart < now.QuadPart)
+				next.QuadPart = now.QuadPart + step;
+
+			while (_kbhit()) {
+				int c = _getch();
+
+				if (c == 'q' || c == 'Q')
+					InterlockedExchange(&g_stop, 1);
+			}
+		}
+
+		if (bReplay && speed == 0)
+			continue;
+
+		QueryPerformanceCounter(&now);
+
+		if (next.QuadPart > now.QuadPart)
+			Sleep((DWORD)(((next.QuadPart - now.QuadPart) * 1000 + frequency.QuadPart - 1) / frequency.QuadPart));
+	}
+
+	//the final rates of a replay stay on the screen
+	if (bEnded && bReplay && !bFailed) {
+		sprintf_s(line, sizeof(line), "hvtool top - %s   elapsed %.2fs   end of the segments",
+			pSource->Describe(), (lastTime - firstTime) / 10000000.0);
+
+		screen.Begin();
+		screen.Add(line);
+		view.Render(screen, pSource->HasFlows(), flows);
+		screen.Present();
+	}
+
+	screen.Stop();
+
+	timeEndPeriod(1);
+
+	int result = bFailed ? 1 : 0;
+
+	if (bReplay) {
+		double seconds = (double)(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+		ULONG64 records = ((ReplaySource*)pSource)->GetRecordCount();
+
+		fprintf(stderr, "%I64u packet records replayed in %.3fs (%.0f records/s)\n",
+			records, seconds, seconds > 0 ? records / seconds : 0.0);
+	} else if (bEnded) {
+		fprintf(stderr, "the counters page could not be read: %u\n", GetLastError());
+		result = 1;
+	}
+
+	delete pSource;
+
+	return result;
+}
@@ -0,0 +1,280 @@
+#include "TopSource.h"
+#include "../HVService/HVService/Stuff.h"
+
+#include <cstdio>
+
+//attempts at a consistent snapshot before a poll gives up and reports nothing new
+#define COUNTERS_SNAPSHOT_ATTEMPTS 64
+
+CountersSource::CountersSource()
+	: m_hControl(INVALID_HANDLE_VALUE),
+	m_pPage(NULL),
+	m_bHaveLast(false)
+{
+}
+
+CountersSource::~CountersSource()
+{
+	if (m_hControl == INVALID_HANDLE_VALUE)
+		return;
+
+	//closing the handle would unmap the view too
+	if (m_pPage) {
+		DWORD bytes;
+		DeviceIoControl(m_hControl, OSR_COMM_CONTROL_UNMAP_COUNTERS, NULL, 0, NULL, 0, &bytes, NULL);
+	}
+
+	CloseHandle(m_hControl);
+}
+
+bool CountersSource::Open()
+{
+	HV_COUNTERS_MAPPING mapping;
+	DWORD bytes = 0;
+
+	m_hControl = CreateFileA("\\\\.\\OSRMSPassthroughExtControl", GENERIC_READ|GENERIC_WRITE,
+		0, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (m_hControl == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!DeviceIoControl(m_hControl, OSR_COMM_CONTROL_MAP_COUNTERS, NULL, 0, &mapping, sizeof(mapping), &bytes, NULL))
+		return false;
+
+	if (bytes < sizeof(mapping) || mapping.Length < sizeof(HV_COUNTERS_PAGE)) {
+		SetLastError(ERROR_REVISION_MISMATCH);
+		return false;
+	}
+
+	m_pPage = (const HV_COUNTERS_PAGE*)(ULONG_PTR)mapping.Address;
+
+	return true;
+}
+
+//totals of a slot since the previous snapshot; all of them if the slot was bound again since
+static TopTraffic counter_delta(const HV_COUNTER& current, const HV_COUNTER& previous, bool rebound)
+{
+	TopTraffic delta;
+
+	if (rebound || current.Frames < previous.Frames || current.Bytes < previous.Bytes) {
+		delta.frames = current.Frames;
+		delta.bytes = current.Bytes;
+	} else {
+		delta.frames = current.Frames - previous.Frames;
+		delta.bytes = current.Bytes - previous.Bytes;
+	}
+
+	return delta;
+}
+
+bool CountersSource::Sample(TopSample& sample)
+{
+	HV_COUNTERS_PAGE snapshot;
+
+	sample.ports.clear();
+	sample.flows.clear();
+
+	//nothing new if the driver kept the page busy: the next poll gets it all
+	if (!HvCountersSnapshot(m_pPage, &snapshot, COUNTERS_SNAPSHOT_ATTEMPTS)) {
+		sample.time = m_bHaveLast ? m_last.Timestamp : 0;
+		return true;
+	}
+
+	if (snapshot.Version != HV_COUNTERS_VERSION || snapshot.PortCount > HV_STATS_PORT_SLOTS) {
+		SetLastError(ERROR_REVISION_MISMATCH);
+		return false;
+	}
+
+	sample.time = snapshot.Timestamp;
+
+	//the first snapshot is only what the next ones are measured against
+	if (m_bHaveLast) {
+		for (ULONG slot = 0; slot < snapshot.PortCount; ++slot) {
+			const HV_COUNTERS_PORT& current = snapshot.Ports[slot];
+			const HV_COUNTERS_PORT& previous = m_last.Ports[slot];
+			bool rebound = current.PortId != previous.PortId;
+			TopPortDelta port;
+
+			if (!current.InUse)
+				continue;
+
+			port.portId = current.PortId;
+
+			for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction)
+				port.direction[direction] = counter_delta(current.Direction[direction], previous.Direction[direction], rebound);
+
+			//the unknown slot is only shown while it sees traffic
+			if (slot == HV_STATS_UNKNOWN_PORT_SLOT &&
+				!port.direction[HV_STATS_DIRECTION_INBOUND].frames && !port.direction[HV_STATS_DIRECTION_OUTBOUND].frames)
+				continue;
+
+			sample.ports.push_back(port);
+		}
+	}
+
+	m_last = snapshot;
+	m_bHaveLast = true;
+
+	return true;
+}
+
+ReplaySource::ReplaySource(double speed, ULONG64 interval)
+	: m_file(0),
+	m_pPending(NULL),
+	m_speed(speed),
+	m_interval(interval),
+	m_bStarted(false),
+	m_clock(0),
+	m_origin(0),
+	m_records(0)
+{
+	QueryPerformanceFrequency(&m_frequency);
+
+	if (speed > 0)
+		sprintf_s(m_description, sizeof(m_description), "replay at %gx", speed);
+	else
+		sprintf_s(m_description, sizeof(m_description), "replay at most speed");
+}
+
+ReplaySource::~ReplaySource()
+{
+	for (size_t i = 0; i < m_files.size(); ++i)
+		delete m_files[i];
+}
+
+bool ReplaySource::Open(int count, const char* paths[])
+{
+	for (int i = 0; i < count; ++i) {
+		CaptureFile* pFile = new CaptureFile;
+
+		if (!pFile->Open(paths[i])) {
+			fprintf(stderr, "%s: not a capture segment\n", paths[i]);
+			delete pFile;
+			return false;
+		}
+
+		m_files.push_back(pFile);
+	}
+
+	return true;
+}
+
+const HV_RECORD_PACKET_DATA* ReplaySource::Peek()
+{
+	while (!m_pPending && m_file < m_files.size()) {
+		const HV_RECORD_HEADER* pRecord = m_files[m_file]->Next();
+
+		if (!pRecord) {
+			//done with the segment: its view is not needed any more
+			m_files[m_file++]->Close();
+			continue;
+		}
+
+		//flows, counters and the rest were not seen frame by frame
+		if (pRecord->Type == HV_RECORD_PACKET && HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, DestinationPort))
+			m_pPending = (const HV_RECORD_PACKET_DATA*)pRecord;
+	}
+
+	return m_pPending;
+}
+
+void ReplaySource::Account(const HV_RECORD_PACKET_DATA* pPacket)
+{
+	ULONG direction = pPacket->Direction == HV_STATS_DIRECTION_INBOUND ? HV_STATS_DIRECTION_INBOUND : HV_STATS_DIRECTION_OUTBOUND;
+	TopPortDelta* pPort = NULL;
+
+	//a handful of vPorts: a scan is cheaper than a hash
+	for (size_t i = 0; i < m_ports.size(); ++i) {
+		if (m_ports[i].portId == pPacket->Header.PortId) {
+			pPort = &m_ports[i];
+			break;
+		}
+	}
+
+	if (!pPort) {
+		TopPortDelta port;
+
+		memset(&port, 0, sizeof(port));
+		port.portId = pPacket->Header.PortId;
+		m_ports.push_back(port);
+		pPort = &m_ports.back();
+	}
+
+	++pPort->direction[direction].frames;
+	pPort->direction[direction].bytes += pPacket->FrameLength;
+
+	TopFlowKey key;
+
+	key.portId = pPacket->Header.PortId;
+	key.sourceAddress = pPacket->SourceAddress;
+	key.destinationAddress = pPacket->DestinationAddress;
+	key.sourcePort = pPacket->SourcePort;
+	key.destinationPort = pPacket->DestinationPort;
+	key.protocol = pPacket->IpProtocol;
+
+	TopTraffic& flow = m_flows[key];
+
+	++flow.frames;
+	flow.bytes += pPacket->FrameLength;
+
+	++m_records;
+}
+
+bool ReplaySource::Sample(TopSample& sample)
+{
+	const HV_RECORD_PACKET_DATA* pPacket = Peek();
+
+	sample.ports.clear();
+	sample.flows.clear();
+
+	if (!pPacket)
+		return false;
+
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	//the clock starts at the first record, and is paced from the first poll on;
+	//like the first snapshot of the counters page, the first sample is only a baseline
+	if (!m_bStarted) {
+		m_bStarted = true;
+		m_origin = m_clock = pPacket->Header.Timestamp;
+		m_wallOrigin = now;
+		sample.time = m_clock;
+		return true;
+	}
+
+	if (m_speed > 0) {
+		double elapsed = (double)(now.QuadPart - m_wallOrigin.QuadPart) / m_frequency.QuadPart;
+
+		m_clock = m_origin + (ULONG64)(elapsed * m_speed * 10000000.0);
+	} else {
+		//nothing to wait for: idle stretches of the recording are skipped
+		m_clock += m_interval;
+		if (pPacket->Header.Timestamp > m_clock)
+			m_clock = pPacket->Header.Timestamp;
+	}
+
+	m_ports.clear();
+
+	for (; pPacket && pPacket->Header.Timestamp <= m_clock; pPacket = Peek()) {
+		Account(pPacket);
+		m_pPending = NULL;
+	}
+
+	sample.time = m_clock;
+	sample.ports = m_ports;
+	sample.flows.reserve(m_flows.size());
+
+	for (std::unordered_map<TopFlowKey, TopTraffic, TopFlowKeyHash>::const_iterator it = m_flows.begin(); it != m_flows.end(); ++it) {
+		TopFlowDelta flow;
+
+		flow.key = it->first;
+		flow.traffic = it->second;
+		sample.flows.push_back(flow);
+	}
+
+	m_flows.clear();
+
+	return true;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "CaptureFile.h"
+#include "../HVService/HVService/HVStats.h"
+#include "../HVService/HVService/HVCounters.h"
+
+#include <unordered_map>
+#include <vector>
+
+//
+// Where hvtool top gets its numbers from.  A source is polled once per screen
+// update and hands back what it counted since the previous poll, stamped with
+// its own clock: the driver clock for the counters page, the record timestamps
+// for a replay.  Rates are computed on that clock, so a late poll or a replay
+// at 8x speed still shows the rates of the traffic itself.
+//
+
+struct TopTraffic
+{
+	ULONG64	frames;
+	ULONG64	bytes;
+};
+
+struct TopPortDelta
+{
+	ULONG		portId;
+	TopTraffic	direction[HV_STATS_DIRECTIONS];
+};
+
+//addresses and ports in network byte order, as in HV_RECORD_PACKET_DATA
+struct TopFlowKey
+{
+	ULONG	portId;
+	ULONG	sourceAddress;
+	ULONG	destinationAddress;
+	USHORT	sourcePort;
+	USHORT	destinationPort;
+	UCHAR	protocol;
+
+	bool operator==(const TopFlowKey& other) const
+	{
+		return portId == other.portId && sourceAddress == other.sourceAddress &&
+			destinationAddress == other.destinationAddress && sourcePort == other.sourcePort &&
+			destinationPort == other.destinationPort && protocol == other.protocol;
+	}
+};
+
+struct TopFlowKeyHash
+{
+	size_t operator()(const TopFlowKey& key) const
+	{
+		ULONG64 h = (ULONG64)key.sourceAddress << 32 | key.destinationAddress;
+
+		h ^= ((ULONG64)key.sourcePort << 24 | (ULONG64)key.destinationPort << 8 | key.protocol) * 0x9E3779B97F4A7C15ull;
+		h ^= (ULONG64)key.portId * 0xC2B2AE3D27D4EB4Full;
+		h ^= h >> 29;
+
+		return (size_t)h;
+	}
+};
+
+struct TopFlowDelta
+{
+	TopFlowKey	key;
+	TopTraffic	traffic;
+};
+
+struct TopSample
+{
+	//clock of the source, in 100ns units
+	ULONG64						time;
+
+	std::vector<TopPortDelta>	ports;
+	std::vector<TopFlowDelta>	flows;
+};
+
+class TopSource
+{
+public:
+	virtual ~TopSource() {}
+
+	//what was counted since the previous call; false once the source is exhausted or broken
+	virtual bool Sample(TopSample& sample) = 0;
+
+	//whether the samples carry flows at all
+	virtual bool HasFlows() const = 0;
+
+	//one line about the source, for the top of the screen
+	virtual const char* Describe() const = 0;
+};
+
+//
+// The read-only counters page of the driver (HVCounters.h): per vPort totals,
+// read without a system call.  The page has no flows.  The handle it is mapped
+// through is a control device handle; it never asks for data requests, so it
+// does not keep the data device active once the service is gone.
+//
+class CountersSource : public TopSource
+{
+public:
+	CountersSource();
+	~CountersSource();
+
+	//false with the last error set if the driver is not there or refused the mapping
+	bool Open();
+
+	virtual bool Sample(TopSample& sample);
+	virtual bool HasFlows() const { return false; }
+	virtual const char* Describe() const { return "driver counters"; }
+
+private:
+	HANDLE					m_hControl;
+	const HV_COUNTERS_PAGE*	m_pPage;
+
+	//the previous snapshot, which the deltas are taken against
+	HV_COUNTERS_PAGE		m_last;
+	bool					m_bHaveLast;
+};
+
+//
+// Packet records of capture segments (capture-NNNNNN.hvr), replayed at a
+// multiple of the speed they were recorded at: every Sample consumes the
+// records up to where the replay clock has come.  At most speed the clock
+// moves one sampling interval per Sample instead, as fast as the caller polls,
+// and jumps over the stretches without a record.  Only the frames the capture
+// kept are counted: the rates are those of the capture, sampling included.
+//
+class ReplaySource : public TopSource
+{
+public:
+	//speed is the multiple of real time, 0 for as fast as possible;
+	//interval is the sampling interval of the caller, in 100ns units
+	ReplaySource(double speed, ULONG64 interval);
+	~ReplaySource();
+
+	//the segments, in order; false if one is not a capture segment
+	bool Open(int count, const char* paths[]);
+
+	virtual bool Sample(TopSample& sample);
+	virtual bool HasFlows() const { return true; }
+	virtual const char* Describe() const { return m_description; }
+
+	//packet records consumed so far
+	ULONG64 GetRecordCount() const { return m_records; }
+
+private:
+	//the next packet record, from the next segment at the end of one; NULL at the end
+	const HV_RECORD_PACKET_DATA* Peek();
+
+	void Account(const HV_RECORD_PACKET_DATA* pPacket);
+
+	std::vector<CaptureFile*>	m_files;
+	size_t						m_file;
+	const HV_RECORD_PACKET_DATA* m_pPending;
+
+	double			m_speed;
+	ULONG64			m_interval;
+
+	//replay clock and the wall clock it is paced against
+	bool			m_bStarted;
+	ULONG64			m_clock;
+	ULONG64			m_origin;
+	LARGE_INTEGER	m_wallOrigin;
+	LARGE_INTEGER	m_frequency;
+
+	ULONG64			m_records;
+
+	//cleared every Sample; they keep their buckets
+	std::vector<TopPortDelta>	m_ports;
+	std::unordered_map<TopFlowKey, TopTraffic, TopFlowKeyHash> m_flows;
+
+	char			m_description[64];
+};
@@ -0,0 +1,43 @@
+#include "Commands.h"
+
+#include <cstdio>
+#include <cstring>
+
+struct Command
+{
+	const char*	name;
+	int			(*run)(int argc, const char* argv[]);
+	const char*	help;
+};
+
+static const Command commands[] = {
+	{"dump", dump_command, "print the records of capture segments"},
+	{"export", export_command, "render capture segments as CSV or NDJSON"},
+	{"store", store_command, "build a column store from capture segments"},
+	{"query", query_command, "print the packets of a column store that match a filter"},
+	{"top", top_command, "show the busiest vPorts and flows, live or from capture segments"},
+};
+
+static void print_usage()
+{
+	fprintf(stderr, "usage: hvtool <command> [arguments]\n\n");
+
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+		fprintf(stderr, "  %-10s %s\n", commands[i].name, commands[i].help);
+}
+
+int main(int argc, const char* argv[])
+{
+	if (argc < 2) {
+		print_usage();
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+		if (!strcmp(argv[1], commands[i].name))
+			return commands[i].run(argc - 1, argv + 1);
+	}
+
+	print_usage();
+	return 1;
+}
@@ -0,0 +1,220 @@
+#include "PipeServer.h"
+
+PipeServer::PipeServer(PipeTransport& transport, const PIPE_FLOW_EXPORT* pFlowExport)
+	: m_transport(transport),
+	m_bFlows(pFlowExport != NULL)
+{
+	if (m_bFlows)
+		m_flowExport = *pFlowExport;
+	else
+		memset(&m_flowExport, 0, sizeof(m_flowExport));
+
+	m_pClients = new Client[PIPE_MAX_CLIENTS];
+	memset(m_pClients, 0, PIPE_MAX_CLIENTS * sizeof(Client));
+
+	InitializeCriticalSection(&m_lock);
+}
+
+PipeServer::~PipeServer(void)
+{
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i)
+		CloseFlows(&m_pClients[i]);
+
+	DeleteCriticalSection(&m_lock);
+
+	delete[] m_pClients;
+}
+
+//a reader connected
+void PipeServer::OpenFlows(Client* pClient)
+{
+	if (!m_bFlows)
+		return;
+
+	pClient->pFlows = m_flowExport.Open(m_flowExport.context);
+
+	//the first export goes out at once
+	pClient->flowsAsked = GetTickCount() - PIPE_FLOW_INTERVAL;
+}
+
+//no write may be in flight on the slot
+void PipeServer::CloseFlows(Client* pClient)
+{
+	if (!pClient->pFlows)
+		return;
+
+	m_flowExport.Close(pClient->pFlows);
+	pClient->pFlows = NULL;
+}
+
+//the reader is gone: the slot waits for the next one, with an empty queue
+void PipeServer::ResetClient(Client* pClient)
+{
+	CloseFlows(pClient);
+
+	EnterCriticalSection(&m_lock);
+	pClient->state = ClientState_Waiting;
+	pClient->head = pClient->tail = 0;
+	pClient->dropped = 0;
+	LeaveCriticalSection(&m_lock);
+}
+
+void PipeServer::SetState(Client* pClient, ClientState state)
+{
+	EnterCriticalSection(&m_lock);
+	pClient->state = state;
+	LeaveCriticalSection(&m_lock);
+}
+
+//writes the reader's flows if they are due; false if nothing was written
+bool PipeServer::WriteFlows(int slot)
+{
+	Client* pClient = &m_pClients[slot];
+	unsigned long length = 0;
+
+	if (!pClient->pFlows || GetTickCount() - pClient->flowsAsked < PIPE_FLOW_INTERVAL)
+		return false;
+
+	PIPE_FRAME_HEADER* pHeader = (PIPE_FRAME_HEADER*)m_flowExport.Export(pClient->pFlows, &length);
+
+	pClient->flowsAsked = GetTickCount();
+
+	if (!pHeader)
+		return false;
+
+	pHeader->Magic = PIPE_FLOW_FRAME_MAGIC;
+	pHeader->Length = length;
+	pHeader->RecordCount = 0;
+	pHeader->Dropped = 0;
+
+	SetState(pClient, ClientState_Writing);
+
+	if (!m_transport.Write(slot, pHeader, length))
+		ResetClient(pClient);
+
+	return true;
+}
+
+//writes the reader's flows when they are due, otherwise what it has queued as
+//one frame; false if there is nothing to write
+bool PipeServer::WriteFrame(int slot)
+{
+	Client* pClient = &m_pClients[slot];
+	PIPE_FRAME_HEADER* pHeader = (PIPE_FRAME_HEADER*)pClient->frame;
+	PIPE_COUNTERS* pRecords = (PIPE_COUNTERS*)(pHeader + 1);
+	ULONG count;
+
+	//first, or the counters of a busy switch would never leave room for them
+	if (WriteFlows(slot))
+		return true;
+
+	EnterCriticalSection(&m_lock);
+
+	count = min(pClient->head - pClient->tail, (ULONG)PIPE_FRAME_MAX_RECORDS);
+
+	for (ULONG i = 0; i < count; ++i)
+		pRecords[i] = pClient->queue[(pClient->tail + i) % PIPE_CLIENT_QUEUE_RECORDS];
+
+	pClient->tail += count;
+
+	if (count) {
+		pHeader->Dropped = pClient->dropped;
+		pClient->dropped = 0;
+		pClient->state = ClientState_Writing;
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	if (!count)
+		return false;
+
+	pHeader->Magic = PIPE_FRAME_MAGIC;
+	pHeader->Length = sizeof(PIPE_FRAME_HEADER) + count * sizeof(PIPE_COUNTERS);
+	pHeader->RecordCount = count;
+
+	if (!m_transport.Write(slot, pHeader, pHeader->Length))
+		ResetClient(pClient);
+
+	return true;
+}
+
+DWORD PipeServer::FlowTimeout() const
+{
+	DWORD timeout = PIPE_FLOW_INTERVAL;
+	DWORD now = GetTickCount();
+
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		const Client* pClient = &m_pClients[i];
+
+		//a writing reader gets its flows once the write is complete
+		if (pClient->state != ClientState_Idle || !pClient->pFlows)
+			continue;
+
+		DWORD elapsed = now - pClient->flowsAsked;
+
+		timeout = min(timeout, elapsed < PIPE_FLOW_INTERVAL ? PIPE_FLOW_INTERVAL - elapsed : 0);
+	}
+
+	return timeout;
+}
+
+void PipeServer::Run()
+{
+	for (;;) {
+		int slot = -1;
+
+		//not INFINITE: the flows are due on the clock, whether or not records come
+		switch (m_transport.Wait(FlowTimeout(), &slot)) {
+		case PipeTransportEvent_Stop:
+			return;
+
+		case PipeTransportEvent_Connected:
+			OpenFlows(&m_pClients[slot]);
+			SetState(&m_pClients[slot], ClientState_Idle);
+			break;
+
+		case PipeTransportEvent_Written:
+			//the frame is out: the next one may go
+			SetState(&m_pClients[slot], ClientState_Idle);
+			break;
+
+		case PipeTransportEvent_Failed:
+			ResetClient(&m_pClients[slot]);
+			break;
+
+		default:
+			break;
+		}
+
+		//batches whatever was queued while the previous frame was out
+		for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+			if (m_pClients[i].state == ClientState_Idle)
+				WriteFrame(i);
+		}
+	}
+}
+
+void PipeServer::Write(const PIPE_COUNTERS& record)
+{
+	EnterCriticalSection(&m_lock);
+
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		Client* pClient = &m_pClients[i];
+
+		//no reader yet: nothing to keep
+		if (pClient->state == ClientState_Waiting)
+			continue;
+
+		//drop-oldest: a slow reader gets the latest totals, and the count of what it missed
+		if (pClient->head - pClient->tail == PIPE_CLIENT_QUEUE_RECORDS) {
+			++pClient->tail;
+			++pClient->dropped;
+		}
+
+		pClient->queue[pClient->head++ % PIPE_CLIENT_QUEUE_RECORDS] = record;
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	m_transport.Notify();
+}
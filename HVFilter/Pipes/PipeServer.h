@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Pipes.h"
+#include "PipeTransport.h"
+
+//
+// The server side of Pipes.h over any PipeTransport: a queue of records per
+// reader, dropped oldest first when the reader does not keep up, frames of
+// what was queued since the reader's previous one, and the flows every
+// PIPE_FLOW_INTERVAL ms.  Run is the server thread; Write is called by the
+// producer and never waits for a reader.
+//
+class PipeServer
+{
+public:
+	//pFlowExport is NULL if the readers get no flows
+	PipeServer(PipeTransport& transport, const PIPE_FLOW_EXPORT* pFlowExport);
+	~PipeServer(void);
+
+	//the server thread: returns once the transport is stopped.  Flow
+	//exporters still open are closed by the destructor, once the transport
+	//has no write in flight
+	void Run();
+
+	//queues the totals to every connected reader
+	void Write(const PIPE_COUNTERS& record);
+
+private:
+	enum ClientState {ClientState_Waiting, ClientState_Idle, ClientState_Writing};
+
+	//one slot of the transport and the records waiting for its reader
+	struct Client
+	{
+		ClientState		state;
+
+		//free running: the queue holds [tail, head)
+		ULONG			head;
+		ULONG			tail;
+		ULONG			dropped;
+		PIPE_COUNTERS	queue[PIPE_CLIENT_QUEUE_RECORDS];
+
+		//the frame being written
+		BYTE			frame[PIPE_FRAME_MAX_LENGTH];
+
+		//the reader's flow exporter and when it was last asked, in ticks; server thread only
+		void*			pFlows;
+		DWORD			flowsAsked;
+	};
+
+	void OpenFlows(Client* pClient);
+	void CloseFlows(Client* pClient);
+	void ResetClient(Client* pClient);
+	void SetState(Client* pClient, ClientState state);
+
+	bool WriteFlows(int slot);
+	bool WriteFrame(int slot);
+
+	//ms until the flows of a reader are due, PIPE_FLOW_INTERVAL at most
+	DWORD FlowTimeout() const;
+
+private:
+	PipeServer(const PipeServer&);
+	PipeServer& operator=(const PipeServer&);
+
+private:
+	PipeTransport&		m_transport;
+	PIPE_FLOW_EXPORT	m_flowExport;
+	bool				m_bFlows;
+
+	Client*				m_pClients;
+
+	//guards the queues and the states the producer looks at; never held across a transport call
+	CRITICAL_SECTION	m_lock;
+};
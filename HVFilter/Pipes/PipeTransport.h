@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Windows.h>
+
+//
+// Where the counter stream goes out.  PipeServer (PipeServer.h) keeps the
+// readers' queues and builds their frames; a transport only moves bytes.  It
+// has PIPE_MAX_CLIENTS slots, each either waiting for a reader or connected
+// to one, and at most one write in flight per slot.  The service serves named
+// pipe instances (Pipes.cpp); the tests serve Unix domain sockets.
+//
+
+enum PipeTransportEvent
+{
+	//the wait timed out
+	PipeTransportEvent_Timeout,
+
+	//Stop was called: the server thread returns
+	PipeTransportEvent_Stop,
+
+	//Notify was called
+	PipeTransportEvent_Data,
+
+	//a reader connected to the slot
+	PipeTransportEvent_Connected,
+
+	//the write of the slot is complete
+	PipeTransportEvent_Written,
+
+	//the reader of the slot is gone, with its write if one was in flight; the
+	//slot waits for the next one
+	PipeTransportEvent_Failed
+};
+
+class PipeTransport
+{
+public:
+	virtual ~PipeTransport() {}
+
+	//server thread: waits at most dwTimeout ms for one event; *pSlot is set for the slot events
+	virtual PipeTransportEvent Wait(DWORD dwTimeout, int* pSlot) = 0;
+
+	//server thread: starts writing to a connected slot that has no write in
+	//flight.  The buffer is left alone until the slot is Written or Failed;
+	//false if the reader is gone, and the slot waits for the next one
+	virtual bool Write(int slot, const void* pData, DWORD dwLength) = 0;
+
+	//any thread: the next Wait returns PipeTransportEvent_Data, at the latest
+	virtual void Notify() = 0;
+
+	//any thread: every Wait from now on returns PipeTransportEvent_Stop
+	virtual void Stop() = 0;
+};
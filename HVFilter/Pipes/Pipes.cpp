@@ -1,40 +1,282 @@
 #include "Pipes.h"
+#include "PipeServer.h"
 
-//#include <Windows.h>
-
-const char* PIPE_SERVER_NAME = "\\\\.\\pipe\\HV_NDIS_UniquePipeName";
+#include <Windows.h>
 
 namespace
 {
-	//HANDLE hServerPipe = INVALID_HANDLE_VALUE;
+	//
+	// PIPE_MAX_CLIENTS instances of the pipe, written with overlapped I/O
+	//
+	class NamedPipeTransport : public PipeTransport
+	{
+	public:
+		NamedPipeTransport(void);
+		~NamedPipeTransport(void);
+
+		//false if the name is someone else's, or the instances cannot be created
+		bool Open();
+
+		PipeTransportEvent Wait(DWORD dwTimeout, int* pSlot) override;
+		bool Write(int slot, const void* pData, DWORD dwLength) override;
+		void Notify() override { SetEvent(m_hDataEvent); }
+		void Stop() override { SetEvent(m_hStopEvent); }
+
+	private:
+		enum InstanceState {InstanceState_Closed, InstanceState_Connecting, InstanceState_Connected, InstanceState_Writing};
+
+		struct Instance
+		{
+			HANDLE			hPipe;
+			OVERLAPPED		overlapped;
+			InstanceState	state;
+
+			//the reader came before the wait: Wait reports it without waiting
+			bool			bConnectedNow;
+		};
+
+		void Listen(Instance* pInstance);
+		void Reset(Instance* pInstance);
+
+		Instance	m_instances[PIPE_MAX_CLIENTS];
+		HANDLE		m_hDataEvent;
+		HANDLE		m_hStopEvent;
+	};
+
+	NamedPipeTransport*	g_pTransport = NULL;
+	PipeServer*			g_pServer = NULL;
+	HANDLE				g_hServerThread = NULL;
+}
+
+NamedPipeTransport::NamedPipeTransport(void)
+{
+	memset(m_instances, 0, sizeof(m_instances));
+
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i)
+		m_instances[i].hPipe = INVALID_HANDLE_VALUE;
+
+	m_hDataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+NamedPipeTransport::~NamedPipeTransport(void)
+{
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		Instance* pInstance = &m_instances[i];
+		DWORD bytes;
+
+		//the buffers must outlive the operations still in flight
+		if (pInstance->state == InstanceState_Connecting || pInstance->state == InstanceState_Writing) {
+			CancelIo(pInstance->hPipe);
+			GetOverlappedResult(pInstance->hPipe, &pInstance->overlapped, &bytes, TRUE);
+		}
+
+		if (pInstance->hPipe != INVALID_HANDLE_VALUE)
+			CloseHandle(pInstance->hPipe);
+
+		if (pInstance->overlapped.hEvent)
+			CloseHandle(pInstance->overlapped.hEvent);
+	}
+
+	if (m_hDataEvent)
+		CloseHandle(m_hDataEvent);
+
+	if (m_hStopEvent)
+		CloseHandle(m_hStopEvent);
+}
+
+bool NamedPipeTransport::Open()
+{
+	if (!m_hDataEvent || !m_hStopEvent)
+		return false;
+
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		Instance* pInstance = &m_instances[i];
+
+		pInstance->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+		//the first instance makes sure the name is not someone else's
+		pInstance->hPipe = CreateNamedPipeA(PIPE_SERVER_NAME,
+			PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | (i ? 0 : FILE_FLAG_FIRST_PIPE_INSTANCE),
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+			PIPE_MAX_CLIENTS, /*out buf size*/ PIPE_FRAME_MAX_LENGTH, /*in buf size*/ 0, /*def timeout*/ 0, /*sec attrs*/ NULL);
+
+		if (!pInstance->overlapped.hEvent || pInstance->hPipe == INVALID_HANDLE_VALUE)
+			return false;
+
+		Listen(pInstance);
+	}
+
+	return true;
+}
+
+//starts waiting for a reader on the instance
+void NamedPipeTransport::Listen(Instance* pInstance)
+{
+	ResetEvent(pInstance->overlapped.hEvent);
+
+	if (ConnectNamedPipe(pInstance->hPipe, &pInstance->overlapped)) {
+		pInstance->state = InstanceState_Connecting;
+		return;
+	}
+
+	switch (GetLastError()) {
+	case ERROR_IO_PENDING:
+		pInstance->state = InstanceState_Connecting;
+		break;
+
+	case ERROR_PIPE_CONNECTED:
+		//there is nothing to complete
+		pInstance->state = InstanceState_Connected;
+		pInstance->bConnectedNow = true;
+		break;
+
+	default:
+		pInstance->state = InstanceState_Closed;
+		break;
+	}
+}
+
+//the reader is gone: the instance waits for the next one
+void NamedPipeTransport::Reset(Instance* pInstance)
+{
+	DisconnectNamedPipe(pInstance->hPipe);
+
+	pInstance->state = InstanceState_Closed;
+	pInstance->bConnectedNow = false;
+
+	Listen(pInstance);
+}
+
+PipeTransportEvent NamedPipeTransport::Wait(DWORD dwTimeout, int* pSlot)
+{
+	HANDLE handles[2 + PIPE_MAX_CLIENTS];
+	int waiting[PIPE_MAX_CLIENTS];
+	DWORD count = 0;
+
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		if (m_instances[i].bConnectedNow) {
+			m_instances[i].bConnectedNow = false;
+			*pSlot = i;
+			return PipeTransportEvent_Connected;
+		}
+	}
+
+	handles[count++] = m_hStopEvent;
+	handles[count++] = m_hDataEvent;
+
+	//only the instances with an operation in flight: the event of a connected one stays signaled
+	for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+		Instance* pInstance = &m_instances[i];
+
+		if (pInstance->state == InstanceState_Connecting || pInstance->state == InstanceState_Writing) {
+			waiting[count - 2] = i;
+			handles[count++] = pInstance->overlapped.hEvent;
+		}
+	}
+
+	DWORD result = WaitForMultipleObjects(count, handles, FALSE, dwTimeout);
+
+	if (result == WAIT_TIMEOUT)
+		return PipeTransportEvent_Timeout;
+
+	if (result == WAIT_OBJECT_0 || result == WAIT_FAILED)
+		return PipeTransportEvent_Stop;
+
+	if (result == WAIT_OBJECT_0 + 1)
+		return PipeTransportEvent_Data;
+
+	Instance* pInstance = &m_instances[waiting[result - WAIT_OBJECT_0 - 2]];
+	DWORD bytes = 0;
+
+	*pSlot = waiting[result - WAIT_OBJECT_0 - 2];
+
+	if (!GetOverlappedResult(pInstance->hPipe, &pInstance->overlapped, &bytes, FALSE)) {
+		Reset(pInstance);
+		return PipeTransportEvent_Failed;
+	}
+
+	PipeTransportEvent event = pInstance->state == InstanceState_Connecting ?
+		PipeTransportEvent_Connected : PipeTransportEvent_Written;
+
+	pInstance->state = InstanceState_Connected;
+
+	return event;
+}
+
+bool NamedPipeTransport::Write(int slot, const void* pData, DWORD dwLength)
+{
+	Instance* pInstance = &m_instances[slot];
+
+	//completes through the event, even when it completes at once
+	ResetEvent(pInstance->overlapped.hEvent);
+	pInstance->state = InstanceState_Writing;
+
+	if (!WriteFile(pInstance->hPipe, pData, dwLength, NULL, &pInstance->overlapped) &&
+		GetLastError() != ERROR_IO_PENDING) {
+		Reset(pInstance);
+		return false;
+	}
+
+	return true;
+}
+
+static DWORD WINAPI server_thread(LPVOID)
+{
+	g_pServer->Run();
+
+	return 0;
 }
 
-void create_pipe_server()
+int create_pipe_server(const PIPE_FLOW_EXPORT* pFlowExport)
 {
-	//hServerPipe = CreateNamedPipeA(PIPE_SERVER_NAME, PIPE_ACCESS_OUTBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE, 
-	//	PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 
-	//	/*max inst*/1, /*out buf size*/ 100, /*in buf size*/ 100, /*def timeout*/ 100, /*sec attrs*/ NULL);
+	if (g_pServer)
+		return 1;
 
-	//if (hServerPipe == INVALID_HANDLE_VALUE) {
-	//	//TODO: log error or smth
-	//	return;
-	//}
+	g_pTransport = new NamedPipeTransport;
+	g_pServer = new PipeServer(*g_pTransport, pFlowExport);
+
+	if (g_pTransport->Open())
+		g_hServerThread = CreateThread(NULL, 0, server_thread, NULL, 0, NULL);
+
+	if (!g_hServerThread) {
+		uninit_pipe_server();
+		return 0;
+	}
+
+	return 1;
 }
 
-void uninit_pipe_server()
+void uninit_pipe_server(void)
 {
-	/*if (hServerPipe != INVALID_HANDLE_VALUE) {
-		CloseHandle(hServerPipe);
-		hServerPipe = INVALID_HANDLE_VALUE;
-	}*/
+	if (!g_pServer)
+		return;
+
+	if (g_hServerThread) {
+		g_pTransport->Stop();
+		WaitForSingleObject(g_hServerThread, INFINITE);
+		CloseHandle(g_hServerThread);
+		g_hServerThread = NULL;
+	}
+
+	//no write in flight once the transport is gone: the flow exporters may be closed
+	delete g_pTransport;
+	g_pTransport = NULL;
+
+	delete g_pServer;
+	g_pServer = NULL;
 }
 
-void pipe_server_write(unsigned long/* count*/, unsigned long/* size*/)
+void pipe_server_write(unsigned long long timestamp, unsigned long long count, unsigned long long size)
 {
-	//ULONGLONG value = (ULONGLONG(count) << 32ULL) + size;
-	//BOOL result = WriteFile(hServerPipe, &value, sizeof(value), NULL, NULL);
-	//if (!result) {
-	//	//todo: error.
-	//	//DWORD dwError = GetLastError();
-	//}
-}
\ No newline at end of file
+	if (!g_pServer)
+		return;
+
+	PIPE_COUNTERS record;
+
+	record.Timestamp = timestamp;
+	record.Count = count;
+	record.Size = size;
+
+	g_pServer->Write(record);
+}
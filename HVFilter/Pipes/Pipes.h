@@ -1,15 +1,88 @@
 #pragma once
 
-extern const char* PIPE_SERVER_NAME;
+//
+// Counter stream served by HVService on a named pipe to any number of
+// readers (the Client's PipeThread).  Every reader gets frames: a
+// PIPE_FRAME_HEADER followed by RecordCount PIPE_COUNTERS records, the totals
+// published since its previous frame.  A reader that does not keep up loses
+// its oldest records, counted in the Dropped field of its next frame; the
+// producer never waits for it.
+//
+// When the server is given a PIPE_FLOW_EXPORT, every reader also gets the
+// flows, at most every PIPE_FLOW_INTERVAL ms: a PIPE_FRAME_HEADER of magic
+// PIPE_FLOW_FRAME_MAGIC (RecordCount and Dropped 0) followed by an export of
+// the reader's own FlowEncoder (see HVService's FlowExport.h).
+//
+
+#define PIPE_SERVER_NAME "\\\\.\\pipe\\HV_NDIS_UniquePipeName"
+
+#define PIPE_FRAME_MAGIC 0x46505648 // 'HVPF'
+#define PIPE_FLOW_FRAME_MAGIC 0x4C465648 // 'HVFL'
+
+//readers served at once
+#define PIPE_MAX_CLIENTS 16
+
+//records waiting for a reader before the oldest are dropped
+#define PIPE_CLIENT_QUEUE_RECORDS 256
+
+//records sent in one frame at most
+#define PIPE_FRAME_MAX_RECORDS 64
+
+//flows are sent to a reader at most this often, in ms
+#define PIPE_FLOW_INTERVAL 1000
+
+typedef struct _PIPE_FRAME_HEADER {
+	unsigned long Magic;
+
+	//bytes of the frame, this header included
+	unsigned long Length;
+	unsigned long RecordCount;
+
+	//records this reader lost since its previous frame
+	unsigned long Dropped;
+
+} PIPE_FRAME_HEADER;
+
+typedef struct _PIPE_COUNTERS {
+	//clock of the records, 100ns units
+	unsigned long long Timestamp;
+
+	//frames and bytes seen since the service started
+	unsigned long long Count;
+	unsigned long long Size;
+
+} PIPE_COUNTERS;
+
+#define PIPE_FRAME_MAX_LENGTH (sizeof(PIPE_FRAME_HEADER) + PIPE_FRAME_MAX_RECORDS * sizeof(PIPE_COUNTERS))
+
+//the flows of the readers; the callbacks run on the server thread, or in create_pipe_server
+typedef struct _PIPE_FLOW_EXPORT {
+	//a reader connected: returns its exporter, NULL if it gets no flows
+	void* (*Open)(void* context);
+
+	//returns the next flow frame of the reader and sets *pLength, or NULL if there is
+	//nothing to send this time.  The frame starts with sizeof(PIPE_FRAME_HEADER) bytes
+	//the server fills in; it is left alone until the next call or Close
+	void* (*Export)(void* exporter, unsigned long* pLength);
+
+	//the reader is gone
+	void (*Close)(void* exporter);
+
+	void* context;
+
+} PIPE_FLOW_EXPORT;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void create_pipe_server();
-void uninit_pipe_server();
-void pipe_server_write(unsigned long count, unsigned long size);
+//nonzero if the server is listening; pFlowExport is NULL if the readers get no flows
+int create_pipe_server(const PIPE_FLOW_EXPORT* pFlowExport);
+void uninit_pipe_server(void);
+
+//queues the totals to every connected reader
+void pipe_server_write(unsigned long long timestamp, unsigned long long count, unsigned long long size);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
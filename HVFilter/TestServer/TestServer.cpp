@@ -8,10 +8,11 @@
 
 int _tmain(int argc, _TCHAR* argv[])
 {
-	create_pipe_server();
+	create_pipe_server(NULL);
 	
 	for (int i = 0; i < 1000; ++i) {
-		pipe_server_write(i, i * 100);
+		//totals of 1 frame of 100 bytes every 100ms, stamped in 100ns units
+		pipe_server_write(i * 1000000ull, i, i * 100);
 		Sleep(100);
 	}
 	
@@ -0,0 +1,208 @@
+#pragma once
+
+//
+// The service buffers registered through OSR_COMM_CONTROL_REGISTER_BUFFERS:
+// one set at a time, owned by the handle that registered it, and named by
+// index in control requests and batched exchanges.
+//
+// The routines below only keep the books; the caller holds the service queue
+// lock, and locks, maps and unmaps the buffers.  They need nothing but the
+// Windows base types, so the tests under tests/ build them outside the WDK.
+//
+#include "../HVService/HVService/HVioctl.h"
+
+//
+// A registered service buffer: locked and mapped once, at registration
+//
+typedef struct _OSR_COMM_MAPPED_BUFFER {
+
+  PMDL Mdl;
+
+  PVOID SystemAddress;
+
+  ULONG Length;
+
+} OSR_COMM_MAPPED_BUFFER, *POSR_COMM_MAPPED_BUFFER;
+
+typedef struct _OSR_COMM_BUFFER_REGISTRY {
+
+  //
+  // The handle (PFILE_OBJECT) the buffers were registered through, NULL if none are
+  //
+  PVOID Owner;
+
+  POSR_COMM_MAPPED_BUFFER Buffers;
+
+  ULONG Count;
+
+} OSR_COMM_BUFFER_REGISTRY, *POSR_COMM_BUFFER_REGISTRY;
+
+//
+// OsrCommBufferRegistryInit
+//
+//  This routine sets up an empty registry
+//
+// Inputs:
+//  Registry - this is the registry to initialize
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+static __inline VOID OsrCommBufferRegistryInit(POSR_COMM_BUFFER_REGISTRY Registry)
+{
+  RtlZeroMemory(Registry, sizeof(OSR_COMM_BUFFER_REGISTRY));
+}
+
+//
+// OsrCommBufferRegistrationValid
+//
+//  This routine checks a registration request before anything is locked
+//
+// Inputs:
+//  Registration - this is the request, from the IOCTL's input buffer
+//  Length - this is the length of the input buffer
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - 1 to OSR_COMM_MAX_REGISTERED_BUFFERS buffers, all described in
+//         Length bytes, none empty and none above the address space
+//  FALSE - otherwise
+//
+static __inline BOOLEAN OsrCommBufferRegistrationValid(const OSR_COMM_BUFFER_REGISTRATION* Registration, ULONG Length)
+{
+  ULONG index;
+
+  if (Length < FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) ||
+      0 == Registration->Count ||
+      Registration->Count > OSR_COMM_MAX_REGISTERED_BUFFERS ||
+      Length < FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) +
+        Registration->Count * sizeof(OSR_COMM_BUFFER_DESCRIPTOR)) {
+
+    return FALSE;
+
+  }
+
+  for (index = 0; index < Registration->Count; index++) {
+
+    if (0 == Registration->Buffers[index].Length ||
+        Registration->Buffers[index].Buffer > (ULONG64) MAXULONG_PTR) {
+
+      return FALSE;
+
+    }
+
+  }
+
+  return TRUE;
+}
+
+//
+// OsrCommBufferRegistryAttach
+//
+//  This routine records a set of mapped buffers as registered
+//
+// Inputs:
+//  Registry - this is the registry
+//  Owner - this is the handle the buffers are registered through
+//  Buffers - these are the mapped buffers
+//  Count - this is the number of buffers
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - control requests of Owner may now name the buffers by index
+//  FALSE - buffers are already registered; the caller unmaps its own
+//
+static __inline BOOLEAN OsrCommBufferRegistryAttach(POSR_COMM_BUFFER_REGISTRY Registry, PVOID Owner,
+                                                    POSR_COMM_MAPPED_BUFFER Buffers, ULONG Count)
+{
+  if (Registry->Buffers) {
+
+    return FALSE;
+
+  }
+
+  Registry->Owner = Owner;
+
+  Registry->Buffers = Buffers;
+
+  Registry->Count = Count;
+
+  return TRUE;
+}
+
+//
+// OsrCommBufferRegistryLookup
+//
+//  This routine finds the registered buffer a request names
+//
+// Inputs:
+//  Registry - this is the registry
+//  Owner - this is the handle the request came through
+//  Index - this is the buffer's index
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The buffer, or NULL if Owner has no such buffer registered
+//
+// Notes:
+//  The buffer is only valid while the caller holds the service queue lock.
+//
+static __inline POSR_COMM_MAPPED_BUFFER OsrCommBufferRegistryLookup(POSR_COMM_BUFFER_REGISTRY Registry, PVOID Owner,
+                                                                    ULONG Index)
+{
+  if (NULL == Registry->Buffers || Index >= Registry->Count || Owner != Registry->Owner) {
+
+    return NULL;
+
+  }
+
+  return &Registry->Buffers[Index];
+}
+
+//
+// OsrCommBufferRegistryDetach
+//
+//  This routine takes the buffers a handle registered out of the registry
+//
+// Inputs:
+//  Registry - this is the registry
+//  Owner - this is the handle
+//
+// Outputs:
+//  Count - this is the number of buffers taken
+//
+// Returns:
+//  The buffers, for the caller to unmap and free, or NULL if Owner has none
+//  registered
+//
+// Notes:
+//  The caller makes sure first that no exchange waits on one of them.
+//
+static __inline POSR_COMM_MAPPED_BUFFER OsrCommBufferRegistryDetach(POSR_COMM_BUFFER_REGISTRY Registry, PVOID Owner,
+                                                                    PULONG Count)
+{
+  POSR_COMM_MAPPED_BUFFER buffers = Registry->Buffers;
+
+  if (NULL == buffers || Owner != Registry->Owner) {
+
+    *Count = 0;
+
+    return NULL;
+
+  }
+
+  *Count = Registry->Count;
+
+  OsrCommBufferRegistryInit(Registry);
+
+  return buffers;
+}
@@ -7,6 +7,11 @@
 #define OSR_COMM_DOSDEVICE_PATH L"\\DosDevices\\OSR"
 
 
+//
+// Service buffers registered through OSR_COMM_CONTROL_REGISTER_BUFFERS
+//
+#include "BufferRegistry.h"
+
 typedef struct _OSR_COMM_CONTROL_DEVICE_EXTENSION {
 
   //
@@ -49,10 +54,73 @@ typedef struct _OSR_COMM_CONTROL_DEVICE_EXTENSION {
   //
   FAST_MUTEX RequestQueueLock;
 
+  //
+  // Batched control requests waiting for data requests, protected by the
+  // service queue lock
+  //
+  LIST_ENTRY BatchQueue;
+
+  //
+  // Control handles that serve data requests (see OSR_COMM_SERVICE_HANDLE);
+  // the data device is active while there are any
+  //
+  volatile LONG ServiceHandles;
+
+  //
+  // Service buffers registered through OSR_COMM_CONTROL_REGISTER_BUFFERS and
+  // the handle that owns them, protected by the service queue lock
+  //
+  OSR_COMM_BUFFER_REGISTRY BufferRegistry;
+
 } OSR_COMM_CONTROL_DEVICE_EXTENSION, *POSR_COMM_CONTROL_DEVICE_EXTENSION;
 
 #define OSR_COMM_CONTROL_EXTENSION_MAGIC_NUMBER 0x1d88f403
 
+//
+// FsContext of a control handle that asked for data requests or answered one.
+// Readers of the statistics, the counters page or the capture open control
+// handles too, but only the marked ones keep the data device active.
+//
+#define OSR_COMM_SERVICE_HANDLE ((PVOID) 1)
+
+//
+// Where a batched control request gets its requests written: its locked output
+// buffer or a registered buffer, with its length.  Kept in the IRP while it
+// waits on the batch queue (DriverContext does not overlap the list entry).
+//
+#define OSR_COMM_BATCH_BUFFER(Irp) ((Irp)->Tail.Overlay.DriverContext[0])
+#define OSR_COMM_BATCH_BUFFER_LENGTH(Irp) (*(PULONG) &(Irp)->Tail.Overlay.DriverContext[1])
+#define OSR_COMM_BATCH_BUFFER_REGISTERED(Irp) ((Irp)->Tail.Overlay.DriverContext[2])
+
+//
+// Request ID layout, the choice of data queue and the slot table of each
+//
+#include "RequestTable.h"
+
+typedef struct _OSR_COMM_DATA_QUEUE {
+
+  //
+  // Request Queue
+  //
+  LIST_ENTRY Queue;
+
+  //
+  // Request Queue Lock
+  //
+  FAST_MUTEX Lock;
+
+  //
+  // The queue's requests indexed by request ID, protected by the queue's lock
+  //
+  OSR_COMM_REQUEST_TABLE Table;
+
+} OSR_COMM_DATA_QUEUE, *POSR_COMM_DATA_QUEUE;
+
+//
+// Per-processor object cache of the data request records
+//
+#include "RequestCache.h"
+
 typedef struct _OSR_COMM_DATA_DEVICE_EXTENSION {
 
   //
@@ -71,24 +139,19 @@ typedef struct _OSR_COMM_DATA_DEVICE_EXTENSION {
   UNICODE_STRING SymbolicLinkName;
 
   //
-  // Read Request Queue
-  //
-  LIST_ENTRY ReadRequestQueue;
-
-  //
-  // Read Request Queue Lock
+  // Read Request Queues
   //
-  FAST_MUTEX ReadRequestQueueLock;
+  OSR_COMM_DATA_QUEUE ReadQueues[OSR_COMM_DATA_QUEUES];
 
   //
-  // Write Request Queue
+  // Write Request Queues
   //
-  LIST_ENTRY WriteRequestQueue;
+  OSR_COMM_DATA_QUEUE WriteQueues[OSR_COMM_DATA_QUEUES];
 
   //
-  // Write Request Queue Lock
+  // Where the data request records of both queues come from
   //
-  FAST_MUTEX WriteRequestQueueLock;
+  OSR_COMM_REQUEST_CACHE RequestCache;
 
 } OSR_COMM_DATA_DEVICE_EXTENSION, *POSR_COMM_DATA_DEVICE_EXTENSION;
 
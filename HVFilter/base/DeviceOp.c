@@ -7,11 +7,22 @@
 #include "DeviceInfo.h"
 #include "../HVService/HVService/Stuff.h"
 #include "../HVService/HVService/HVioctl.h"
+#include "../HVService/HVService/BatchProtocol.h"
+#include "../HVService/HVService/HVStats.h"
+#include "../HVService/HVService/HVCapture.h"
+#include "../HVService/HVService/HVRing.h"
+#include "../HVService/HVService/HVCounters.h"
 #include "../samples/passthrough/SendPacketsInfo.h"
+#include "../samples/passthrough/PortStats.h"
+#include "../samples/passthrough/Microburst.h"
+#include "../samples/passthrough/Governor.h"
+#include "../samples/passthrough/Capture.h"
+#include "../samples/passthrough/SharedRing.h"
+#include "../samples/passthrough/RecordExport.h"
+#include "../samples/passthrough/CountersPage.h"
 
 extern PDEVICE_OBJECT OsrDataDeviceObject;
 extern PDEVICE_OBJECT OsrCommDeviceObject;
-extern LONG OsrRequestID;
 
 
 
@@ -35,10 +46,11 @@ extern LONG OsrRequestID;
 //
 NTSTATUS OsrCommCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
-  POSR_COMM_DATA_DEVICE_EXTENSION dataExt;
+  UNREFERENCED_PARAMETER(DeviceObject);
 
   //
-  // Tell the caller "yes"
+  // Tell the caller "yes".  A control handle only activates the data device
+  // once it serves requests (see MarkServiceHandle).
   //
   Irp->IoStatus.Status = STATUS_SUCCESS;
 
@@ -47,22 +59,46 @@ NTSTATUS OsrCommCreate(PDEVICE_OBJECT DeviceObject, PIRP Irp)
   IoCompleteRequest(Irp, IO_NO_INCREMENT);
 
   //
-  // If this was the control device, note that we now have
-  // activated the data device.
+  // Done.
   //
-  if (OSR_COMM_CONTROL_TYPE == DeviceObject->DeviceType) {
+  return STATUS_SUCCESS;
 
-    dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
+}
 
-    dataExt->DeviceState = OSR_COMM_DATA_DEVICE_ACTIVE;
+//
+// MarkServiceHandle
+//
+//  This routine counts a control handle as a service handle, the first time
+//  it asks for or answers data requests
+//
+// Inputs:
+//  Irp - this is the GET_REQUEST / SEND_RESPONSE / GET_AND_SEND / EXCHANGE_BATCH IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  Several service handles may be open; the last one to be cleaned up
+//  deactivates the data device.
+//
+static VOID MarkServiceHandle(PIRP Irp)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  POSR_COMM_DATA_DEVICE_EXTENSION dataExt =
+    (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
+  PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
 
-  }
+  if (NULL == InterlockedCompareExchangePointer(&fileObject->FsContext, OSR_COMM_SERVICE_HANDLE, NULL)) {
 
-  //
-  // Done.
-  //
-  return STATUS_SUCCESS;
+    InterlockedIncrement(&controlExt->ServiceHandles);
+
+    dataExt->DeviceState = OSR_COMM_DATA_DEVICE_ACTIVE;
 
+  }
 }
 
 typedef struct _OSR_COMM_DATA_REQUEST {
@@ -86,659 +122,2406 @@ typedef struct _OSR_COMM_DATA_REQUEST {
   //
   PIRP Irp;
 
+  //
+  // TRUE while the request is on the service request queue, protected by
+  // the service request queue lock
+  //
+  BOOLEAN ServiceQueued;
+
 } OSR_COMM_DATA_REQUEST, *POSR_COMM_DATA_REQUEST;
 
 //
-// CancelPendingRequestList
+// OsrCommInitializeRequestTable
 //
-//   This routine will walk through a list of data requests
-//   looking for requests that need to be cancelled.
+//  This routine sets up an empty request table
 //
 // Inputs:
-//   List - this is the list to traverse
-//   ListLock - this is the fast mutex protecting the list
-//   FileObject - this is the file object to match against the requests being cancelled.  If it is
-//                zero, it indicates that all entries on the queue should be cancelled.
+//  Table - this is the table to initialize
+//  IdFlags - these are or'ed into every request ID the table hands out
 //
 // Outputs:
-//   None.
+//  None.
 //
 // Returns:
-//   VOID function
+//  VOID function
 //
 // Notes:
-//   This is a "helper" function for cleanup, not a general-purpose cancellation mechanism.
+//  The slots are only allocated when the first request is inserted.
 //
-static VOID CancelPendingRequestList(PLIST_ENTRY List, PFAST_MUTEX ListLock, PFILE_OBJECT FileObject)
+VOID OsrCommInitializeRequestTable(POSR_COMM_REQUEST_TABLE Table, ULONG IdFlags)
 {
-  PLIST_ENTRY listEntry;
-  PLIST_ENTRY nextListEntry;
-  POSR_COMM_DATA_REQUEST dataRequest;
-
-  //
-  // Lock the list
-  //
-  ExAcquireFastMutex(ListLock);
-
-  //
-  // Walk the list
-  //
-  for (listEntry = List->Flink;
-       listEntry != List;
-       listEntry = nextListEntry) {
-    //
-    // Set up the next list entry first.  Thus, even if we delete the
-    // list entry from the queue, we can skip to the next entry
-    //
-    nextListEntry = listEntry->Flink;
-
-    //
-    // Extract the data request from the list entry
-    //
-    dataRequest = CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ListEntry);
-
-    //
-    // If there is an IRP associated with this request and the file object in the IRP
-    // stack location matches the file object passed to this call, then we need to
-    // cancel this request.
-    //
-    // Note that if the file object is NULL we cancel ALL I/O operations on the queue.
-    //
-    if (dataRequest->Irp &&
-        ((NULL == FileObject) ||
-         (IoGetCurrentIrpStackLocation(dataRequest->Irp)->FileObject == FileObject))) {
-      
-      //
-      // We need to remove this entry from the queue
-      //
-      RemoveEntryList(listEntry);
-
-      //
-      // Cancel this IRP
-      //
-      dataRequest->Irp->IoStatus.Status = STATUS_CANCELLED;
-
-      dataRequest->Irp->IoStatus.Information = 0;
-
-      IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+  OsrCommRequestTableInit(Table, IdFlags);
+}
 
-      //
-      // Free this data request
-      //
-      ExFreePool(dataRequest);
+//
+// OsrCommFreeRequestTable
+//
+//  This routine releases the slots of a request table
+//
+// Inputs:
+//  Table - this is the table to free
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The requests themselves are not touched; the queue must be empty.
+//
+VOID OsrCommFreeRequestTable(POSR_COMM_REQUEST_TABLE Table)
+{
+  if (Table->Slots) {
 
-    }
+    ExFreePool(Table->Slots);
 
   }
 
-  //
-  // Unlock the list
-  //
-  ExReleaseFastMutex(ListLock);
-
-  //
-  // Done!
-  //
-  return;
+  OsrCommInitializeRequestTable(Table, Table->IdFlags);
 }
 
 //
-// 
-//OsrCommCleanup
-//  This is the cleanup entry point
+// OsrCommInitializeDataQueues
+//
+//  This routine sets up the read and write queues of the data device
 //
 // Inputs:
-//  DeviceObject - this is the device object on which we are operating
-//  Irp - this is the cleanup IRP
+//  DataExt - this is the data device extension
 //
 // Outputs:
 //  None.
 //
 // Returns:
-//  SUCCESS - the operation was successful.
+//  VOID function
 //
 // Notes:
-//  None.
+//  Each queue's request IDs carry its index and, for writes,
+//  OSR_COMM_REQUEST_WRITE_ID.
 //
-NTSTATUS OsrCommCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+VOID OsrCommInitializeDataQueues(POSR_COMM_DATA_DEVICE_EXTENSION DataExt)
 {
-//	PLIST_ENTRY listEntry;
-//  PLIST_ENTRY nextListEntry;
-  POSR_COMM_DATA_DEVICE_EXTENSION dataExt;
-  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt;
-
-  DbgPrint("OsrCommCleanup: entered. \n");
-
-  //
-  // If this is the control object, we need to deal with it closing,
-  // in case there are any existing threads waiting for answers from
-  // the control object.
-  //
-  if (OSR_COMM_CONTROL_TYPE == DeviceObject->DeviceType) {
-
-    //
-    // Need the data device
-    //
-    dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
-    controlExt = (POSR_COMM_CONTROL_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
-
-    //
-    // Set the device state
-    //
-    dataExt->DeviceState = OSR_COMM_DATA_DEVICE_INACTIVE;
+  ULONG index;
 
+  for (index = 0; index < OSR_COMM_DATA_QUEUES; index++) {
 
-    //
-    // In this case, we must cancel all pending requests on the queue
-    //
+    InitializeListHead(&DataExt->ReadQueues[index].Queue);
 
-    CancelPendingRequestList(&controlExt->ServiceQueue,
-                             &controlExt->ServiceQueueLock,
-                             NULL);
+    ExInitializeFastMutex(&DataExt->ReadQueues[index].Lock);
 
-    CancelPendingRequestList(&controlExt->RequestQueue,
-                             &controlExt->RequestQueueLock,
-                             NULL);
+    OsrCommInitializeRequestTable(&DataExt->ReadQueues[index].Table,
+                                  index << OSR_COMM_REQUEST_QUEUE_SHIFT);
 
+    InitializeListHead(&DataExt->WriteQueues[index].Queue);
 
-    //
-    // In this case, we must cancel all pending requests on the queue
-    //
-    CancelPendingRequestList(&dataExt->ReadRequestQueue,
-                             &dataExt->ReadRequestQueueLock,
-                             NULL);
+    ExInitializeFastMutex(&DataExt->WriteQueues[index].Lock);
 
-    CancelPendingRequestList(&dataExt->WriteRequestQueue,
-                             &dataExt->WriteRequestQueueLock,
-                             NULL);
+    OsrCommInitializeRequestTable(&DataExt->WriteQueues[index].Table,
+                                  OSR_COMM_REQUEST_WRITE_ID | (index << OSR_COMM_REQUEST_QUEUE_SHIFT));
 
   }
+}
 
-  //
-  // If this is the data object, we need to find any pending requests
-  // and remove them from the queue
-  //
-  if (OSR_COMM_DATA_TYPE == DeviceObject->DeviceType) {
-
-    //
-    // We need to walk the list of pending requests and
-    // remove any matching the file object in the cleanup request.
-    //
-    dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
-    controlExt = (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
-
-    //
-    // In this case, we must cancel all pending requests on the queue
-    //
-
-    CancelPendingRequestList(&controlExt->ServiceQueue,
-                             &controlExt->ServiceQueueLock,
-                             IoGetCurrentIrpStackLocation(Irp)->FileObject);
-
-    CancelPendingRequestList(&controlExt->RequestQueue,
-                             &controlExt->RequestQueueLock,
-                             IoGetCurrentIrpStackLocation(Irp)->FileObject);
+//
+// OsrCommFreeDataQueues
+//
+//  This routine releases the request tables of the data device queues
+//
+// Inputs:
+//  DataExt - this is the data device extension
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The queues must be empty.
+//
+VOID OsrCommFreeDataQueues(POSR_COMM_DATA_DEVICE_EXTENSION DataExt)
+{
+  ULONG index;
 
+  for (index = 0; index < OSR_COMM_DATA_QUEUES; index++) {
 
-    //
-    // Clean up the pending read queue
-    //
-    CancelPendingRequestList(&dataExt->ReadRequestQueue,
-                             &dataExt->ReadRequestQueueLock,
-                             IoGetCurrentIrpStackLocation(Irp)->FileObject);
+    OsrCommFreeRequestTable(&DataExt->ReadQueues[index].Table);
 
-    //
-    // Clean up the pending write queue
-    //
-    CancelPendingRequestList(&dataExt->WriteRequestQueue,
-                             &dataExt->WriteRequestQueueLock,
-                             IoGetCurrentIrpStackLocation(Irp)->FileObject);
+    OsrCommFreeRequestTable(&DataExt->WriteQueues[index].Table);
 
   }
+}
 
-  //
-  // Tell the caller "yes"
-  //
-  Irp->IoStatus.Status = STATUS_SUCCESS;
-
-  Irp->IoStatus.Information = 0;
-
-  IoCompleteRequest(Irp, IO_NO_INCREMENT);
-
-  //
-  // Done.
-  //
-  return STATUS_SUCCESS;
+//
+// DataQueueOf
+//
+//  This routine picks the data queue a request goes on, or is on
+//
+// Inputs:
+//  Write - this is TRUE for a write request, FALSE for a read request
+//  RequestID - this is the request's ID, or OSR_COMM_REQUEST_NO_SLOT for a
+//              new request
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The data queue
+//
+// Notes:
+//  New requests go on the current processor's queue.
+//
+static POSR_COMM_DATA_QUEUE DataQueueOf(BOOLEAN Write, ULONG RequestID)
+{
+  POSR_COMM_DATA_DEVICE_EXTENSION dataExt =
+    (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
+  ULONG index = OsrCommDataQueueIndex(RequestID, KeGetCurrentProcessorNumberEx(NULL));
 
+  return Write ? &dataExt->WriteQueues[index] : &dataExt->ReadQueues[index];
 }
 
 //
-// Close
+// OsrCommInitializeRequestCache
 //
-//  This is the close entry point
+//  This routine sets up the data request cache
 //
 // Inputs:
-//  DeviceObject - this is the device object on which we are operating
-//  Irp - this is the close IRP
+//  Cache - this is the cache to initialize
 //
 // Outputs:
 //  None.
 //
 // Returns:
-//  SUCCESS - the operation was successful.
+//  STATUS_SUCCESS - the cache is ready
+//  STATUS_INSUFFICIENT_RESOURCES - the magazines could not be allocated
 //
 // Notes:
-//  None.
+//  The slabs are only allocated as requests come in.
 //
-NTSTATUS OsrCommClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+NTSTATUS OsrCommInitializeRequestCache(POSR_COMM_REQUEST_CACHE Cache)
 {
-	UNREFERENCED_PARAMETER(DeviceObject);
+  ULONG count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  POSR_COMM_CACHE_MAGAZINE magazines;
+
   //
-  // Tell the caller "yes"
+  // Records are only handled below DISPATCH_LEVEL, so paged pool is fine
   //
-  Irp->IoStatus.Status = STATUS_SUCCESS;
+  magazines = (POSR_COMM_CACHE_MAGAZINE) ExAllocatePoolWithTag(PagedPool,
+                                                               count * sizeof(OSR_COMM_CACHE_MAGAZINE),
+                                                               'mcCO');
 
-  Irp->IoStatus.Information = 0;
+  if (NULL == magazines) {
 
-  IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    Cache->Magazines = NULL;
 
-  //
-  // Done.
-  //
-  return STATUS_SUCCESS;
+    return STATUS_INSUFFICIENT_RESOURCES;
 
-}
+  }
 
-
+  OsrCommRequestCacheInit(Cache, magazines, count, sizeof(OSR_COMM_DATA_REQUEST));
+
+  return STATUS_SUCCESS;
+}
 
 //
-// ProcessResponse
+// OsrCommFreeRequestCache
 //
-//  This routine is used to process a response
+//  This routine releases the slabs and magazines of the data request cache
 //
 // Inputs:
-//  Irp - this is the IRP containing a (validated) response
+//  Cache - this is the cache to free
 //
 // Outputs:
 //  None.
 //
 // Returns:
-//  STATUS_SUCCESS - the operation completed successfully
+//  VOID function
 //
 // Notes:
-//  This is a helper function for the device control logic.  It does NOT
-//  complete the control request - that is the job of the caller!  It DOES
-//  complete the data request (if it finds a matching entry).
+//  Every record must be back in the cache; the queues must be empty.
 //
+VOID OsrCommFreeRequestCache(POSR_COMM_REQUEST_CACHE Cache)
+{
+  PVOID slab;
 
-NTSTATUS ProcessResponse(PIRP Irp)
+  if (NULL == Cache->Magazines) {
 
-{
-  POSR_COMM_CONTROL_RESPONSE response;
-  PLIST_ENTRY queue;
-  PFAST_MUTEX queueLock;
+    return;
+
+  }
+
+  while (NULL != (slab = OsrCommRequestCacheTakeSlab(Cache))) {
+
+    ExFreePool(slab);
+
+  }
+
+  ExFreePool(Cache->Magazines);
+
+  Cache->Magazines = NULL;
+
+  InitializeSListHead(&Cache->Depot);
+}
+
+//
+// AllocateDataRequest
+//
+//  This routine takes a data request record from the cache
+//
+// Inputs:
+//  None.
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The record, zeroed, or NULL if a new slab could not be allocated
+//
+// Notes:
+//  The current processor's magazine first, then the depot, then a new slab
+//  whose other records go to the depot.
+//
+static POSR_COMM_DATA_REQUEST AllocateDataRequest(VOID)
+{
+  POSR_COMM_REQUEST_CACHE cache =
+    &((POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension)->RequestCache;
+  PVOID record;
+  PVOID slab;
+
+  record = OsrCommRequestCacheAllocate(cache, KeGetCurrentProcessorNumberEx(NULL));
+
+  if (NULL == record) {
+
+    slab = ExAllocatePoolWithTag(PagedPool, OSR_COMM_CACHE_SLAB_SIZE, 'rdCO');
+
+    if (NULL == slab) {
+
+      return NULL;
+
+    }
+
+    record = OsrCommRequestCacheAddSlab(cache, slab);
+
+  }
+
+  RtlZeroMemory(record, sizeof(OSR_COMM_DATA_REQUEST));
+
+  return (POSR_COMM_DATA_REQUEST) record;
+}
+
+//
+// FreeDataRequest
+//
+//  This routine gives a data request record back to the cache
+//
+// Inputs:
+//  DataRequest - this is the record, no longer on any queue or table
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The depth check is racy, which only lets a magazine run a little over.
+//
+static VOID FreeDataRequest(POSR_COMM_DATA_REQUEST DataRequest)
+{
+  POSR_COMM_REQUEST_CACHE cache =
+    &((POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension)->RequestCache;
+
+  OsrCommRequestCacheFree(cache, KeGetCurrentProcessorNumberEx(NULL), DataRequest);
+}
+
+//
+// GrowRequestTable
+//
+//  This routine doubles the number of slots of a request table
+//
+// Inputs:
+//  Table - this is the table to grow; its queue lock must be held
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  TRUE - there are free slots
+//  FALSE - the table is at OSR_COMM_REQUEST_MAX_SLOTS, or the allocation failed
+//
+// Notes:
+//  Slot indexes do not change, so IDs handed out before stay valid.
+//
+static BOOLEAN GrowRequestTable(POSR_COMM_REQUEST_TABLE Table)
+{
+  POSR_COMM_REQUEST_SLOT slots;
+  ULONG capacity;
+
+  capacity = OsrCommRequestTableGrowCapacity(Table);
+
+  if (0 == capacity) {
+
+    return FALSE;
+
+  }
+
+  //
+  // Only touched under the queue's fast mutex, so paged pool is fine
+  //
+  slots = (POSR_COMM_REQUEST_SLOT) ExAllocatePoolWithTag(PagedPool, capacity * sizeof(OSR_COMM_REQUEST_SLOT), 'trCO');
+
+  if (NULL == slots) {
+
+    return FALSE;
+
+  }
+
+  //
+  // The table hands the previous array back to be freed
+  //
+  slots = OsrCommRequestTableGrow(Table, slots);
+
+  if (slots) {
+
+    ExFreePool(slots);
+
+  }
+
+  return TRUE;
+}
+
+//
+// InsertRequest
+//
+//  This routine gives a data request a slot and the matching request ID
+//
+// Inputs:
+//  Table - this is the table of the request's queue; its lock must be held
+//  DataRequest - this is the request to insert
+//
+// Outputs:
+//  DataRequest->RequestID is set.
+//
+// Returns:
+//  TRUE - the request was inserted
+//  FALSE - no slot could be found for it
+//
+static BOOLEAN InsertRequest(POSR_COMM_REQUEST_TABLE Table, POSR_COMM_DATA_REQUEST DataRequest)
+{
+  if (OSR_COMM_REQUEST_NO_SLOT == Table->FreeHead && !GrowRequestTable(Table)) {
+
+    return FALSE;
+
+  }
+
+  return OsrCommRequestTableInsert(Table, DataRequest, &DataRequest->RequestID);
+}
+
+//
+// LookupRequest
+//
+//  This routine finds the data request a response is meant for
+//
+// Inputs:
+//  Table - this is the table of the response's queue; its lock must be held
+//  RequestID - this is the ID from the response
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The data request, or NULL if the ID does not match a pending request
+//
+static POSR_COMM_DATA_REQUEST LookupRequest(POSR_COMM_REQUEST_TABLE Table, ULONG RequestID)
+{
+  return (POSR_COMM_DATA_REQUEST) OsrCommRequestTableLookup(Table, RequestID);
+}
+
+//
+// RemoveRequest
+//
+//  This routine releases the slot of a data request
+//
+// Inputs:
+//  Table - this is the table of the request's queue; its lock must be held
+//  DataRequest - this is the request leaving the queue
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+static VOID RemoveRequest(POSR_COMM_REQUEST_TABLE Table, POSR_COMM_DATA_REQUEST DataRequest)
+{
+  ASSERT(OsrCommRequestTableLookup(Table, DataRequest->RequestID) == DataRequest);
+
+  OsrCommRequestTableRemove(Table, DataRequest->RequestID);
+}
+
+//
+// CancelPendingRequestList
+//
+//   This routine will walk through a data queue
+//   looking for requests that need to be cancelled.
+//
+// Inputs:
+//   DataQueue - this is the data queue to traverse
+//   FileObject - this is the file object to match against the requests being cancelled.  If it is
+//                zero, it indicates that all entries on the queue should be cancelled.
+//
+// Outputs:
+//   None.
+//
+// Returns:
+//   VOID function
+//
+// Notes:
+//   This is a "helper" function for cleanup, not a general-purpose cancellation mechanism.
+//
+static VOID CancelPendingRequestList(POSR_COMM_DATA_QUEUE DataQueue, PFILE_OBJECT FileObject)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
   PLIST_ENTRY listEntry;
-//  PLIST_ENTRY nextEntry;
-  POSR_COMM_DATA_REQUEST dataRequest = NULL;
-  NTSTATUS status = STATUS_SUCCESS;
-  PVOID requestBuffer;
-  PIO_STACK_LOCATION irpSp;
-  ULONG bytesToCopy;
-  POSR_COMM_DATA_DEVICE_EXTENSION dataExt =
-    (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
-//  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt = (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
-  //UCHAR* next_addr = NULL;
+  PLIST_ENTRY nextListEntry;
+  POSR_COMM_DATA_REQUEST dataRequest;
+
+  //
+  // Lock the list
+  //
+  ExAcquireFastMutex(&DataQueue->Lock);
+
+  //
+  // Walk the list
+  //
+  for (listEntry = DataQueue->Queue.Flink;
+       listEntry != &DataQueue->Queue;
+       listEntry = nextListEntry) {
+    //
+    // Set up the next list entry first.  Thus, even if we delete the
+    // list entry from the queue, we can skip to the next entry
+    //
+    nextListEntry = listEntry->Flink;
+
+    //
+    // Extract the data request from the list entry
+    //
+    dataRequest = CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ListEntry);
+
+    //
+    // If there is an IRP associated with this request and the file object in the IRP
+    // stack location matches the file object passed to this call, then we need to
+    // cancel this request.
+    //
+    // Note that if the file object is NULL we cancel ALL I/O operations on the queue.
+    //
+    if (dataRequest->Irp &&
+        ((NULL == FileObject) ||
+         (IoGetCurrentIrpStackLocation(dataRequest->Irp)->FileObject == FileObject))) {
+      
+      //
+      // We need to remove this entry from the queue
+      //
+      RemoveEntryList(listEntry);
+
+      RemoveRequest(&DataQueue->Table, dataRequest);
+
+      //
+      // A request the service has not picked up yet must leave the service
+      // request queue too
+      //
+      ExAcquireFastMutex(&controlExt->RequestQueueLock);
+
+      if (dataRequest->ServiceQueued) {
+
+        RemoveEntryList(&dataRequest->ServiceListEntry);
+
+        dataRequest->ServiceQueued = FALSE;
+
+      }
+
+      ExReleaseFastMutex(&controlExt->RequestQueueLock);
+
+      //
+      // Cancel this IRP
+      //
+      dataRequest->Irp->IoStatus.Status = STATUS_CANCELLED;
+
+      dataRequest->Irp->IoStatus.Information = 0;
+
+      IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+      //
+      // Free this data request
+      //
+      FreeDataRequest(dataRequest);
+
+    }
+
+  }
+
+  //
+  // Unlock the list
+  //
+  ExReleaseFastMutex(&DataQueue->Lock);
+
+  //
+  // Done!
+  //
+  return;
+}
+
+//
+// CancelPendingIrpList
+//
+//   This routine cancels the control IRPs waiting on the service queue or the
+//   batch queue.
+//
+// Inputs:
+//   List - this is the list to traverse
+//   ListLock - this is the fast mutex protecting the list
+//   FileObject - this is the file object to match against the requests being cancelled.  If it is
+//                zero, it indicates that all entries on the queue should be cancelled.
+//
+// Outputs:
+//   None.
+//
+// Returns:
+//   VOID function
+//
+// Notes:
+//   Unlike the data queues, these queues hold the control IRPs themselves.
+//
+static VOID CancelPendingIrpList(PLIST_ENTRY List, PFAST_MUTEX ListLock, PFILE_OBJECT FileObject)
+{
+  PLIST_ENTRY listEntry;
+  PLIST_ENTRY nextListEntry;
+  LIST_ENTRY cancelled;
+  PIRP irp;
+
+  InitializeListHead(&cancelled);
+
+  ExAcquireFastMutex(ListLock);
+
+  for (listEntry = List->Flink;
+       listEntry != List;
+       listEntry = nextListEntry) {
+
+    nextListEntry = listEntry->Flink;
+
+    irp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+
+    if ((NULL == FileObject) ||
+        (IoGetCurrentIrpStackLocation(irp)->FileObject == FileObject)) {
+
+      RemoveEntryList(listEntry);
+
+      InsertTailList(&cancelled, listEntry);
+
+    }
+
+  }
+
+  ExReleaseFastMutex(ListLock);
+
+  while (!IsListEmpty(&cancelled)) {
+
+    irp = CONTAINING_RECORD(RemoveHeadList(&cancelled), IRP, Tail.Overlay.ListEntry);
+
+    irp->IoStatus.Status = STATUS_CANCELLED;
+
+    irp->IoStatus.Information = 0;
+
+    IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+  }
+}
+
+//
+// CancelPendingDataRequests
+//
+//   This routine cancels requests on every read and write queue of the data
+//   device.
+//
+// Inputs:
+//   DataExt - this is the data device extension
+//   FileObject - this is the file object to match against the requests being cancelled.  If it is
+//                zero, it indicates that all entries on the queues should be cancelled.
+//
+// Outputs:
+//   None.
+//
+// Returns:
+//   VOID function
+//
+// Notes:
+//   None.
+//
+static VOID CancelPendingDataRequests(POSR_COMM_DATA_DEVICE_EXTENSION DataExt, PFILE_OBJECT FileObject)
+{
+  ULONG index;
+
+  for (index = 0; index < OSR_COMM_DATA_QUEUES; index++) {
+
+    CancelPendingRequestList(&DataExt->ReadQueues[index], FileObject);
+
+    CancelPendingRequestList(&DataExt->WriteQueues[index], FileObject);
+
+  }
+}
+
+//
+// UnmapBuffers
+//
+//  This routine unlocks and frees a set of registered buffers
+//
+// Inputs:
+//  Buffers - this is the array of buffers
+//  Count - this is the number of buffers in the array that are mapped
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The buffers must no longer be reachable from the control extension.
+//
+static VOID UnmapBuffers(POSR_COMM_MAPPED_BUFFER Buffers, ULONG Count)
+{
+  ULONG index;
+
+  for (index = 0; index < Count; index++) {
+
+    MmUnlockPages(Buffers[index].Mdl);
+
+    IoFreeMdl(Buffers[index].Mdl);
+
+  }
+
+  ExFreePool(Buffers);
+}
+
+//
+// ReleaseRegisteredBuffers
+//
+//  This routine unregisters the service buffers registered through a handle
+//
+// Inputs:
+//  FileObject - this is the handle the buffers were registered through
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the buffers are no longer used
+//  STATUS_INVALID_DEVICE_STATE - no buffers were registered through this handle
+//  STATUS_DEVICE_BUSY - a batched exchange waits for requests in one of them
+//
+// Notes:
+//  A write being copied into one of the buffers holds the service queue lock,
+//  and so does a batch being filled into one, so once the buffers are detached
+//  under it nothing uses them any more.  Cleanup cancels the waiting exchanges
+//  of the handle first, so it never finds the buffers busy.
+//
+static NTSTATUS ReleaseRegisteredBuffers(PFILE_OBJECT FileObject)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  POSR_COMM_MAPPED_BUFFER buffers;
+  ULONG count;
+  PLIST_ENTRY listEntry;
+  PIRP irp;
+
+  ExAcquireFastMutex(&controlExt->ServiceQueueLock);
+
+  //
+  // Only the owner's exchanges can wait on a registered buffer
+  //
+  for (listEntry = controlExt->BatchQueue.Flink;
+       listEntry != &controlExt->BatchQueue;
+       listEntry = listEntry->Flink) {
+
+    irp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+
+    if (OSR_COMM_BATCH_BUFFER_REGISTERED(irp) && FileObject == controlExt->BufferRegistry.Owner) {
+
+      ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+      return STATUS_DEVICE_BUSY;
+
+    }
+
+  }
+
+  buffers = OsrCommBufferRegistryDetach(&controlExt->BufferRegistry, FileObject, &count);
+
+  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+  if (NULL == buffers) {
+
+    return STATUS_INVALID_DEVICE_STATE;
+
+  }
+
+  UnmapBuffers(buffers, count);
+
+  return STATUS_SUCCESS;
+}
+
+//
+// LookupRegisteredBuffer
+//
+//  This routine finds the registered buffer a control request names
+//
+// Inputs:
+//  ControlIrp - this is the control IRP the request came in
+//  ControlRequest - this is the request; RequestBuffer names a registered buffer
+//
+// Outputs:
+//  ControlRequest->RequestBufferLength is clipped to the registered length
+//
+// Returns:
+//  The system address of the buffer, or NULL if the control request's handle
+//  has no such buffer registered
+//
+// Notes:
+//  The caller holds the service queue lock until it is done with the buffer.
+//
+static PVOID LookupRegisteredBuffer(PIRP ControlIrp, POSR_COMM_CONTROL_REQUEST ControlRequest)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  POSR_COMM_MAPPED_BUFFER buffer;
+
+  buffer = OsrCommBufferRegistryLookup(&controlExt->BufferRegistry,
+                                       IoGetCurrentIrpStackLocation(ControlIrp)->FileObject,
+                                       OSR_COMM_REGISTERED_BUFFER_INDEX(ControlRequest->RequestBuffer));
+
+  if (NULL == buffer) {
+
+    return NULL;
+
+  }
+
+  if (ControlRequest->RequestBufferLength > buffer->Length) {
+
+    ControlRequest->RequestBufferLength = buffer->Length;
+
+  }
+
+  return buffer->SystemAddress;
+}
+
+//
+// 
+//OsrCommCleanup
+//  This is the cleanup entry point
+//
+// Inputs:
+//  DeviceObject - this is the device object on which we are operating
+//  Irp - this is the cleanup IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  SUCCESS - the operation was successful.
+//
+// Notes:
+//  None.
+//
+NTSTATUS OsrCommCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+//	PLIST_ENTRY listEntry;
+//  PLIST_ENTRY nextListEntry;
+  POSR_COMM_DATA_DEVICE_EXTENSION dataExt;
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt;
+
+  DbgPrint("OsrCommCleanup: entered. \n");
+
+  //
+  // If this is the control object, we need to deal with it closing,
+  // in case there are any existing threads waiting for answers from
+  // the control object.
+  //
+  if (OSR_COMM_CONTROL_TYPE == DeviceObject->DeviceType) {
+
+    //
+    // Need the data device
+    //
+    dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
+    controlExt = (POSR_COMM_CONTROL_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    //
+    // The control IRPs of this handle are cancelled; those of other service
+    // handles keep serving the data requests
+    //
+    CancelPendingIrpList(&controlExt->ServiceQueue,
+                         &controlExt->ServiceQueueLock,
+                         IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    CancelPendingIrpList(&controlExt->BatchQueue,
+                         &controlExt->ServiceQueueLock,
+                         IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    if (OSR_COMM_SERVICE_HANDLE == IoGetCurrentIrpStackLocation(Irp)->FileObject->FsContext &&
+        0 == InterlockedDecrement(&controlExt->ServiceHandles)) {
+
+      //
+      // Set the device state
+      //
+      dataExt->DeviceState = OSR_COMM_DATA_DEVICE_INACTIVE;
+
+      //
+      // Nobody is left to answer: we must cancel all pending requests on the
+      // queues, which takes them off the service request queue as well
+      //
+      CancelPendingDataRequests(dataExt, NULL);
+
+    }
+
+    //
+    // Microburst readers wait on the control device as well
+    //
+    microburst_cancel_readers(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    //
+    // A record ring registered through this handle must not outlive it
+    //
+    shared_ring_unregister(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    //
+    // Nor may the buffers it registered
+    //
+    ReleaseRegisteredBuffers(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    //
+    // Nor the view of the counters page it mapped
+    //
+    counters_page_unmap(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+  }
+
+  //
+  // If this is the data object, we need to find any pending requests
+  // and remove them from the queue
+  //
+  if (OSR_COMM_DATA_TYPE == DeviceObject->DeviceType) {
+
+    //
+    // We need to walk the list of pending requests and
+    // remove any matching the file object in the cleanup request.
+    //
+    dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    //
+    // Clean up the pending read and write queues; requests the service has
+    // not picked up leave the service request queue with them
+    //
+    CancelPendingDataRequests(dataExt, IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    //
+    // Each handle has its own place in the microburst events of the record stream
+    //
+    microburst_forget_reader(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+  }
+
+  //
+  // Tell the caller "yes"
+  //
+  Irp->IoStatus.Status = STATUS_SUCCESS;
+
+  Irp->IoStatus.Information = 0;
+
+  IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+  //
+  // Done.
+  //
+  return STATUS_SUCCESS;
+
+}
+
+//
+// Close
+//
+//  This is the close entry point
+//
+// Inputs:
+//  DeviceObject - this is the device object on which we are operating
+//  Irp - this is the close IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  SUCCESS - the operation was successful.
+//
+// Notes:
+//  None.
+//
+NTSTATUS OsrCommClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(DeviceObject);
+  //
+  // Tell the caller "yes"
+  //
+  Irp->IoStatus.Status = STATUS_SUCCESS;
+
+  Irp->IoStatus.Information = 0;
+
+  IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+  //
+  // Done.
+  //
+  return STATUS_SUCCESS;
+
+}
+
+
+
+//
+// CompleteDataRequest
+//
+//  This routine completes the data request a response is for
+//
+// Inputs:
+//  ResponseType - this is OSR_COMM_READ_RESPONSE or OSR_COMM_WRITE_RESPONSE
+//  RequestID - this is the ID of the data request
+//  ResponseBufferLength - this is the length of the service's response data,
+//                         which is not passed on: reads get the record stream
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the operation completed successfully
+//  STATUS_INVALID_PARAMETER - the response is not valid
+//
+// Notes:
+//  Responses to unknown (or already completed) request IDs are ignored.  This
+//  is shared by the single and the batched responses.
+//
+static NTSTATUS CompleteDataRequest(ULONG ResponseType, ULONG RequestID, ULONG ResponseBufferLength)
+{
+  POSR_COMM_REQUEST_TABLE table;
+  PFAST_MUTEX queueLock;
+//  PLIST_ENTRY nextEntry;
+  POSR_COMM_DATA_REQUEST dataRequest = NULL;
+  NTSTATUS status = STATUS_SUCCESS;
+  PVOID requestBuffer;
+  PIO_STACK_LOCATION irpSp;
+  ULONG bytesToCopy;
+  POSR_COMM_DATA_QUEUE dataQueue;
+//  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt = (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  //UCHAR* next_addr = NULL;
+
+  UNREFERENCED_PARAMETER(ResponseBufferLength);
+
+  //
+  // Let's pick the right queue to process: the request ID says which of the
+  // read or write queues
+  //
+  if (OSR_COMM_READ_RESPONSE == ResponseType) {
+
+    dataQueue = DataQueueOf(FALSE, RequestID);
+    
+  } else if (OSR_COMM_WRITE_RESPONSE == ResponseType) {
+
+      dataQueue = DataQueueOf(TRUE, RequestID);
+
+  } else {
+
+    //
+    // Invalid response
+    //
+    return STATUS_INVALID_PARAMETER;
+
+  }
+
+  table = &dataQueue->Table;
+  queueLock = &dataQueue->Lock;
+        
+  ExAcquireFastMutex(queueLock);
+
+  //
+  // The request ID indexes the queue's request table: no need to walk the queue
+  //
+  dataRequest = LookupRequest(table, RequestID);
+
+  if (dataRequest) {
+
+    //
+    // This is our request, process it:
+    //  - Remove it from the list
+    //  - Transfer the data
+    //  - Indicate the results
+    //  - Complete the IRP
+    //
+    RemoveEntryList(&dataRequest->ListEntry);
+
+    RemoveRequest(table, dataRequest);
+
+    requestBuffer = MmGetSystemAddressForMdlSafe(dataRequest->Irp->MdlAddress, NormalPagePriority);
+
+    if (NULL == requestBuffer) {
+      //
+      // We were unable to obtain the system PTEs
+      //
+      dataRequest->Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+      dataRequest->Irp->IoStatus.Information = 0;
+
+      IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+      status = STATUS_INSUFFICIENT_RESOURCES;
+
+      FreeDataRequest(dataRequest);
+
+      ExReleaseFastMutex(queueLock);
+
+      return status;
+
+    }
+
+    irpSp = IoGetCurrentIrpStackLocation(dataRequest->Irp);
+
+    if (OSR_COMM_WRITE_RESPONSE == ResponseType) {
+
+      //
+      // The payload went to the service; the caller's buffer is left alone
+      //
+      bytesToCopy = irpSp->Parameters.Write.Length;
+
+    } else {
+
+      //
+      // A read returns a record stream (see HVRecord.h), packed with as many
+      // records as the read buffer holds
+      //
+      bytesToCopy = 0;
+
+      //
+      // We run this in a try/except to protect against bogus pointers, the usual
+      //
+      __try {
+
+        bytesToCopy = record_export(irpSp->FileObject, requestBuffer, irpSp->Parameters.Read.Length);
+
+      } __except (EXCEPTION_EXECUTE_HANDLER) {
+
+        status = GetExceptionCode();
+
+      }
+
+      if (NT_SUCCESS(status) && 0 == bytesToCopy) {
+
+        status = STATUS_BUFFER_TOO_SMALL;
+
+      }
+
+    }
+
+    dataRequest->Irp->IoStatus.Status = status;
+
+    dataRequest->Irp->IoStatus.Information = NT_SUCCESS(status) ? bytesToCopy : 0;
+
+    IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+    FreeDataRequest(dataRequest);
+
+    //
+    // The control operation was successful in any case
+    //
+    status = STATUS_SUCCESS;
+
+  }
+
+  ExReleaseFastMutex(queueLock);
+
+  //
+  // Return the results of the operation.
+  //
+  return status;
+  
+}
+
+//
+// ProcessResponse
+//
+//  This routine is used to process a response
+//
+// Inputs:
+//  Irp - this is the IRP containing a (validated) response
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the operation completed successfully
+//
+// Notes:
+//  This is a helper function for the device control logic.  It does NOT
+//  complete the control request - that is the job of the caller!  It DOES
+//  complete the data request (if it finds a matching entry).
+//
+
+NTSTATUS ProcessResponse(PIRP Irp)
+
+{
+  POSR_COMM_CONTROL_RESPONSE response;
+  NTSTATUS status;
+
+  DbgPrint("ProcessResponse: Entered. \n");
+
+  //
+  // Get the response packet
+  //
+  response = (POSR_COMM_CONTROL_RESPONSE) Irp->AssociatedIrp.SystemBuffer;
+
+  status = CompleteDataRequest(response->ResponseType,
+                               response->RequestID,
+                               response->ResponseBufferLength);
+
+  if (!NT_SUCCESS(status)) {
+
+    Irp->IoStatus.Status = status;
+
+    Irp->IoStatus.Information = 0;
+
+    //
+    // Caller will handle completing the request
+    //
+
+  }
+
+  return status;
+}
+
+//
+// ProcessControlRequest
+//
+//  This routine is used to either satisfy the control request or enqueue it
+//
+// Inputs:
+//  Irp - this is the IRP that we are processing
+//  ControlRequest - this is the control request (from the IRP, actually)
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  SUCCESS - there's data going back up to the application
+//  PENDING - the IRP will block and wait 'til it is time...
+//
+//
+NTSTATUS ProcessControlRequest(PIRP Irp)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  PLIST_ENTRY listEntry = NULL;
+  NTSTATUS status = STATUS_UNSUCCESSFUL;
+  POSR_COMM_CONTROL_REQUEST controlRequest;
+//  PIRP dataIrp;
+  POSR_COMM_DATA_REQUEST dataRequest;
+  PIO_STACK_LOCATION irpSp;
+  PVOID dataBuffer;
+  ULONG bytesToCopy;
+
+  DbgPrint("ProcessControlRequest: Entered. \n");
+
+  //
+  // First, we need to lock the control queue before we do anything else
+  //
+  ExAcquireFastMutex(&controlExt->ServiceQueueLock);
+
+  ExAcquireFastMutex(&controlExt->RequestQueueLock);
+
+  //
+  // Check request queue
+  //
+  if (!IsListEmpty(&controlExt->RequestQueue)) {
+
+    listEntry = RemoveHeadList(&controlExt->RequestQueue);
+
+    CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ServiceListEntry)->ServiceQueued = FALSE;
+
+    status = STATUS_SUCCESS;
+
+  } else {
+
+    POSR_COMM_CONTROL_REQUEST controlRequest = (POSR_COMM_CONTROL_REQUEST) Irp->AssociatedIrp.SystemBuffer;
+    irpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if(!controlRequest || irpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(OSR_COMM_CONTROL_REQUEST)) {
+
+        status = STATUS_INVALID_PARAMETER;
+
+    } else {
+
+        //
+        // We have to insert the control IRP into the queue
+        //
+        IoMarkIrpPending(Irp);
+
+        DbgPrint("ProcessControlRequest:  Irp %x, RequestBuffer %x RequestBufferLength %x\n.",
+                 Irp,
+                 controlRequest->RequestBuffer,
+                 controlRequest->RequestBufferLength);
+
+        InsertTailList(&controlExt->ServiceQueue, &Irp->Tail.Overlay.ListEntry);
+
+        status = STATUS_PENDING;
+
+    }
+
+  }
+
+  //
+  // OK.  At this point we can drop both locks
+  //
+  ExReleaseFastMutex(&controlExt->RequestQueueLock);
+
+  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+  //
+  // If we found an entry to process, we need to return the information to
+  // the caller here.
+  //
+  if (listEntry) {
+
+    //
+    // This is the request we removed from the queue.
+    //
+    controlRequest = (POSR_COMM_CONTROL_REQUEST) Irp->AssociatedIrp.SystemBuffer;
+
+    dataRequest = CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ServiceListEntry);
+
+    irpSp = IoGetCurrentIrpStackLocation(dataRequest->Irp);
+
+    //
+    // We are going to use the request ID to match the response
+    //
+    controlRequest->RequestID = dataRequest->RequestID;
+
+    //
+    // Is this a read or write?
+    //
+    if (IRP_MJ_WRITE == irpSp->MajorFunction) {
+
+      controlRequest->RequestType = OSR_COMM_WRITE_REQUEST; // : OSR_COMM_READ_REQUEST;
+
+      //
+      // We must copy the data from the user's address space to the control application's
+      // address space.
+      //
+      dataBuffer = MmGetSystemAddressForMdlSafe(dataRequest->Irp->MdlAddress, NormalPagePriority);
+
+      if (NULL == dataBuffer) {
+        //
+        // It failed.
+        //
+        dataRequest->Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+        dataRequest->Irp->IoStatus.Information = 0;
+
+        IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+        FreeDataRequest(dataRequest);
+
+        return status;
+
+      }
+
+      //
+      // Figure out how much data we are going to move.  Allow control app to set its
+      // own MAX size here...
+      //
+      if (irpSp->Parameters.Write.Length < controlRequest->RequestBufferLength) {
+        
+        bytesToCopy = irpSp->Parameters.Write.Length;
+
+      } else {
+
+        bytesToCopy = controlRequest->RequestBufferLength;
+
+      }
+
+      //
+      // Since the control application's address space is "naked" here we must protect our
+      // data copy.
+      //
+      __try {
+
+        RtlCopyMemory(controlRequest->RequestBuffer, dataBuffer, bytesToCopy);
+
+        controlRequest->RequestBufferLength = bytesToCopy;
+
+        status = STATUS_SUCCESS;
+
+      } __except(EXCEPTION_EXECUTE_HANDLER) {
+
+        status = GetExceptionCode();
+
+      }
+
+      //
+      // We return the final results below...
+      //
+
+    } else {
+
+      //
+      // This is a read operation
+      //
+
+      controlRequest->RequestType = OSR_COMM_READ_REQUEST;
+
+      //
+      // For a READ operation, we must lob data into the user's address space
+      //
+      controlRequest->RequestBuffer = NULL;
+
+      controlRequest->RequestBufferLength = IoGetCurrentIrpStackLocation(dataRequest->Irp)->Parameters.Read.Length;
+
+
+      //
+      // We've finished processing the request to this point.  Dispatch to the control application
+      // for further processing.
+      //
+
+      status = STATUS_SUCCESS;
+    }
+
+  }
+
+  if(status == STATUS_SUCCESS) {
+
+      Irp->IoStatus.Information = sizeof(OSR_COMM_CONTROL_REQUEST);
+
+  }
+
+  return status;
+}
+
+//
+// FailDataRequests
+//
+//  This routine fails data requests that were taken off the service request
+//  queue but could not be handed to the service
+//
+// Inputs:
+//  Failed - this is a list of data requests, threaded through ServiceListEntry
+//  Status - this is the status to complete them with
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The requests are also removed from their data queue and request table, so
+//  a late response cannot find them.  No queue locks may be held by the caller.
+//
+static VOID FailDataRequests(PLIST_ENTRY Failed, NTSTATUS Status)
+{
+  POSR_COMM_DATA_REQUEST dataRequest;
+  POSR_COMM_DATA_QUEUE dataQueue;
+
+  while (!IsListEmpty(Failed)) {
+
+    dataRequest = CONTAINING_RECORD(RemoveHeadList(Failed), OSR_COMM_DATA_REQUEST, ServiceListEntry);
+
+    dataQueue = DataQueueOf(IRP_MJ_WRITE == IoGetCurrentIrpStackLocation(dataRequest->Irp)->MajorFunction,
+                            dataRequest->RequestID);
+
+    ExAcquireFastMutex(&dataQueue->Lock);
+
+    RemoveEntryList(&dataRequest->ListEntry);
+
+    RemoveRequest(&dataQueue->Table, dataRequest);
+
+    ExReleaseFastMutex(&dataQueue->Lock);
+
+    dataRequest->Irp->IoStatus.Status = Status;
+
+    dataRequest->Irp->IoStatus.Information = 0;
+
+    IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+    FreeDataRequest(dataRequest);
+
+  }
+}
+
+//
+// FailQueuedDataRequest
+//
+//  This routine fails a data request that is still on its data queue
+//
+// Inputs:
+//  DataQueue - this is the queue the request was inserted in
+//  RequestID - this is the ID its request table handed out
+//  Status - this is the status to complete the data IRP with
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  For a request that could not be handed to a service thread after all.  It
+//  is looked up by ID rather than by pointer: if the cleanup of its handle
+//  cancelled it meanwhile, it is gone and there is nothing left to do.
+//
+static VOID FailQueuedDataRequest(POSR_COMM_DATA_QUEUE DataQueue, ULONG RequestID, NTSTATUS Status)
+{
+  POSR_COMM_DATA_REQUEST dataRequest;
+
+  ExAcquireFastMutex(&DataQueue->Lock);
+
+  dataRequest = LookupRequest(&DataQueue->Table, RequestID);
+
+  if (dataRequest) {
+
+    RemoveEntryList(&dataRequest->ListEntry);
+
+    RemoveRequest(&DataQueue->Table, dataRequest);
+
+  }
+
+  ExReleaseFastMutex(&DataQueue->Lock);
+
+  if (dataRequest) {
+
+    dataRequest->Irp->IoStatus.Status = Status;
+
+    dataRequest->Irp->IoStatus.Information = 0;
+
+    IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+
+    FreeDataRequest(dataRequest);
+
+  }
+}
+
+//
+// FillControlBatch
+//
+//  This routine moves queued data requests into a batched control request
+//
+// Inputs:
+//  Irp - this is the OSR_COMM_CONTROL_EXCHANGE_BATCH IRP
+//  Failed - this is a list that receives the requests whose data could not
+//           be mapped
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The number of requests placed in the batch
+//
+// Notes:
+//  The caller holds the service queue lock and, once it has dropped it, fails
+//  the requests on Failed.  If requests were placed in the batch, the IRP is
+//  set up for completion.  A write whose payload does not fit is left queued
+//  for the next batch, unless it is the first one: it is then truncated, the
+//  way a single control request truncates it to RequestBufferLength.
+//
+static ULONG FillControlBatch(PIRP Irp, PLIST_ENTRY Failed)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  PIO_STACK_LOCATION dataSp;
+  OSR_COMM_BATCH_WRITER writer;
+  POSR_COMM_DATA_REQUEST dataRequest;
+  PVOID dataBuffer;
+  ULONG payload;
+
+  //
+  // Mapped (or looked up) when the IRP was first processed
+  //
+  OsrCommBatchWriterInit(&writer, OSR_COMM_BATCH_BUFFER(Irp), OSR_COMM_BATCH_BUFFER_LENGTH(Irp));
+
+  ExAcquireFastMutex(&controlExt->RequestQueueLock);
+
+  while (!IsListEmpty(&controlExt->RequestQueue)) {
+
+    dataRequest = CONTAINING_RECORD(controlExt->RequestQueue.Flink, OSR_COMM_DATA_REQUEST, ServiceListEntry);
+
+    dataSp = IoGetCurrentIrpStackLocation(dataRequest->Irp);
+
+    payload = IRP_MJ_WRITE == dataSp->MajorFunction ? dataSp->Parameters.Write.Length : 0;
+
+    if (!OsrCommBatchWriterFit(&writer, &payload)) {
+
+      break;
+
+    }
+
+    RemoveEntryList(&dataRequest->ServiceListEntry);
+
+    dataRequest->ServiceQueued = FALSE;
+
+    if (IRP_MJ_WRITE == dataSp->MajorFunction) {
+
+      dataBuffer = MmGetSystemAddressForMdlSafe(dataRequest->Irp->MdlAddress, NormalPagePriority);
+
+      if (NULL == dataBuffer) {
+
+        InsertTailList(Failed, &dataRequest->ServiceListEntry);
+
+        continue;
+
+      }
+
+      //
+      // Both buffers are locked and mapped: no exception handler needed
+      //
+      RtlCopyMemory(writer.Next + 1, dataBuffer, payload);
+
+      if (!OsrCommBatchWriterAppend(&writer, dataRequest->RequestID, OSR_COMM_WRITE_REQUEST, payload, payload)) {
+
+        break;
+
+      }
+
+    } else if (!OsrCommBatchWriterAppend(&writer, dataRequest->RequestID, OSR_COMM_READ_REQUEST,
+                                         dataSp->Parameters.Read.Length, 0)) {
+
+      break;
+
+    }
+
+  }
+
+  ExReleaseFastMutex(&controlExt->RequestQueueLock);
+
+  if (writer.Batch->Count) {
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    Irp->IoStatus.Information = OsrCommBatchWriterLength(&writer);
+
+  }
+
+  return writer.Batch->Count;
+}
+
+//
+// ProcessExchangeBatch
+//
+//  This routine completes the data requests answered by a batched response,
+//  then either fills the batched control request or enqueues it
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  SUCCESS - there are requests going back up to the application, or there
+//            is no output buffer and the completions were applied
+//  PENDING - the IRP will block until a data request is queued
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid OSR_COMM_BATCH_RESPONSE,
+//                             or names a registered buffer the handle does not have
+//  STATUS_BUFFER_TOO_SMALL - the output (or registered) buffer cannot hold one OSR_COMM_BATCH_ENTRY
+//
+// Notes:
+//  Like ProcessControlRequest, it does NOT complete the IRP.  One round trip
+//  through here answers and fetches up to OSR_COMM_BATCH_MAX_REQUESTS data
+//  requests.  The control code is METHOD_OUT_DIRECT, so the write payloads are
+//  copied once, straight into the service's locked pages.  A service that
+//  registered its request buffers names one in RegisteredBuffer instead of
+//  passing an output buffer: then not even the I/O manager locks pages per
+//  exchange.  A service that answers requests after its exchange went back
+//  down sends the late completions without an output buffer.
+//
+NTSTATUS ProcessExchangeBatch(PIRP Irp)
+{
+  POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
+    (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  POSR_COMM_BATCH_RESPONSE response = (POSR_COMM_BATCH_RESPONSE) Irp->AssociatedIrp.SystemBuffer;
+  ULONG inputLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+  ULONG outputLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+  ULONG registered = 0;
+  POSR_COMM_MAPPED_BUFFER mapped;
+  PVOID batchBuffer = NULL;
+  LIST_ENTRY failed;
+  NTSTATUS status;
+  ULONG index;
+
+  Irp->IoStatus.Information = 0;
+
+  //
+  // The completions are optional: the first call of a service has none
+  //
+  if (inputLength) {
+
+    if (!OsrCommBatchResponseValid(response, inputLength) ||
+        (response->RegisteredBuffer && outputLength)) {
+
+      Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+
+      return STATUS_INVALID_PARAMETER;
+
+    }
+
+    registered = response->RegisteredBuffer;
+
+  }
+
+  if (outputLength) {
+
+    if (outputLength < OSR_COMM_BATCH_MIN_LENGTH ||
+        NULL == Irp->MdlAddress ||
+        NULL == (batchBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute))) {
+
+      Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+
+      return STATUS_BUFFER_TOO_SMALL;
+
+    }
+
+  }
+
+  if (inputLength) {
+
+    //
+    // A bad completion does not stop the others: like a single response, it
+    // is simply not applied
+    //
+    for (index = 0; index < response->Count; index++) {
+
+      CompleteDataRequest(response->Completions[index].ResponseType,
+                          response->Completions[index].RequestID,
+                          response->Completions[index].ResponseBufferLength);
+
+    }
+
+  }
+
+  //
+  // Completions only
+  //
+  if (0 == outputLength && 0 == registered) {
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    return STATUS_SUCCESS;
+
+  }
+
+  InitializeListHead(&failed);
+
+  ExAcquireFastMutex(&controlExt->ServiceQueueLock);
+
+  if (registered) {
+
+    //
+    // Registered through this handle, and still locked and mapped: nothing
+    // to probe or map per exchange.  Unregistering waits for the IRP to leave
+    // the batch queue, and both happen under this lock.
+    //
+    mapped = OsrCommBufferRegistryLookup(&controlExt->BufferRegistry, irpSp->FileObject, registered - 1);
+
+    if (NULL == mapped) {
+
+      status = STATUS_INVALID_PARAMETER;
+
+    } else if (mapped->Length < OSR_COMM_BATCH_MIN_LENGTH) {
+
+      status = STATUS_BUFFER_TOO_SMALL;
+
+    } else {
+
+      status = STATUS_SUCCESS;
+
+      batchBuffer = mapped->SystemAddress;
+
+      outputLength = mapped->Length;
+
+    }
+
+    if (!NT_SUCCESS(status)) {
+
+      ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+      //
+      // The completions were applied all the same
+      //
+      Irp->IoStatus.Status = status;
+
+      return status;
+
+    }
+
+  }
+
+  //
+  // Where FillControlBatch writes, now or once the IRP is taken off the batch queue
+  //
+  OSR_COMM_BATCH_BUFFER(Irp) = batchBuffer;
+
+  OSR_COMM_BATCH_BUFFER_LENGTH(Irp) = outputLength;
+
+  OSR_COMM_BATCH_BUFFER_REGISTERED(Irp) = (PVOID) (ULONG_PTR) (registered != 0);
+
+  if (FillControlBatch(Irp, &failed)) {
+
+    status = STATUS_SUCCESS;
+
+  } else {
+
+    IoMarkIrpPending(Irp);
+
+    InsertTailList(&controlExt->BatchQueue, &Irp->Tail.Overlay.ListEntry);
+
+    status = STATUS_PENDING;
+
+  }
+
+  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+  FailDataRequests(&failed, STATUS_INSUFFICIENT_RESOURCES);
+
+  return status;
+}
+
+//
+// ProcessQueryHistograms
+//
+//  This routine returns the merged frame size / inter-arrival histograms
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the snapshot was copied to the output buffer
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_HISTOGRAM_SNAPSHOT
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessQueryHistograms(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+
+  if (irpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(HV_HISTOGRAM_SNAPSHOT)) {
+
+    Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_BUFFER_TOO_SMALL;
+
+  }
+
+  //
+  // METHOD_BUFFERED: the system buffer is ours, no need for __try
+  //
+  port_stats_snapshot((PHV_HISTOGRAM_SNAPSHOT) Irp->AssociatedIrp.SystemBuffer);
+
+  Irp->IoStatus.Status = STATUS_SUCCESS;
+
+  Irp->IoStatus.Information = sizeof(HV_HISTOGRAM_SNAPSHOT);
+
+  return STATUS_SUCCESS;
+}
+
+//
+// ProcessSetMicroburstConfig
+//
+//  This routine changes the microburst detection threshold
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_MICROBURST_CONFIG
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetMicroburstConfig(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  PHV_MICROBURST_CONFIG config = (PHV_MICROBURST_CONFIG) Irp->AssociatedIrp.SystemBuffer;
+
+  Irp->IoStatus.Information = 0;
+
+  if (irpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(HV_MICROBURST_CONFIG) ||
+      0 == config->ThresholdBytes) {
+
+    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+
+    return STATUS_INVALID_PARAMETER;
+
+  }
+
+  microburst_set_config(config);
+
+  Irp->IoStatus.Status = STATUS_SUCCESS;
+
+  return STATUS_SUCCESS;
+}
+
+//
+// ProcessQueryGovernor
+//
+//  This routine returns the configuration and per-processor state of the
+//  sampling governor
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the state was copied to the output buffer
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold one processor
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessQueryGovernor(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  ULONG length = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+  if (length < sizeof(HV_GOVERNOR_STATE)) {
+
+    Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_BUFFER_TOO_SMALL;
+
+  }
+
+  Irp->IoStatus.Information = governor_query((PHV_GOVERNOR_STATE) Irp->AssociatedIrp.SystemBuffer, length);
+
+  Irp->IoStatus.Status = STATUS_SUCCESS;
+
+  return STATUS_SUCCESS;
+}
+
+//
+// ProcessSetGovernorConfig
+//
+//  This routine changes the budget of the sampling governor, or pins it to a mode
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_GOVERNOR_CONFIG
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetGovernorConfig(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  PHV_GOVERNOR_CONFIG config = (PHV_GOVERNOR_CONFIG) Irp->AssociatedIrp.SystemBuffer;
+  BOOLEAN valid;
+
+  Irp->IoStatus.Information = 0;
+
+  valid = irpSp->Parameters.DeviceIoControl.InputBufferLength >= sizeof(HV_GOVERNOR_CONFIG);
+
+  if (valid) {
+
+    valid = config->Budget > 0 && config->Budget <= 1000000 &&
+            config->Interval >= HV_GOVERNOR_MIN_INTERVAL && config->Interval <= MAXLONG;
+
+  }
+
+  if (valid && HV_GOVERNOR_MODE_SAMPLED == config->ForcedMode) {
+
+    //
+    // The weight of a sample must be a power of 2 the governor itself could pick
+    //
+    valid = config->ForcedSampleRate >= 2 && config->ForcedSampleRate <= HV_GOVERNOR_MAX_SAMPLE_RATE &&
+            0 == (config->ForcedSampleRate & (config->ForcedSampleRate - 1));
+
+  } else if (valid) {
+
+    valid = HV_GOVERNOR_MODE_AUTO == config->ForcedMode ||
+            HV_GOVERNOR_MODE_FULL == config->ForcedMode ||
+            HV_GOVERNOR_MODE_HEADERS == config->ForcedMode;
+
+  }
+
+  if (!valid) {
+
+    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+
+    return STATUS_INVALID_PARAMETER;
+
+  }
 
-  DbgPrint("ProcessResponse: Entered. \n");
+  governor_set_config(config);
 
-  //
-  // Get the response packet
-  //
-  response = (POSR_COMM_CONTROL_RESPONSE) Irp->AssociatedIrp.SystemBuffer;
+  Irp->IoStatus.Status = STATUS_SUCCESS;
 
-  //
-  // Let's pick the right queue to process
-  //
-  if (OSR_COMM_READ_RESPONSE == response->ResponseType) {
+  return STATUS_SUCCESS;
+}
 
-    queue = &dataExt->ReadRequestQueue;
-    queueLock = &dataExt->ReadRequestQueueLock;
-    
-  } else if (OSR_COMM_WRITE_RESPONSE == response->ResponseType) {
+//
+// ProcessSetCaptureConfig
+//
+//  This routine changes the capture filter, snaplen and sampling, and turns
+//  capture on or off
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_CAPTURE_CONFIG
+//  STATUS_INSUFFICIENT_RESOURCES - the capture rings could not be allocated
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetCaptureConfig(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  PHV_CAPTURE_CONFIG config = (PHV_CAPTURE_CONFIG) Irp->AssociatedIrp.SystemBuffer;
+  NTSTATUS status;
 
-      queue = &dataExt->WriteRequestQueue;
-      queueLock = &dataExt->WriteRequestQueueLock;
+  Irp->IoStatus.Information = 0;
 
-  } else {
+  if (irpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(HV_CAPTURE_CONFIG) ||
+      0 == config->Snaplen || config->Snaplen > HV_CAPTURE_MAX_SNAPLEN ||
+      0 == config->SampleRate || config->SampleRate > MAXLONG) {
 
-    //
-    // Invalid response
-    //
     Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
 
-    Irp->IoStatus.Information = 0;
-
-    //
-    // Caller will handle completing the request
-    //
     return STATUS_INVALID_PARAMETER;
 
   }
-        
-  ExAcquireFastMutex(queueLock);
 
-  for (listEntry = queue->Flink;
-       listEntry != queue;
-       listEntry = listEntry->Flink) {
+  status = capture_set_config(config);
 
-    //
-    // Check to see if this response matches up
-    //
-    dataRequest = CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ListEntry);
+  Irp->IoStatus.Status = status;
 
-    if (dataRequest->RequestID == response->RequestID) {
+  return status;
+}
 
-      //
-      // This is our request, process it:
-      //  - Remove it from the list
-      //  - Transfer the data
-      //  - Indicate the results
-      //  - Complete the IRP
-      //
-      RemoveEntryList(listEntry);
+//
+// ProcessDrainCapture
+//
+//  This routine moves the captured records from the per-processor rings to the
+//  caller's buffer
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - an HV_CAPTURE_BATCH (possibly without records) was returned
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_CAPTURE_BATCH
+//  STATUS_INSUFFICIENT_RESOURCES - the output buffer could not be mapped
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The control code is
+//  METHOD_OUT_DIRECT, so the records are copied only once, straight into the
+//  caller's pages.
+//
+NTSTATUS ProcessDrainCapture(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  ULONG length = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+  PHV_CAPTURE_BATCH batch;
 
-      requestBuffer = MmGetSystemAddressForMdlSafe(dataRequest->Irp->MdlAddress, NormalPagePriority);
+  Irp->IoStatus.Information = 0;
 
-      if (NULL == requestBuffer) {
-        //
-        // We were unable to obtain the system PTEs
-        //
-        dataRequest->Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+  if (length < sizeof(HV_CAPTURE_BATCH) || NULL == Irp->MdlAddress) {
 
-        dataRequest->Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
 
-        IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+    return STATUS_BUFFER_TOO_SMALL;
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
+  }
 
-        ExFreePool(dataRequest);
+  batch = (PHV_CAPTURE_BATCH) MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
 
-        break; // from loop
+  if (NULL == batch) {
 
-      }
+    Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
 
-      //
-      // Figure out how much data we are going to actually copy here.
-      //
-      irpSp = IoGetCurrentIrpStackLocation(dataRequest->Irp);
-      
-      if (response->ResponseBufferLength < irpSp->Parameters.Read.Length ||
-		  response->ResponseBufferLength < 2000 * 2) {
-        
-		  ExReleaseFastMutex(queueLock);
+    return STATUS_INSUFFICIENT_RESOURCES;
 
-		  //TODO: does it leak if I return here?
-		  return STATUS_INVALID_PARAMETER;
+  }
 
-        //bytesToCopy = response->ResponseBufferLength;
-        
-      } else {
-        
-        bytesToCopy = irpSp->Parameters.Read.Length;
-        
-      }
+  Irp->IoStatus.Information = capture_drain(batch, length);
 
-	  
-	  ExAcquireFastMutex(&g_inbound_mutex);
-	  ExAcquireFastMutex(&g_outbound_mutex);
-	  //next_addr = ((unsigned char*)requestBuffer) + sizeof(ulCount);
-      //
-      // We run this in a try/except to protect against bogus pointers, the usual
-      //
-      __try { 
-		  RtlCopyMemory(requestBuffer, g_pInboundData, 2000);
-		  RtlCopyMemory((BYTE*)requestBuffer + 2000, g_pOutboundData, 2000);
+  Irp->IoStatus.Status = STATUS_SUCCESS;
 
-      } __except (EXCEPTION_EXECUTE_HANDLER) {
+  return STATUS_SUCCESS;
+}
 
-        status = GetExceptionCode();
+//
+// ProcessRegisterRing
+//
+//  This routine locks the caller's buffer and lays the shared record rings
+//  out in it
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the datapath now writes records to the buffer
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_RING_REGISTER
+//  STATUS_BUFFER_TOO_SMALL - the buffer cannot hold HV_RING_MIN_RECORDS per processor
+//  STATUS_DEVICE_BUSY - a buffer is already registered
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  This is the only probe
+//  and lock of the buffer; it stays locked until it is unregistered or the
+//  registering handle is cleaned up.
+//
+NTSTATUS ProcessRegisterRing(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  PHV_RING_REGISTER registration = (PHV_RING_REGISTER) Irp->AssociatedIrp.SystemBuffer;
+  NTSTATUS status;
 
-      }
+  Irp->IoStatus.Information = 0;
 
-	  ExReleaseFastMutex(&g_inbound_mutex);
-	  ExReleaseFastMutex(&g_outbound_mutex);
+  if (irpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(HV_RING_REGISTER) ||
+      registration->Buffer > (ULONG64) MAXULONG_PTR) {
 
-      dataRequest->Irp->IoStatus.Status = status;
+    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
 
-      dataRequest->Irp->IoStatus.Information = NT_SUCCESS(status) ? bytesToCopy : 0;
+    return STATUS_INVALID_PARAMETER;
 
-      IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+  }
 
-      ExFreePool(dataRequest);
+  status = shared_ring_register(irpSp->FileObject,
+                                Irp->RequestorMode,
+                                (PVOID) (ULONG_PTR) registration->Buffer,
+                                registration->Length);
 
-      //
-      // The control operation was successful in any case
-      //
-      status = STATUS_SUCCESS;
+  Irp->IoStatus.Status = status;
 
-      //
-      // And break from the loop, no sense looking any farther
-      //
-      break;
+  return status;
+}
 
-    }
-    
-  }
+//
+// ProcessUnregisterRing
+//
+//  This routine stops the datapath from writing to the shared record rings and
+//  unlocks the buffer
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the buffer is no longer used
+//  STATUS_INVALID_DEVICE_STATE - no buffer was registered through this handle
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnregisterRing(PIRP Irp)
+{
+  NTSTATUS status;
 
-  ExReleaseFastMutex(queueLock);
+  status = shared_ring_unregister(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+  Irp->IoStatus.Status = status;
+
+  Irp->IoStatus.Information = 0;
 
-  //
-  // Return the results of the operation.
-  //
   return status;
-  
 }
 
 //
-// ProcessControlRequest
+// ProcessRegisterBuffers
 //
-//  This routine is used to either satisfy the control request or enqueue it
+//  This routine locks and maps the service buffers that write payloads are
+//  copied to
 //
 // Inputs:
-//  Irp - this is the IRP that we are processing
-//  ControlRequest - this is the control request (from the IRP, actually)
+//  Irp - this is the device control IRP
 //
 // Outputs:
 //  None.
 //
 // Returns:
-//  SUCCESS - there's data going back up to the application
-//  PENDING - the IRP will block and wait 'til it is time...
+//  STATUS_SUCCESS - control requests may now name the buffers by index
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid OSR_COMM_BUFFER_REGISTRATION
+//  STATUS_INSUFFICIENT_RESOURCES - a buffer could not be locked or mapped
+//  STATUS_DEVICE_BUSY - buffers are already registered
 //
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  This is the only probe,
+//  lock and map of the buffers; they stay mapped until they are unregistered
+//  or the registering handle is cleaned up.  The I/O manager calls us in the
+//  service's context, which the probe needs.
 //
-NTSTATUS ProcessControlRequest(PIRP Irp)
+NTSTATUS ProcessRegisterBuffers(PIRP Irp)
 {
   POSR_COMM_CONTROL_DEVICE_EXTENSION controlExt =
     (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
-  PLIST_ENTRY listEntry = NULL;
-  NTSTATUS status = STATUS_UNSUCCESSFUL;
-  POSR_COMM_CONTROL_REQUEST controlRequest;
-//  PIRP dataIrp;
-  POSR_COMM_DATA_REQUEST dataRequest;
-  PIO_STACK_LOCATION irpSp;
-  PVOID dataBuffer;
-  ULONG bytesToCopy;
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  POSR_COMM_BUFFER_REGISTRATION registration = (POSR_COMM_BUFFER_REGISTRATION) Irp->AssociatedIrp.SystemBuffer;
+  ULONG inputLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+  POSR_COMM_MAPPED_BUFFER buffers;
+  NTSTATUS status = STATUS_SUCCESS;
+  ULONG index;
 
-  DbgPrint("ProcessControlRequest: Entered. \n");
+  Irp->IoStatus.Information = 0;
 
-  //
-  // First, we need to lock the control queue before we do anything else
-  //
-  ExAcquireFastMutex(&controlExt->ServiceQueueLock);
+  if (!OsrCommBufferRegistrationValid(registration, inputLength)) {
 
-  ExAcquireFastMutex(&controlExt->RequestQueueLock);
+    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
 
-  //
-  // Check request queue
-  //
-  if (!IsListEmpty(&controlExt->RequestQueue)) {
+    return STATUS_INVALID_PARAMETER;
 
-    listEntry = RemoveHeadList(&controlExt->RequestQueue);
+  }
 
-    status = STATUS_SUCCESS;
+  buffers = (POSR_COMM_MAPPED_BUFFER) ExAllocatePoolWithTag(PagedPool,
+                                                            registration->Count * sizeof(OSR_COMM_MAPPED_BUFFER),
+                                                            'bmCO');
 
-  } else {
+  if (NULL == buffers) {
 
-    POSR_COMM_CONTROL_REQUEST controlRequest = (POSR_COMM_CONTROL_REQUEST) Irp->AssociatedIrp.SystemBuffer;
-    irpSp = IoGetCurrentIrpStackLocation(Irp);
+    Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
 
-    if(!controlRequest || irpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(OSR_COMM_CONTROL_REQUEST)) {
+    return STATUS_INSUFFICIENT_RESOURCES;
 
-        status = STATUS_INVALID_PARAMETER;
+  }
 
-    } else {
+  for (index = 0; index < registration->Count; index++) {
 
-        //
-        // We have to insert the control IRP into the queue
-        //
-        IoMarkIrpPending(Irp);
+    buffers[index].Length = registration->Buffers[index].Length;
 
-        DbgPrint("ProcessControlRequest:  Irp %x, RequestBuffer %x RequestBufferLength %x\n.",
-                 Irp,
-                 controlRequest->RequestBuffer,
-                 controlRequest->RequestBufferLength);
+    buffers[index].Mdl = IoAllocateMdl((PVOID) (ULONG_PTR) registration->Buffers[index].Buffer,
+                                       buffers[index].Length,
+                                       FALSE,
+                                       FALSE,
+                                       NULL);
 
-        InsertTailList(&controlExt->ServiceQueue, &Irp->Tail.Overlay.ListEntry);
+    if (NULL == buffers[index].Mdl) {
 
-        status = STATUS_PENDING;
+      status = STATUS_INSUFFICIENT_RESOURCES;
+
+      break;
 
     }
 
-  }
+    __try {
 
-  //
-  // OK.  At this point we can drop both locks
-  //
-  ExReleaseFastMutex(&controlExt->RequestQueueLock);
+      MmProbeAndLockPages(buffers[index].Mdl, Irp->RequestorMode, IoWriteAccess);
 
-  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
 
-  //
-  // If we found an entry to process, we need to return the information to
-  // the caller here.
-  //
-  if (listEntry) {
+      status = GetExceptionCode();
 
-    //
-    // This is the request we removed from the queue.
-    //
-    controlRequest = (POSR_COMM_CONTROL_REQUEST) Irp->AssociatedIrp.SystemBuffer;
+    }
 
-    dataRequest = CONTAINING_RECORD(listEntry, OSR_COMM_DATA_REQUEST, ServiceListEntry);
+    if (!NT_SUCCESS(status)) {
 
-    irpSp = IoGetCurrentIrpStackLocation(dataRequest->Irp);
+      IoFreeMdl(buffers[index].Mdl);
 
-    //
-    // We are going to use the request ID to match the response
-    //
-    controlRequest->RequestID = dataRequest->RequestID;
+      break;
 
-    //
-    // Is this a read or write?
-    //
-    if (IRP_MJ_WRITE == irpSp->MajorFunction) {
+    }
 
-      controlRequest->RequestType = OSR_COMM_WRITE_REQUEST; // : OSR_COMM_READ_REQUEST;
+    buffers[index].SystemAddress = MmGetSystemAddressForMdlSafe(buffers[index].Mdl,
+                                                                NormalPagePriority | MdlMappingNoExecute);
 
-      //
-      // We must copy the data from the user's address space to the control application's
-      // address space.
-      //
-      dataBuffer = MmGetSystemAddressForMdlSafe(dataRequest->Irp->MdlAddress, NormalPagePriority);
+    if (NULL == buffers[index].SystemAddress) {
 
-      if (NULL == dataBuffer) {
-        //
-        // It failed.
-        //
-        dataRequest->Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+      MmUnlockPages(buffers[index].Mdl);
 
-        dataRequest->Irp->IoStatus.Information = 0;
+      IoFreeMdl(buffers[index].Mdl);
 
-        IoCompleteRequest(dataRequest->Irp, IO_NO_INCREMENT);
+      status = STATUS_INSUFFICIENT_RESOURCES;
 
-        ExFreePool(dataRequest);
+      break;
 
-        return status;
+    }
 
-      }
+  }
 
-      //
-      // Figure out how much data we are going to move.  Allow control app to set its
-      // own MAX size here...
-      //
-      if (irpSp->Parameters.Write.Length < controlRequest->RequestBufferLength) {
-        
-        bytesToCopy = irpSp->Parameters.Write.Length;
+  if (NT_SUCCESS(status)) {
+
+    ExAcquireFastMutex(&controlExt->ServiceQueueLock);
+
+    if (!OsrCommBufferRegistryAttach(&controlExt->BufferRegistry, irpSp->FileObject, buffers, registration->Count)) {
+
+      status = STATUS_DEVICE_BUSY;
+
+    }
+
+    ExReleaseFastMutex(&controlExt->ServiceQueueLock);
 
-      } else {
+  }
 
-        bytesToCopy = controlRequest->RequestBufferLength;
+  //
+  // index buffers were mapped when the loop stopped
+  //
+  if (!NT_SUCCESS(status)) {
 
-      }
+    UnmapBuffers(buffers, index);
 
-      //
-      // Since the control application's address space is "naked" here we must protect our
-      // data copy.
-      //
-      __try {
+  }
 
-        RtlCopyMemory(controlRequest->RequestBuffer, dataBuffer, bytesToCopy);
+  Irp->IoStatus.Status = status;
 
-        controlRequest->RequestBufferLength = bytesToCopy;
+  return status;
+}
 
-        status = STATUS_SUCCESS;
+//
+// ProcessUnregisterBuffers
+//
+//  This routine unlocks the service buffers registered through a handle
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the buffers are no longer used
+//  STATUS_INVALID_DEVICE_STATE - no buffers were registered through this handle
+//  STATUS_DEVICE_BUSY - a batched exchange waits for requests in one of them
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnregisterBuffers(PIRP Irp)
+{
+  NTSTATUS status;
 
-      } __except(EXCEPTION_EXECUTE_HANDLER) {
+  status = ReleaseRegisteredBuffers(IoGetCurrentIrpStackLocation(Irp)->FileObject);
 
-        status = GetExceptionCode();
+  Irp->IoStatus.Status = status;
 
-      }
+  Irp->IoStatus.Information = 0;
 
-      //
-      // We return the final results below...
-      //
+  return status;
+}
 
-    } else {
+//
+// ProcessMapCounters
+//
+//  This routine maps the counters page read-only into the caller's address
+//  space
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the output buffer holds the HV_COUNTERS_MAPPING of the view
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_COUNTERS_MAPPING
+//  STATUS_DEVICE_BUSY - the handle has a view in another process
+//  STATUS_INSUFFICIENT_RESOURCES - too many handles have a view
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The I/O manager calls
+//  us in the caller's context, which the mapping needs.  The view stays until
+//  it is unmapped or the mapping handle is cleaned up.
+//
+NTSTATUS ProcessMapCounters(PIRP Irp)
+{
+  PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+  NTSTATUS status;
 
-      //
-      // This is a read operation
-      //
+  Irp->IoStatus.Information = 0;
 
-      controlRequest->RequestType = OSR_COMM_READ_REQUEST;
+  if (irpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(HV_COUNTERS_MAPPING)) {
 
-      //
-      // For a READ operation, we must lob data into the user's address space
-      //
-      controlRequest->RequestBuffer = NULL;
+    Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
 
-      controlRequest->RequestBufferLength = IoGetCurrentIrpStackLocation(dataRequest->Irp)->Parameters.Read.Length;
+    return STATUS_BUFFER_TOO_SMALL;
 
+  }
 
-      //
-      // We've finished processing the request to this point.  Dispatch to the control application
-      // for further processing.
-      //
+  //
+  // METHOD_BUFFERED: the system buffer is ours, no need for __try
+  //
+  status = counters_page_map(irpSp->FileObject, (PHV_COUNTERS_MAPPING) Irp->AssociatedIrp.SystemBuffer);
 
-      status = STATUS_SUCCESS;
-    }
+  if (NT_SUCCESS(status)) {
+
+    Irp->IoStatus.Information = sizeof(HV_COUNTERS_MAPPING);
 
   }
 
-  if(status == STATUS_SUCCESS) {
+  Irp->IoStatus.Status = status;
 
-      Irp->IoStatus.Information = sizeof(OSR_COMM_CONTROL_REQUEST);
+  return status;
+}
 
-  }
+//
+// ProcessUnmapCounters
+//
+//  This routine unmaps the view of the counters page mapped through a handle
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the view is gone
+//  STATUS_INVALID_DEVICE_STATE - no view was mapped through this handle
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnmapCounters(PIRP Irp)
+{
+  NTSTATUS status;
+
+  status = counters_page_unmap(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+  Irp->IoStatus.Status = status;
+
+  Irp->IoStatus.Information = 0;
 
   return status;
 }
@@ -795,6 +2578,137 @@ NTSTATUS OsrCommDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
   //
   switch (irpSp->Parameters.DeviceIoControl.IoControlCode) {
     
+    case OSR_COMM_CONTROL_QUERY_HISTOGRAMS:
+    //
+    // Statistics queries are not part of the request/response protocol
+    //
+    status = ProcessQueryHistograms(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_READ_MICROBURSTS:
+    //
+    // Blocks until a burst newer than the caller's cursor is logged
+    //
+    status = microburst_read(Irp);
+
+    if (STATUS_PENDING != status) {
+
+      IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    }
+
+    return status;
+
+    case OSR_COMM_CONTROL_SET_MICROBURST_CONFIG:
+    status = ProcessSetMicroburstConfig(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_QUERY_GOVERNOR:
+    status = ProcessQueryGovernor(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_SET_GOVERNOR_CONFIG:
+    status = ProcessSetGovernorConfig(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_SET_CAPTURE_CONFIG:
+    status = ProcessSetCaptureConfig(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_DRAIN_CAPTURE:
+    status = ProcessDrainCapture(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_REGISTER_RING:
+    status = ProcessRegisterRing(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_UNREGISTER_RING:
+    status = ProcessUnregisterRing(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_REGISTER_BUFFERS:
+    status = ProcessRegisterBuffers(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_UNREGISTER_BUFFERS:
+    status = ProcessUnregisterBuffers(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_MAP_COUNTERS:
+    //
+    // Readers of the page poll it without coming back here
+    //
+    status = ProcessMapCounters(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_UNMAP_COUNTERS:
+    status = ProcessUnmapCounters(Irp);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+
+    case OSR_COMM_CONTROL_WAIT_RING:
+    //
+    // Only an idle ring consumer sleeps here; records never travel in IRPs
+    //
+    status = shared_ring_wait(Irp);
+
+    if (STATUS_PENDING != status) {
+
+      IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    }
+
+    return status;
+
+    case OSR_COMM_CONTROL_EXCHANGE_BATCH:
+    DbgPrint("OsrCommDeviceControl: EXCHANGE_BATCH received.\n");
+    MarkServiceHandle(Irp);
+    status = ProcessExchangeBatch(Irp);
+
+    if (STATUS_PENDING != status) {
+
+      IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    }
+
+    return status;
+
     case OSR_COMM_CONTROL_GET_AND_SEND:
     DbgPrint("OsrCommDeviceControl: GET_AND_SEND received.\n");
     sendResponse = TRUE;
@@ -836,6 +2750,8 @@ NTSTATUS OsrCommDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
   }
 
+  MarkServiceHandle(Irp);
+
   //
   // Parameter validation...
   //
@@ -955,13 +2871,18 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
     (POSR_COMM_CONTROL_DEVICE_EXTENSION) OsrCommDeviceObject->DeviceExtension;
   PLIST_ENTRY listEntry;
   PIRP controlIrp;
+  PIRP batchIrp;
+  LIST_ENTRY failed;
   POSR_COMM_CONTROL_REQUEST controlRequest;
   BOOLEAN writeOp = IRP_MJ_WRITE == IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+  POSR_COMM_DATA_QUEUE dataQueue;
   PFAST_MUTEX queueLock;
   PLIST_ENTRY queue;
+  POSR_COMM_REQUEST_TABLE table;
   PMDL mdl;
   PVOID dataBuffer, controlBuffer;
   ULONG bytesToCopy;
+  ULONG requestID;
 
   if (OSR_COMM_CONTROL_TYPE == DeviceObject->DeviceType) {
 
@@ -975,25 +2896,26 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
   if (OSR_COMM_DATA_TYPE == DeviceObject->DeviceType) {
 
     //
-    // Set the queue to use appropriately
+    // Set the queue to use appropriately: this processor's read or write
+    // queue
     //
     if (writeOp) {
 
         DbgPrint("OsrCommReadWrite: Write Request Received.\n");
 
-        queue = &dataExt->WriteRequestQueue;
-
-        queueLock = &dataExt->WriteRequestQueueLock;
-
     } else {
 
         DbgPrint("OsrCommReadWrite: Read Request Received.\n");
 
-        queue = &dataExt->ReadRequestQueue;
+    }
+
+    dataQueue = DataQueueOf(writeOp, OSR_COMM_REQUEST_NO_SLOT);
 
-        queueLock = &dataExt->ReadRequestQueueLock;
+    queue = &dataQueue->Queue;
 
-    }
+    queueLock = &dataQueue->Lock;
+
+    table = &dataQueue->Table;
 
     //
     // If the device is enabled, enqueue the request
@@ -1005,7 +2927,7 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
           // Data device read must be satisfied by queuing request
           // off to the service.
           //
-          dataRequest = (POSR_COMM_DATA_REQUEST) ExAllocatePoolWithTag(PagedPool, sizeof(OSR_COMM_DATA_REQUEST), 'rdCO');
+          dataRequest = AllocateDataRequest();
 
           if (!dataRequest) {
 
@@ -1017,10 +2939,6 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             break;
           }
       
-          RtlZeroMemory(dataRequest, sizeof(OSR_COMM_DATA_REQUEST));
-      
-          dataRequest->RequestID = (ULONG) InterlockedIncrement(&OsrRequestID);
-      
           dataRequest->Irp = Irp;
       
           //
@@ -1031,11 +2949,30 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
           status = STATUS_PENDING;
 
           //
-          // Insert the request into the appropriate queue here
+          // Insert the request into the appropriate queue here.  The request
+          // table hands out the request ID.
           //
           ExAcquireFastMutex(queueLock);
+
+          if (!InsertRequest(table, dataRequest)) {
+
+            ExReleaseFastMutex(queueLock);
+
+            FreeDataRequest(dataRequest);
+
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+            Irp->IoStatus.Information = 0;
+
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            break;
+
+          }
         
           InsertTailList(queue, &dataRequest->ListEntry);
+
+          requestID = dataRequest->RequestID;
         
           ExReleaseFastMutex(queueLock);
         
@@ -1055,13 +2992,51 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
             InsertTailList(&controlExt->RequestQueue, &dataRequest->ServiceListEntry);
 
+            dataRequest->ServiceQueued = TRUE;
+
             ExReleaseFastMutex(&controlExt->RequestQueueLock);
+
+            //
+            // A waiting batched control request takes this request and any
+            // others that are queued
+            //
+            batchIrp = NULL;
+
+            InitializeListHead(&failed);
+
+            if (!IsListEmpty(&controlExt->BatchQueue)) {
+
+              listEntry = RemoveHeadList(&controlExt->BatchQueue);
+
+              batchIrp = CONTAINING_RECORD(listEntry, IRP, Tail.Overlay.ListEntry);
+
+              if (!FillControlBatch(batchIrp, &failed)) {
+
+                InsertHeadList(&controlExt->BatchQueue, listEntry);
+
+                batchIrp = NULL;
+
+              }
+
+            }
         
             //
             // Release the service queue lock
             //
             ExReleaseFastMutex(&controlExt->ServiceQueueLock);
 
+            if (batchIrp) {
+
+              IoCompleteRequest(batchIrp, IO_NO_INCREMENT);
+
+            }
+
+            //
+            // This may include the request we just queued; its IRP is already
+            // marked pending, so completing it here is fine
+            //
+            FailDataRequests(&failed, STATUS_INSUFFICIENT_RESOURCES);
+
           } else {
 
             //
@@ -1077,7 +3052,7 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             //
             controlRequest = (POSR_COMM_CONTROL_REQUEST) controlIrp->AssociatedIrp.SystemBuffer;
 
-            controlRequest->RequestID = dataRequest->RequestID;
+            controlRequest->RequestID = requestID;
 
             DbgPrint("OsrCommReadWrite:  Irp %x, RequestBuffer %x RequestBufferLength %x\n.",
                      controlIrp,
@@ -1089,97 +3064,107 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
               controlRequest->RequestType = OSR_COMM_WRITE_REQUEST;
 
-              //
-              // Our problem here is that the control buffer is in a different
-              // address space.  So, we need to reach over into that address space and
-              // grab it.
-              //
-              mdl = IoAllocateMdl(controlRequest->RequestBuffer,
-                                  controlRequest->RequestBufferLength,
-                                  FALSE, // should not be any other MDLs associated with control IRP
-                                  FALSE, // no quota charged
-                                  controlIrp); // track the MDL in the control IRP...
+              if (OSR_COMM_IS_REGISTERED_BUFFER(controlRequest->RequestBuffer)) {
 
-              if (NULL == mdl) {
                 //
-                // We failed to get an MDL.  What a pain.
+                // The service registered this buffer up front: it is already
+                // locked and mapped, no page table work here
                 //
-                InsertTailList(&controlExt->ServiceQueue, listEntry);
+                controlBuffer = LookupRegisteredBuffer(controlIrp, controlRequest);
 
-                //
-                // Complete the data request - this falls through and completes below.
-                //
-                status = STATUS_INSUFFICIENT_RESOURCES;
+              } else {
 
                 //
-                // Release the service queue lock
+                // Our problem here is that the control buffer is in a different
+                // address space.  So, we need to reach over into that address space and
+                // grab it.
                 //
-                ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+                mdl = IoAllocateMdl(controlRequest->RequestBuffer,
+                                    controlRequest->RequestBufferLength,
+                                    FALSE, // should not be any other MDLs associated with control IRP
+                                    FALSE, // no quota charged
+                                    controlIrp); // track the MDL in the control IRP...
+
+                if (NULL == mdl) {
+                  //
+                  // We failed to get an MDL.  What a pain.
+                  //
+                  InsertTailList(&controlExt->ServiceQueue, listEntry);
+
+                  //
+                  // Release the service queue lock
+                  //
+                  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+
+                  //
+                  // The data request is queued (and marked pending): it must
+                  // leave its queue and table before it is completed
+                  //
+                  FailQueuedDataRequest(dataQueue, requestID, STATUS_INSUFFICIENT_RESOURCES);
+
+                  status = STATUS_PENDING;
+
+                  break;
+            
+                }
 
-                Irp->IoStatus.Status = status;
-    
-                Irp->IoStatus.Information = 0;
-    
-                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                __try {
+                  //
+                  // Probe and lock the pages
+                  //
+                  MmProbeAndLockProcessPages(mdl,
+                                             IoGetRequestorProcess(controlIrp),
+                                             UserMode,
+                                             IoWriteAccess);
 
-                status = STATUS_PENDING;
+                } __except(EXCEPTION_EXECUTE_HANDLER) {
 
-                break;
-            
-              }
+                  //
+                  // Access probe failed
+                  //
+                  status = GetExceptionCode();
 
-              __try {
-                //
-                // Probe and lock the pages
-                //
-                MmProbeAndLockProcessPages(mdl,
-                                           IoGetRequestorProcess(controlIrp),
-                                           UserMode,
-                                           IoWriteAccess);
+                  //
+                  // Cleanup what we were doing....
+                  //
 
-              } __except(EXCEPTION_EXECUTE_HANDLER) {
+                  IoFreeMdl(mdl);
 
-                //
-                // Access probe failed
-                //
-                status = GetExceptionCode();
+                  //
+                  // IoAllocateMdl attached it: the control IRP goes back on the
+                  // queue and must not complete with a freed MDL
+                  //
+                  controlIrp->MdlAddress = NULL;
 
-                //
-                // Cleanup what we were doing....
-                //
+                  InsertTailList(&controlExt->ServiceQueue, listEntry);
 
-                IoFreeMdl(mdl);
+                  //
+                  // Release the service queue lock
+                  //
+                  ExReleaseFastMutex(&controlExt->ServiceQueueLock);
 
-                InsertTailList(&controlExt->ServiceQueue, listEntry);
+                  FailQueuedDataRequest(dataQueue, requestID, status);
 
-                //
-                // Release the service queue lock
-                //
-                ExReleaseFastMutex(&controlExt->ServiceQueueLock);
+                  status = STATUS_PENDING;
 
-                Irp->IoStatus.Status = status;
-    
-                Irp->IoStatus.Information = 0;
-    
-                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                  break;
 
-                status = STATUS_PENDING;
+                }
 
-                break;
+                //
+                // We now have an MDL we can use
+                //
+                controlBuffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
 
               }
 
-              //
-              // We now have an MDL we can use
-              //
               dataBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
 
-              controlBuffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
-
               if ((NULL == dataBuffer) || (NULL == controlBuffer)) {
 
                 //
-                // Not enough PTEs, obviously. Since we've modified the control IRP we need
+                // Not enough PTEs, obviously (or the service named a buffer it
+                // never registered). Since we've modified the control IRP we need
                 // to complete it here so we don't leave junk lying around.
                 //
                 controlIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
@@ -1188,16 +3173,15 @@ NTSTATUS OsrCommReadWrite(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
                 IoCompleteRequest(controlIrp, IO_NO_INCREMENT);
 
-                status = STATUS_INSUFFICIENT_RESOURCES;
-
                 //
                 // Release the service queue lock
                 //
                 ExReleaseFastMutex(&controlExt->ServiceQueueLock);
 
-                //
-                // Handle data irp failure below
-                //
+                FailQueuedDataRequest(dataQueue, requestID, STATUS_INSUFFICIENT_RESOURCES);
+
+                status = STATUS_PENDING;
+
                 break;
 
               }
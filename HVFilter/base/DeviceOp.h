@@ -3,6 +3,8 @@
 //#include <ndis.h>
 //#include <ntifs.h>
 
+#include "DeviceInfo.h"
+
 //
 // OsrCommCreate
 //
@@ -63,6 +65,123 @@ NTSTATUS OsrCommCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 //
 NTSTATUS OsrCommClose(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
+//
+// OsrCommInitializeRequestTable
+//
+//  This routine sets up an empty request table
+//
+// Inputs:
+//  Table - this is the table to initialize
+//  IdFlags - these are or'ed into every request ID the table hands out
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The slots are only allocated when the first request is inserted.
+//
+VOID OsrCommInitializeRequestTable(POSR_COMM_REQUEST_TABLE Table, ULONG IdFlags);
+
+//
+// OsrCommFreeRequestTable
+//
+//  This routine releases the slots of a request table
+//
+// Inputs:
+//  Table - this is the table to free
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The requests themselves are not touched; the queue must be empty.
+//
+VOID OsrCommFreeRequestTable(POSR_COMM_REQUEST_TABLE Table);
+
+//
+// OsrCommInitializeDataQueues
+//
+//  This routine sets up the read and write queues of the data device
+//
+// Inputs:
+//  DataExt - this is the data device extension
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  Each queue's request IDs carry its index and, for writes,
+//  OSR_COMM_REQUEST_WRITE_ID.
+//
+VOID OsrCommInitializeDataQueues(POSR_COMM_DATA_DEVICE_EXTENSION DataExt);
+
+//
+// OsrCommFreeDataQueues
+//
+//  This routine releases the request tables of the data device queues
+//
+// Inputs:
+//  DataExt - this is the data device extension
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The queues must be empty.
+//
+VOID OsrCommFreeDataQueues(POSR_COMM_DATA_DEVICE_EXTENSION DataExt);
+
+//
+// OsrCommInitializeRequestCache
+//
+//  This routine sets up the data request cache
+//
+// Inputs:
+//  Cache - this is the cache to initialize
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the cache is ready
+//  STATUS_INSUFFICIENT_RESOURCES - the magazines could not be allocated
+//
+// Notes:
+//  The slabs are only allocated as requests come in.
+//
+NTSTATUS OsrCommInitializeRequestCache(POSR_COMM_REQUEST_CACHE Cache);
+
+//
+// OsrCommFreeRequestCache
+//
+//  This routine releases the slabs and magazines of the data request cache
+//
+// Inputs:
+//  Cache - this is the cache to free
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  Every record must be back in the cache; the queues must be empty.
+//
+VOID OsrCommFreeRequestCache(POSR_COMM_REQUEST_CACHE Cache);
+
 
 //
 // ProcessResponse
@@ -104,6 +223,292 @@ NTSTATUS ProcessResponse(PIRP Irp);
 //
 NTSTATUS ProcessControlRequest(PIRP Irp);
 
+//
+// ProcessExchangeBatch
+//
+//  This routine completes the data requests answered by a batched response,
+//  then either fills the batched control request or enqueues it
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  SUCCESS - there are requests going back up to the application
+//  PENDING - the IRP will block until a data request is queued
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid OSR_COMM_BATCH_RESPONSE,
+//                             or names a registered buffer the handle does not have
+//  STATUS_BUFFER_TOO_SMALL - the output (or registered) buffer cannot hold one OSR_COMM_BATCH_ENTRY
+//
+// Notes:
+//  Like ProcessControlRequest, it does NOT complete the IRP.
+//
+NTSTATUS ProcessExchangeBatch(PIRP Irp);
+
+//
+// ProcessQueryHistograms
+//
+//  This routine returns the merged frame size / inter-arrival histograms
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the snapshot was copied to the output buffer
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_HISTOGRAM_SNAPSHOT
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessQueryHistograms(PIRP Irp);
+
+//
+// ProcessSetMicroburstConfig
+//
+//  This routine changes the microburst detection threshold
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_MICROBURST_CONFIG
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetMicroburstConfig(PIRP Irp);
+
+//
+// ProcessQueryGovernor
+//
+//  This routine returns the configuration and per-processor state of the
+//  sampling governor
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the state was copied to the output buffer
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold one processor
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessQueryGovernor(PIRP Irp);
+
+//
+// ProcessSetGovernorConfig
+//
+//  This routine changes the budget of the sampling governor, or pins it to a mode
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_GOVERNOR_CONFIG
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetGovernorConfig(PIRP Irp);
+
+//
+// ProcessSetCaptureConfig
+//
+//  This routine changes the capture filter, snaplen and sampling, and turns
+//  capture on or off
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the new configuration is in effect
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_CAPTURE_CONFIG
+//  STATUS_INSUFFICIENT_RESOURCES - the capture rings could not be allocated
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessSetCaptureConfig(PIRP Irp);
+
+//
+// ProcessDrainCapture
+//
+//  This routine moves the captured records from the per-processor rings to the
+//  caller's buffer
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - an HV_CAPTURE_BATCH (possibly without records) was returned
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_CAPTURE_BATCH
+//  STATUS_INSUFFICIENT_RESOURCES - the output buffer could not be mapped
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The control code is
+//  METHOD_OUT_DIRECT, so the records are copied only once, straight into the
+//  caller's pages.
+//
+NTSTATUS ProcessDrainCapture(PIRP Irp);
+
+//
+// ProcessRegisterRing
+//
+//  This routine locks the caller's buffer and lays the shared record rings
+//  out in it
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the datapath now writes records to the buffer
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid HV_RING_REGISTER
+//  STATUS_BUFFER_TOO_SMALL - the buffer cannot hold HV_RING_MIN_RECORDS per processor
+//  STATUS_DEVICE_BUSY - a buffer is already registered
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The buffer stays
+//  locked until it is unregistered or the registering handle is cleaned up.
+//
+NTSTATUS ProcessRegisterRing(PIRP Irp);
+
+//
+// ProcessUnregisterRing
+//
+//  This routine stops the datapath from writing to the shared record rings and
+//  unlocks the buffer
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the buffer is no longer used
+//  STATUS_INVALID_DEVICE_STATE - no buffer was registered through this handle
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnregisterRing(PIRP Irp);
+
+//
+// ProcessRegisterBuffers
+//
+//  This routine locks and maps the service buffers that write payloads are
+//  copied to
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - control requests may now name the buffers by index
+//  STATUS_INVALID_PARAMETER - the input buffer does not hold a valid OSR_COMM_BUFFER_REGISTRATION
+//  STATUS_INSUFFICIENT_RESOURCES - a buffer could not be locked or mapped
+//  STATUS_DEVICE_BUSY - buffers are already registered
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The buffers stay
+//  mapped until they are unregistered or the registering handle is cleaned up.
+//
+NTSTATUS ProcessRegisterBuffers(PIRP Irp);
+
+//
+// ProcessUnregisterBuffers
+//
+//  This routine unlocks the service buffers registered through a handle
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the buffers are no longer used
+//  STATUS_INVALID_DEVICE_STATE - no buffers were registered through this handle
+//  STATUS_DEVICE_BUSY - a batched exchange waits for requests in one of them
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnregisterBuffers(PIRP Irp);
+
+//
+// ProcessMapCounters
+//
+//  This routine maps the counters page read-only into the caller's address
+//  space
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the output buffer holds the HV_COUNTERS_MAPPING of the view
+//  STATUS_BUFFER_TOO_SMALL - the output buffer cannot hold HV_COUNTERS_MAPPING
+//  STATUS_DEVICE_BUSY - the handle has a view in another process
+//  STATUS_INSUFFICIENT_RESOURCES - too many handles have a view
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.  The I/O manager calls
+//  us in the caller's context, which the mapping needs.  The view stays until
+//  it is unmapped or the mapping handle is cleaned up.
+//
+NTSTATUS ProcessMapCounters(PIRP Irp);
+
+//
+// ProcessUnmapCounters
+//
+//  This routine unmaps the view of the counters page mapped through a handle
+//
+// Inputs:
+//  Irp - this is the device control IRP
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  STATUS_SUCCESS - the view is gone
+//  STATUS_INVALID_DEVICE_STATE - no view was mapped through this handle
+//
+// Notes:
+//  Like ProcessResponse, it does NOT complete the IRP.
+//
+NTSTATUS ProcessUnmapCounters(PIRP Irp);
+
 //
 // OsrCommReadWrite
 //
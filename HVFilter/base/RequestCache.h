@@ -0,0 +1,216 @@
+#pragma once
+
+//
+// Data request records come from a fixed-size object cache.  Each processor
+// keeps a magazine of free records, an interlocked list so a thread that
+// migrates halfway through does no harm.  A full magazine spills into the
+// shared depot, an empty one refills from it, and the depot is carved out of
+// page-sized slabs that are only given back at unload.
+//
+// The routines below only move records between the lists; the caller picks
+// the processor and allocates the magazines and the slabs.  They need nothing
+// but the Windows base types and the interlocked lists, so the tests under
+// tests/ build them outside the WDK.
+//
+#define OSR_COMM_CACHE_MAGAZINE_DEPTH 32
+#define OSR_COMM_CACHE_SLAB_SIZE PAGE_SIZE
+
+typedef struct _OSR_COMM_CACHE_MAGAZINE {
+
+  SLIST_HEADER Free;
+
+  //
+  // One magazine per cache line
+  //
+  UCHAR Padding[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(SLIST_HEADER)];
+
+} OSR_COMM_CACHE_MAGAZINE, *POSR_COMM_CACHE_MAGAZINE;
+
+typedef struct _OSR_COMM_REQUEST_CACHE {
+
+  //
+  // Free records no magazine has room for
+  //
+  SLIST_HEADER Depot;
+
+  //
+  // Every slab, threaded through its first bytes
+  //
+  SLIST_HEADER Slabs;
+
+  POSR_COMM_CACHE_MAGAZINE Magazines;
+
+  ULONG MagazineCount;
+
+  //
+  // Record size rounded up to MEMORY_ALLOCATION_ALIGNMENT
+  //
+  ULONG ObjectSize;
+
+} OSR_COMM_REQUEST_CACHE, *POSR_COMM_REQUEST_CACHE;
+
+//
+// OsrCommRequestCacheInit
+//
+//  This routine sets up an empty cache
+//
+// Inputs:
+//  Cache - this is the cache to initialize
+//  Magazines - these are the magazines, one per processor
+//  MagazineCount - this is the number of magazines
+//  ObjectSize - this is the size of a record
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The cache has no records until OsrCommRequestCacheAddSlab gives it some.
+//
+static __inline VOID OsrCommRequestCacheInit(POSR_COMM_REQUEST_CACHE Cache, POSR_COMM_CACHE_MAGAZINE Magazines,
+                                             ULONG MagazineCount, ULONG ObjectSize)
+{
+  ULONG index;
+
+  InitializeSListHead(&Cache->Depot);
+
+  InitializeSListHead(&Cache->Slabs);
+
+  Cache->Magazines = Magazines;
+
+  Cache->MagazineCount = MagazineCount;
+
+  Cache->ObjectSize = (ObjectSize + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(MEMORY_ALLOCATION_ALIGNMENT - 1);
+
+  for (index = 0; index < MagazineCount; index++) {
+
+    InitializeSListHead(&Magazines[index].Free);
+
+  }
+}
+
+//
+// OsrCommRequestCacheAllocate
+//
+//  This routine takes a free record from the cache
+//
+// Inputs:
+//  Cache - this is the cache
+//  Processor - this is the current processor's number
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The record, or NULL if the cache needs a new slab
+//
+// Notes:
+//  The processor's magazine first, then the depot.  The record is not zeroed.
+//
+static __inline PVOID OsrCommRequestCacheAllocate(POSR_COMM_REQUEST_CACHE Cache, ULONG Processor)
+{
+  PSLIST_ENTRY entry;
+
+  entry = InterlockedPopEntrySList(&Cache->Magazines[Processor % Cache->MagazineCount].Free);
+
+  if (NULL == entry) {
+
+    entry = InterlockedPopEntrySList(&Cache->Depot);
+
+  }
+
+  return entry;
+}
+
+//
+// OsrCommRequestCacheAddSlab
+//
+//  This routine carves a new slab into records
+//
+// Inputs:
+//  Cache - this is the cache
+//  Slab - this is OSR_COMM_CACHE_SLAB_SIZE bytes, MEMORY_ALLOCATION_ALIGNMENT aligned
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The slab's first record, for the caller; the others go to the depot
+//
+// Notes:
+//  The first record's worth holds the slab link.
+//
+static __inline PVOID OsrCommRequestCacheAddSlab(POSR_COMM_REQUEST_CACHE Cache, PVOID Slab)
+{
+  PUCHAR slab = (PUCHAR) Slab;
+  ULONG offset;
+
+  InterlockedPushEntrySList(&Cache->Slabs, (PSLIST_ENTRY) slab);
+
+  for (offset = 2 * Cache->ObjectSize; offset + Cache->ObjectSize <= OSR_COMM_CACHE_SLAB_SIZE; offset += Cache->ObjectSize) {
+
+    InterlockedPushEntrySList(&Cache->Depot, (PSLIST_ENTRY) (slab + offset));
+
+  }
+
+  return slab + Cache->ObjectSize;
+}
+
+//
+// OsrCommRequestCacheFree
+//
+//  This routine gives a record back to the cache
+//
+// Inputs:
+//  Cache - this is the cache
+//  Processor - this is the current processor's number
+//  Object - this is the record
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The depth check is racy, which only lets a magazine run a little over.
+//
+static __inline VOID OsrCommRequestCacheFree(POSR_COMM_REQUEST_CACHE Cache, ULONG Processor, PVOID Object)
+{
+  POSR_COMM_CACHE_MAGAZINE magazine = &Cache->Magazines[Processor % Cache->MagazineCount];
+
+  if (QueryDepthSList(&magazine->Free) < OSR_COMM_CACHE_MAGAZINE_DEPTH) {
+
+    InterlockedPushEntrySList(&magazine->Free, (PSLIST_ENTRY) Object);
+
+  } else {
+
+    InterlockedPushEntrySList(&Cache->Depot, (PSLIST_ENTRY) Object);
+
+  }
+}
+
+//
+// OsrCommRequestCacheTakeSlab
+//
+//  This routine takes back a slab, to free it
+//
+// Inputs:
+//  Cache - this is the cache
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  A slab, or NULL once they are all taken
+//
+// Notes:
+//  Every record must be back in the cache; once the first slab is taken the
+//  cache must not be used until it is initialized again.
+//
+static __inline PVOID OsrCommRequestCacheTakeSlab(POSR_COMM_REQUEST_CACHE Cache)
+{
+  return InterlockedPopEntrySList(&Cache->Slabs);
+}
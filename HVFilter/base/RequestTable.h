@@ -0,0 +1,305 @@
+#pragma once
+
+//
+// Request IDs index a slot table: the low bits are the slot, the next bits name
+// the data queue the request is on, then comes the slot's generation (bumped
+// each time it is reused, so stale responses do not match), and the top bit
+// tells write requests from read requests.
+//
+// The table routines below only touch the slots; the caller holds the queue's
+// lock and allocates the slot arrays.  They need nothing but the Windows base
+// types, so the tests under tests/ build them outside the WDK.
+//
+#define OSR_COMM_REQUEST_INDEX_BITS 20
+#define OSR_COMM_REQUEST_MAX_SLOTS (1 << OSR_COMM_REQUEST_INDEX_BITS)
+#define OSR_COMM_REQUEST_QUEUE_SHIFT OSR_COMM_REQUEST_INDEX_BITS
+#define OSR_COMM_REQUEST_QUEUE_BITS 3
+#define OSR_COMM_REQUEST_GENERATION_SHIFT (OSR_COMM_REQUEST_QUEUE_SHIFT + OSR_COMM_REQUEST_QUEUE_BITS)
+#define OSR_COMM_REQUEST_GENERATION_MASK 0xFF
+#define OSR_COMM_REQUEST_WRITE_ID 0x80000000
+#define OSR_COMM_REQUEST_INITIAL_SLOTS 64
+#define OSR_COMM_REQUEST_NO_SLOT 0xFFFFFFFF
+
+//
+// Reads and writes are each spread over OSR_COMM_DATA_QUEUES queues, picked by
+// the processor the request comes in on, so concurrent readers and writers do
+// not all serialize on one fast mutex.  The request ID names the queue, which
+// is how a response finds its request again.
+//
+#define OSR_COMM_DATA_QUEUES (1 << OSR_COMM_REQUEST_QUEUE_BITS)
+#define OSR_COMM_REQUEST_QUEUE(RequestID) (((RequestID) >> OSR_COMM_REQUEST_QUEUE_SHIFT) & (OSR_COMM_DATA_QUEUES - 1))
+
+typedef struct _OSR_COMM_REQUEST_SLOT {
+
+  //
+  // The data request (POSR_COMM_DATA_REQUEST), NULL if the slot is free
+  //
+  PVOID Request;
+
+  //
+  // Next free slot, while the slot is free
+  //
+  ULONG NextFree;
+
+  ULONG Generation;
+
+} OSR_COMM_REQUEST_SLOT, *POSR_COMM_REQUEST_SLOT;
+
+typedef struct _OSR_COMM_REQUEST_TABLE {
+
+  //
+  // Slot array, grown by doubling up to OSR_COMM_REQUEST_MAX_SLOTS
+  //
+  POSR_COMM_REQUEST_SLOT Slots;
+
+  ULONG Capacity;
+
+  ULONG FreeHead;
+
+  //
+  // Queue index and OSR_COMM_REQUEST_WRITE_ID (for the write queues), or'ed
+  // into every request ID the table hands out
+  //
+  ULONG IdFlags;
+
+} OSR_COMM_REQUEST_TABLE, *POSR_COMM_REQUEST_TABLE;
+
+//
+// OsrCommDataQueueIndex
+//
+//  This routine picks the data queue a request goes on, or is on
+//
+// Inputs:
+//  RequestID - this is the request's ID, or OSR_COMM_REQUEST_NO_SLOT for a
+//              new request
+//  Processor - this is the current processor's number
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The index of the data queue, below OSR_COMM_DATA_QUEUES
+//
+// Notes:
+//  New requests go on the current processor's queue; processors past
+//  OSR_COMM_DATA_QUEUES share them round robin.
+//
+static __inline ULONG OsrCommDataQueueIndex(ULONG RequestID, ULONG Processor)
+{
+  if (OSR_COMM_REQUEST_NO_SLOT == RequestID) {
+
+    return Processor & (OSR_COMM_DATA_QUEUES - 1);
+
+  }
+
+  return OSR_COMM_REQUEST_QUEUE(RequestID);
+}
+
+//
+// OsrCommRequestTableInit
+//
+//  This routine sets up an empty request table
+//
+// Inputs:
+//  Table - this is the table to initialize
+//  IdFlags - these are or'ed into every request ID the table hands out
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The table has no slots until OsrCommRequestTableGrow gives it some.
+//
+static __inline VOID OsrCommRequestTableInit(POSR_COMM_REQUEST_TABLE Table, ULONG IdFlags)
+{
+  RtlZeroMemory(Table, sizeof(OSR_COMM_REQUEST_TABLE));
+
+  Table->FreeHead = OSR_COMM_REQUEST_NO_SLOT;
+
+  Table->IdFlags = IdFlags;
+}
+
+//
+// OsrCommRequestTableGrowCapacity
+//
+//  This routine tells how many slots the table has after it grew
+//
+// Inputs:
+//  Table - this is the table to grow
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The new capacity, or 0 if the table is at OSR_COMM_REQUEST_MAX_SLOTS
+//
+static __inline ULONG OsrCommRequestTableGrowCapacity(POSR_COMM_REQUEST_TABLE Table)
+{
+  ULONG capacity = Table->Capacity ? Table->Capacity * 2 : OSR_COMM_REQUEST_INITIAL_SLOTS;
+
+  return capacity > OSR_COMM_REQUEST_MAX_SLOTS ? 0 : capacity;
+}
+
+//
+// OsrCommRequestTableGrow
+//
+//  This routine moves the table to a larger slot array
+//
+// Inputs:
+//  Table - this is the table to grow
+//  Slots - this is the new slot array, of OsrCommRequestTableGrowCapacity slots
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The previous slot array, for the caller to free (NULL the first time)
+//
+// Notes:
+//  Slot indexes do not change, so IDs handed out before stay valid.
+//
+static __inline POSR_COMM_REQUEST_SLOT OsrCommRequestTableGrow(POSR_COMM_REQUEST_TABLE Table, POSR_COMM_REQUEST_SLOT Slots)
+{
+  POSR_COMM_REQUEST_SLOT previous = Table->Slots;
+  ULONG capacity = OsrCommRequestTableGrowCapacity(Table);
+  ULONG index;
+
+  RtlZeroMemory(Slots, capacity * sizeof(OSR_COMM_REQUEST_SLOT));
+
+  if (previous) {
+
+    RtlCopyMemory(Slots, previous, Table->Capacity * sizeof(OSR_COMM_REQUEST_SLOT));
+
+  }
+
+  //
+  // Thread the new slots onto the free list, lowest index first
+  //
+  for (index = capacity; index > Table->Capacity; index--) {
+
+    Slots[index - 1].NextFree = Table->FreeHead;
+
+    Table->FreeHead = index - 1;
+
+  }
+
+  Table->Slots = Slots;
+
+  Table->Capacity = capacity;
+
+  return previous;
+}
+
+//
+// OsrCommRequestTableInsert
+//
+//  This routine gives a request a slot and the matching request ID
+//
+// Inputs:
+//  Table - this is the table to insert into
+//  Request - this is the request
+//
+// Outputs:
+//  RequestID - this is the ID of the request
+//
+// Returns:
+//  TRUE - the request was inserted
+//  FALSE - there is no free slot; grow the table
+//
+static __inline BOOLEAN OsrCommRequestTableInsert(POSR_COMM_REQUEST_TABLE Table, PVOID Request, PULONG RequestID)
+{
+  ULONG index = Table->FreeHead;
+  POSR_COMM_REQUEST_SLOT slot;
+
+  if (OSR_COMM_REQUEST_NO_SLOT == index) {
+
+    return FALSE;
+
+  }
+
+  slot = &Table->Slots[index];
+
+  Table->FreeHead = slot->NextFree;
+
+  slot->Request = Request;
+
+  *RequestID = Table->IdFlags | (slot->Generation << OSR_COMM_REQUEST_GENERATION_SHIFT) | index;
+
+  return TRUE;
+}
+
+//
+// OsrCommRequestTableLookup
+//
+//  This routine finds the request a response is meant for
+//
+// Inputs:
+//  Table - this is the table of the response's queue
+//  RequestID - this is the ID from the response
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  The request, or NULL if the ID does not match a pending request
+//
+static __inline PVOID OsrCommRequestTableLookup(POSR_COMM_REQUEST_TABLE Table, ULONG RequestID)
+{
+  ULONG index = RequestID & (OSR_COMM_REQUEST_MAX_SLOTS - 1);
+  POSR_COMM_REQUEST_SLOT slot;
+
+  if (index >= Table->Capacity) {
+
+    return NULL;
+
+  }
+
+  slot = &Table->Slots[index];
+
+  //
+  // A free slot, one reused since the ID was handed out, or an ID of another queue
+  //
+  if (NULL == slot->Request ||
+      RequestID != (Table->IdFlags | (slot->Generation << OSR_COMM_REQUEST_GENERATION_SHIFT) | index)) {
+
+    return NULL;
+
+  }
+
+  return slot->Request;
+}
+
+//
+// OsrCommRequestTableRemove
+//
+//  This routine releases the slot of a pending request
+//
+// Inputs:
+//  Table - this is the table of the request's queue
+//  RequestID - this is the ID of the request, as handed out by OsrCommRequestTableInsert
+//
+// Outputs:
+//  None.
+//
+// Returns:
+//  VOID function
+//
+// Notes:
+//  The slot's generation moves on, so the ID no longer matches.
+//
+static __inline VOID OsrCommRequestTableRemove(POSR_COMM_REQUEST_TABLE Table, ULONG RequestID)
+{
+  ULONG index = RequestID & (OSR_COMM_REQUEST_MAX_SLOTS - 1);
+  POSR_COMM_REQUEST_SLOT slot = &Table->Slots[index];
+
+  slot->Request = NULL;
+
+  slot->Generation = (slot->Generation + 1) & OSR_COMM_REQUEST_GENERATION_MASK;
+
+  slot->NextFree = Table->FreeHead;
+
+  Table->FreeHead = index;
+}
@@ -151,8 +151,6 @@ Cleanup:
 PDEVICE_OBJECT OsrCommDeviceObject;
 PDEVICE_OBJECT OsrDataDeviceObject;
 
-LONG OsrRequestID = 0xFFFFFFFE; // checks for "roll-over" problems
-
 NTSTATUS InitializeDevice(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
 {
 	USHORT index;
@@ -280,7 +278,7 @@ NTSTATUS InitializeDevice(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryP
 		&deviceName,
 		OSR_COMM_CONTROL_TYPE,
 		FILE_DEVICE_SECURE_OPEN, // characteristics
-		TRUE, // exclusive - only one control process
+		FALSE, // several service handles (or processes) may serve requests
 		&OsrCommDeviceObject);
 
 	//
@@ -314,6 +312,10 @@ NTSTATUS InitializeDevice(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryP
 
 	ExInitializeFastMutex(&controlExt->RequestQueueLock);
 
+	InitializeListHead(&controlExt->BatchQueue);
+
+	OsrCommBufferRegistryInit(&controlExt->BufferRegistry);
+
 
 	//
 	// Now, store away the registry path for future use
@@ -534,10 +536,20 @@ NTSTATUS InitializeDevice(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryP
 	dataExt = (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
 
 	dataExt->MagicNumber = OSR_COMM_DATA_DEVICE_EXTENSION_MAGIC_NUMBER;
-	InitializeListHead(&dataExt->ReadRequestQueue);
-	ExInitializeFastMutex(&dataExt->ReadRequestQueueLock);
-	InitializeListHead(&dataExt->WriteRequestQueue);
-	ExInitializeFastMutex(&dataExt->WriteRequestQueueLock);
+	OsrCommInitializeDataQueues(dataExt);
+
+	status = OsrCommInitializeRequestCache(&dataExt->RequestCache);
+
+	if (!NT_SUCCESS(status)) {
+
+		ExFreePool(deviceName.Buffer);
+		ExFreePool(driverName.Buffer);
+
+		SxNdisUnload(DriverObject);
+
+		return status;
+
+	}
 
 	//
 	// Create a symbolic link so the driver is visible to Win32 applications
@@ -661,6 +673,14 @@ SxNdisUnload(
 {
     UNREFERENCED_PARAMETER(DriverObject);
 
+    if (OsrDataDeviceObject) {
+        POSR_COMM_DATA_DEVICE_EXTENSION dataExt =
+            (POSR_COMM_DATA_DEVICE_EXTENSION) OsrDataDeviceObject->DeviceExtension;
+
+        OsrCommFreeDataQueues(dataExt);
+        OsrCommFreeRequestCache(&dataExt->RequestCache);
+    }
+
     SxExtUninitialize();
     
     NdisFDeregisterFilterDriver(SxDriverHandle);
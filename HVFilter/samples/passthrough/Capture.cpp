@@ -0,0 +1,303 @@
+#include "Capture.h"
+#include "CaptureRing.h"
+
+#define CAPTURE_TAG 'paCS'
+
+namespace
+{
+	CaptureRing*		g_pCaptureRings = NULL;
+	ULONG				g_capture_cpu_count = 0;
+
+	//serializes configuration changes and drains
+	FAST_MUTEX			g_capture_mutex;
+	ULONG				g_drain_next_cpu = 0;
+
+	//read by the datapath without a lock: a frame may see a half updated filter while it changes
+	volatile LONG		g_capture_enabled = 0;
+	ULONG				g_capture_snaplen = HV_CAPTURE_DEFAULT_SNAPLEN;
+	ULONG				g_capture_sample_rate = 1;
+	HV_CAPTURE_FILTER	g_capture_filter;
+}
+
+NTSTATUS init_capture()
+{
+	ExInitializeFastMutex(&g_capture_mutex);
+
+	g_capture_enabled = 0;
+	g_capture_snaplen = HV_CAPTURE_DEFAULT_SNAPLEN;
+	g_capture_sample_rate = 1;
+	g_drain_next_cpu = 0;
+	RtlZeroMemory(&g_capture_filter, sizeof(g_capture_filter));
+
+	//the rings themselves are only allocated when capture is first enabled
+	g_capture_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	return STATUS_SUCCESS;
+}
+
+static void free_ring_array(CaptureRing* pRings)
+{
+	for (ULONG cpu = 0; cpu < g_capture_cpu_count; ++cpu) {
+		if (pRings[cpu].data)
+			ExFreePoolWithTag(pRings[cpu].data, CAPTURE_TAG);
+	}
+
+	ExFreePoolWithTag(pRings, CAPTURE_TAG);
+}
+
+static void free_rings()
+{
+	if (!g_pCaptureRings)
+		return;
+
+	free_ring_array(g_pCaptureRings);
+	g_pCaptureRings = NULL;
+}
+
+void uninit_capture()
+{
+	g_capture_enabled = 0;
+
+	free_rings();
+}
+
+//only complete rings are published: the counters page reads them at any time
+static NTSTATUS alloc_rings()
+{
+	SIZE_T size = sizeof(CaptureRing) * g_capture_cpu_count;
+
+	CaptureRing* pRings = (CaptureRing*)ExAllocatePoolWithTag(NonPagedPoolNx, size, CAPTURE_TAG);
+	if (!pRings)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(pRings, size);
+
+	for (ULONG cpu = 0; cpu < g_capture_cpu_count; ++cpu) {
+		BYTE* data = (BYTE*)ExAllocatePoolWithTag(NonPagedPoolNx, CAPTURE_RING_SIZE, CAPTURE_TAG);
+		if (!data) {
+			free_ring_array(pRings);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		capture_ring_init(&pRings[cpu], data, 0x2545F491u ^ (cpu * 0x9E3779B9u));
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&g_pCaptureRings, pRings);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS capture_set_config(__in PHV_CAPTURE_CONFIG pConfig)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	ExAcquireFastMutex(&g_capture_mutex);
+
+	//stop the datapath while the filter changes; frames already past the check still use the old one
+	InterlockedExchange(&g_capture_enabled, 0);
+
+	g_capture_snaplen = pConfig->Snaplen;
+	g_capture_sample_rate = pConfig->SampleRate;
+	g_capture_filter = pConfig->Filter;
+
+	if (pConfig->Enabled && !g_pCaptureRings)
+		status = alloc_rings();
+
+	//the rings are published before the datapath may use them
+	if (pConfig->Enabled && NT_SUCCESS(status))
+		InterlockedExchange(&g_capture_enabled, 1);
+
+	ExReleaseFastMutex(&g_capture_mutex);
+
+	return status;
+}
+
+ULONG64 capture_dropped()
+{
+	//the rings stay until uninit_capture once they are there
+	CaptureRing* pRings = g_pCaptureRings;
+	ULONG64 dropped = 0;
+
+	if (!pRings)
+		return 0;
+
+	//read without synchronization, like the counters of a drain
+	for (ULONG cpu = 0; cpu < g_capture_cpu_count; ++cpu)
+		dropped += pRings[cpu].dropped;
+
+	return dropped;
+}
+
+BOOLEAN capture_active()
+{
+	return g_capture_enabled != 0;
+}
+
+enum {CaptureEtherType_IPv4 = 0x800, CaptureEtherType_IPv6 = 0x86DD};
+enum {CaptureProtocol_Tcp = 0x06, CaptureProtocol_Udp = 0x11};
+
+static BOOLEAN match_filter(const HV_CAPTURE_FILTER* pFilter, NET_BUFFER* net_buffer, ULONG frame_size,
+	NDIS_SWITCH_PORT_ID port_id, ULONG direction)
+{
+	if (!(pFilter->Directions & (1 << direction)))
+		return FALSE;
+
+	if (pFilter->PortId != HV_CAPTURE_ANY_PORT && pFilter->PortId != port_id)
+		return FALSE;
+
+	if (!pFilter->EtherType && !pFilter->IpProtocol && !pFilter->L4Port && !pFilter->Ipv4Mask)
+		return TRUE;
+
+	//ethernet + longest IPv4 header + TCP / UDP ports
+	BYTE headers[14 + 60 + 4];
+	ULONG size = min(frame_size, (ULONG)sizeof(headers));
+
+	BYTE* buffer = (BYTE*)NdisGetDataBuffer(net_buffer, size, headers, 1, 0);
+	if (!buffer || size < 14)
+		return FALSE;
+
+	USHORT ether_type = RtlUshortByteSwap(*(USHORT*)(buffer + 12));
+	if (pFilter->EtherType && ether_type != pFilter->EtherType)
+		return FALSE;
+
+	BYTE protocol;
+	BYTE* pL4Header = NULL;
+
+	if (ether_type == CaptureEtherType_IPv4) {
+		if (size < 14 + 20)
+			return FALSE;
+
+		ULONG header_length = (buffer[14] & 0xF) << 2;
+		ULONG source = *(ULONG*)(buffer + 14 + 12);
+		ULONG destination = *(ULONG*)(buffer + 14 + 16);
+
+		if (pFilter->Ipv4Mask &&
+			(source & pFilter->Ipv4Mask) != (pFilter->Ipv4Address & pFilter->Ipv4Mask) &&
+			(destination & pFilter->Ipv4Mask) != (pFilter->Ipv4Address & pFilter->Ipv4Mask))
+			return FALSE;
+
+		protocol = buffer[14 + 9];
+
+		if (14 + header_length + 4 <= size)
+			pL4Header = buffer + 14 + header_length;
+
+	} else if (ether_type == CaptureEtherType_IPv6) {
+		if (pFilter->Ipv4Mask || size < 14 + 40)
+			return FALSE;
+
+		//extension headers are not followed
+		protocol = buffer[14 + 6];
+
+		if (14 + 40 + 4 <= size)
+			pL4Header = buffer + 14 + 40;
+
+	} else {
+		return !pFilter->IpProtocol && !pFilter->L4Port && !pFilter->Ipv4Mask;
+	}
+
+	if (pFilter->IpProtocol && protocol != pFilter->IpProtocol)
+		return FALSE;
+
+	if (pFilter->L4Port) {
+		if (!pL4Header || (protocol != CaptureProtocol_Tcp && protocol != CaptureProtocol_Udp))
+			return FALSE;
+
+		USHORT l4_port = RtlUshortByteSwap(pFilter->L4Port);
+
+		if (*(USHORT*)pL4Header != l4_port && *(USHORT*)(pL4Header + 2) != l4_port)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void write_record(CaptureRing* pRing, ULONG cpu, NET_BUFFER* net_buffer, ULONG frame_size,
+	NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now)
+{
+	ULONG captured = min(frame_size, g_capture_snaplen);
+	ULONG record_length = ALIGN_UP_BY(sizeof(HV_CAPTURE_RECORD) + captured, HV_CAPTURE_RECORD_ALIGNMENT);
+	LONG64 position;
+
+	PHV_CAPTURE_RECORD pRecord = capture_ring_reserve(pRing, record_length, &position);
+	if (!pRecord)
+		return;
+
+	BYTE* pData = (BYTE*)(pRecord + 1);
+
+	//copies straight into the ring when the frame is split across MDLs
+	BYTE* source = (BYTE*)NdisGetDataBuffer(net_buffer, captured, pData, 1, 0);
+	if (!source && captured) {
+		++pRing->dropped;
+		//gives up the pad, if one was written
+		capture_ring_publish(pRing, position);
+		return;
+	}
+
+	if (source != pData && captured)
+		RtlCopyMemory(pData, source, captured);
+
+	pRecord->Timestamp = now;
+	pRecord->PortId = port_id;
+	pRecord->Direction = (USHORT)direction;
+	pRecord->Flags = 0;
+	pRecord->OriginalLength = frame_size;
+	pRecord->CapturedLength = captured;
+	pRecord->RecordLength = record_length;
+	pRecord->Cpu = cpu;
+
+	++pRing->captured;
+
+	//the record is complete before the drain can see it
+	capture_ring_publish(pRing, position + record_length);
+}
+
+void capture_frame(NET_BUFFER* net_buffer, ULONG frame_size, NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (!g_pCaptureRings || !match_filter(&g_capture_filter, net_buffer, frame_size, port_id, direction))
+		return;
+
+	ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+	CaptureRing* pRing = &g_pCaptureRings[cpu];
+
+	if (!capture_ring_sample(pRing, g_capture_sample_rate))
+		return;
+
+	write_record(pRing, cpu, net_buffer, frame_size, port_id, direction, now);
+}
+
+ULONG capture_drain(__out PHV_CAPTURE_BATCH pBatch, ULONG size)
+{
+	RtlZeroMemory(pBatch, sizeof(HV_CAPTURE_BATCH));
+
+	ExAcquireFastMutex(&g_capture_mutex);
+
+	if (g_pCaptureRings) {
+		BYTE* pOut = (BYTE*)(pBatch + 1);
+		ULONG space = size - sizeof(HV_CAPTURE_BATCH);
+
+		//start where the last drain stopped, so a busy processor cannot starve the others
+		ULONG first = g_drain_next_cpu;
+
+		for (ULONG i = 0; i < g_capture_cpu_count; ++i) {
+			ULONG cpu = (first + i) % g_capture_cpu_count;
+
+			if (!capture_ring_drain(&g_pCaptureRings[cpu], pBatch, pOut, space)) {
+				g_drain_next_cpu = cpu;
+				break;
+			}
+		}
+
+		//the counters are read without synchronization, like the histograms
+		for (ULONG cpu = 0; cpu < g_capture_cpu_count; ++cpu) {
+			pBatch->Captured += g_pCaptureRings[cpu].captured;
+			pBatch->Dropped += g_pCaptureRings[cpu].dropped;
+			pBatch->SampledOut += g_pCaptureRings[cpu].sampled_out;
+		}
+	}
+
+	ExReleaseFastMutex(&g_capture_mutex);
+
+	return sizeof(HV_CAPTURE_BATCH) + pBatch->Length;
+}
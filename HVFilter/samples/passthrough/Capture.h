@@ -0,0 +1,50 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+#include "../../HVService/HVService/HVCapture.h"
+
+//
+// Sampled snaplen capture.
+//
+// Every processor owns a ring the datapath appends records to without locks; a
+// record that does not fit is dropped and counted, the datapath never waits.
+// User mode drains all rings in bulk through OSR_COMM_CONTROL_DRAIN_CAPTURE.
+//
+
+NTSTATUS init_capture();
+void uninit_capture();
+
+//
+// Allocates the rings on first use. Called at PASSIVE_LEVEL.
+//
+NTSTATUS capture_set_config(__in PHV_CAPTURE_CONFIG pConfig);
+
+//
+// TRUE if frames must be offered to capture_frame; checked once per NBL chain.
+//
+BOOLEAN capture_active();
+
+//
+// Filters, samples and copies one frame. Must be called at DISPATCH_LEVEL.
+//
+void capture_frame(NET_BUFFER* net_buffer, ULONG frame_size, NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now);
+
+//
+// Moves as many whole records as fit in size bytes from the rings to pBatch.
+// Returns the bytes written. Called at PASSIVE_LEVEL.
+//
+ULONG capture_drain(__out PHV_CAPTURE_BATCH pBatch, ULONG size);
+
+//
+// Records dropped because a ring was full, since capture was first enabled.
+//
+ULONG64 capture_dropped();
+
+#ifdef __cplusplus
+}
+#endif
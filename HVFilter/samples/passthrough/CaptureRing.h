@@ -0,0 +1,179 @@
+#pragma once
+
+#include "../../HVService/HVService/HVCapture.h"
+
+//
+// Ring of capture records with a single producer, the processor that owns it,
+// and a single consumer, the drain.
+//
+// head and tail are free running byte positions; the offset in data is
+// position & (CAPTURE_RING_SIZE - 1).  head is only written by the producer,
+// tail only by the consumer.  Records never wrap: one that does not fit before
+// the end of data starts over at the beginning, behind a pad record (or behind
+// nothing when the rest is shorter than a record header).
+//
+// Only needs the Windows base types and Interlocked functions, so the tests
+// under tests/ build it outside the WDK.
+//
+
+#define CAPTURE_RING_SIZE (256 * 1024)
+
+//driver-only record flag: the rest of the ring, up to the wrap, is unused
+#define CAPTURE_RECORD_PAD 0x8000
+
+C_ASSERT((CAPTURE_RING_SIZE & (CAPTURE_RING_SIZE - 1)) == 0);
+C_ASSERT(sizeof(HV_CAPTURE_RECORD) % HV_CAPTURE_RECORD_ALIGNMENT == 0);
+
+//a volatile read of the other side's position orders the reads behind it: MSVC gives volatile reads acquire semantics
+#ifdef _MSC_VER
+#define CAPTURE_RING_ACQUIRE()
+#else
+#define CAPTURE_RING_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+struct DECLSPEC_CACHEALIGN CaptureRing
+{
+	BYTE*			data;
+
+	volatile LONG64	head;
+
+	//sampling state and counters, only written by the producer
+	ULONG			countdown;
+	ULONG			random;
+	ULONG64			captured;
+	ULONG64			dropped;
+	ULONG64			sampled_out;
+
+	//keep the consumer's writes off the producer's cache line
+	DECLSPEC_CACHEALIGN volatile LONG64 tail;
+};
+
+//the xorshift state must not be 0
+inline void capture_ring_init(CaptureRing* pRing, BYTE* data, ULONG seed)
+{
+	RtlZeroMemory(pRing, sizeof(CaptureRing));
+
+	pRing->data = data;
+	pRing->countdown = 1;
+	pRing->random = seed | 1;
+}
+
+//random gaps with a mean of sample_rate, so periodic traffic cannot alias with the sampling
+inline ULONG capture_ring_next_countdown(CaptureRing* pRing, ULONG sample_rate)
+{
+	if (sample_rate <= 1)
+		return 1;
+
+	pRing->random ^= pRing->random << 13;
+	pRing->random ^= pRing->random >> 17;
+	pRing->random ^= pRing->random << 5;
+
+	return 1 + pRing->random % (2 * sample_rate - 1);
+}
+
+//TRUE if the frame is sampled, FALSE if it is counted as sampled out. Producer only.
+inline BOOLEAN capture_ring_sample(CaptureRing* pRing, ULONG sample_rate)
+{
+	if (--pRing->countdown) {
+		++pRing->sampled_out;
+		return FALSE;
+	}
+
+	pRing->countdown = capture_ring_next_countdown(pRing, sample_rate);
+	return TRUE;
+}
+
+//
+// Room for a record of record_length bytes (a multiple of HV_CAPTURE_RECORD_ALIGNMENT).
+// NULL if the ring is full, which counts the record as dropped. *pPosition receives the
+// position of the record, which capture_ring_publish moves head past. Producer only.
+//
+inline PHV_CAPTURE_RECORD capture_ring_reserve(CaptureRing* pRing, ULONG record_length, LONG64* pPosition)
+{
+	LONG64 head = pRing->head;
+	//volatile read: the consumer's copy out of the ring happened before it moved tail
+	LONG64 tail = pRing->tail;
+	CAPTURE_RING_ACQUIRE();
+
+	ULONG offset = (ULONG)(head & (CAPTURE_RING_SIZE - 1));
+	ULONG to_end = CAPTURE_RING_SIZE - offset;
+
+	ULONG needed = record_length <= to_end ? record_length : to_end + record_length;
+
+	if ((ULONG64)(head - tail) + needed > CAPTURE_RING_SIZE) {
+		++pRing->dropped;
+		return NULL;
+	}
+
+	if (record_length > to_end) {
+		//the consumer skips tails shorter than a record header on its own
+		if (to_end >= sizeof(HV_CAPTURE_RECORD)) {
+			PHV_CAPTURE_RECORD pPad = (PHV_CAPTURE_RECORD)(pRing->data + offset);
+
+			pPad->Flags = CAPTURE_RECORD_PAD;
+			pPad->RecordLength = to_end;
+		}
+
+		head += to_end;
+		offset = 0;
+	}
+
+	*pPosition = head;
+	return (PHV_CAPTURE_RECORD)(pRing->data + offset);
+}
+
+//makes everything up to position visible to the consumer. Producer only.
+inline void capture_ring_publish(CaptureRing* pRing, LONG64 position)
+{
+	InterlockedExchange64(&pRing->head, position);
+}
+
+//
+// Copies the records of the ring to pOut while they fit in space, moving pOut and space
+// on and adding them to pBatch. Returns FALSE once a record did not fit. Consumer only.
+//
+inline BOOLEAN capture_ring_drain(CaptureRing* pRing, PHV_CAPTURE_BATCH pBatch, BYTE*& pOut, ULONG& space)
+{
+	LONG64 tail = pRing->tail;
+	//volatile read: the records up to head are complete
+	LONG64 head = pRing->head;
+	CAPTURE_RING_ACQUIRE();
+
+	BOOLEAN has_space = TRUE;
+
+	while (tail != head) {
+		ULONG offset = (ULONG)(tail & (CAPTURE_RING_SIZE - 1));
+		ULONG to_end = CAPTURE_RING_SIZE - offset;
+
+		if (to_end < sizeof(HV_CAPTURE_RECORD)) {
+			tail += to_end;
+			continue;
+		}
+
+		PHV_CAPTURE_RECORD pRecord = (PHV_CAPTURE_RECORD)(pRing->data + offset);
+
+		if (pRecord->Flags & CAPTURE_RECORD_PAD) {
+			tail += pRecord->RecordLength;
+			continue;
+		}
+
+		if (pRecord->RecordLength > space) {
+			has_space = FALSE;
+			break;
+		}
+
+		RtlCopyMemory(pOut, pRecord, pRecord->RecordLength);
+
+		pOut += pRecord->RecordLength;
+		space -= pRecord->RecordLength;
+		tail += pRecord->RecordLength;
+
+		++pBatch->Count;
+		pBatch->Length += pRecord->RecordLength;
+	}
+
+	//hand the space back to the producer
+	InterlockedExchange64(&pRing->tail, tail);
+
+	return has_space;
+}
@@ -0,0 +1,470 @@
+#include "CountersPage.h"
+#include "PortStats.h"
+#include "Capture.h"
+#include "SharedRing.h"
+
+#define COUNTERS_PAGE_TAG 'gPtC'
+
+//handles that may have a view mapped at once
+#define COUNTERS_MAX_VIEWS 16
+
+//publish copies everything but the sequence
+C_ASSERT(FIELD_OFFSET(HV_COUNTERS_PAGE, Sequence) == 0);
+
+struct DECLSPEC_CACHEALIGN CountersCpu
+{
+	HV_COUNTER	ports[HV_STATS_PORT_SLOTS][HV_STATS_DIRECTIONS];
+	HV_COUNTER	protocols[HV_COUNTERS_PROTOCOLS][HV_STATS_DIRECTIONS];
+};
+
+//a view in a process; the process stays referenced, so another one cannot take its address
+struct CountersView
+{
+	PFILE_OBJECT	owner;
+	PEPROCESS		process;
+	PVOID			address;
+};
+
+namespace
+{
+	CountersCpu*		g_pCountersCpus = NULL;
+	ULONG				g_counters_cpu_count = 0;
+
+	//the section backing the page, and its system view, locked so the DPC can write to it
+	HANDLE				g_hCountersSection = NULL;
+	PVOID				g_pCountersSection = NULL;
+	PVOID				g_pCountersView = NULL;
+	SIZE_T				g_counters_length = 0;
+	PMDL				g_counters_mdl = NULL;
+
+	//the page only ever gets written, never read back: the totals are summed here first
+	PHV_COUNTERS_PAGE	g_pCountersPage = NULL;
+	PHV_COUNTERS_PAGE	g_pCountersTotals = NULL;
+	LONG				g_counters_sequence = 0;
+
+	//a timer DPC may run on two processors at once: only one of them writes
+	volatile LONG		g_counters_writing = 0;
+
+	KTIMER				g_counters_timer;
+	KDPC				g_counters_dpc;
+
+	//serializes the view table; never held while a view is mapped or unmapped
+	FAST_MUTEX			g_counters_mutex;
+	CountersView		g_counters_views[COUNTERS_MAX_VIEWS];
+	ULONG				g_counters_view_count = 0;
+}
+
+static KDEFERRED_ROUTINE publish_dpc;
+
+static NTSTATUS create_page()
+{
+	OBJECT_ATTRIBUTES attributes;
+	InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	LARGE_INTEGER size;
+	size.QuadPart = ROUND_TO_PAGES(sizeof(HV_COUNTERS_PAGE));
+
+	NTSTATUS status = ZwCreateSection(&g_hCountersSection, SECTION_ALL_ACCESS, &attributes, &size,
+		PAGE_READWRITE, SEC_COMMIT, NULL);
+	if (!NT_SUCCESS(status)) {
+		g_hCountersSection = NULL;
+		return status;
+	}
+
+	status = ObReferenceObjectByHandle(g_hCountersSection, SECTION_ALL_ACCESS, NULL, KernelMode, &g_pCountersSection, NULL);
+	if (!NT_SUCCESS(status)) {
+		g_pCountersSection = NULL;
+		return status;
+	}
+
+	g_counters_length = (SIZE_T)size.QuadPart;
+
+	status = MmMapViewInSystemSpace(g_pCountersSection, &g_pCountersView, &g_counters_length);
+	if (!NT_SUCCESS(status)) {
+		g_pCountersView = NULL;
+		return status;
+	}
+
+	//the section is pageable: lock it for the DPC
+	PMDL mdl = IoAllocateMdl(g_pCountersView, (ULONG)g_counters_length, FALSE, FALSE, NULL);
+	if (!mdl)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	__try {
+		MmProbeAndLockPages(mdl, KernelMode, IoWriteAccess);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode();
+	}
+
+	if (!NT_SUCCESS(status)) {
+		IoFreeMdl(mdl);
+		return status;
+	}
+
+	g_counters_mdl = mdl;
+	g_pCountersPage = (PHV_COUNTERS_PAGE)g_pCountersView;
+
+	//Sequence stays 0 until the first publication
+	RtlZeroMemory(g_pCountersPage, g_counters_length);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS init_counters_page()
+{
+	ExInitializeFastMutex(&g_counters_mutex);
+	RtlZeroMemory(g_counters_views, sizeof(g_counters_views));
+	g_counters_view_count = 0;
+	g_counters_sequence = 0;
+	g_counters_writing = 0;
+
+	KeInitializeTimer(&g_counters_timer);
+	KeInitializeDpc(&g_counters_dpc, publish_dpc, NULL);
+
+	g_counters_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T size = sizeof(CountersCpu) * g_counters_cpu_count;
+	g_pCountersCpus = (CountersCpu*)ExAllocatePoolWithTag(NonPagedPoolNx, size, COUNTERS_PAGE_TAG);
+	g_pCountersTotals = (PHV_COUNTERS_PAGE)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_COUNTERS_PAGE), COUNTERS_PAGE_TAG);
+
+	if (!g_pCountersCpus || !g_pCountersTotals) {
+		uninit_counters_page();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(g_pCountersCpus, size);
+	RtlZeroMemory(g_pCountersTotals, sizeof(HV_COUNTERS_PAGE));
+
+	g_pCountersTotals->Version = HV_COUNTERS_VERSION;
+	g_pCountersTotals->Length = sizeof(HV_COUNTERS_PAGE);
+	g_pCountersTotals->PortCount = HV_STATS_PORT_SLOTS;
+	g_pCountersTotals->ProtocolCount = HV_COUNTERS_PROTOCOLS;
+
+	NTSTATUS status = create_page();
+	if (!NT_SUCCESS(status)) {
+		uninit_counters_page();
+		return status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+//the view belongs to the process that mapped it; cleaned up from another process, it is left to that process' teardown
+static void unmap_view(const CountersView* pView)
+{
+	if (pView->process == PsGetCurrentProcess())
+		ZwUnmapViewOfSection(ZwCurrentProcess(), pView->address);
+
+	ObDereferenceObject(pView->process);
+}
+
+void uninit_counters_page()
+{
+	//the DPC must be done with the page before it goes
+	KeCancelTimer(&g_counters_timer);
+	KeFlushQueuedDpcs();
+
+	//every handle was cleaned up by now; only the references are left to drop
+	for (ULONG i = 0; i < g_counters_view_count; ++i)
+		ObDereferenceObject(g_counters_views[i].process);
+
+	g_counters_view_count = 0;
+	g_pCountersPage = NULL;
+
+	if (g_counters_mdl) {
+		MmUnlockPages(g_counters_mdl);
+		IoFreeMdl(g_counters_mdl);
+		g_counters_mdl = NULL;
+	}
+
+	if (g_pCountersView) {
+		MmUnmapViewInSystemSpace(g_pCountersView);
+		g_pCountersView = NULL;
+	}
+
+	if (g_pCountersSection) {
+		ObDereferenceObject(g_pCountersSection);
+		g_pCountersSection = NULL;
+	}
+
+	if (g_hCountersSection) {
+		ZwClose(g_hCountersSection);
+		g_hCountersSection = NULL;
+	}
+
+	if (g_pCountersTotals) {
+		ExFreePoolWithTag(g_pCountersTotals, COUNTERS_PAGE_TAG);
+		g_pCountersTotals = NULL;
+	}
+
+	if (g_pCountersCpus) {
+		ExFreePoolWithTag(g_pCountersCpus, COUNTERS_PAGE_TAG);
+		g_pCountersCpus = NULL;
+		g_counters_cpu_count = 0;
+	}
+}
+
+void counters_page_reset_slot(ULONG slot)
+{
+	if (!g_pCountersCpus || slot >= HV_STATS_PORT_SLOTS)
+		return;
+
+	//like the histograms: a frame accounted while the slot is cleared may survive it
+	for (ULONG cpu = 0; cpu < g_counters_cpu_count; ++cpu)
+		RtlZeroMemory(g_pCountersCpus[cpu].ports[slot], sizeof(g_pCountersCpus[cpu].ports[slot]));
+}
+
+enum {CountersEtherType_IPv4 = 0x800, CountersEtherType_Arp = 0x806, CountersEtherType_IPv6 = 0x86DD};
+enum {CountersProtocol_Icmp = 0x01, CountersProtocol_Tcp = 0x06, CountersProtocol_Udp = 0x11, CountersProtocol_Icmpv6 = 0x3A};
+
+static ULONG classify_frame(NET_BUFFER* net_buffer, ULONG frame_size)
+{
+	//ethernet + up to the protocol field of an IPv4 header (the IPv6 one comes earlier)
+	BYTE headers[14 + 10];
+	ULONG size = min(frame_size, (ULONG)sizeof(headers));
+
+	BYTE* buffer = (BYTE*)NdisGetDataBuffer(net_buffer, size, headers, 1, 0);
+	if (!buffer || size < 14)
+		return HV_COUNTERS_PROTOCOL_OTHER;
+
+	BYTE protocol;
+
+	switch (RtlUshortByteSwap(*(USHORT*)(buffer + 12))) {
+	case CountersEtherType_IPv4:
+		if (size < 14 + 10)
+			return HV_COUNTERS_PROTOCOL_OTHER_IP;
+
+		protocol = buffer[14 + 9];
+		break;
+
+	case CountersEtherType_IPv6:
+		if (size < 14 + 7)
+			return HV_COUNTERS_PROTOCOL_OTHER_IP;
+
+		//extension headers are not followed
+		protocol = buffer[14 + 6];
+		break;
+
+	case CountersEtherType_Arp:
+		return HV_COUNTERS_PROTOCOL_ARP;
+
+	default:
+		return HV_COUNTERS_PROTOCOL_OTHER;
+	}
+
+	switch (protocol) {
+	case CountersProtocol_Tcp:
+		return HV_COUNTERS_PROTOCOL_TCP;
+
+	case CountersProtocol_Udp:
+		return HV_COUNTERS_PROTOCOL_UDP;
+
+	case CountersProtocol_Icmp:
+	case CountersProtocol_Icmpv6:
+		return HV_COUNTERS_PROTOCOL_ICMP;
+
+	default:
+		return HV_COUNTERS_PROTOCOL_OTHER_IP;
+	}
+}
+
+void counters_page_frame(NET_BUFFER* net_buffer, ULONG frame_size, ULONG slot, ULONG direction)
+{
+	ASSERT(slot < HV_STATS_PORT_SLOTS);
+	ASSERT(direction < HV_STATS_DIRECTIONS);
+
+	if (!g_pCountersCpus)
+		return;
+
+	CountersCpu* pCpu = &g_pCountersCpus[KeGetCurrentProcessorNumberEx(NULL)];
+
+	HV_COUNTER* pPort = &pCpu->ports[slot][direction];
+	HV_COUNTER* pProtocol = &pCpu->protocols[classify_frame(net_buffer, frame_size)][direction];
+
+	++pPort->Frames;
+	pPort->Bytes += frame_size;
+
+	++pProtocol->Frames;
+	pProtocol->Bytes += frame_size;
+}
+
+static void add_counter(HV_COUNTER* pTarget, const HV_COUNTER* pSource)
+{
+	pTarget->Frames += pSource->Frames;
+	pTarget->Bytes += pSource->Bytes;
+}
+
+//sums the processors' counters and writes them to the page. At DISPATCH_LEVEL.
+static void publish()
+{
+	//the other processor publishes the same totals
+	if (InterlockedCompareExchange(&g_counters_writing, 1, 0))
+		return;
+
+	PHV_COUNTERS_PAGE pTotals = g_pCountersTotals;
+
+	pTotals->Timestamp = port_stats_now();
+
+	RtlZeroMemory(pTotals->Ports, sizeof(pTotals->Ports));
+	RtlZeroMemory(pTotals->Protocols, sizeof(pTotals->Protocols));
+
+	for (ULONG slot = 0; slot < HV_STATS_MAX_PORTS; ++slot) {
+		pTotals->Ports[slot].PortId = port_stats_slot_port(slot);
+		pTotals->Ports[slot].InUse = pTotals->Ports[slot].PortId != HV_STATS_UNKNOWN_PORT_ID;
+	}
+
+	pTotals->Ports[HV_STATS_UNKNOWN_PORT_SLOT].PortId = HV_STATS_UNKNOWN_PORT_ID;
+	pTotals->Ports[HV_STATS_UNKNOWN_PORT_SLOT].InUse = 1;
+
+	//the per-processor copies are read without synchronization, like the histograms
+	for (ULONG cpu = 0; cpu < g_counters_cpu_count; ++cpu) {
+		const CountersCpu* pCpu = &g_pCountersCpus[cpu];
+
+		for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+			for (ULONG slot = 0; slot < HV_STATS_PORT_SLOTS; ++slot)
+				add_counter(&pTotals->Ports[slot].Direction[direction], &pCpu->ports[slot][direction]);
+
+			for (ULONG protocol = 0; protocol < HV_COUNTERS_PROTOCOLS; ++protocol)
+				add_counter(&pTotals->Protocols[protocol][direction], &pCpu->protocols[protocol][direction]);
+		}
+	}
+
+	pTotals->Drops.RingRecords = shared_ring_dropped();
+	pTotals->Drops.CaptureRecords = capture_dropped();
+
+	//the page is only odd for the copy; interlocked: each store is ordered with the copy
+	InterlockedExchange(&g_pCountersPage->Sequence, ++g_counters_sequence);
+
+	RtlCopyMemory((BYTE*)g_pCountersPage + sizeof(LONG), (BYTE*)pTotals + sizeof(LONG), sizeof(HV_COUNTERS_PAGE) - sizeof(LONG));
+
+	InterlockedExchange(&g_pCountersPage->Sequence, ++g_counters_sequence);
+
+	InterlockedExchange(&g_counters_writing, 0);
+}
+
+static void publish_dpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(DeferredContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	publish();
+}
+
+//g_counters_mutex must be held
+static CountersView* find_view(PFILE_OBJECT owner)
+{
+	for (ULONG i = 0; i < g_counters_view_count; ++i) {
+		if (g_counters_views[i].owner == owner)
+			return &g_counters_views[i];
+	}
+
+	return NULL;
+}
+
+NTSTATUS counters_page_map(PFILE_OBJECT owner, __out PHV_COUNTERS_MAPPING pMapping)
+{
+	PAGED_CODE();
+
+	if (!g_pCountersPage)
+		return STATUS_DEVICE_NOT_READY;
+
+	ExAcquireFastMutex(&g_counters_mutex);
+
+	CountersView* pView = find_view(owner);
+	BOOLEAN full = g_counters_view_count == COUNTERS_MAX_VIEWS;
+
+	//the same handle asking again gets the view it has
+	if (pView && pView->process == PsGetCurrentProcess()) {
+		pMapping->Address = (ULONG64)(ULONG_PTR)pView->address;
+		pMapping->Length = (ULONG)g_counters_length;
+		pMapping->Reserved = 0;
+
+		ExReleaseFastMutex(&g_counters_mutex);
+		return STATUS_SUCCESS;
+	}
+
+	ExReleaseFastMutex(&g_counters_mutex);
+
+	if (pView)
+		return STATUS_DEVICE_BUSY;
+
+	if (full)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	//mapping needs PASSIVE_LEVEL: not under the mutex
+	PVOID address = NULL;
+	SIZE_T length = 0;
+
+	NTSTATUS status = ZwMapViewOfSection(g_hCountersSection, ZwCurrentProcess(), &address, 0, 0, NULL, &length,
+		ViewUnmap, 0, PAGE_READONLY);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	ExAcquireFastMutex(&g_counters_mutex);
+
+	//another request through the handle, or another handle, got there first
+	if (find_view(owner) || g_counters_view_count == COUNTERS_MAX_VIEWS) {
+		ExReleaseFastMutex(&g_counters_mutex);
+
+		ZwUnmapViewOfSection(ZwCurrentProcess(), address);
+		return STATUS_DEVICE_BUSY;
+	}
+
+	pView = &g_counters_views[g_counters_view_count++];
+	pView->owner = owner;
+	pView->process = PsGetCurrentProcess();
+	pView->address = address;
+
+	ObReferenceObject(pView->process);
+
+	if (g_counters_view_count == 1) {
+		//the first reader finds the page written, then it is kept up to date
+		KIRQL old_irql;
+		KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+		publish();
+		KeLowerIrql(old_irql);
+
+		LARGE_INTEGER due;
+		due.QuadPart = -(LONGLONG)HV_COUNTERS_PUBLISH_INTERVAL;
+
+		KeSetTimerEx(&g_counters_timer, due, HV_COUNTERS_PUBLISH_INTERVAL / 10000, &g_counters_dpc);
+	}
+
+	ExReleaseFastMutex(&g_counters_mutex);
+
+	pMapping->Address = (ULONG64)(ULONG_PTR)address;
+	pMapping->Length = (ULONG)g_counters_length;
+	pMapping->Reserved = 0;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS counters_page_unmap(PFILE_OBJECT owner)
+{
+	PAGED_CODE();
+
+	CountersView view;
+
+	ExAcquireFastMutex(&g_counters_mutex);
+
+	CountersView* pView = find_view(owner);
+	if (!pView) {
+		ExReleaseFastMutex(&g_counters_mutex);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	view = *pView;
+	*pView = g_counters_views[--g_counters_view_count];
+
+	//nobody looks at the page any more; a DPC already queued only writes it once more
+	if (!g_counters_view_count)
+		KeCancelTimer(&g_counters_timer);
+
+	ExReleaseFastMutex(&g_counters_mutex);
+
+	unmap_view(&view);
+
+	return STATUS_SUCCESS;
+}
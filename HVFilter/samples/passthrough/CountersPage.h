@@ -0,0 +1,46 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+#include "../../HVService/HVService/HVCounters.h"
+
+//
+// Read-only counters page (see HVCounters.h).
+//
+// Every processor owns a private copy of the counters, updated with plain
+// increments at DISPATCH_LEVEL like the histograms.  A periodic timer DPC sums
+// the copies into a page the driver allocates once and maps read-only into
+// every process that asks for it; the timer only runs while a view is mapped.
+//
+
+NTSTATUS init_counters_page();
+void uninit_counters_page();
+
+//
+// Forgets the totals of a slot (see PortStats.h) that is being bound to a new vPort.
+//
+void counters_page_reset_slot(ULONG slot);
+
+//
+// Accounts one frame. Must be called at DISPATCH_LEVEL.
+//
+void counters_page_frame(NET_BUFFER* net_buffer, ULONG frame_size, ULONG slot, ULONG direction);
+
+//
+// Maps the page read-only into the current process, once per file object.
+// Called at PASSIVE_LEVEL, in the context of the requesting process.
+//
+NTSTATUS counters_page_map(PFILE_OBJECT owner, __out PHV_COUNTERS_MAPPING pMapping);
+
+//
+// Unmaps the view mapped through owner. Called at PASSIVE_LEVEL.
+//
+NTSTATUS counters_page_unmap(PFILE_OBJECT owner);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,239 @@
+#include "Governor.h"
+
+#define GOVERNOR_TAG 'voGS'
+
+struct DECLSPEC_CACHEALIGN GovernorCpu
+{
+	ULONG	mode;
+	ULONG	sample_rate;
+	ULONG	countdown;
+	ULONG	random;
+
+	//current interval
+	ULONG64	window_start;
+	ULONG64	window_frames;
+	ULONG64	window_busy;
+
+	//last complete interval
+	ULONG	frames_per_second;
+	ULONG	busy;
+
+	ULONG64	frames;
+	ULONG64	sampled_frames;
+	ULONG	mode_changes;
+};
+
+namespace
+{
+	GovernorCpu*	g_pGovernor = NULL;
+	ULONG			g_governor_cpu_count = 0;
+
+	//written at PASSIVE_LEVEL, read by every processor when its interval ends
+	volatile LONG	g_governor_budget = HV_GOVERNOR_DEFAULT_BUDGET;
+	volatile LONG	g_governor_interval = HV_GOVERNOR_DEFAULT_INTERVAL;
+	volatile LONG	g_governor_forced_mode = (LONG)HV_GOVERNOR_MODE_AUTO;
+	volatile LONG	g_governor_forced_rate = 1;
+}
+
+NTSTATUS init_governor()
+{
+	g_governor_budget = HV_GOVERNOR_DEFAULT_BUDGET;
+	g_governor_interval = HV_GOVERNOR_DEFAULT_INTERVAL;
+	g_governor_forced_mode = (LONG)HV_GOVERNOR_MODE_AUTO;
+	g_governor_forced_rate = 1;
+
+	g_governor_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T size = sizeof(GovernorCpu) * g_governor_cpu_count;
+	g_pGovernor = (GovernorCpu*)ExAllocatePoolWithTag(NonPagedPoolNx, size, GOVERNOR_TAG);
+	if (!g_pGovernor) {
+		g_governor_cpu_count = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(g_pGovernor, size);
+
+	for (ULONG cpu = 0; cpu < g_governor_cpu_count; ++cpu) {
+		g_pGovernor[cpu].mode = HV_GOVERNOR_MODE_FULL;
+		g_pGovernor[cpu].sample_rate = 1;
+		g_pGovernor[cpu].countdown = 1;
+		//xorshift seed: any non-zero value
+		g_pGovernor[cpu].random = (0x9E3779B9u ^ (cpu * 0x85EBCA6Bu)) | 1;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+void uninit_governor()
+{
+	if (g_pGovernor) {
+		ExFreePoolWithTag(g_pGovernor, GOVERNOR_TAG);
+		g_pGovernor = NULL;
+		g_governor_cpu_count = 0;
+	}
+}
+
+static void set_mode(GovernorCpu* pCpu, ULONG mode, ULONG sample_rate)
+{
+	if (pCpu->mode == mode && pCpu->sample_rate == sample_rate)
+		return;
+
+	pCpu->mode = mode;
+	pCpu->sample_rate = sample_rate;
+	//the next frame is sampled: the new weight applies from there on
+	pCpu->countdown = 1;
+	++pCpu->mode_changes;
+}
+
+//full -> headers -> sampled 1/2 -> ... -> sampled 1/HV_GOVERNOR_MAX_SAMPLE_RATE
+static void step_down(GovernorCpu* pCpu)
+{
+	switch (pCpu->mode) {
+	case HV_GOVERNOR_MODE_FULL:
+		set_mode(pCpu, HV_GOVERNOR_MODE_HEADERS, 1);
+		break;
+
+	case HV_GOVERNOR_MODE_HEADERS:
+		set_mode(pCpu, HV_GOVERNOR_MODE_SAMPLED, 2);
+		break;
+
+	default:
+		if (pCpu->sample_rate < HV_GOVERNOR_MAX_SAMPLE_RATE)
+			set_mode(pCpu, HV_GOVERNOR_MODE_SAMPLED, pCpu->sample_rate * 2);
+		break;
+	}
+}
+
+static void step_up(GovernorCpu* pCpu)
+{
+	switch (pCpu->mode) {
+	case HV_GOVERNOR_MODE_FULL:
+		break;
+
+	case HV_GOVERNOR_MODE_HEADERS:
+		set_mode(pCpu, HV_GOVERNOR_MODE_FULL, 1);
+		break;
+
+	default:
+		if (pCpu->sample_rate > 2)
+			set_mode(pCpu, HV_GOVERNOR_MODE_SAMPLED, pCpu->sample_rate / 2);
+		else
+			set_mode(pCpu, HV_GOVERNOR_MODE_HEADERS, 1);
+		break;
+	}
+}
+
+static void evaluate(GovernorCpu* pCpu, ULONG64 now)
+{
+	ULONG64 elapsed = now - pCpu->window_start;
+
+	pCpu->busy = (ULONG)min(pCpu->window_busy * 1000000 / elapsed, 1000000);
+	pCpu->frames_per_second = (ULONG)min(pCpu->window_frames * 10000000 / elapsed, MAXULONG);
+
+	ULONG forced_mode = (ULONG)g_governor_forced_mode;
+	ULONG budget = (ULONG)g_governor_budget;
+
+	if (forced_mode != HV_GOVERNOR_MODE_AUTO) {
+		set_mode(pCpu, forced_mode, forced_mode == HV_GOVERNOR_MODE_SAMPLED ? (ULONG)g_governor_forced_rate : 1);
+	} else if (pCpu->busy > budget) {
+		step_down(pCpu);
+	} else if (pCpu->busy < budget / 2) {
+		//stepping up roughly doubles the cost: only do it with room for that
+		step_up(pCpu);
+	}
+
+	pCpu->window_start = now;
+	pCpu->window_frames = 0;
+	pCpu->window_busy = 0;
+}
+
+void governor_begin(__out PGOVERNOR_CHAIN pChain, ULONG64 now)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	pChain->frames = 0;
+	pChain->sampled = 0;
+	pChain->start = now;
+
+	if (!g_pGovernor) {
+		pChain->cpu = MAXULONG;
+		pChain->mode = HV_GOVERNOR_MODE_FULL;
+		pChain->sample_rate = 1;
+		pChain->countdown = 1;
+		pChain->random = 1;
+		return;
+	}
+
+	pChain->cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	const GovernorCpu* pCpu = &g_pGovernor[pChain->cpu];
+
+	pChain->mode = pCpu->mode;
+	pChain->sample_rate = pCpu->sample_rate;
+	pChain->countdown = pCpu->countdown;
+	pChain->random = pCpu->random;
+}
+
+void governor_end(__in PGOVERNOR_CHAIN pChain, ULONG64 now)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (pChain->cpu == MAXULONG)
+		return;
+
+	GovernorCpu* pCpu = &g_pGovernor[pChain->cpu];
+
+	pCpu->countdown = pChain->countdown;
+	pCpu->random = pChain->random;
+
+	pCpu->frames += pChain->frames;
+	pCpu->sampled_frames += pChain->sampled;
+	pCpu->window_frames += pChain->frames;
+	pCpu->window_busy += now - pChain->start;
+
+	if (pCpu->window_start == 0) {
+		pCpu->window_start = pChain->start;
+	} else if (now - pCpu->window_start >= (ULONG)g_governor_interval) {
+		evaluate(pCpu, now);
+	}
+}
+
+void governor_set_config(__in PHV_GOVERNOR_CONFIG pConfig)
+{
+	InterlockedExchange(&g_governor_budget, (LONG)pConfig->Budget);
+	InterlockedExchange(&g_governor_interval, (LONG)pConfig->Interval);
+	InterlockedExchange(&g_governor_forced_rate, (LONG)pConfig->ForcedSampleRate);
+	InterlockedExchange(&g_governor_forced_mode, (LONG)pConfig->ForcedMode);
+}
+
+ULONG governor_query(__out PHV_GOVERNOR_STATE pState, ULONG size)
+{
+	ULONG capacity = (size - FIELD_OFFSET(HV_GOVERNOR_STATE, Cpus)) / sizeof(HV_GOVERNOR_CPU);
+	ULONG count = min(capacity, g_governor_cpu_count);
+
+	RtlZeroMemory(pState, FIELD_OFFSET(HV_GOVERNOR_STATE, Cpus));
+
+	pState->Version = HV_GOVERNOR_STATE_VERSION;
+	pState->CpuCount = g_governor_cpu_count;
+	pState->Config.Budget = (ULONG)g_governor_budget;
+	pState->Config.Interval = (ULONG)g_governor_interval;
+	pState->Config.ForcedMode = (ULONG)g_governor_forced_mode;
+	pState->Config.ForcedSampleRate = (ULONG)g_governor_forced_rate;
+
+	//read without synchronization, like the histograms
+	for (ULONG cpu = 0; cpu < count; ++cpu) {
+		const GovernorCpu* pCpu = &g_pGovernor[cpu];
+		PHV_GOVERNOR_CPU pTarget = &pState->Cpus[cpu];
+
+		pTarget->Mode = pCpu->mode;
+		pTarget->SampleRate = pCpu->sample_rate;
+		pTarget->FramesPerSecond = pCpu->frames_per_second;
+		pTarget->Busy = pCpu->busy;
+		pTarget->Frames = pCpu->frames;
+		pTarget->SampledFrames = pCpu->sampled_frames;
+		pTarget->ModeChanges = pCpu->mode_changes;
+		pTarget->Reserved = 0;
+	}
+
+	return FIELD_OFFSET(HV_GOVERNOR_STATE, Cpus) + count * sizeof(HV_GOVERNOR_CPU);
+}
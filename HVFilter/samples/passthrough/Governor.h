@@ -0,0 +1,79 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+
+//
+// Adaptive sampling governor.
+//
+// Every processor measures the frames it handles and the time it spends in the
+// extension.  At the end of each interval it steps between full parsing, header-only
+// parsing and 1-in-N sampling (N doubling / halving) to keep that time within the
+// configured budget.  See HV_GOVERNOR_MODE_* in HVStats.h.
+//
+
+NTSTATUS init_governor();
+void uninit_governor();
+
+//
+// State of the processor for the NBL chain being processed.  Filled by governor_begin
+// and handed back to governor_end; all of it is used at DISPATCH_LEVEL.
+//
+typedef struct _GOVERNOR_CHAIN {
+	ULONG	cpu;
+	ULONG	mode;
+	//weight of a sampled frame, 1 unless mode is HV_GOVERNOR_MODE_SAMPLED
+	ULONG	sample_rate;
+	//frames left before the next sampled one
+	ULONG	countdown;
+	ULONG	random;
+
+	ULONG	frames;
+	ULONG	sampled;
+	ULONG64	start;
+} GOVERNOR_CHAIN, *PGOVERNOR_CHAIN;
+
+void governor_begin(__out PGOVERNOR_CHAIN pChain, ULONG64 now);
+
+//
+// Returns TRUE if the next frame of the chain must be parsed and accounted (with a
+// weight of pChain->sample_rate).
+//
+FORCEINLINE BOOLEAN governor_take_frame(PGOVERNOR_CHAIN pChain)
+{
+	++pChain->frames;
+
+	if (--pChain->countdown)
+		return FALSE;
+
+	//random gaps with a mean of sample_rate, so periodic traffic cannot alias with the sampling
+	if (pChain->sample_rate > 1) {
+		pChain->random ^= pChain->random << 13;
+		pChain->random ^= pChain->random >> 17;
+		pChain->random ^= pChain->random << 5;
+
+		pChain->countdown = 1 + pChain->random % (2 * pChain->sample_rate - 1);
+	} else {
+		pChain->countdown = 1;
+	}
+
+	++pChain->sampled;
+	return TRUE;
+}
+
+void governor_end(__in PGOVERNOR_CHAIN pChain, ULONG64 now);
+
+void governor_set_config(__in PHV_GOVERNOR_CONFIG pConfig);
+
+//
+// Fills pState with as many processors as fit in size bytes; returns the bytes written.
+//
+ULONG governor_query(__out PHV_GOVERNOR_STATE pState, ULONG size);
+
+#ifdef __cplusplus
+}
+#endif
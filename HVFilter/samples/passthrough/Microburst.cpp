@@ -0,0 +1,571 @@
+#include "Microburst.h"
+#include "PortStats.h"
+
+#define MICROBURST_RING_BUCKETS 64
+#define MICROBURST_LOG_EVENTS 1024
+#define MICROBURST_TAG 'bMsM'
+
+//how often the bursts of ports that went quiet are closed, in ms
+#define MICROBURST_FLUSH_INTERVAL 100
+
+C_ASSERT((MICROBURST_RING_BUCKETS & (MICROBURST_RING_BUCKETS - 1)) == 0);
+
+struct MicroburstBucket
+{
+	ULONG64	bytes;
+	ULONG	packets;
+};
+
+struct DECLSPEC_CACHEALIGN MicroburstPort
+{
+	KSPIN_LOCK			lock;
+
+	NDIS_SWITCH_PORT_ID	port_id;
+
+	//index (time / HV_MICROBURST_BUCKET_TIME) of the bucket being filled
+	ULONG64				current;
+	MicroburstBucket	ring[MICROBURST_RING_BUCKETS];
+
+	//burst in progress
+	BOOLEAN				in_burst;
+	ULONG64				burst_start;
+	ULONG64				burst_bytes;
+	ULONG				burst_packets;
+	ULONG				peak_bytes;
+	ULONG				peak_packets;
+};
+
+namespace
+{
+	//[slot][direction]
+	MicroburstPort*		g_pMicroburstPorts = NULL;
+	volatile LONG		g_microburst_threshold = HV_MICROBURST_DEFAULT_THRESHOLD;
+
+	//event log and the reads waiting for it, in a cancel-safe queue
+	KSPIN_LOCK			g_event_lock;
+	HV_MICROBURST_EVENT	g_events[MICROBURST_LOG_EVENTS];
+	ULONG64				g_event_sequence = 0;
+	LIST_ENTRY			g_waiting_readers;
+	IO_CSQ				g_reader_queue;
+
+	//MicroburstExport of every data device handle that read the record stream, under g_event_lock
+	LIST_ENTRY			g_export_readers;
+
+	//closes the bursts no later frame would close
+	KTIMER				g_flush_timer;
+	KDPC				g_flush_dpc;
+}
+
+//next event of the record stream, one per data device handle
+struct MicroburstExport
+{
+	LIST_ENTRY		list_entry;
+	PFILE_OBJECT	file_object;
+	ULONG64			sequence;
+};
+
+//what the reader queue is searched for: the reads of a handle (all if NULL), only those with events to take if ready
+struct MicroburstPeek
+{
+	PFILE_OBJECT	file_object;
+	BOOLEAN			ready;
+};
+
+static KDEFERRED_ROUTINE flush_dpc;
+
+static IO_CSQ_INSERT_IRP_EX reader_insert;
+static IO_CSQ_REMOVE_IRP reader_remove;
+static IO_CSQ_PEEK_NEXT_IRP reader_peek_next;
+static IO_CSQ_ACQUIRE_LOCK reader_acquire_lock;
+static IO_CSQ_RELEASE_LOCK reader_release_lock;
+static IO_CSQ_COMPLETE_CANCELED_IRP reader_complete_canceled;
+
+static MicroburstPort* get_port(ULONG slot, ULONG direction)
+{
+	return &g_pMicroburstPorts[slot * HV_STATS_DIRECTIONS + direction];
+}
+
+//clears everything but the lock, which the caller holds
+static void reset_port(MicroburstPort* pPort, NDIS_SWITCH_PORT_ID port_id)
+{
+	RtlZeroMemory((BYTE*)pPort + FIELD_OFFSET(MicroburstPort, port_id),
+		sizeof(MicroburstPort) - FIELD_OFFSET(MicroburstPort, port_id));
+
+	pPort->port_id = port_id;
+}
+
+NTSTATUS init_microburst()
+{
+	KeInitializeSpinLock(&g_event_lock);
+	InitializeListHead(&g_waiting_readers);
+	InitializeListHead(&g_export_readers);
+	g_event_sequence = 0;
+	g_microburst_threshold = HV_MICROBURST_DEFAULT_THRESHOLD;
+
+	IoCsqInitializeEx(&g_reader_queue, reader_insert, reader_remove, reader_peek_next,
+		reader_acquire_lock, reader_release_lock, reader_complete_canceled);
+
+	SIZE_T size = sizeof(MicroburstPort) * HV_STATS_PORT_SLOTS * HV_STATS_DIRECTIONS;
+	g_pMicroburstPorts = (MicroburstPort*)ExAllocatePoolWithTag(NonPagedPoolNx, size, MICROBURST_TAG);
+	if (!g_pMicroburstPorts)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(g_pMicroburstPorts, size);
+
+	for (ULONG slot = 0; slot < HV_STATS_PORT_SLOTS; ++slot) {
+		for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+			MicroburstPort* pPort = get_port(slot, direction);
+
+			KeInitializeSpinLock(&pPort->lock);
+			pPort->port_id = HV_STATS_UNKNOWN_PORT_ID;
+		}
+	}
+
+	LARGE_INTEGER due;
+	due.QuadPart = -(LONGLONG)MICROBURST_FLUSH_INTERVAL * 10000;
+
+	KeInitializeTimer(&g_flush_timer);
+	KeInitializeDpc(&g_flush_dpc, flush_dpc, NULL);
+	KeSetTimerEx(&g_flush_timer, due, MICROBURST_FLUSH_INTERVAL, &g_flush_dpc);
+
+	return STATUS_SUCCESS;
+}
+
+void uninit_microburst()
+{
+	if (g_pMicroburstPorts) {
+		KeCancelTimer(&g_flush_timer);
+		KeFlushQueuedDpcs();
+	}
+
+	microburst_cancel_readers(NULL);
+
+	while (!IsListEmpty(&g_export_readers))
+		ExFreePoolWithTag(CONTAINING_RECORD(RemoveHeadList(&g_export_readers), MicroburstExport, list_entry), MICROBURST_TAG);
+
+	if (g_pMicroburstPorts) {
+		ExFreePoolWithTag(g_pMicroburstPorts, MICROBURST_TAG);
+		g_pMicroburstPorts = NULL;
+	}
+}
+
+void microburst_reset_slot(ULONG slot, NDIS_SWITCH_PORT_ID port_id)
+{
+	if (!g_pMicroburstPorts || slot >= HV_STATS_PORT_SLOTS)
+		return;
+
+	for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+		MicroburstPort* pPort = get_port(slot, direction);
+		KIRQL old_irql;
+
+		KeAcquireSpinLock(&pPort->lock, &old_irql);
+		reset_port(pPort, port_id);
+		KeReleaseSpinLock(&pPort->lock, old_irql);
+	}
+}
+
+void microburst_set_config(__in PHV_MICROBURST_CONFIG pConfig)
+{
+	if (pConfig->ThresholdBytes > 0)
+		InterlockedExchange(&g_microburst_threshold, (LONG)pConfig->ThresholdBytes);
+}
+
+//METHOD_BUFFERED: input and output share the system buffer, so this is only valid until fill_read
+static ULONG64 read_cursor(PIRP Irp)
+{
+	return ((PHV_MICROBURST_READ)Irp->AssociatedIrp.SystemBuffer)->Sequence;
+}
+
+//copies the events following the reader's cursor into the IRP. g_event_lock must be held.
+static void fill_read(PIRP Irp)
+{
+	PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+	ULONG64 cursor = read_cursor(Irp);
+	PHV_MICROBURST_EVENTS pOut = (PHV_MICROBURST_EVENTS)Irp->AssociatedIrp.SystemBuffer;
+
+	ULONG capacity = (irpSp->Parameters.DeviceIoControl.OutputBufferLength - FIELD_OFFSET(HV_MICROBURST_EVENTS, Events))
+		/ sizeof(HV_MICROBURST_EVENT);
+
+	ULONG64 oldest = g_event_sequence > MICROBURST_LOG_EVENTS ? g_event_sequence - MICROBURST_LOG_EVENTS : 0;
+	ULONG lost = 0;
+
+	if (cursor < oldest) {
+		lost = (ULONG)min(oldest - cursor, MAXULONG);
+		cursor = oldest;
+	}
+
+	//a cursor from the future belongs to a previous instance of the driver
+	if (cursor > g_event_sequence)
+		cursor = oldest;
+
+	ULONG count = (ULONG)min(g_event_sequence - cursor, capacity);
+
+	for (ULONG i = 0; i < count; ++i)
+		pOut->Events[i] = g_events[(cursor + i) % MICROBURST_LOG_EVENTS];
+
+	pOut->NextSequence = cursor + count;
+	pOut->Lost = lost;
+	pOut->Count = count;
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = FIELD_OFFSET(HV_MICROBURST_EVENTS, Events) + count * sizeof(HV_MICROBURST_EVENT);
+}
+
+//a read waits only while there is nothing after its cursor; otherwise the caller answers it at once
+static NTSTATUS reader_insert(PIO_CSQ Csq, PIRP Irp, PVOID InsertContext)
+{
+	UNREFERENCED_PARAMETER(Csq);
+	UNREFERENCED_PARAMETER(InsertContext);
+
+	if (read_cursor(Irp) != g_event_sequence)
+		return STATUS_UNSUCCESSFUL;
+
+	InsertTailList(&g_waiting_readers, &Irp->Tail.Overlay.ListEntry);
+	return STATUS_SUCCESS;
+}
+
+static void reader_remove(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+static PIRP reader_peek_next(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	const MicroburstPeek* pPeek = (const MicroburstPeek*)PeekContext;
+	PLIST_ENTRY entry = Irp ? Irp->Tail.Overlay.ListEntry.Flink : g_waiting_readers.Flink;
+
+	for (; entry != &g_waiting_readers; entry = entry->Flink) {
+		PIRP next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+		if (pPeek->file_object && IoGetCurrentIrpStackLocation(next)->FileObject != pPeek->file_object)
+			continue;
+
+		if (pPeek->ready && read_cursor(next) == g_event_sequence)
+			continue;
+
+		return next;
+	}
+
+	return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+static void reader_acquire_lock(PIO_CSQ Csq, PKIRQL Irql)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeAcquireSpinLock(&g_event_lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static void reader_release_lock(PIO_CSQ Csq, KIRQL Irql)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeReleaseSpinLock(&g_event_lock, Irql);
+}
+
+static void reader_complete_canceled(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+//takes a read that has events to return off the queue and answers it; FALSE if there is none
+static BOOLEAN complete_ready_read()
+{
+	MicroburstPeek peek = {NULL, TRUE};
+	PIRP Irp = IoCsqRemoveNextIrp(&g_reader_queue, &peek);
+	KIRQL old_irql;
+
+	if (!Irp)
+		return FALSE;
+
+	KeAcquireSpinLock(&g_event_lock, &old_irql);
+	fill_read(Irp);
+	KeReleaseSpinLock(&g_event_lock, old_irql);
+
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return TRUE;
+}
+
+//called at DISPATCH_LEVEL, without any port lock held
+static void log_event(const HV_MICROBURST_EVENT* pEvent)
+{
+	KeAcquireSpinLockAtDpcLevel(&g_event_lock);
+
+	g_events[g_event_sequence % MICROBURST_LOG_EVENTS] = *pEvent;
+	++g_event_sequence;
+
+	KeReleaseSpinLockFromDpcLevel(&g_event_lock);
+
+	//a read queued since then waits for the next event: only those behind are answered
+	while (complete_ready_read())
+		;
+}
+
+//closes pPort->current and moves on to bucket. Returns TRUE if a burst ended. Port lock must be held.
+static BOOLEAN advance(MicroburstPort* pPort, ULONG direction, ULONG64 bucket, HV_MICROBURST_EVENT* pEvent)
+{
+	ULONG threshold = (ULONG)g_microburst_threshold;
+	MicroburstBucket* pClosed = &pPort->ring[pPort->current & (MICROBURST_RING_BUCKETS - 1)];
+	BOOLEAN bursting = pClosed->bytes >= threshold;
+	BOOLEAN ended = FALSE;
+
+	if (bursting) {
+		if (!pPort->in_burst) {
+			pPort->in_burst = TRUE;
+			pPort->burst_start = pPort->current;
+			pPort->burst_bytes = 0;
+			pPort->burst_packets = 0;
+			pPort->peak_bytes = 0;
+			pPort->peak_packets = 0;
+		}
+
+		pPort->burst_bytes += pClosed->bytes;
+		pPort->burst_packets += pClosed->packets;
+
+		if (pClosed->bytes > pPort->peak_bytes) {
+			pPort->peak_bytes = (ULONG)pClosed->bytes;
+			pPort->peak_packets = pClosed->packets;
+		}
+	}
+
+	//the burst ends with the closed bucket, or with the empty buckets being skipped over
+	if (pPort->in_burst && (!bursting || bucket > pPort->current + 1)) {
+		ULONG64 end = bursting ? pPort->current + 1 : pPort->current;
+
+		pEvent->StartTime = pPort->burst_start * HV_MICROBURST_BUCKET_TIME;
+		pEvent->Bytes = pPort->burst_bytes;
+		pEvent->Packets = pPort->burst_packets;
+		pEvent->PortId = pPort->port_id;
+		pEvent->Duration = (ULONG)min((end - pPort->burst_start) * HV_MICROBURST_BUCKET_TIME, MAXULONG);
+		pEvent->PeakBytes = pPort->peak_bytes;
+		pEvent->PeakPackets = pPort->peak_packets;
+		pEvent->Direction = direction;
+
+		pPort->in_burst = FALSE;
+		ended = TRUE;
+	}
+
+	//recycle the ring entries of the buckets we move over
+	ULONG64 skipped = min(bucket - pPort->current, MICROBURST_RING_BUCKETS);
+	for (ULONG64 i = 1; i <= skipped; ++i) {
+		MicroburstBucket* pNext = &pPort->ring[(pPort->current + i) & (MICROBURST_RING_BUCKETS - 1)];
+		pNext->bytes = 0;
+		pNext->packets = 0;
+	}
+
+	pPort->current = bucket;
+
+	return ended;
+}
+
+void microburst_add(ULONG slot, ULONG direction, ULONG packets, ULONG bytes, ULONG64 now)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (!g_pMicroburstPorts || packets == 0)
+		return;
+
+	MicroburstPort* pPort = get_port(slot, direction);
+	ULONG64 bucket = now / HV_MICROBURST_BUCKET_TIME;
+	HV_MICROBURST_EVENT event;
+	BOOLEAN ended = FALSE;
+
+	KeAcquireSpinLockAtDpcLevel(&pPort->lock);
+
+	//a chain timestamped just before another processor advanced the port lands in the current bucket
+	if (bucket > pPort->current)
+		ended = advance(pPort, direction, bucket, &event);
+
+	MicroburstBucket* pBucket = &pPort->ring[pPort->current & (MICROBURST_RING_BUCKETS - 1)];
+	pBucket->bytes += bytes;
+	pBucket->packets += packets;
+
+	KeReleaseSpinLockFromDpcLevel(&pPort->lock);
+
+	if (ended)
+		log_event(&event);
+}
+
+//moves the port on to bucket, reporting the burst that ends there. Called at DISPATCH_LEVEL.
+static void close_port(MicroburstPort* pPort, ULONG direction, ULONG64 bucket)
+{
+	HV_MICROBURST_EVENT event;
+	BOOLEAN ended = FALSE;
+
+	KeAcquireSpinLockAtDpcLevel(&pPort->lock);
+
+	if (bucket > pPort->current)
+		ended = advance(pPort, direction, bucket, &event);
+
+	KeReleaseSpinLockFromDpcLevel(&pPort->lock);
+
+	if (ended)
+		log_event(&event);
+}
+
+//a burst only ends when the bucket after it is closed, which takes a later frame:
+//the timer closes the buckets of the ports that are bursting and went quiet
+static void flush_dpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(DeferredContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	ULONG threshold = (ULONG)g_microburst_threshold;
+	ULONG64 bucket = port_stats_now() / HV_MICROBURST_BUCKET_TIME;
+
+	for (ULONG slot = 0; slot < HV_STATS_PORT_SLOTS; ++slot) {
+		for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+			MicroburstPort* pPort = get_port(slot, direction);
+
+			//read without the lock: close_port looks again under it
+			if (!pPort->in_burst && pPort->ring[pPort->current & (MICROBURST_RING_BUCKETS - 1)].bytes < threshold)
+				continue;
+
+			close_port(pPort, direction, bucket);
+		}
+	}
+}
+
+void microburst_close_slot(ULONG slot)
+{
+	if (!g_pMicroburstPorts || slot >= HV_STATS_PORT_SLOTS)
+		return;
+
+	ULONG64 bucket = port_stats_now() / HV_MICROBURST_BUCKET_TIME;
+	KIRQL old_irql;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+
+	for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+		MicroburstPort* pPort = get_port(slot, direction);
+
+		//at least two buckets on: the burst ends even if the current bucket was bursting
+		close_port(pPort, direction, max(bucket, pPort->current + 2));
+	}
+
+	KeLowerIrql(old_irql);
+}
+
+NTSTATUS microburst_read(PIRP Irp)
+{
+	PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+	KIRQL old_irql;
+
+	if (irpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(HV_MICROBURST_READ) ||
+		irpSp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(HV_MICROBURST_EVENTS)) {
+
+		Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+		Irp->IoStatus.Information = 0;
+
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	//queued (and marked pending) only if there is nothing to return yet; cancelling it takes it off the queue
+	if (NT_SUCCESS(IoCsqInsertIrpEx(&g_reader_queue, Irp, NULL, NULL)))
+		return STATUS_PENDING;
+
+	KeAcquireSpinLock(&g_event_lock, &old_irql);
+	fill_read(Irp);
+	KeReleaseSpinLock(&g_event_lock, old_irql);
+
+	return STATUS_SUCCESS;
+}
+
+//the cursor of a handle, created at the oldest event still logged. g_event_lock must be held.
+static MicroburstExport* find_export(PFILE_OBJECT FileObject)
+{
+	for (PLIST_ENTRY entry = g_export_readers.Flink; entry != &g_export_readers; entry = entry->Flink) {
+		MicroburstExport* pExport = CONTAINING_RECORD(entry, MicroburstExport, list_entry);
+
+		if (pExport->file_object == FileObject)
+			return pExport;
+	}
+
+	MicroburstExport* pExport = (MicroburstExport*)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(MicroburstExport), MICROBURST_TAG);
+	if (!pExport)
+		return NULL;
+
+	pExport->file_object = FileObject;
+	pExport->sequence = g_event_sequence > MICROBURST_LOG_EVENTS ? g_event_sequence - MICROBURST_LOG_EVENTS : 0;
+	InsertTailList(&g_export_readers, &pExport->list_entry);
+
+	return pExport;
+}
+
+ULONG microburst_take_events(PFILE_OBJECT FileObject, PHV_MICROBURST_EVENT events, ULONG capacity)
+{
+	KIRQL old_irql;
+	ULONG count = 0;
+
+	KeAcquireSpinLock(&g_event_lock, &old_irql);
+
+	MicroburstExport* pExport = find_export(FileObject);
+
+	if (pExport) {
+		//the events overwritten since the previous call are gone
+		ULONG64 oldest = g_event_sequence > MICROBURST_LOG_EVENTS ? g_event_sequence - MICROBURST_LOG_EVENTS : 0;
+		if (pExport->sequence < oldest)
+			pExport->sequence = oldest;
+
+		count = (ULONG)min(g_event_sequence - pExport->sequence, capacity);
+
+		for (ULONG i = 0; i < count; ++i)
+			events[i] = g_events[(pExport->sequence + i) % MICROBURST_LOG_EVENTS];
+
+		pExport->sequence += count;
+	}
+
+	KeReleaseSpinLock(&g_event_lock, old_irql);
+
+	return count;
+}
+
+void microburst_forget_reader(PFILE_OBJECT FileObject)
+{
+	MicroburstExport* pFound = NULL;
+	KIRQL old_irql;
+
+	KeAcquireSpinLock(&g_event_lock, &old_irql);
+
+	for (PLIST_ENTRY entry = g_export_readers.Flink; entry != &g_export_readers; entry = entry->Flink) {
+		MicroburstExport* pExport = CONTAINING_RECORD(entry, MicroburstExport, list_entry);
+
+		if (pExport->file_object == FileObject) {
+			RemoveEntryList(entry);
+			pFound = pExport;
+			break;
+		}
+	}
+
+	KeReleaseSpinLock(&g_event_lock, old_irql);
+
+	if (pFound)
+		ExFreePoolWithTag(pFound, MICROBURST_TAG);
+}
+
+void microburst_cancel_readers(PFILE_OBJECT FileObject)
+{
+	MicroburstPeek peek = {FileObject, FALSE};
+	PIRP Irp;
+
+	//the queue clears the cancel routine of the IRPs it hands out
+	while ((Irp = IoCsqRemoveNextIrp(&g_reader_queue, &peek)) != NULL) {
+		Irp->IoStatus.Status = STATUS_CANCELLED;
+		Irp->IoStatus.Information = 0;
+
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+}
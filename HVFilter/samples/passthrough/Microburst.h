@@ -0,0 +1,68 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+
+//
+// Microburst detection.
+//
+// Each vPort slot (see PortStats.h) and direction keeps a ring of 100us byte / frame
+// buckets.  When a bucket is closed it is compared against the threshold; runs of
+// bursting buckets are recorded as HV_MICROBURST_EVENT in a global event log that
+// user mode reads through OSR_COMM_CONTROL_READ_MICROBURSTS.
+//
+
+NTSTATUS init_microburst();
+void uninit_microburst();
+
+//
+// Forgets the state of a slot that is being bound to a new vPort.
+//
+void microburst_reset_slot(ULONG slot, NDIS_SWITCH_PORT_ID port_id);
+
+//
+// Reports the burst in progress on a slot whose vPort is going away. Called at PASSIVE_LEVEL.
+// Bursts of ports that merely went quiet are reported by a timer, within 100ms.
+//
+void microburst_close_slot(ULONG slot);
+
+//
+// Accounts frames that arrived at time now (100ns units). Must be called at DISPATCH_LEVEL.
+//
+void microburst_add(ULONG slot, ULONG direction, ULONG packets, ULONG bytes, ULONG64 now);
+
+void microburst_set_config(__in PHV_MICROBURST_CONFIG pConfig);
+
+//
+// Satisfies a OSR_COMM_CONTROL_READ_MICROBURSTS request, or pends it in a cancel-safe
+// queue until the next event is logged.  Returns STATUS_PENDING if the IRP was queued;
+// otherwise the caller completes the IRP.
+//
+NTSTATUS microburst_read(PIRP Irp);
+
+//
+// Copies up to capacity of the events logged since the previous call for the same handle,
+// oldest first, and returns their count: every handle reading the record stream of the data
+// device (see RecordExport.h) gets every event once.  The first call of a handle starts at
+// the oldest event still logged.  Called at or below DISPATCH_LEVEL.
+//
+ULONG microburst_take_events(PFILE_OBJECT FileObject, PHV_MICROBURST_EVENT events, ULONG capacity);
+
+//
+// Forgets the record stream cursor of a data device handle that is being cleaned up.
+//
+void microburst_forget_reader(PFILE_OBJECT FileObject);
+
+//
+// Completes the pending reads of a handle (all of them if FileObject is NULL) with
+// STATUS_CANCELLED.
+//
+void microburst_cancel_readers(PFILE_OBJECT FileObject);
+
+#ifdef __cplusplus
+}
+#endif
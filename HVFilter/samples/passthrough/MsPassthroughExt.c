@@ -25,15 +25,72 @@ ULONG SxExtAllocationTag = 'tPsM';
 ULONG SxExtOidRequestId = 'tPsM';
 
 #include "SendPacketsInfo.h"
-#include "Pipes.h"
+#include "PortStats.h"
+#include "Microburst.h"
+#include "Governor.h"
+#include "Capture.h"
+#include "SharedRing.h"
+#include "CountersPage.h"
 
 
 NDIS_STATUS
 SxExtInitialize()
 {
-	//create_pipe_server();
+	NTSTATUS status;
+
 	init_io_data();
 
+	status = init_port_stats();
+	if (!NT_SUCCESS(status)) {
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
+	status = init_microburst();
+	if (!NT_SUCCESS(status)) {
+		uninit_port_stats();
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
+	status = init_governor();
+	if (!NT_SUCCESS(status)) {
+		uninit_microburst();
+		uninit_port_stats();
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
+	status = init_capture();
+	if (!NT_SUCCESS(status)) {
+		uninit_governor();
+		uninit_microburst();
+		uninit_port_stats();
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
+	status = init_shared_ring();
+	if (!NT_SUCCESS(status)) {
+		uninit_capture();
+		uninit_governor();
+		uninit_microburst();
+		uninit_port_stats();
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
+	status = init_counters_page();
+	if (!NT_SUCCESS(status)) {
+		uninit_shared_ring();
+		uninit_capture();
+		uninit_governor();
+		uninit_microburst();
+		uninit_port_stats();
+		uninit_io_data();
+		return NDIS_STATUS_RESOURCES;
+	}
+
     return NDIS_STATUS_SUCCESS;
 }
 
@@ -41,7 +98,12 @@ SxExtInitialize()
 VOID
 SxExtUninitialize()
 {
-	//uninit_pipe_server();
+	uninit_counters_page();
+	uninit_shared_ring();
+	uninit_capture();
+	uninit_governor();
+	uninit_microburst();
+	uninit_port_stats();
 	uninit_io_data();
 
     return;
@@ -126,9 +188,18 @@ SxExtCreatePort(
     PNDIS_SWITCH_PORT_PARAMETERS Port
     )
 {
+    ULONG slot;
+
     UNREFERENCED_PARAMETER(Switch);
     UNREFERENCED_PARAMETER(ExtensionContext);
-    UNREFERENCED_PARAMETER(Port);
+
+    slot = port_stats_register_port(Port->PortId);
+
+    //a full table folds the port into the unknown slot, whose state belongs to the ports already there
+    if (slot != HV_STATS_UNKNOWN_PORT_SLOT) {
+        microburst_reset_slot(slot, Port->PortId);
+        counters_page_reset_slot(slot);
+    }
     
     return NDIS_STATUS_SUCCESS;
 }
@@ -254,9 +325,18 @@ SxExtDeletePort(
     PNDIS_SWITCH_PORT_PARAMETERS Port
     )
 {
+    ULONG slot;
+
     UNREFERENCED_PARAMETER(Switch);
     UNREFERENCED_PARAMETER(ExtensionContext);
-    UNREFERENCED_PARAMETER(Port);
+
+    slot = port_stats_find_slot(Port->PortId);
+
+    //the burst still open on the port would otherwise never be reported
+    if (slot != HV_STATS_UNKNOWN_PORT_SLOT)
+        microburst_close_slot(slot);
+
+    port_stats_unregister_port(Port->PortId);
     
     return;
 }
@@ -545,7 +625,7 @@ SxExtStartNetBufferListsIngress(
 {
     UNREFERENCED_PARAMETER(ExtensionContext);
 
-	push_buffers_info_lists_inbound(NetBufferLists);
+	push_buffers_info_lists_inbound(Switch, NetBufferLists);
     
     SxLibSendNetBufferListsIngress(Switch,
                                    NetBufferLists,
@@ -566,7 +646,7 @@ SxExtStartNetBufferListsEgress(
 {
     UNREFERENCED_PARAMETER(ExtensionContext);
 
-	push_buffers_info_lists_outbound(NetBufferLists);
+	push_buffers_info_lists_outbound(Switch, NetBufferLists);
     
     SxLibSendNetBufferListsEgress(Switch,
                                   NetBufferLists,
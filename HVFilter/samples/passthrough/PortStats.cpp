@@ -0,0 +1,260 @@
+#include "PortStats.h"
+
+#include <intrin.h>
+
+struct DECLSPEC_CACHEALIGN PortStatsCpu
+{
+	HV_PORT_HISTOGRAM	histograms[HV_STATS_PORT_SLOTS][HV_STATS_DIRECTIONS];
+	//time of the last frame of a slot and direction on this processor (100ns units), 0 before the first one.
+	//with RSS a processor serves one queue of the port, so these are the gaps of that queue.
+	ULONG64				last_arrival[HV_STATS_PORT_SLOTS][HV_STATS_DIRECTIONS];
+};
+
+namespace
+{
+	PortStatsCpu*	g_pPortStats = NULL;
+	ULONG			g_port_stats_cpu_count = 0;
+	LARGE_INTEGER	g_perf_frequency;
+
+	//slot table: written under g_port_table_mutex, read lock-free by the datapath.
+	FAST_MUTEX					g_port_table_mutex;
+	NDIS_SWITCH_PORT_ID			g_port_ids[HV_STATS_MAX_PORTS];
+	volatile LONG				g_port_in_use[HV_STATS_MAX_PORTS];
+	//longest probe sequence ever needed by an insert; lookups never go further.
+	volatile LONG				g_port_probe_limit = 0;
+}
+
+C_ASSERT((HV_STATS_MAX_PORTS & (HV_STATS_MAX_PORTS - 1)) == 0);
+
+#define PORT_STATS_TAG 'tSoP'
+
+NTSTATUS init_port_stats()
+{
+	ExInitializeFastMutex(&g_port_table_mutex);
+	RtlZeroMemory(g_port_ids, sizeof(g_port_ids));
+	RtlZeroMemory((PVOID)g_port_in_use, sizeof(g_port_in_use));
+	g_port_probe_limit = 0;
+
+	KeQueryPerformanceCounter(&g_perf_frequency);
+
+	g_port_stats_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T size = sizeof(PortStatsCpu) * g_port_stats_cpu_count;
+	g_pPortStats = (PortStatsCpu*)ExAllocatePoolWithTag(NonPagedPoolNx, size, PORT_STATS_TAG);
+	if (!g_pPortStats) {
+		g_port_stats_cpu_count = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(g_pPortStats, size);
+	return STATUS_SUCCESS;
+}
+
+void uninit_port_stats()
+{
+	if (g_pPortStats) {
+		ExFreePoolWithTag(g_pPortStats, PORT_STATS_TAG);
+		g_pPortStats = NULL;
+		g_port_stats_cpu_count = 0;
+	}
+}
+
+C_ASSERT(HV_STATS_MAX_PORTS == (1 << 6));
+
+//multiplicative hash, top 6 bits
+static ULONG hash_port_id(NDIS_SWITCH_PORT_ID port_id)
+{
+	return (port_id * 2654435761u) >> (32 - 6);
+}
+
+static void clear_slot(ULONG slot)
+{
+	for (ULONG cpu = 0; cpu < g_port_stats_cpu_count; ++cpu) {
+		RtlZeroMemory(g_pPortStats[cpu].histograms[slot], sizeof(g_pPortStats[cpu].histograms[slot]));
+		RtlZeroMemory(g_pPortStats[cpu].last_arrival[slot], sizeof(g_pPortStats[cpu].last_arrival[slot]));
+	}
+}
+
+ULONG port_stats_register_port(NDIS_SWITCH_PORT_ID port_id)
+{
+	ULONG result = HV_STATS_UNKNOWN_PORT_SLOT;
+
+	if (!g_pPortStats)
+		return result;
+
+	ExAcquireFastMutex(&g_port_table_mutex);
+
+	ULONG hash = hash_port_id(port_id);
+
+	for (LONG probe = 0; probe < HV_STATS_MAX_PORTS; ++probe) {
+		ULONG slot = (hash + probe) & (HV_STATS_MAX_PORTS - 1);
+
+		if (g_port_in_use[slot] && g_port_ids[slot] == port_id) {
+			result = slot;
+			break;
+		}
+
+		if (!g_port_in_use[slot]) {
+			//a recycled slot must not report the previous port's traffic
+			clear_slot(slot);
+			g_port_ids[slot] = port_id;
+
+			if (probe + 1 > g_port_probe_limit)
+				InterlockedExchange(&g_port_probe_limit, probe + 1);
+
+			//publish the id before the slot becomes visible to the datapath
+			InterlockedExchange(&g_port_in_use[slot], 1);
+			result = slot;
+			break;
+		}
+	}
+
+	//if the table is full the port is accounted in the unknown slot
+
+	ExReleaseFastMutex(&g_port_table_mutex);
+
+	return result;
+}
+
+void port_stats_unregister_port(NDIS_SWITCH_PORT_ID port_id)
+{
+	if (!g_pPortStats)
+		return;
+
+	ExAcquireFastMutex(&g_port_table_mutex);
+
+	ULONG slot = port_stats_find_slot(port_id);
+	if (slot != HV_STATS_UNKNOWN_PORT_SLOT)
+		InterlockedExchange(&g_port_in_use[slot], 0);
+
+	ExReleaseFastMutex(&g_port_table_mutex);
+}
+
+ULONG port_stats_find_slot(NDIS_SWITCH_PORT_ID port_id)
+{
+	ULONG hash = hash_port_id(port_id);
+	LONG limit = g_port_probe_limit;
+
+	for (LONG probe = 0; probe < limit; ++probe) {
+		ULONG slot = (hash + probe) & (HV_STATS_MAX_PORTS - 1);
+
+		if (g_port_in_use[slot] && g_port_ids[slot] == port_id)
+			return slot;
+	}
+
+	return HV_STATS_UNKNOWN_PORT_SLOT;
+}
+
+NDIS_SWITCH_PORT_ID port_stats_slot_port(ULONG slot)
+{
+	if (slot >= HV_STATS_MAX_PORTS || !g_port_in_use[slot])
+		return HV_STATS_UNKNOWN_PORT_ID;
+
+	//a slot rebound meanwhile reports the new id
+	return g_port_ids[slot];
+}
+
+ULONG64 port_stats_now()
+{
+	LARGE_INTEGER ticks = KeQueryPerformanceCounter(NULL);
+	ULONG64 freq = (ULONG64)g_perf_frequency.QuadPart;
+
+	//split to keep ticks * 10^7 from overflowing
+	return ((ULONG64)ticks.QuadPart / freq) * 10000000ull +
+		((ULONG64)ticks.QuadPart % freq) * 10000000ull / freq;
+}
+
+//bucket = floor(log2(value)), clamped; no branches on the value itself
+static ULONG size_bucket(ULONG frame_size)
+{
+	ULONG index;
+	_BitScanReverse(&index, frame_size | 1);
+
+	return index < HV_STATS_SIZE_BUCKETS - 1 ? index : HV_STATS_SIZE_BUCKETS - 1;
+}
+
+//bucket 0 = no gap, bucket i = [2^(i-1), 2^i)
+static ULONG gap_bucket(ULONG64 gap)
+{
+	ULONG index;
+	_BitScanReverse64(&index, gap | 1);
+	index += (gap != 0);
+
+	return index < HV_STATS_GAP_BUCKETS - 1 ? index : HV_STATS_GAP_BUCKETS - 1;
+}
+
+void port_stats_add_frame(ULONG slot, ULONG direction, ULONG frame_size, ULONG weight, ULONG64 now)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+	ASSERT(slot < HV_STATS_PORT_SLOTS);
+	ASSERT(direction < HV_STATS_DIRECTIONS);
+
+	if (!g_pPortStats)
+		return;
+
+	ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+	PortStatsCpu* pCpu = &g_pPortStats[cpu];
+
+	HV_PORT_HISTOGRAM* pHistogram = &pCpu->histograms[slot][direction];
+
+	//the previous frame of this port's queue: a plain store, no cache line shared with other processors
+	ULONG64 last = pCpu->last_arrival[slot][direction];
+	pCpu->last_arrival[slot][direction] = now;
+
+	pHistogram->Frames += weight;
+	pHistogram->Bytes += (ULONG64)frame_size * weight;
+	pHistogram->SizeBuckets[size_bucket(frame_size)] += weight;
+
+	//the first frame has no gap to measure
+	if (!last)
+		return;
+
+	//now is taken once per chain, so frames of one chain have the same time.
+	//between two sampled frames there are weight gaps on average.
+	ULONG64 gap = now > last ? (now - last) / weight : 0;
+
+	pHistogram->GapBuckets[gap_bucket(gap)] += weight;
+}
+
+void port_stats_snapshot(__out PHV_HISTOGRAM_SNAPSHOT pSnapshot)
+{
+	RtlZeroMemory(pSnapshot, sizeof(HV_HISTOGRAM_SNAPSHOT));
+
+	pSnapshot->Version = HV_HISTOGRAM_SNAPSHOT_VERSION;
+	pSnapshot->PortCount = HV_STATS_PORT_SLOTS;
+
+	if (!g_pPortStats)
+		return;
+
+	pSnapshot->Timestamp = port_stats_now();
+
+	for (ULONG slot = 0; slot < HV_STATS_MAX_PORTS; ++slot) {
+		pSnapshot->Ports[slot].InUse = g_port_in_use[slot];
+		pSnapshot->Ports[slot].PortId = g_port_ids[slot];
+	}
+
+	pSnapshot->Ports[HV_STATS_UNKNOWN_PORT_SLOT].InUse = 1;
+	pSnapshot->Ports[HV_STATS_UNKNOWN_PORT_SLOT].PortId = HV_STATS_UNKNOWN_PORT_ID;
+
+	//the per-processor copies are read without synchronization: a snapshot may be
+	//off by the frames being accounted while it is taken, which is fine for statistics.
+	for (ULONG cpu = 0; cpu < g_port_stats_cpu_count; ++cpu) {
+		const PortStatsCpu* pCpu = &g_pPortStats[cpu];
+
+		for (ULONG slot = 0; slot < HV_STATS_PORT_SLOTS; ++slot) {
+			for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+				const HV_PORT_HISTOGRAM* pSource = &pCpu->histograms[slot][direction];
+				HV_PORT_HISTOGRAM* pTarget = &pSnapshot->Ports[slot].Direction[direction];
+
+				pTarget->Frames += pSource->Frames;
+				pTarget->Bytes += pSource->Bytes;
+
+				for (ULONG i = 0; i < HV_STATS_SIZE_BUCKETS; ++i)
+					pTarget->SizeBuckets[i] += pSource->SizeBuckets[i];
+
+				for (ULONG i = 0; i < HV_STATS_GAP_BUCKETS; ++i)
+					pTarget->GapBuckets[i] += pSource->GapBuckets[i];
+			}
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+
+//
+// Per-vPort, per-direction frame size and inter-arrival histograms.
+//
+// Every processor owns a private copy of all histograms, so the datapath updates
+// them with plain (non-interlocked) increments while running at DISPATCH_LEVEL.
+// The copies are only summed up when a snapshot is requested.  The time of the
+// last frame, which the gaps are measured from, is kept per processor too: with
+// RSS every queue is served by one processor, so the gaps are those of a queue.
+//
+
+NTSTATUS init_port_stats();
+void uninit_port_stats();
+
+//
+// Binds / unbinds a vPort to a histogram slot. Called from the port create / delete
+// callbacks at PASSIVE_LEVEL.  Returns the slot, or HV_STATS_UNKNOWN_PORT_SLOT if
+// the table is full.
+//
+ULONG port_stats_register_port(NDIS_SWITCH_PORT_ID port_id);
+void port_stats_unregister_port(NDIS_SWITCH_PORT_ID port_id);
+
+//
+// Returns the slot of port_id, or HV_STATS_UNKNOWN_PORT_SLOT.
+//
+ULONG port_stats_find_slot(NDIS_SWITCH_PORT_ID port_id);
+
+//
+// Returns the vPort bound to slot, or HV_STATS_UNKNOWN_PORT_ID if the slot is free.
+//
+NDIS_SWITCH_PORT_ID port_stats_slot_port(ULONG slot);
+
+//
+// Current time in 100ns units, with performance counter resolution.
+//
+ULONG64 port_stats_now();
+
+//
+// Accounts one frame. Must be called at DISPATCH_LEVEL.  A frame sampled 1 in
+// weight frames (see Governor.h) counts for weight frames.
+//
+void port_stats_add_frame(ULONG slot, ULONG direction, ULONG frame_size, ULONG weight, ULONG64 now);
+
+//
+// Merges the per-processor histograms into pSnapshot.
+//
+void port_stats_snapshot(__out PHV_HISTOGRAM_SNAPSHOT pSnapshot);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,166 @@
+#include "RecordExport.h"
+#include "SendPacketsInfo.h"
+#include "PortStats.h"
+#include "Microburst.h"
+#include "SharedRing.h"
+#include "Capture.h"
+
+#define RECORD_EXPORT_TAG 'xERH'
+
+//microburst events taken from the log per read at most; the others wait for the next read
+#define RECORD_EXPORT_EVENTS 8
+
+//offsets in PACKET_SNAPSHOT::data
+enum {SnapshotData_Source = 0, SnapshotData_Destination = 4, SnapshotData_PayloadSize = 8, SnapshotData_Payload = 10};
+
+//FALSE if the record did not fit. The direction's spin lock must be held.
+static BOOLEAN append_packet(PHV_RECORD_WRITER pWriter, const PACKET_SNAPSHOT* pSnapshot, ULONG direction)
+{
+	//nothing parsed in this direction yet
+	if (!pSnapshot->timestamp)
+		return TRUE;
+
+	WORD payload_size = 0;
+	RtlCopyMemory(&payload_size, pSnapshot->data + SnapshotData_PayloadSize, sizeof(WORD));
+
+	//the parser only copies payloads that fit behind the headers
+	ULONG payload = (pSnapshot->payload && payload_size <= sizeof(pSnapshot->data) - SnapshotData_Payload) ? payload_size : 0;
+
+	PHV_RECORD_PACKET_DATA pRecord = (PHV_RECORD_PACKET_DATA)HvRecordAppend(pWriter, HV_RECORD_PACKET,
+		HV_RECORD_PACKET_LENGTH(payload), pSnapshot->port_id, pSnapshot->timestamp);
+	if (!pRecord)
+		return FALSE;
+
+	pRecord->Direction = (USHORT)direction;
+	pRecord->FrameLength = pSnapshot->frame_length;
+	pRecord->PayloadLength = payload;
+
+	RtlCopyMemory(&pRecord->SourceAddress, pSnapshot->data + SnapshotData_Source, 4);
+	RtlCopyMemory(&pRecord->DestinationAddress, pSnapshot->data + SnapshotData_Destination, 4);
+	RtlCopyMemory(pRecord->Payload, pSnapshot->data + SnapshotData_Payload, payload);
+
+	return TRUE;
+}
+
+static BOOLEAN append_histogram(PHV_RECORD_WRITER pWriter, ULONG port_id, ULONG64 timestamp, ULONG direction,
+	USHORT kind, const ULONG64* buckets, ULONG bucket_count)
+{
+	PHV_RECORD_HISTOGRAM_DATA pRecord = (PHV_RECORD_HISTOGRAM_DATA)HvRecordAppend(pWriter, HV_RECORD_HISTOGRAM,
+		HV_RECORD_HISTOGRAM_LENGTH(bucket_count), port_id, timestamp);
+	if (!pRecord)
+		return FALSE;
+
+	pRecord->Direction = (USHORT)direction;
+	pRecord->Kind = kind;
+	pRecord->BucketCount = bucket_count;
+
+	RtlCopyMemory(pRecord->Buckets, buckets, bucket_count * sizeof(ULONG64));
+
+	return TRUE;
+}
+
+//FALSE if the writer is full. An event leaves the log when it is taken, so only as many as fit are.
+static BOOLEAN append_events(PHV_RECORD_WRITER pWriter, PFILE_OBJECT FileObject)
+{
+	HV_MICROBURST_EVENT events[RECORD_EXPORT_EVENTS];
+	ULONG room = (pWriter->Length - pWriter->Offset) / HV_RECORD_ALIGN(sizeof(HV_RECORD_EVENT_DATA));
+	ULONG count = microburst_take_events(FileObject, events, min(room, RECORD_EXPORT_EVENTS));
+
+	for (ULONG i = 0; i < count; ++i) {
+		PHV_RECORD_EVENT_DATA pRecord = (PHV_RECORD_EVENT_DATA)HvRecordAppend(pWriter, HV_RECORD_EVENT,
+			sizeof(HV_RECORD_EVENT_DATA), events[i].PortId, events[i].StartTime);
+
+		pRecord->Code = HV_RECORD_EVENT_MICROBURST;
+		pRecord->Value[0] = events[i].Bytes;
+		pRecord->Value[1] = events[i].Packets;
+	}
+
+	return count < room;
+}
+
+//the records of the shared ring and of the capture that were dropped, for the whole switch
+static BOOLEAN append_drops(PHV_RECORD_WRITER pWriter, ULONG64 timestamp)
+{
+	PHV_RECORD_COUNTERS_DATA pCounters = (PHV_RECORD_COUNTERS_DATA)HvRecordAppend(pWriter, HV_RECORD_COUNTERS,
+		sizeof(HV_RECORD_COUNTERS_DATA), HV_STATS_UNKNOWN_PORT_ID, timestamp);
+	if (!pCounters)
+		return FALSE;
+
+	pCounters->Direction = HV_RECORD_DIRECTION_SWITCH;
+	pCounters->Dropped = shared_ring_dropped() + capture_dropped();
+
+	return TRUE;
+}
+
+//FALSE if the port's records did not all fit; the writer is left as it was
+static BOOLEAN append_port(PHV_RECORD_WRITER pWriter, const HV_PORT_HISTOGRAMS* pPort, ULONG64 timestamp)
+{
+	HV_RECORD_WRITER saved = *pWriter;
+
+	for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+		const HV_PORT_HISTOGRAM* pHistogram = &pPort->Direction[direction];
+
+		if (!pHistogram->Frames)
+			continue;
+
+		PHV_RECORD_COUNTERS_DATA pCounters = (PHV_RECORD_COUNTERS_DATA)HvRecordAppend(pWriter, HV_RECORD_COUNTERS,
+			sizeof(HV_RECORD_COUNTERS_DATA), pPort->PortId, timestamp);
+
+		if (!pCounters ||
+			!append_histogram(pWriter, pPort->PortId, timestamp, direction, HV_RECORD_HISTOGRAM_SIZE,
+				pHistogram->SizeBuckets, HV_STATS_SIZE_BUCKETS) ||
+			!append_histogram(pWriter, pPort->PortId, timestamp, direction, HV_RECORD_HISTOGRAM_GAP,
+				pHistogram->GapBuckets, HV_STATS_GAP_BUCKETS)) {
+			*pWriter = saved;
+			return FALSE;
+		}
+
+		pCounters->Direction = (USHORT)direction;
+		pCounters->Frames = pHistogram->Frames;
+		pCounters->Bytes = pHistogram->Bytes;
+	}
+
+	return TRUE;
+}
+
+ULONG record_export(PFILE_OBJECT FileObject, PVOID buffer, ULONG length)
+{
+	HV_RECORD_WRITER writer;
+
+	if (!HvRecordWriterInit(&writer, buffer, length))
+		return 0;
+
+	KIRQL old_irql;
+
+	KeAcquireSpinLock(&g_inbound_lock, &old_irql);
+	BOOLEAN room = append_packet(&writer, g_pInboundSnapshot, HV_STATS_DIRECTION_INBOUND);
+	KeReleaseSpinLock(&g_inbound_lock, old_irql);
+
+	if (room) {
+		KeAcquireSpinLock(&g_outbound_lock, &old_irql);
+		room = append_packet(&writer, g_pOutboundSnapshot, HV_STATS_DIRECTION_OUTBOUND);
+		KeReleaseSpinLock(&g_outbound_lock, old_irql);
+	}
+
+	if (room)
+		room = append_events(&writer, FileObject);
+
+	//too large for the stack
+	PHV_HISTOGRAM_SNAPSHOT pSnapshot = room ?
+		(PHV_HISTOGRAM_SNAPSHOT)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HV_HISTOGRAM_SNAPSHOT), RECORD_EXPORT_TAG) : NULL;
+
+	if (pSnapshot) {
+		port_stats_snapshot(pSnapshot);
+
+		room = append_drops(&writer, pSnapshot->Timestamp);
+
+		for (ULONG slot = 0; room && slot < pSnapshot->PortCount; ++slot) {
+			if (pSnapshot->Ports[slot].InUse && !append_port(&writer, &pSnapshot->Ports[slot], pSnapshot->Timestamp))
+				break;
+		}
+
+		ExFreePoolWithTag(pSnapshot, RECORD_EXPORT_TAG);
+	}
+
+	return HvRecordWriterFinish(&writer);
+}
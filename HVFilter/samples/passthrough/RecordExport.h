@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+#include "../../HVService/HVService/HVRecord.h"
+
+//
+// Record stream of the data device reads (see HVRecord.h).
+//
+// A read gets the last frame parsed in each direction, the microburst events
+// logged since the previous read of the same handle, the drops of the whole switch, then the
+// counters and histograms of every port, as far as they fit: records are
+// whole, and so are the ports (a port that does not fit ends the stream).
+// Events that do not fit wait for the next read.
+//
+
+//
+// Encodes the stream for the data device handle FileObject into buffer; returns its
+// length, or 0 if length cannot even hold the stream header. Called below DISPATCH_LEVEL.
+//
+ULONG record_export(PFILE_OBJECT FileObject, PVOID buffer, ULONG length);
+
+#ifdef __cplusplus
+}
+#endif
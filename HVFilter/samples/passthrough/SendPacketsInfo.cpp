@@ -1,43 +1,36 @@
 #include "SendPacketsInfo.h"
-#include "Pipes.h"
+#include "PortStats.h"
+#include "Microburst.h"
+#include "Governor.h"
+#include "Capture.h"
+#include "SharedRing.h"
+#include "CountersPage.h"
 
-class FastMutexLocker {
-public:
-	explicit FastMutexLocker(PFAST_MUTEX pMutex) : m_pMutex(pMutex) { Acquire(); }
-	~FastMutexLocker() { Release(); }
+//the datapath runs at DISPATCH_LEVEL: a fast mutex can't be taken there
+KSPIN_LOCK g_inbound_lock;
+KSPIN_LOCK g_outbound_lock;
 
-private:
-	void Acquire() { ExAcquireFastMutex(m_pMutex); }
-	void Release() { ExReleaseFastMutex(m_pMutex); }
-
-private:
-	PFAST_MUTEX	m_pMutex;
-};
-
-FAST_MUTEX g_inbound_mutex;
-FAST_MUTEX g_outbound_mutex;
-
-BYTE* g_pInboundData;
-BYTE* g_pOutboundData;
+PPACKET_SNAPSHOT g_pInboundSnapshot;
+PPACKET_SNAPSHOT g_pOutboundSnapshot;
 
 void init_io_data()
 {
-	ExInitializeFastMutex(&g_inbound_mutex);
-	ExInitializeFastMutex(&g_outbound_mutex);
+	KeInitializeSpinLock(&g_inbound_lock);
+	KeInitializeSpinLock(&g_outbound_lock);
 
-	g_pInboundData = (BYTE*)ExAllocatePoolWithTag(PagedPool, 2000, 'tDbI');
-	ASSERT(g_pInboundData);
-	RtlZeroMemory(g_pInboundData, 2000);
+	g_pInboundSnapshot = (PPACKET_SNAPSHOT)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PACKET_SNAPSHOT), 'tDbI');
+	ASSERT(g_pInboundSnapshot);
+	RtlZeroMemory(g_pInboundSnapshot, sizeof(PACKET_SNAPSHOT));
 
-	g_pOutboundData = (BYTE*)ExAllocatePoolWithTag(PagedPool, 2000, 'tDbO');
-	ASSERT(g_pOutboundData);
-	RtlZeroMemory(g_pOutboundData, 2000);
+	g_pOutboundSnapshot = (PPACKET_SNAPSHOT)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PACKET_SNAPSHOT), 'tDbO');
+	ASSERT(g_pOutboundSnapshot);
+	RtlZeroMemory(g_pOutboundSnapshot, sizeof(PACKET_SNAPSHOT));
 }
 
 void uninit_io_data()
 {
-	ExFreePoolWithTag(g_pInboundData, 'tDbI');
-	ExFreePoolWithTag(g_pOutboundData, 'tDbO');
+	ExFreePoolWithTag(g_pInboundSnapshot, 'tDbI');
+	ExFreePoolWithTag(g_pOutboundSnapshot, 'tDbO');
 }
 
 //void add_io_data(ULONG count, ULONG size, BOOLEAN is_inbound)
@@ -131,160 +124,267 @@ typedef Z_ETH_HEADER eth_header_t;
 
 enum OptionKind:BYTE {OptionKind_EndOfOptions = 0x0, OptionKind_NoOption = 0x01, OptionKind_Timestamp = 0x08};
 
-BYTE get_tcp_option_size(BYTE* buffer)
+//the options are walked within the header: size is what is left of them at buffer
+BYTE get_tcp_option_size(BYTE* buffer, ULONG size)
 {
 	BYTE* pOptionInfo = (BYTE*)buffer;
 	ASSERT(pOptionInfo);
 
+	//kind + length at least; a length that runs past the header ends the walk
+	if (size < 2 || pOptionInfo[1] < 2 || pOptionInfo[1] > size)
+		return 0;
+
 	return pOptionInfo[1];
 }
 
 DWORD read_tcp_timestamp(BYTE* buffer)
 {
 	//length = 10, TSval = 4 bytes, echo TSval = 4 bytes
-	BYTE length = get_tcp_option_size(buffer);
-	ASSERT(length == 10);
-
 	BYTE* pTimestampOption = (BYTE*)buffer;
 	ASSERT(pTimestampOption);
 
 	//buffer = kind; buffer + 1 = length; buffer + 2 == timestamp needed (4 bytes). buffer + 6 = timestamp echo (4 bytes).
-	DWORD dwTimeStamp = *(DWORD*)(pTimestampOption + 2);
+	DWORD dwTimeStamp = *(DWORD UNALIGNED*)(pTimestampOption + 2);
 	return RtlUlongByteSwap(dwTimeStamp);
 }
 
-void read_tcp_data(BYTE* buffer, DWORD offset /*padding + last option*/, DWORD data_size /*size to read as packet content*/, BYTE* pOutBuffer)
+void read_tcp_data(BYTE* buffer, DWORD data_size /*size to read as packet content*/, BYTE* pOutBuffer)
 {
 	if (data_size > 0)
 	{
-		buffer += offset;
-
 		if (data_size <= 2000 - 4 - 4 - 2)
 		{
-			UNREFERENCED_PARAMETER(data_size);
-
 			RtlCopyMemory(pOutBuffer, buffer, data_size);
 		}
 	}
 }
 
+//the caller checked that the header (options included) and data_size bytes past it are mapped
 void read_tcp_info(BYTE* buffer, tcp_header_t* pTcpHeader, WORD data_size, BYTE* pOutBuffer)
 {
 	//1. OPTIONS
 	ULONG tcp_header_bytes = pTcpHeader->th_len << 2;
 	ASSERT(tcp_header_bytes >= sizeof(tcp_header_t));
 
-	if (data_size > 0) {
-		int x = 0;
-		++x;
-	}
-
 	ULONG options_size = tcp_header_bytes - sizeof(tcp_header_t);
-
-	if (options_size == 0) {
-		buffer += tcp_header_bytes;
-		read_tcp_data(buffer, 0, data_size, pOutBuffer);
-		return;
-	} else {
-		buffer += sizeof(tcp_header_t);
-	}
-
-	BYTE* pOptionKind = (BYTE*)buffer;
-	ASSERT(pOptionKind);
-
-	BYTE option_kind = *pOptionKind;
+	BYTE* pOption = buffer + sizeof(tcp_header_t);
 
 	ULONG bytes_advanced = 0;
-	ULONG bytes_to_advance = 0;
 
-	while (option_kind != OptionKind_EndOfOptions && bytes_advanced < options_size)
+	//end of options may not exist!!!
+	while (bytes_advanced < options_size && *pOption != OptionKind_EndOfOptions)
 	{
-		if (option_kind == OptionKind_NoOption) {
+		ULONG bytes_to_advance = 0;
+
+		if (*pOption == OptionKind_NoOption) {
 			//no option -- padding
 			bytes_to_advance = 1;
-
-		} else if (option_kind == OptionKind_Timestamp){
-			//timestamp
-
-			//1. read timestamp for current packet.
-			DWORD dwTimeStamp = read_tcp_timestamp(buffer);
-			DbgPrint("timestamp: 0x%x", dwTimeStamp);
-			//1.1. store the timestamp somewhere.
-			//2. exit loop... or not (perhaps we also read the data, no?)
-
-			bytes_to_advance = 10; // timestamp option size
 		} else {
-			bytes_to_advance = get_tcp_option_size(buffer);
+			bytes_to_advance = get_tcp_option_size(pOption, options_size - bytes_advanced);
+
+			//malformed: the rest of the options cannot be trusted
+			if (!bytes_to_advance)
+				break;
+
+			if (*pOption == OptionKind_Timestamp && bytes_to_advance == 10) {
+				//1. read timestamp for current packet.
+				DWORD dwTimeStamp = read_tcp_timestamp(pOption);
+				DbgPrint("timestamp: 0x%x", dwTimeStamp);
+				//1.1. store the timestamp somewhere.
+			}
 		}
 
-		buffer += bytes_to_advance;
+		pOption += bytes_to_advance;
 		bytes_advanced += bytes_to_advance;
+	}
 
-		pOptionKind = (BYTE*)buffer;
-		ASSERT(pOptionKind);
+	//2. DATA: whatever the options held, it starts past the whole header (padding included)
+	read_tcp_data(buffer + tcp_header_bytes, data_size, pOutBuffer);
+}
 
-		option_kind = *pOptionKind;
-	}
+//parse stages enabled in a pipeline instantiation. Each stage needs the ones before it.
+enum ParseFeature {
+	ParseFeature_L2			= 0x01,
+	ParseFeature_L3			= 0x02,
+	ParseFeature_L4			= 0x04,
+	ParseFeature_Payload	= 0x08,
+	ParseFeature_Tunnels	= 0x10,
+};
 
-	//end of options may not exist!!!
-	if (bytes_advanced == options_size) {
-		read_tcp_data(buffer, 0, data_size, pOutBuffer);
-	} else if (option_kind == OptionKind_EndOfOptions) {
-		//the end option byte
-		++bytes_advanced;
+//the feature sets that get their own instantiation, cheapest first: one per governor mode, and one
+//for the chains that come while the snapshot buffer is taken
+enum ParseLevel {
+	ParseLevel_None,		//histograms only
+	ParseLevel_L3,			//IP addresses
+	ParseLevel_L4,			//Ethernet / IP / TCP headers
+	ParseLevel_Tunnels,		//TCP payload, and the inner frame of VXLAN / NVGRE packets
+
+	ParseLevel_Count
+};
+
+enum {Protocol_Udp = 0x11, Protocol_Gre = 0x2F};
+enum {UdpPort_Vxlan = 4789};
+enum {EtherType_TransparentBridging = 0x6558};
+
+struct Z_UDP_HEADER
+{
+	WORD source_port;
+	WORD destination_port;
+	WORD length;
+	WORD checksum;
+};
 
-		//or I could have simply used tcp_header + pTcpHeader->th_len << 2
-		DWORD modulo = bytes_advanced % sizeof(DWORD);
-		DWORD padding_size = (modulo ? sizeof(DWORD) - modulo : 0ul);
+C_ASSERT(sizeof(Z_UDP_HEADER) == 8);
 
-		read_tcp_data(buffer, padding_size, data_size, pOutBuffer);
+//NVGRE: GRE with the key bit set, carrying ethernet frames
+struct Z_GRE_HEADER
+{
+	WORD flags_version;
+	WORD protocol;
+	DWORD key;
+};
+
+C_ASSERT(sizeof(Z_GRE_HEADER) == 8);
+
+enum {GreFlags_Key = 0x2000};
+enum {VxlanHeader_Size = 8};
+
+//bytes a header-only instantiation maps from the frame: the longest headers it can parse
+template<ULONG Features>
+struct ParseHeadersSize
+{
+	enum {
+		L2 = sizeof(eth_header_t),
+		L3 = (Features & ParseFeature_L3) ? 60 : 0,
+		L4 = (Features & ParseFeature_L4) ? 60 : 0,
+		//UDP + VXLAN, then the headers of the inner frame
+		Tunnel = (Features & ParseFeature_Tunnels) ? sizeof(Z_UDP_HEADER) + VxlanHeader_Size + sizeof(eth_header_t) + 60 + 60 : 0,
+
+		value = L2 + L3 + L4 + Tunnel
+	};
+};
+
+//
+// Every parse step gets the bytes it may read at buffer (mapped) and the bytes the
+// frame still has from there (remaining): mapped is less than remaining when only the
+// headers were mapped.  A header that claims more than either is malformed (or
+// truncated by the mapping) and the rest of the frame is not parsed.
+//
+
+//returns the size of the VXLAN / NVGRE header before the inner frame, or 0. buffer points past the outer IP header.
+static ULONG get_tunnel_header_size(BYTE* buffer, ULONG mapped, ULONG remaining, BYTE protocol)
+{
+	if (protocol == Protocol_Udp) {
+		if (mapped < sizeof(Z_UDP_HEADER) + VxlanHeader_Size)
+			return 0;
+
+		Z_UDP_HEADER* pUdpHeader = (Z_UDP_HEADER*)buffer;
+		ULONG udp_length = RtlUshortByteSwap(pUdpHeader->length);
+
+		if (pUdpHeader->destination_port == RtlUshortByteSwap(UdpPort_Vxlan) &&
+			udp_length >= sizeof(Z_UDP_HEADER) + VxlanHeader_Size && udp_length <= remaining)
+			return sizeof(Z_UDP_HEADER) + VxlanHeader_Size;
+
+	} else if (protocol == Protocol_Gre) {
+		if (mapped < sizeof(Z_GRE_HEADER))
+			return 0;
+
+		Z_GRE_HEADER* pGreHeader = (Z_GRE_HEADER*)buffer;
+
+		if ((pGreHeader->flags_version & RtlUshortByteSwap(GreFlags_Key)) &&
+			pGreHeader->protocol == RtlUshortByteSwap(EtherType_TransparentBridging))
+			return sizeof(Z_GRE_HEADER);
 	}
+
+	return 0;
 }
 
-void read_tcp_header(BYTE* buffer, WORD offset, WORD total_ip_length, BYTE* pOutBuffer)
+template<ULONG Features>
+void read_tcp_header(BYTE* buffer, ULONG mapped, ULONG remaining, BYTE* pOutBuffer)
 {
+	if (mapped < sizeof(tcp_header_t))
+		return;
+
 	tcp_header_t* pTcpHeader = (tcp_header_t*)buffer;
 
-	ASSERT(pTcpHeader); 
+	ASSERT(pTcpHeader);
 
 	//DbgPrint("have tcp: port destination = %d; source= %d\n", RtlUshortByteSwap(pTcpHeader->th_dport), RtlUshortByteSwap(pTcpHeader->th_sport));
-	WORD tcp_size = total_ip_length - offset;
-	//WORD data_and_options_size = tcp_size - (pTcpHeader->th_len << 2);
-	WORD data_size = tcp_size - (pTcpHeader->th_len << 2);
+	ULONG tcp_header_bytes = pTcpHeader->th_len << 2;
+	if (tcp_header_bytes < sizeof(tcp_header_t) || tcp_header_bytes > mapped || tcp_header_bytes > remaining)
+		return;
+
+	//remaining ends where the IP packet does
+	WORD data_size = (WORD)(remaining - tcp_header_bytes);
 	RtlCopyMemory(pOutBuffer, &data_size, sizeof(WORD));
 
-	read_tcp_info(buffer, pTcpHeader, data_size, pOutBuffer + 2);
+	//the payload instantiations map the whole frame: mapped == remaining
+	if (Features & ParseFeature_Payload)
+		read_tcp_info(buffer, pTcpHeader, data_size, pOutBuffer + 2);
 }
 
-void read_ip_header(BYTE* buffer, BYTE* pOutBuffer)
+template<ULONG Features>
+void read_ethernet_header(BYTE* buffer, ULONG mapped, ULONG remaining, void* pOutBuffer);
+
+template<ULONG Features>
+void read_ip_header(BYTE* buffer, ULONG mapped, ULONG remaining, BYTE* pOutBuffer)
 {
+	if (mapped < sizeof(ipv4_header_t))
+		return;
+
 	ipv4_header_t* pIpHeader = (ipv4_header_t*)buffer;
 	ASSERT(pIpHeader);
-	ASSERT(pIpHeader->Version == 0x04);
 
-	WORD offset = 0;
-	UINT16 total_length = 0;
-	
+	if (pIpHeader->Version != 0x04)
+		return;
+
+	ULONG offset = pIpHeader->HeaderLength << 2;//sizeof(ipv4_header_t);
+	if (offset < sizeof(ipv4_header_t) || offset > mapped)
+		return;
+
+	//the frame may be padded past the IP packet, never shorter than it
+	ULONG total_length = RtlUshortByteSwap(pIpHeader->TotalLength);
+	if (total_length < offset || total_length > remaining)
+		return;
+
+	buffer += offset;
+	remaining = total_length - offset;
+	mapped = min(mapped - offset, remaining);
+
+	if (Features & ParseFeature_Tunnels) {
+		ULONG tunnel_header_size = get_tunnel_header_size(buffer, mapped, remaining, pIpHeader->Protocol);
+
+		//report the tenant's flow rather than the one between the hosts; tunnels are not nested
+		if (tunnel_header_size) {
+			read_ethernet_header<Features & ~(ULONG)ParseFeature_Tunnels>(buffer + tunnel_header_size,
+				mapped - tunnel_header_size, remaining - tunnel_header_size, pOutBuffer);
+			return;
+		}
+	}
+
+	if (!(Features & ParseFeature_L4)) {
+		RtlCopyMemory(pOutBuffer, &pIpHeader->SourceAddress, 4);
+		RtlCopyMemory(pOutBuffer + 4, &pIpHeader->DestinationAddress, 4);
+		return;
+	}
+
 	if (pIpHeader->Protocol == Protocol_Tcp)
 	{
 		//DbgPrint("have ip: destination=0x%x source=0x%x\n", pIpHeader->DestinationAddress, pIpHeader->SourceAddress);
 
-		offset = pIpHeader->HeaderLength << 2;//sizeof(ipv4_header_t);
-		ASSERT(offset >= sizeof(ipv4_header_t));
-		//TODO: is offset==sizeof(ipv4_header_t) == 20?
-
-		buffer += offset;
-		total_length = RtlUshortByteSwap(pIpHeader->TotalLength);
-
 		RtlCopyMemory(pOutBuffer, &pIpHeader->SourceAddress, 4);
 		RtlCopyMemory(pOutBuffer + 4, &pIpHeader->DestinationAddress, 4);
 
-		read_tcp_header(buffer, offset, total_length, pOutBuffer + 8);
+		read_tcp_header<Features>(buffer, mapped, remaining, pOutBuffer + 8);
 	}
 }
 
-void read_ethernet_header(BYTE* buffer, void* pOutBuffer)
+template<ULONG Features>
+void read_ethernet_header(BYTE* buffer, ULONG mapped, ULONG remaining, void* pOutBuffer)
 {
+	if (mapped < sizeof(eth_header_t) || remaining < sizeof(eth_header_t))
+		return;
+
 	eth_header_t* pEthHeader = (eth_header_t*)buffer;
 
 	if (pEthHeader->type == RtlUshortByteSwap(EtherType_IPv4))
@@ -292,7 +392,9 @@ void read_ethernet_header(BYTE* buffer, void* pOutBuffer)
 		//DbgPrint("eth type = ipv4 = 0x%x\n", pEthHeader->type);
 
 		buffer += sizeof(eth_header_t);
-		read_ip_header(buffer, (BYTE*)pOutBuffer);
+
+		if (Features & ParseFeature_L3)
+			read_ip_header<Features>(buffer, mapped - sizeof(eth_header_t), remaining - sizeof(eth_header_t), (BYTE*)pOutBuffer);
 	}
 
 	else
@@ -301,6 +403,7 @@ void read_ethernet_header(BYTE* buffer, void* pOutBuffer)
 	}
 }
 
+template<ULONG Features>
 void read_eth_header(NET_BUFFER* net_buffer, ULONG buffer_size, void* pOutBuffer)
 {
 	/*eth_header_t* pEthHeader = (eth_header_t*)NdisGetDataBuffer(buffer, sizeof(eth_header_t), NULL, 1, 0);
@@ -311,17 +414,32 @@ void read_eth_header(NET_BUFFER* net_buffer, ULONG buffer_size, void* pOutBuffer
 
 	read_ip_header(buffer, pEthHeader);*/
 
+	if (!(Features & ParseFeature_Payload)) {
+		//only the headers are needed: map just them, and copy them to the stack if they are split
+		BYTE headers[ParseHeadersSize<Features>::value];
+		ULONG headers_size = min(buffer_size, (ULONG)ParseHeadersSize<Features>::value);
+
+		BYTE* buffer = (BYTE*)NdisGetDataBuffer(net_buffer, headers_size, headers, 1, 0);
+		if (buffer)
+			read_ethernet_header<Features>(buffer, headers_size, buffer_size, pOutBuffer);
+
+		return;
+	}
+
 	BYTE* buffer = (BYTE*)NdisGetDataBuffer(net_buffer, buffer_size, NULL, 1, 0);
 	if (buffer) {
-		read_ethernet_header(buffer, pOutBuffer);
+		read_ethernet_header<Features>(buffer, buffer_size, buffer_size, pOutBuffer);
 	} else {
 		//then perhaps it's not contiguous...
 
-		void* alloc_mem = ExAllocatePoolWithTag(PagedPool, buffer_size, 'BteN');
+		//runs at DISPATCH_LEVEL: must not touch paged pool
+		void* alloc_mem = ExAllocatePoolWithTag(NonPagedPoolNx, buffer_size, 'BteN');
+		if (!alloc_mem)
+			return;
 
 		buffer = (BYTE*)NdisGetDataBuffer(net_buffer, buffer_size, alloc_mem, 1, 0);
 		if (buffer) {
-			read_ethernet_header(buffer, pOutBuffer);
+			read_ethernet_header<Features>(buffer, buffer_size, buffer_size, pOutBuffer);
 		} else {
 			DbgPrint("could not retrieve mac header: should have allocated storage in NdisGetDataBuffer!\n");
 		}
@@ -332,10 +450,14 @@ void read_eth_header(NET_BUFFER* net_buffer, ULONG buffer_size, void* pOutBuffer
 	}
 }
 
-ULONG process_buffers(PNET_BUFFER_LIST NetBufferLists, void* pOutBuffer)
+template<ULONG Features>
+ULONG process_buffers(PNET_BUFFER_LIST NetBufferLists, NDIS_SWITCH_PORT_ID port, ULONG slot, ULONG direction, ULONG64 now,
+	PGOVERNOR_CHAIN pGovernor, BOOLEAN capture, PSHARED_RING_CHAIN pRing, ULONG& frames, void* pOutBuffer)
 {
 	ULONG total_size = 0;
 
+	frames = 0;
+
 	NET_BUFFER* buffer = NET_BUFFER_LIST_FIRST_NB(NetBufferLists);
 
 	while (buffer) {
@@ -343,10 +465,39 @@ ULONG process_buffers(PNET_BUFFER_LIST NetBufferLists, void* pOutBuffer)
 		ULONG buffer_size = NET_BUFFER_DATA_LENGTH(buffer);
 		//DbgPrint("buffer size: %u = 0x%x\n", buffer_size, buffer_size);
 
-		read_eth_header(buffer, buffer_size, pOutBuffer);
+		//frames skipped by the sampling governor only count towards the totals
+		if (governor_take_frame(pGovernor)) {
+			if (Features & ParseFeature_L2) {
+				PPACKET_SNAPSHOT pSnapshot = (PPACKET_SNAPSHOT)pOutBuffer;
+
+				pSnapshot->timestamp = now;
+				pSnapshot->port_id = port;
+				pSnapshot->frame_length = buffer_size;
+				pSnapshot->payload = (Features & ParseFeature_Payload) != 0;
+
+				//the parser only writes what the frame has: nothing of the previous frame may show through
+				RtlZeroMemory(pSnapshot->data, 4 + 4 + 2);
+
+				read_eth_header<Features>(buffer, buffer_size, pSnapshot->data);
+			}
+
+			port_stats_add_frame(slot, direction, buffer_size, pGovernor->sample_rate, now);
+		}
+
+		//the counters page counts every frame, whatever the governor skips
+		counters_page_frame(buffer, buffer_size, slot, direction);
+
+		//capture has its own filter and sampling
+		if (capture)
+			capture_frame(buffer, buffer_size, port, direction, now);
+
+		//the shared rings get every frame; NULL while no buffer is registered
+		if (pRing)
+			shared_ring_frame(pRing, buffer, buffer_size, port, direction, now);
 
 		//I'll assume there are is no total size of buffer size >= 2^32 bytes
 		total_size += buffer_size;
+		++frames;
 
 		buffer = NET_BUFFER_NEXT_NB(buffer);
 	}
@@ -354,62 +505,151 @@ ULONG process_buffers(PNET_BUFFER_LIST NetBufferLists, void* pOutBuffer)
 	return total_size;
 }
 
-ULONG process_buffer_list(PNET_BUFFER_LIST NetBufferLists, ULONG& total_size, void* pOutBuffer)
+//egress is accounted to the (first) port the chain's first NBL is delivered to: looking the
+//destinations of every NBL up through the switch costs a call per NBL on the hot path.
+static NDIS_SWITCH_PORT_ID get_chain_destination(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST buffer_list)
+{
+	PNDIS_SWITCH_FORWARDING_DESTINATION_ARRAY destinations = NULL;
+	NDIS_STATUS status = Switch->NdisSwitchHandlers.GetNetBufferListDestinations(Switch->NdisSwitchContext,
+		buffer_list, &destinations);
+
+	if (status != NDIS_STATUS_SUCCESS || !destinations || destinations->NumDestinations == 0) {
+		return HV_STATS_UNKNOWN_PORT_ID;
+	}
+
+	return NDIS_SWITCH_PORT_DESTINATION_AT_ARRAY_INDEX(destinations, 0)->PortId;
+}
+
+template<ULONG Features>
+ULONG process_chain(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST NetBufferLists, ULONG direction, ULONG64 now,
+	PGOVERNOR_CHAIN pGovernor, BOOLEAN capture, PSHARED_RING_CHAIN pRing, ULONG& total_size, void* pOutBuffer)
 {
 	int count = 0;
 	NET_BUFFER_LIST* buffer_list = NetBufferLists;
 
 	total_size = 0;
 
+	NDIS_SWITCH_PORT_ID last_port = HV_STATS_UNKNOWN_PORT_ID;
+	ULONG slot = HV_STATS_UNKNOWN_PORT_SLOT;
+
+	//ingress is accounted to the port that sent each NBL, a field of the NBL; egress to the destination of the chain
+	BOOLEAN inbound = direction == HV_STATS_DIRECTION_INBOUND;
+	NDIS_SWITCH_PORT_ID chain_port = inbound ? HV_STATS_UNKNOWN_PORT_ID : get_chain_destination(Switch, NetBufferLists);
+
+	//frames / bytes of the current run of NBLs on the same port, for the microburst buckets
+	ULONG run_frames = 0;
+	ULONG run_bytes = 0;
+
 	while (buffer_list) {
+		//chains usually come from a single port: only look the slot up when it changes
+		NDIS_SWITCH_PORT_ID port = inbound ? NET_BUFFER_LIST_SWITCH_FORWARDING_DETAIL(buffer_list)->SourcePortId : chain_port;
+		if (port != last_port) {
+			microburst_add(slot, direction, run_frames, run_bytes, now);
+			run_frames = run_bytes = 0;
+
+			last_port = port;
+			slot = port_stats_find_slot(port);
+		}
+
 		//operations
-		total_size += process_buffers(buffer_list, pOutBuffer);
+		ULONG frames = 0;
+		ULONG size = process_buffers<Features>(buffer_list, last_port, slot, direction, now, pGovernor, capture, pRing, frames, pOutBuffer);
+
+		total_size += size;
+		run_bytes += size;
+		run_frames += frames;
 
 		buffer_list = NET_BUFFER_LIST_NEXT_NBL(buffer_list);
 
 		++count;
 	}
 
+	microburst_add(slot, direction, run_frames, run_bytes, now);
+
 	return count;
 }
 
-void push_buffers_info_lists_inbound(PNET_BUFFER_LIST net_buffer_lists)
+typedef ULONG (*process_chain_t)(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST NetBufferLists, ULONG direction, ULONG64 now,
+	PGOVERNOR_CHAIN pGovernor, BOOLEAN capture, PSHARED_RING_CHAIN pRing, ULONG& total_size, void* pOutBuffer);
+
+//one fully inlined instantiation per ParseLevel
+static const process_chain_t g_pipelines[ParseLevel_Count] = {
+	process_chain<0>,
+	process_chain<ParseFeature_L2 | ParseFeature_L3>,
+	process_chain<ParseFeature_L2 | ParseFeature_L3 | ParseFeature_L4>,
+	process_chain<ParseFeature_L2 | ParseFeature_L3 | ParseFeature_L4 | ParseFeature_Payload | ParseFeature_Tunnels>,
+};
+
+//parse level of each governor mode, while the snapshot buffer is available
+static const ULONG g_mode_levels[] = {
+	ParseLevel_Tunnels,		//HV_GOVERNOR_MODE_FULL
+	ParseLevel_L4,			//HV_GOVERNOR_MODE_HEADERS
+	ParseLevel_L3,			//HV_GOVERNOR_MODE_SAMPLED: IP addresses only
+};
+
+C_ASSERT(HV_GOVERNOR_MODE_FULL == 0 && HV_GOVERNOR_MODE_HEADERS == 1 && HV_GOVERNOR_MODE_SAMPLED == 2);
+
+ULONG process_buffer_list(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST NetBufferLists, ULONG direction, ULONG& total_size, void* pOutBuffer)
 {
-	/*BOOLEAN is_ipv4 = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_IPV4);
-	BOOLEAN is_ipv6 = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_IPV6);
-	BOOLEAN is_tcp = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_TCP);*/
+	//per-processor histograms: the caller keeps us on this processor
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-	//if (is_tcp && (is_ipv4 || is_ipv6))
-	{
-		if (ExTryToAcquireFastMutex(&g_inbound_mutex)) {
-			ULONG total_size = 0;
-			/*ULONG count = */ process_buffer_list(net_buffer_lists, total_size, g_pInboundData);
+	//one timestamp for the whole chain: frames indicated together arrived together
+	ULONG64 now = port_stats_now();
 
-			ExReleaseFastMutex(&g_inbound_mutex);
-		}
+	GOVERNOR_CHAIN governor;
+	governor_begin(&governor, now);
 
-		//add_io_data(count, total_size, /*inbound*/ true);
-	}
+	//the parse stages are picked once per chain, not tested per frame
+	ULONG level = pOutBuffer ? g_mode_levels[governor.mode] : ParseLevel_None;
+
+	SHARED_RING_CHAIN ring;
+	BOOLEAN ring_active = shared_ring_begin(&ring);
+
+	ULONG count = g_pipelines[level](Switch, NetBufferLists, direction, now, &governor, capture_active(),
+		ring_active ? &ring : NULL, total_size, pOutBuffer);
+
+	//publishes the chain's records with a single write
+	if (ring_active)
+		shared_ring_end(&ring);
+
+	//a second timestamp measures the time spent on the chain
+	governor_end(&governor, port_stats_now());
+
+	return count;
 }
 
-void push_buffers_info_lists_outbound(PNET_BUFFER_LIST net_buffer_lists)
+void push_buffers_info_lists(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST net_buffer_lists, ULONG direction,
+	PKSPIN_LOCK pLock, PPACKET_SNAPSHOT pOutBuffer)
 {
 	/*BOOLEAN is_ipv4 = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_IPV4);
 	BOOLEAN is_ipv6 = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_IPV6);
 	BOOLEAN is_tcp = NdisTestNblFlag(net_buffer_lists, NDIS_NBL_FLAGS_IS_TCP);*/
 
-	//if (trueis_tcp && (is_ipv4 || is_ipv6))
-	{
-		if (ExTryToAcquireFastMutex(&g_outbound_mutex)) {
-			ULONG total_size = 0;
-			/*ULONG count = */ process_buffer_list(net_buffer_lists, total_size, g_pOutboundData);
+	ULONG total_size = 0;
 
-			ExReleaseFastMutex(&g_outbound_mutex);
-		}
+	//the send and receive paths may come at PASSIVE_LEVEL; the lock and the per-processor data need DISPATCH_LEVEL
+	KIRQL old_irql;
+	KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
 
-		/*UNREFERENCED_PARAMETER(count);
-		UNREFERENCED_PARAMETER(total_size);*/
-		
-		//add_io_data(count, total_size, /*inbound*/ false);
+	//the histograms are updated for every chain; the snapshot buffer only when it is free.
+	if (KeTryToAcquireSpinLockAtDpcLevel(pLock)) {
+		/*ULONG count = */ process_buffer_list(Switch, net_buffer_lists, direction, total_size, pOutBuffer);
+
+		KeReleaseSpinLockFromDpcLevel(pLock);
+	} else {
+		process_buffer_list(Switch, net_buffer_lists, direction, total_size, NULL);
 	}
-}
\ No newline at end of file
+
+	KeLowerIrql(old_irql);
+}
+
+void push_buffers_info_lists_inbound(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST net_buffer_lists)
+{
+	push_buffers_info_lists(Switch, net_buffer_lists, HV_STATS_DIRECTION_INBOUND, &g_inbound_lock, g_pInboundSnapshot);
+}
+
+void push_buffers_info_lists_outbound(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST net_buffer_lists)
+{
+	push_buffers_info_lists(Switch, net_buffer_lists, HV_STATS_DIRECTION_OUTBOUND, &g_outbound_lock, g_pOutboundSnapshot);
+}
@@ -13,17 +13,31 @@ extern "C" {
 //	//data here
 //} PacketInfo;
 
-void push_buffers_info_lists_inbound(PNET_BUFFER_LIST NetBufferLists);
-void push_buffers_info_lists_outbound(PNET_BUFFER_LIST NetBufferLists);
+void push_buffers_info_lists_inbound(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST NetBufferLists);
+void push_buffers_info_lists_outbound(PSX_SWITCH_OBJECT Switch, PNET_BUFFER_LIST NetBufferLists);
 
 void init_io_data();
 void uninit_io_data();
 
-extern FAST_MUTEX g_inbound_mutex;
-extern FAST_MUTEX g_outbound_mutex;
+extern KSPIN_LOCK g_inbound_lock;
+extern KSPIN_LOCK g_outbound_lock;
 
-extern BYTE* g_pInboundData;
-extern BYTE* g_pOutboundData;
+//the last frame parsed in a direction; read under the direction's spin lock
+typedef struct _PACKET_SNAPSHOT {
+	//0 until a frame was parsed
+	ULONG64				timestamp;
+	NDIS_SWITCH_PORT_ID	port_id;
+	ULONG				frame_length;
+
+	//the parse level copied the payload (if it fit), not just its size
+	BOOLEAN				payload;
+
+	//as the parser left it: source IP (+0), destination IP (+4), payload size (+8, a WORD), payload (+10)
+	BYTE				data[2000];
+} PACKET_SNAPSHOT, *PPACKET_SNAPSHOT;
+
+extern PPACKET_SNAPSHOT g_pInboundSnapshot;
+extern PPACKET_SNAPSHOT g_pOutboundSnapshot;
 
 //void add_io_data(ULONG count, ULONG size, BOOLEAN is_inbound);
 //retrieves the value of count & size. 
@@ -0,0 +1,555 @@
+#include "SharedRing.h"
+
+#define SHARED_RING_TAG 'gnRS'
+
+C_ASSERT(sizeof(HV_RING_CONTROL) == 2 * HV_RING_CACHE_LINE);
+C_ASSERT(FIELD_OFFSET(HV_RING_AREA, Rings) == HV_RING_CACHE_LINE);
+C_ASSERT(sizeof(HV_RING_RECORD) % 8 == 0);
+
+//the datapath only trusts this copy of the geometry, never the pages the service can write to
+struct DECLSPEC_CACHEALIGN SharedRingCpu
+{
+	//only written by the owning processor
+	HV_RING_PRODUCER	producer;
+};
+
+//what the wait queue is searched for: the waits issued through a handle, all if NULL
+struct RingWaitPeek
+{
+	PFILE_OBJECT	file_object;
+};
+
+//the thresholds of a wait on its way into the queue, and how it completes if it is not queued
+struct RingWaitInsert
+{
+	HV_RING_WAIT	wait;
+	NTSTATUS		status;
+};
+
+namespace
+{
+	//serializes registration
+	FAST_MUTEX					g_ring_mutex;
+
+	//held by the datapath while it writes to the rings; run down while no buffer is registered
+	PEX_RUNDOWN_REF_CACHE_AWARE	g_pRingRundown = NULL;
+
+	PMDL				g_ring_mdl = NULL;
+	PHV_RING_AREA		g_pRingArea = NULL;
+	PFILE_OBJECT		g_ring_owner = NULL;
+	SharedRingCpu*		g_pRingCpus = NULL;
+	ULONG				g_ring_cpu_count = 0;
+	ULONG				g_ring_mask = 0;
+
+	//waits of an idle consumer, in a cancel-safe queue; g_ring_waitable is only changed under g_ring_wait_lock
+	KSPIN_LOCK			g_ring_wait_lock;
+	LIST_ENTRY			g_ring_waiters;
+	IO_CSQ				g_ring_wait_queue;
+	BOOLEAN				g_ring_waitable = FALSE;
+
+	//batched wakeups (HV_RING_WAIT): the thresholds of the last wait issued, and the records published since
+	volatile LONG		g_ring_notify_pending = 0;
+	LONG				g_ring_notify_records = 1;
+	LONGLONG			g_ring_notify_latency = 0;
+	KTIMER				g_ring_notify_timer;
+	KDPC				g_ring_notify_dpc;
+}
+
+static KDEFERRED_ROUTINE notify_timer_dpc;
+
+static IO_CSQ_INSERT_IRP_EX waiter_insert;
+static IO_CSQ_REMOVE_IRP waiter_remove;
+static IO_CSQ_PEEK_NEXT_IRP waiter_peek_next;
+static IO_CSQ_ACQUIRE_LOCK waiter_acquire_lock;
+static IO_CSQ_RELEASE_LOCK waiter_release_lock;
+static IO_CSQ_COMPLETE_CANCELED_IRP waiter_complete_canceled;
+
+NTSTATUS init_shared_ring()
+{
+	ExInitializeFastMutex(&g_ring_mutex);
+	KeInitializeSpinLock(&g_ring_wait_lock);
+	InitializeListHead(&g_ring_waiters);
+	g_ring_waitable = FALSE;
+
+	IoCsqInitializeEx(&g_ring_wait_queue, waiter_insert, waiter_remove, waiter_peek_next,
+		waiter_acquire_lock, waiter_release_lock, waiter_complete_canceled);
+
+	KeInitializeTimer(&g_ring_notify_timer);
+	KeInitializeDpc(&g_ring_notify_dpc, notify_timer_dpc, NULL);
+
+	g_ring_cpu_count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	SIZE_T size = sizeof(SharedRingCpu) * g_ring_cpu_count;
+	g_pRingCpus = (SharedRingCpu*)ExAllocatePoolWithTag(NonPagedPoolNx, size, SHARED_RING_TAG);
+	if (!g_pRingCpus) {
+		g_ring_cpu_count = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(g_pRingCpus, size);
+
+	g_pRingRundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, SHARED_RING_TAG);
+	if (!g_pRingRundown) {
+		ExFreePoolWithTag(g_pRingCpus, SHARED_RING_TAG);
+		g_pRingCpus = NULL;
+		g_ring_cpu_count = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	//nothing is registered yet: shared_ring_begin fails until a buffer is
+	ExWaitForRundownProtectionReleaseCacheAware(g_pRingRundown);
+
+	return STATUS_SUCCESS;
+}
+
+//completes the waits issued through file (all waits if file is NULL); any IRQL up to DISPATCH_LEVEL
+static void complete_waiters(PFILE_OBJECT file, NTSTATUS status)
+{
+	RingWaitPeek peek = {file};
+	PIRP Irp;
+
+	//the queue clears the cancel routine of the IRPs it hands out
+	while ((Irp = IoCsqRemoveNextIrp(&g_ring_wait_queue, &peek)) != NULL) {
+		Irp->IoStatus.Status = status;
+		Irp->IoStatus.Information = 0;
+
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+}
+
+//g_ring_mutex must be held
+static void release_buffer()
+{
+	//no chain starts using the rings any more, and the ones that did are done
+	ExWaitForRundownProtectionReleaseCacheAware(g_pRingRundown);
+
+	KIRQL old_irql;
+	KeAcquireSpinLock(&g_ring_wait_lock, &old_irql);
+	g_ring_waitable = FALSE;
+	KeReleaseSpinLock(&g_ring_wait_lock, old_irql);
+
+	//nothing arms the timer any more; the DPC must be done with the area before it goes
+	KeCancelTimer(&g_ring_notify_timer);
+	KeFlushQueuedDpcs();
+
+	complete_waiters(NULL, STATUS_CANCELLED);
+
+	//also removes the system mapping
+	MmUnlockPages(g_ring_mdl);
+	IoFreeMdl(g_ring_mdl);
+
+	g_ring_mdl = NULL;
+	g_pRingArea = NULL;
+	g_ring_owner = NULL;
+}
+
+void uninit_shared_ring()
+{
+	if (g_pRingRundown) {
+		ExAcquireFastMutex(&g_ring_mutex);
+
+		if (g_ring_mdl)
+			release_buffer();
+
+		ExReleaseFastMutex(&g_ring_mutex);
+
+		ExFreeCacheAwareRundownProtection(g_pRingRundown);
+		g_pRingRundown = NULL;
+	}
+
+	if (g_pRingCpus) {
+		ExFreePoolWithTag(g_pRingCpus, SHARED_RING_TAG);
+		g_pRingCpus = NULL;
+		g_ring_cpu_count = 0;
+	}
+}
+
+static NTSTATUS lock_buffer(KPROCESSOR_MODE mode, PVOID buffer, ULONG length, PMDL* pMdl, PHV_RING_AREA* pArea)
+{
+	PMDL mdl = IoAllocateMdl(buffer, length, FALSE, FALSE, NULL);
+	if (!mdl)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	NTSTATUS status = STATUS_SUCCESS;
+
+	__try {
+		MmProbeAndLockPages(mdl, mode, IoWriteAccess);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode();
+	}
+
+	if (!NT_SUCCESS(status)) {
+		IoFreeMdl(mdl);
+		return status;
+	}
+
+	PHV_RING_AREA area = (PHV_RING_AREA)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+	if (!area) {
+		MmUnlockPages(mdl);
+		IoFreeMdl(mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	*pMdl = mdl;
+	*pArea = area;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS shared_ring_register(PFILE_OBJECT owner, KPROCESSOR_MODE mode, PVOID buffer, ULONG length)
+{
+	PAGED_CODE();
+
+	if (!g_pRingRundown || !buffer || length > HV_RING_MAX_BUFFER)
+		return STATUS_INVALID_PARAMETER;
+
+	ULONG records_offset;
+	ULONG records;
+
+	if (!HvRingLayout(length, g_ring_cpu_count, &records_offset, &records))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	ExAcquireFastMutex(&g_ring_mutex);
+
+	if (g_ring_mdl) {
+		ExReleaseFastMutex(&g_ring_mutex);
+		return STATUS_DEVICE_BUSY;
+	}
+
+	PMDL mdl = NULL;
+	PHV_RING_AREA area = NULL;
+
+	NTSTATUS status = lock_buffer(mode, buffer, length, &mdl, &area);
+	if (!NT_SUCCESS(status)) {
+		ExReleaseFastMutex(&g_ring_mutex);
+		return status;
+	}
+
+	HvRingInitArea(area, g_ring_cpu_count, records, records_offset);
+
+	for (ULONG cpu = 0; cpu < g_ring_cpu_count; ++cpu)
+		HvRingProducerInit(&g_pRingCpus[cpu].producer, area, cpu, records, records_offset);
+
+	g_ring_mdl = mdl;
+	g_pRingArea = area;
+	g_ring_owner = owner;
+	g_ring_mask = records - 1;
+
+	KIRQL old_irql;
+	KeAcquireSpinLock(&g_ring_wait_lock, &old_irql);
+	g_ring_waitable = TRUE;
+	KeReleaseSpinLock(&g_ring_wait_lock, old_irql);
+
+	//let the datapath in
+	ExReInitializeRundownProtectionCacheAware(g_pRingRundown);
+
+	ExReleaseFastMutex(&g_ring_mutex);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS shared_ring_unregister(PFILE_OBJECT owner)
+{
+	PAGED_CODE();
+
+	NTSTATUS status = STATUS_INVALID_DEVICE_STATE;
+
+	if (!g_pRingRundown)
+		return status;
+
+	ExAcquireFastMutex(&g_ring_mutex);
+
+	if (g_ring_mdl && g_ring_owner == owner) {
+		release_buffer();
+		status = STATUS_SUCCESS;
+	}
+
+	ExReleaseFastMutex(&g_ring_mutex);
+
+	//waits issued through another handle than the owner's
+	complete_waiters(owner, STATUS_CANCELLED);
+
+	return status;
+}
+
+//records the consumer has not taken, over all the rings. g_ring_wait_lock must be held, with g_ring_waitable set.
+static ULONG64 records_pending()
+{
+	ULONG64 pending = 0;
+
+	for (ULONG cpu = 0; cpu < g_ring_cpu_count; ++cpu)
+		pending += HvRingProducerPending(&g_pRingCpus[cpu].producer);
+
+	return pending;
+}
+
+//TRUE if the caller clears ConsumerWaiting, and so owns the wakeup
+static BOOLEAN claim_wakeup()
+{
+	if (!HvRingClaimWakeup(g_pRingArea))
+		return FALSE;
+
+	InterlockedExchange(&g_ring_notify_pending, 0);
+	return TRUE;
+}
+
+//a wait is only queued while too few records are pending; otherwise it fails the insert and the caller answers it
+static NTSTATUS waiter_insert(PIO_CSQ Csq, PIRP Irp, PVOID InsertContext)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	RingWaitInsert* pInsert = (RingWaitInsert*)InsertContext;
+	HV_RING_WAIT wait = pInsert->wait;
+
+	if (!g_ring_waitable) {
+		pInsert->status = STATUS_DEVICE_NOT_READY;
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	//a full ring drops rather than counts: more than half a ring could never be reached
+	wait.MinRecords = min(wait.MinRecords, (g_ring_mask + 1) / 2);
+
+	ULONG64 pending = records_pending();
+
+	if (pending >= wait.MinRecords) {
+		InterlockedExchange(&g_pRingArea->ConsumerWaiting, 0);
+		pInsert->status = STATUS_SUCCESS;
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	g_ring_notify_records = (LONG)wait.MinRecords;
+	g_ring_notify_latency = -10000LL * wait.MaxLatency;
+
+	//the datapath counts from here, while ConsumerWaiting is set
+	InterlockedExchange(&g_ring_notify_pending, (LONG)pending);
+	InterlockedExchange(&g_pRingArea->ConsumerWaiting, 1);
+
+	if (pending && g_ring_notify_latency)
+		KeSetTimer(&g_ring_notify_timer, *(PLARGE_INTEGER)&g_ring_notify_latency, &g_ring_notify_dpc);
+
+	InsertTailList(&g_ring_waiters, &Irp->Tail.Overlay.ListEntry);
+	return STATUS_SUCCESS;
+}
+
+static void waiter_remove(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+static PIRP waiter_peek_next(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	const RingWaitPeek* pPeek = (const RingWaitPeek*)PeekContext;
+	PLIST_ENTRY entry = Irp ? Irp->Tail.Overlay.ListEntry.Flink : g_ring_waiters.Flink;
+
+	for (; entry != &g_ring_waiters; entry = entry->Flink) {
+		PIRP next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+		if (!pPeek || !pPeek->file_object || IoGetCurrentIrpStackLocation(next)->FileObject == pPeek->file_object)
+			return next;
+	}
+
+	return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+static void waiter_acquire_lock(PIO_CSQ Csq, PKIRQL Irql)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeAcquireSpinLock(&g_ring_wait_lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static void waiter_release_lock(PIO_CSQ Csq, KIRQL Irql)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeReleaseSpinLock(&g_ring_wait_lock, Irql);
+}
+
+static void waiter_complete_canceled(PIO_CSQ Csq, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	Irp->IoStatus.Information = 0;
+
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS shared_ring_wait(PIRP Irp)
+{
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+	RingWaitInsert insert = {{1, 0}, STATUS_SUCCESS};
+
+	if (stack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(HV_RING_WAIT)) {
+		insert.wait = *(PHV_RING_WAIT)Irp->AssociatedIrp.SystemBuffer;
+
+		if (!insert.wait.MinRecords)
+			insert.wait.MinRecords = 1;
+	}
+
+	Irp->IoStatus.Information = 0;
+
+	//queued (and marked pending) only if it has to wait; cancelling it takes it off the queue
+	if (NT_SUCCESS(IoCsqInsertIrpEx(&g_ring_wait_queue, Irp, NULL, &insert)))
+		return STATUS_PENDING;
+
+	Irp->IoStatus.Status = insert.status;
+
+	return insert.status;
+}
+
+ULONG64 shared_ring_dropped()
+{
+	ULONG64 dropped = 0;
+
+	//read without synchronization, like the Dropped fields of the rings
+	for (ULONG cpu = 0; cpu < g_ring_cpu_count; ++cpu)
+		dropped += g_pRingCpus[cpu].producer.Dropped;
+
+	return dropped;
+}
+
+static void wake_waiters()
+{
+	complete_waiters(NULL, STATUS_SUCCESS);
+}
+
+//the oldest record the consumer waits for has waited MaxLatency
+static void notify_timer_dpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(DeferredContext);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	if (claim_wakeup())
+		wake_waiters();
+}
+
+BOOLEAN shared_ring_begin(__out PSHARED_RING_CHAIN pChain)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	if (!g_pRingRundown || !ExAcquireRundownProtectionCacheAware(g_pRingRundown))
+		return FALSE;
+
+	pChain->cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	PHV_RING_PRODUCER pProducer = &g_pRingCpus[pChain->cpu].producer;
+
+	pChain->head = pProducer->Head;
+	//the consumer is done with the records before Tail
+	pChain->tail = HvRingProducerTail(pProducer);
+	pChain->published = 0;
+	pChain->dropped = 0;
+
+	return TRUE;
+}
+
+enum {RingEtherType_IPv4 = 0x800, RingEtherType_IPv6 = 0x86DD};
+enum {RingProtocol_Tcp = 0x06, RingProtocol_Udp = 0x11};
+
+static void fill_record(PHV_RING_RECORD pRecord, NET_BUFFER* net_buffer, ULONG frame_size,
+	NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now)
+{
+	pRecord->Timestamp = now;
+	pRecord->PortId = port_id;
+	pRecord->FrameLength = frame_size;
+	pRecord->Direction = (USHORT)direction;
+	pRecord->EtherType = 0;
+	pRecord->IpProtocol = 0;
+	pRecord->Reserved[0] = pRecord->Reserved[1] = pRecord->Reserved[2] = 0;
+	pRecord->SourceAddress = 0;
+	pRecord->DestinationAddress = 0;
+	pRecord->SourcePort = 0;
+	pRecord->DestinationPort = 0;
+	pRecord->Reserved2 = 0;
+
+	//ethernet + longest IPv4 header + TCP / UDP ports
+	BYTE headers[14 + 60 + 4];
+	ULONG size = min(frame_size, (ULONG)sizeof(headers));
+
+	BYTE* buffer = (BYTE*)NdisGetDataBuffer(net_buffer, size, headers, 1, 0);
+	if (!buffer || size < 14)
+		return;
+
+	pRecord->EtherType = RtlUshortByteSwap(*(USHORT*)(buffer + 12));
+
+	BYTE* pL4Header = NULL;
+
+	if (pRecord->EtherType == RingEtherType_IPv4 && size >= 14 + 20) {
+		ULONG header_length = (buffer[14] & 0xF) << 2;
+
+		pRecord->IpProtocol = buffer[14 + 9];
+		pRecord->SourceAddress = *(ULONG*)(buffer + 14 + 12);
+		pRecord->DestinationAddress = *(ULONG*)(buffer + 14 + 16);
+
+		if (14 + header_length + 4 <= size)
+			pL4Header = buffer + 14 + header_length;
+
+	} else if (pRecord->EtherType == RingEtherType_IPv6 && size >= 14 + 40) {
+		//extension headers are not followed
+		pRecord->IpProtocol = buffer[14 + 6];
+
+		if (14 + 40 + 4 <= size)
+			pL4Header = buffer + 14 + 40;
+	}
+
+	if (pL4Header && (pRecord->IpProtocol == RingProtocol_Tcp || pRecord->IpProtocol == RingProtocol_Udp)) {
+		pRecord->SourcePort = *(USHORT*)pL4Header;
+		pRecord->DestinationPort = *(USHORT*)(pL4Header + 2);
+	}
+}
+
+void shared_ring_frame(__inout PSHARED_RING_CHAIN pChain, NET_BUFFER* net_buffer, ULONG frame_size,
+	NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now)
+{
+	PHV_RING_RECORD pRecord = HvRingProducerSlot(&g_pRingCpus[pChain->cpu].producer, pChain->head, pChain->tail);
+
+	//full, or a Tail the service moved past head
+	if (!pRecord) {
+		++pChain->dropped;
+		return;
+	}
+
+	fill_record(pRecord, net_buffer, frame_size, port_id, direction, now);
+
+	++pChain->head;
+	++pChain->published;
+}
+
+void shared_ring_end(__in PSHARED_RING_CHAIN pChain)
+{
+	ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+	//publish once per chain
+	HvRingProducerPublish(&g_pRingCpus[pChain->cpu].producer, pChain->head, pChain->dropped);
+
+	if (pChain->published) {
+
+		//only an idle consumer costs an IRP completion, and only once enough records are waiting
+		if (g_pRingArea->ConsumerWaiting) {
+			LONG pending = InterlockedExchangeAdd(&g_ring_notify_pending, (LONG)pChain->published) + (LONG)pChain->published;
+
+			if (pending >= g_ring_notify_records) {
+				if (claim_wakeup()) {
+					if (g_ring_notify_latency)
+						KeCancelTimer(&g_ring_notify_timer);
+
+					wake_waiters();
+				}
+			} else if (pending == (LONG)pChain->published && g_ring_notify_latency) {
+				//the first record of the batch starts the clock
+				KeSetTimer(&g_ring_notify_timer, *(PLARGE_INTEGER)&g_ring_notify_latency, &g_ring_notify_dpc);
+			}
+		}
+	}
+
+	ExReleaseRundownProtectionCacheAware(g_pRingRundown);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "precomp.h"
+#include "../../HVService/HVService/HVStats.h"
+#include "../../HVService/HVService/RingProtocol.h"
+
+//
+// Shared-memory record rings (see HVRing.h).
+//
+// The service's buffer is probed and locked once, when it is registered; the
+// datapath then writes HV_RING_RECORDs straight into it and publishes them once
+// per NBL chain.  The only IRPs are the waits of an idle consumer.
+//
+
+typedef struct _SHARED_RING_CHAIN {
+	ULONG	cpu;
+	ULONG64	head;
+	ULONG64	tail;
+	ULONG	published;
+	ULONG	dropped;
+} SHARED_RING_CHAIN, *PSHARED_RING_CHAIN;
+
+NTSTATUS init_shared_ring();
+void uninit_shared_ring();
+
+//
+// Locks the pages of a user buffer and lays the rings out in it. Called at PASSIVE_LEVEL,
+// in the context of the registering process.
+//
+NTSTATUS shared_ring_register(PFILE_OBJECT owner, KPROCESSOR_MODE mode, PVOID buffer, ULONG length);
+
+//
+// Waits for the datapath to leave the rings, fails pending waits and unlocks the buffer,
+// if it was registered through owner. Called at PASSIVE_LEVEL.
+//
+NTSTATUS shared_ring_unregister(PFILE_OBJECT owner);
+
+//
+// Satisfies a OSR_COMM_CONTROL_WAIT_RING request, or pends it until enough records are published
+// (see HV_RING_WAIT).
+// Returns STATUS_PENDING if the IRP was queued; otherwise the caller completes the IRP.
+//
+NTSTATUS shared_ring_wait(PIRP Irp);
+
+//
+// Records dropped because a ring was full, since the buffer was registered.
+//
+ULONG64 shared_ring_dropped();
+
+//
+// Per NBL chain, at DISPATCH_LEVEL: shared_ring_frame may only be called between a
+// shared_ring_begin that returned TRUE and the matching shared_ring_end.
+//
+BOOLEAN shared_ring_begin(__out PSHARED_RING_CHAIN pChain);
+void shared_ring_frame(__inout PSHARED_RING_CHAIN pChain, NET_BUFFER* net_buffer, ULONG frame_size,
+	NDIS_SWITCH_PORT_ID port_id, ULONG direction, ULONG64 now);
+void shared_ring_end(__in PSHARED_RING_CHAIN pChain);
+
+#ifdef __cplusplus
+}
+#endif
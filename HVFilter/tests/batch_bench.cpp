@@ -0,0 +1,91 @@
+#include "standin_engine.h"
+
+#include <chrono>
+
+//
+// Batched against one-at-a-time control requests on the stand-in device: 1 to
+// 256 client threads, each with one read outstanding, against standin::Engine
+// with 1 or 4 exchanges in flight on two workers.  "single" gives every
+// exchange a buffer that holds one entry, which is what a control request per
+// data request costs; "batch" gives it REQUEST_ENGINE_BATCH_LENGTH.  Reports
+// requests answered per second and exchanges (IRPs of the service) per request.
+//
+// usage: batch_bench [requests per client]
+//
+
+namespace
+{
+	const ULONG kWorkers = 2;
+
+	BOOL answer(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		UNREFERENCED_PARAMETER(pContext);
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_READ_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+		return TRUE;
+	}
+
+	void client(standin::Device* pDevice, ULONG requests)
+	{
+		standin::DataRequest request;
+
+		request.type = OSR_COMM_READ_REQUEST;
+		request.length = 1500;
+		request.payload = NULL;
+
+		for (ULONG i = 0; i < requests; ++i) {
+			if (!pDevice->submit(&request))
+				return;
+
+			pDevice->wait(&request);
+		}
+	}
+
+	void run(ULONG clients, ULONG outstanding, ULONG buffer_length, ULONG requests, const char* mode)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+
+		engine.start(outstanding, buffer_length, kWorkers, answer, NULL);
+
+		auto start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> clientThreads;
+		for (ULONG i = 0; i < clients; ++i)
+			clientThreads.emplace_back(client, &device, requests);
+
+		for (auto& thread : clientThreads)
+			thread.join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		standin::Statistics stats = device.statistics();
+
+		engine.stop();
+
+		std::printf("%8u %12u %8s %16.0f %18.3f\n", clients, outstanding, mode,
+			stats.completed / elapsed.count(), stats.completed ? (double)stats.exchanges / stats.completed : 0.0);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	ULONG requests = argc > 1 ? std::atoi(argv[1]) : 2000;
+	const ULONG clients[] = {1, 16, 256};
+	const ULONG outstanding[] = {1, 4};
+
+	std::printf("%u requests per client, %u workers\n", requests, kWorkers);
+	std::printf("%8s %12s %8s %16s %18s\n", "clients", "outstanding", "mode", "requests/s", "exchanges/request");
+
+	for (ULONG c = 0; c < sizeof(clients) / sizeof(clients[0]); ++c) {
+		for (ULONG o = 0; o < sizeof(outstanding) / sizeof(outstanding[0]); ++o) {
+			run(clients[c], outstanding[o], OSR_COMM_BATCH_MIN_LENGTH, requests, "single");
+			run(clients[c], outstanding[o], 65536, requests, "batch");
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,346 @@
+#include "standin_device.h"
+#include "check.h"
+
+#include <vector>
+
+//
+// BatchProtocol.h: what the writer packs the reader gives back, oversized
+// writes wait for the next batch unless they come first, the reader stops at
+// the first entry that does not add up, and against the stand-in device a
+// burst of requests costs a fraction of an exchange per request.
+//
+
+namespace
+{
+	//payload byte i of the write with the given ID
+	BYTE pattern(ULONG id, ULONG i)
+	{
+		return (BYTE)(id * 13 + i);
+	}
+
+	void append_write(POSR_COMM_BATCH_WRITER pWriter, ULONG id, ULONG length)
+	{
+		ULONG payload = length;
+
+		CHECK(OsrCommBatchWriterFit(pWriter, &payload));
+
+		BYTE* pData = (BYTE*)(pWriter->Next + 1);
+		for (ULONG i = 0; i < payload; ++i)
+			pData[i] = pattern(id, i);
+
+		OsrCommBatchWriterAppend(pWriter, id, OSR_COMM_WRITE_REQUEST, payload, payload);
+	}
+
+	void test_round_trip()
+	{
+		std::vector<ULONG64> buffer(65536 / sizeof(ULONG64));
+		OSR_COMM_BATCH_WRITER writer;
+		ULONG count = 0;
+
+		OsrCommBatchWriterInit(&writer, buffer.data(), 65536);
+
+		for (ULONG id = 1; ; ++id) {
+			ULONG payload = id % 3 ? (id * 37) % 700 : 0;
+
+			if (!OsrCommBatchWriterFit(&writer, &payload))
+				break;
+
+			if (id % 3) {
+				append_write(&writer, id, payload);
+			} else {
+				OsrCommBatchWriterAppend(&writer, id, OSR_COMM_READ_REQUEST, id * 10, 0);
+			}
+
+			++count;
+		}
+
+		//stopped by the count or the space, whichever came first
+		CHECK_EQUAL(writer.Batch->Count, count);
+		CHECK(count == OSR_COMM_BATCH_MAX_REQUESTS || writer.Space < sizeof(OSR_COMM_BATCH_ENTRY) + 700);
+
+		OSR_COMM_BATCH_READER reader;
+		POSR_COMM_BATCH_ENTRY entry;
+		ULONG id = 0;
+
+		CHECK(OsrCommBatchReaderInit(&reader, buffer.data(), OsrCommBatchWriterLength(&writer)));
+
+		while ((entry = OsrCommBatchReaderNext(&reader)) != NULL) {
+			++id;
+
+			CHECK_EQUAL(entry->RequestID, id);
+			CHECK_EQUAL(entry->EntryLength % OSR_COMM_BATCH_ALIGNMENT, 0);
+
+			if (id % 3) {
+				CHECK_EQUAL(entry->RequestType, OSR_COMM_WRITE_REQUEST);
+				CHECK_EQUAL(entry->RequestBufferLength, (id * 37) % 700);
+
+				const BYTE* pData = (const BYTE*)(entry + 1);
+				for (ULONG i = 0; i < entry->RequestBufferLength; ++i)
+					CHECK_EQUAL(pData[i], pattern(id, i));
+			} else {
+				CHECK_EQUAL(entry->RequestType, OSR_COMM_READ_REQUEST);
+				CHECK_EQUAL(entry->RequestBufferLength, id * 10);
+			}
+		}
+
+		CHECK_EQUAL(id, count);
+	}
+
+	void test_oversized_writes()
+	{
+		std::vector<ULONG64> buffer(1024 / sizeof(ULONG64));
+		OSR_COMM_BATCH_WRITER writer;
+		ULONG payload;
+
+		//the first write is cut to what fits
+		OsrCommBatchWriterInit(&writer, buffer.data(), 1024);
+
+		payload = 5000;
+		CHECK(OsrCommBatchWriterFit(&writer, &payload));
+		CHECK_EQUAL(payload, 1024 - sizeof(OSR_COMM_BATCH_REQUEST) - sizeof(OSR_COMM_BATCH_ENTRY));
+		CHECK(!OsrCommBatchWriterAppend(&writer, 1, OSR_COMM_WRITE_REQUEST, payload, payload));
+		CHECK_EQUAL(OsrCommBatchWriterLength(&writer), 1024);
+
+		//a later one waits for the next batch, and does not stop a read that fits from coming first next time
+		OsrCommBatchWriterInit(&writer, buffer.data(), 1024);
+
+		CHECK(OsrCommBatchWriterAppend(&writer, 1, OSR_COMM_READ_REQUEST, 100, 0));
+
+		payload = 1000;
+		CHECK(!OsrCommBatchWriterFit(&writer, &payload));
+		CHECK_EQUAL(payload, 1000);
+		CHECK_EQUAL(writer.Batch->Count, 1);
+
+		//a buffer the alignment does not divide
+		OsrCommBatchWriterInit(&writer, buffer.data(), OSR_COMM_BATCH_MIN_LENGTH + 5);
+		CHECK_EQUAL(writer.Space, sizeof(OSR_COMM_BATCH_ENTRY));
+
+		payload = 1;
+		CHECK(OsrCommBatchWriterFit(&writer, &payload));
+		CHECK_EQUAL(payload, 0);
+	}
+
+	void test_malformed()
+	{
+		std::vector<ULONG64> buffer(4096 / sizeof(ULONG64));
+		OSR_COMM_BATCH_WRITER writer;
+		OSR_COMM_BATCH_READER reader;
+
+		OsrCommBatchWriterInit(&writer, buffer.data(), 4096);
+		for (ULONG id = 1; id <= 4; ++id)
+			append_write(&writer, id, 100);
+
+		ULONG length = OsrCommBatchWriterLength(&writer);
+		POSR_COMM_BATCH_ENTRY entries[4];
+
+		entries[0] = (POSR_COMM_BATCH_ENTRY)(writer.Batch + 1);
+		for (ULONG i = 1; i < 4; ++i)
+			entries[i] = (POSR_COMM_BATCH_ENTRY)((BYTE*)entries[i - 1] + entries[i - 1]->EntryLength);
+
+		//more entries than returned
+		CHECK(!OsrCommBatchReaderInit(&reader, buffer.data(), length - 1));
+		CHECK(!OsrCommBatchReaderNext(&reader));
+		CHECK(!OsrCommBatchReaderInit(&reader, buffer.data(), sizeof(OSR_COMM_BATCH_REQUEST) - 1));
+
+		//an entry that claims to run past the batch ends it, and so does the one after a short entry
+		ULONG saved = entries[2]->EntryLength;
+		entries[2]->EntryLength = 4096;
+
+		CHECK(OsrCommBatchReaderInit(&reader, buffer.data(), length));
+		CHECK(OsrCommBatchReaderNext(&reader) == entries[0]);
+		CHECK(OsrCommBatchReaderNext(&reader) == entries[1]);
+		CHECK(!OsrCommBatchReaderNext(&reader));
+		CHECK(!OsrCommBatchReaderNext(&reader));
+
+		entries[2]->EntryLength = sizeof(OSR_COMM_BATCH_ENTRY) - 1;
+		CHECK(OsrCommBatchReaderInit(&reader, buffer.data(), length));
+		OsrCommBatchReaderNext(&reader);
+		OsrCommBatchReaderNext(&reader);
+		CHECK(!OsrCommBatchReaderNext(&reader));
+
+		entries[2]->EntryLength = saved;
+
+		//a write payload longer than its entry
+		entries[1]->RequestBufferLength = entries[1]->EntryLength;
+		CHECK(OsrCommBatchReaderInit(&reader, buffer.data(), length));
+		CHECK(OsrCommBatchReaderNext(&reader) == entries[0]);
+		CHECK(!OsrCommBatchReaderNext(&reader));
+
+		entries[1]->RequestBufferLength = 100;
+
+		//a count beyond OSR_COMM_BATCH_MAX_REQUESTS reads no further than the bytes
+		writer.Batch->Count = 100000;
+		CHECK(OsrCommBatchReaderInit(&reader, buffer.data(), length));
+
+		ULONG count = 0;
+		while (OsrCommBatchReaderNext(&reader))
+			++count;
+
+		CHECK_EQUAL(count, 4);
+
+		//responses
+		union {
+			OSR_COMM_BATCH_RESPONSE response;
+			BYTE bytes[OSR_COMM_BATCH_RESPONSE_LENGTH(OSR_COMM_BATCH_MAX_REQUESTS + 1)];
+		} response;
+
+		response.response.Count = 3;
+		CHECK(OsrCommBatchResponseValid(&response.response, OSR_COMM_BATCH_RESPONSE_LENGTH(3)));
+		CHECK(!OsrCommBatchResponseValid(&response.response, OSR_COMM_BATCH_RESPONSE_LENGTH(3) - 1));
+		CHECK(!OsrCommBatchResponseValid(&response.response, FIELD_OFFSET(OSR_COMM_BATCH_RESPONSE, Completions) - 1));
+
+		response.response.Count = OSR_COMM_BATCH_MAX_REQUESTS + 1;
+		CHECK(!OsrCommBatchResponseValid(&response.response, sizeof(response)));
+	}
+
+	//answers every entry of a batch into response; returns the answer count
+	ULONG answer(const standin::Exchange& exchange, POSR_COMM_BATCH_RESPONSE pResponse)
+	{
+		OSR_COMM_BATCH_READER reader;
+		POSR_COMM_BATCH_ENTRY entry;
+		ULONG count = 0;
+
+		CHECK(OsrCommBatchReaderInit(&reader, exchange.buffer, exchange.returned));
+
+		while ((entry = OsrCommBatchReaderNext(&reader)) != NULL) {
+			POSR_COMM_BATCH_COMPLETION pCompletion = &pResponse->Completions[count++];
+
+			pCompletion->RequestID = entry->RequestID;
+			pCompletion->ResponseType = entry->RequestType == OSR_COMM_WRITE_REQUEST ? OSR_COMM_WRITE_RESPONSE : OSR_COMM_READ_RESPONSE;
+			pCompletion->ResponseBufferLength = entry->RequestBufferLength;
+			pCompletion->Reserved = 0;
+		}
+
+		pResponse->Count = count;
+		pResponse->RegisteredBuffer = 0;
+		return count;
+	}
+
+	//requests queued faster than the service takes them: each exchange brings back a batch of them
+	void test_burst(ULONG requests, ULONG buffer_length, ULONG64 max_exchanges)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		std::vector<standin::DataRequest> data(requests);
+		std::vector<BYTE> payload(512, 0xA5);
+
+		for (ULONG i = 0; i < requests; ++i) {
+			data[i].type = i % 2 ? OSR_COMM_WRITE_REQUEST : OSR_COMM_READ_REQUEST;
+			data[i].length = i % 2 ? (i * 7) % 512 : 4096;
+			data[i].payload = payload.data();
+
+			CHECK(device.submit(&data[i]));
+		}
+
+		std::vector<ULONG64> buffer(buffer_length / sizeof(ULONG64));
+		standin::Exchange exchange = {(BYTE*)buffer.data(), buffer_length, 0, FALSE};
+
+		std::vector<ULONG64> storage;
+		POSR_COMM_BATCH_RESPONSE pResponse = standin::allocate_response(storage, OSR_COMM_BATCH_MAX_REQUESTS);
+		ULONG response_length = 0;
+
+		//one exchange in flight: it carries the answers to the previous batch down
+		while (device.statistics().completed < requests) {
+			CHECK_EQUAL(device.exchange(pResponse, response_length, &exchange), STATUS_PENDING);
+
+			standin::Completion completion = port.get();
+			CHECK(completion.exchange == &exchange);
+			CHECK(exchange.status);
+
+			ULONG count = answer(exchange, pResponse);
+			CHECK(count > 0);
+
+			response_length = OSR_COMM_BATCH_RESPONSE_LENGTH(count);
+
+			//the last answers go down without an output buffer
+			if (device.statistics().submitted - device.statistics().completed == count) {
+				standin::Exchange flush = {NULL, 0, 0, FALSE};
+
+				CHECK_EQUAL(device.exchange(pResponse, response_length, &flush), STATUS_PENDING);
+				CHECK(port.get().exchange == &flush);
+			}
+		}
+
+		standin::Statistics stats = device.statistics();
+
+		CHECK_EQUAL(stats.completed, requests);
+		CHECK_EQUAL(stats.rejected, 0);
+		CHECK(stats.exchanges <= max_exchanges);
+
+		for (ULONG i = 0; i < requests; ++i) {
+			CHECK(data[i].completed);
+			CHECK(!data[i].failed);
+			CHECK_EQUAL(data[i].response_length, data[i].length);
+		}
+
+		std::printf("burst of %u requests, %u byte batches: %llu exchanges, %.3f per request\n",
+			requests, buffer_length, (unsigned long long)stats.exchanges, (double)stats.exchanges / requests);
+	}
+
+	void test_stale_answers()
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::DataRequest request;
+		std::vector<ULONG64> buffer(4096 / sizeof(ULONG64));
+		standin::Exchange exchange = {(BYTE*)buffer.data(), 4096, 0, FALSE};
+
+		std::vector<ULONG64> storage;
+		POSR_COMM_BATCH_RESPONSE pResponse = standin::allocate_response(storage, 2);
+
+		request.type = OSR_COMM_READ_REQUEST;
+		request.length = 10;
+		request.payload = NULL;
+
+		//an answer to a request that was never handed out is not applied
+		CHECK(device.submit(&request));
+
+		pResponse->Count = 1;
+		pResponse->RegisteredBuffer = 0;
+		pResponse->Completions[0].RequestID = request.id;
+		pResponse->Completions[0].ResponseType = OSR_COMM_READ_RESPONSE;
+		pResponse->Completions[0].ResponseBufferLength = 10;
+
+		standin::Exchange flush = {NULL, 0, 0, FALSE};
+		device.exchange(pResponse, OSR_COMM_BATCH_RESPONSE_LENGTH(1), &flush);
+		port.get();
+
+		CHECK(!request.completed);
+		CHECK_EQUAL(device.statistics().rejected, 1);
+
+		//handed out, then answered twice: the second answer finds a stale ID
+		device.exchange(NULL, 0, &exchange);
+		port.get();
+		CHECK_EQUAL(exchange.returned, sizeof(OSR_COMM_BATCH_REQUEST) + sizeof(OSR_COMM_BATCH_ENTRY));
+
+		pResponse->Count = 2;
+		pResponse->Completions[1] = pResponse->Completions[0];
+		device.exchange(pResponse, OSR_COMM_BATCH_RESPONSE_LENGTH(2), &flush);
+		port.get();
+
+		CHECK(request.completed);
+		CHECK_EQUAL(device.statistics().completed, 1);
+		CHECK_EQUAL(device.statistics().rejected, 2);
+
+		//closing fails the exchanges still waiting
+		device.exchange(NULL, 0, &exchange);
+		device.close();
+		CHECK(port.get().exchange == &exchange);
+		CHECK(!exchange.status);
+	}
+}
+
+int main()
+{
+	test_round_trip();
+	test_oversized_writes();
+	test_malformed();
+	test_stale_answers();
+
+	//256 per batch, or what 64KB hold; plus the final flush
+	test_burst(10000, 65536, 10000 / 256 + 2 + 1);
+	test_burst(10000, 8192, 10000 / 24 + 2 + 1);
+
+	std::printf("batch_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include <Windows.h>
+#include "../base/BufferRegistry.h"
+#include "check.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// BufferRegistry.h: registration requests are checked before anything is
+// locked, one set of buffers is registered at a time, only the handle that
+// registered it can name its buffers or take them back, and control requests
+// tell a registered buffer from a user address.  Then lookups racing
+// registrations and unregistrations under one lock, the way the service
+// queue lock serializes them, never reach a set that was taken back.
+//
+
+namespace
+{
+	//a registration of count buffers, in an input buffer of its own
+	std::vector<ULONG64> registration(ULONG count, ULONG length = 4096)
+	{
+		std::vector<ULONG64> storage((FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) +
+			count * sizeof(OSR_COMM_BUFFER_DESCRIPTOR) + sizeof(ULONG64) - 1) / sizeof(ULONG64) + 1);
+		POSR_COMM_BUFFER_REGISTRATION pRegistration = (POSR_COMM_BUFFER_REGISTRATION)storage.data();
+
+		pRegistration->Count = count;
+		pRegistration->Reserved = 0;
+
+		for (ULONG i = 0; i < count; ++i) {
+			pRegistration->Buffers[i].Buffer = 0x10000 + i * 0x10000ULL;
+			pRegistration->Buffers[i].Length = length;
+			pRegistration->Buffers[i].Reserved = 0;
+		}
+
+		return storage;
+	}
+
+	ULONG length_of(ULONG count)
+	{
+		return FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) + count * sizeof(OSR_COMM_BUFFER_DESCRIPTOR);
+	}
+
+	void test_validation()
+	{
+		std::vector<ULONG64> storage = registration(OSR_COMM_MAX_REGISTERED_BUFFERS + 1);
+		POSR_COMM_BUFFER_REGISTRATION pRegistration = (POSR_COMM_BUFFER_REGISTRATION)storage.data();
+
+		CHECK(!OsrCommBufferRegistrationValid(pRegistration, length_of(OSR_COMM_MAX_REGISTERED_BUFFERS + 1)));
+
+		pRegistration->Count = OSR_COMM_MAX_REGISTERED_BUFFERS;
+		CHECK(OsrCommBufferRegistrationValid(pRegistration, length_of(OSR_COMM_MAX_REGISTERED_BUFFERS)));
+
+		//the descriptors must all be in the input buffer
+		CHECK(!OsrCommBufferRegistrationValid(pRegistration, length_of(OSR_COMM_MAX_REGISTERED_BUFFERS) - 1));
+		CHECK(!OsrCommBufferRegistrationValid(pRegistration, FIELD_OFFSET(OSR_COMM_BUFFER_REGISTRATION, Buffers) - 1));
+
+		pRegistration->Count = 0;
+		CHECK(!OsrCommBufferRegistrationValid(pRegistration, length_of(1)));
+
+		pRegistration->Count = 3;
+		CHECK(OsrCommBufferRegistrationValid(pRegistration, length_of(3)));
+
+		pRegistration->Buffers[2].Length = 0;
+		CHECK(!OsrCommBufferRegistrationValid(pRegistration, length_of(3)));
+
+		//only a 32-bit driver has addresses a ULONG64 can go beyond
+		pRegistration->Buffers[2].Length = 4096;
+		pRegistration->Buffers[1].Buffer = (ULONG64)MAXULONG_PTR;
+		CHECK(OsrCommBufferRegistrationValid(pRegistration, length_of(3)));
+
+		if (sizeof(ULONG_PTR) < sizeof(ULONG64)) {
+			pRegistration->Buffers[1].Buffer = (ULONG64)MAXULONG_PTR + 1;
+			CHECK(!OsrCommBufferRegistrationValid(pRegistration, length_of(3)));
+		}
+	}
+
+	void test_ownership()
+	{
+		OSR_COMM_BUFFER_REGISTRY registry;
+		OSR_COMM_MAPPED_BUFFER first[2] = {{NULL, (PVOID)0x1000, 100}, {NULL, (PVOID)0x2000, 200}};
+		OSR_COMM_MAPPED_BUFFER second[1] = {{NULL, (PVOID)0x3000, 300}};
+		int owner, other;
+		ULONG count;
+
+		OsrCommBufferRegistryInit(&registry);
+
+		CHECK(!OsrCommBufferRegistryLookup(&registry, NULL, 0));
+		CHECK(!OsrCommBufferRegistryDetach(&registry, NULL, &count));
+		CHECK_EQUAL(count, 0);
+
+		CHECK(OsrCommBufferRegistryAttach(&registry, &owner, first, 2));
+
+		//one set at a time, whoever asks
+		CHECK(!OsrCommBufferRegistryAttach(&registry, &other, second, 1));
+		CHECK(!OsrCommBufferRegistryAttach(&registry, &owner, second, 1));
+
+		CHECK(OsrCommBufferRegistryLookup(&registry, &owner, 0) == &first[0]);
+		CHECK(OsrCommBufferRegistryLookup(&registry, &owner, 1) == &first[1]);
+		CHECK(!OsrCommBufferRegistryLookup(&registry, &owner, 2));
+		CHECK(!OsrCommBufferRegistryLookup(&registry, &other, 0));
+
+		//another handle cannot take them back
+		CHECK(!OsrCommBufferRegistryDetach(&registry, &other, &count));
+		CHECK_EQUAL(count, 0);
+		CHECK(OsrCommBufferRegistryLookup(&registry, &owner, 1) == &first[1]);
+
+		CHECK(OsrCommBufferRegistryDetach(&registry, &owner, &count) == first);
+		CHECK_EQUAL(count, 2);
+		CHECK(!OsrCommBufferRegistryLookup(&registry, &owner, 0));
+		CHECK(!OsrCommBufferRegistryDetach(&registry, &owner, &count));
+
+		//then anyone can register again
+		CHECK(OsrCommBufferRegistryAttach(&registry, &other, second, 1));
+		CHECK(OsrCommBufferRegistryLookup(&registry, &other, 0)->Length == 300);
+		CHECK(!OsrCommBufferRegistryLookup(&registry, &owner, 0));
+	}
+
+	void test_names()
+	{
+		for (ULONG i = 0; i < OSR_COMM_MAX_REGISTERED_BUFFERS; ++i) {
+			CHECK(OSR_COMM_IS_REGISTERED_BUFFER(OSR_COMM_REGISTERED_BUFFER(i)));
+			CHECK_EQUAL(OSR_COMM_REGISTERED_BUFFER_INDEX(OSR_COMM_REGISTERED_BUFFER(i)), i);
+		}
+
+		//no buffer, and user addresses, are not registered buffers
+		CHECK(!OSR_COMM_IS_REGISTERED_BUFFER(NULL));
+		CHECK(!OSR_COMM_IS_REGISTERED_BUFFER(OSR_COMM_REGISTERED_BUFFER(OSR_COMM_MAX_REGISTERED_BUFFERS)));
+		CHECK(!OSR_COMM_IS_REGISTERED_BUFFER((PVOID)0x10000));
+		CHECK(!OSR_COMM_IS_REGISTERED_BUFFER((PVOID)MAXULONG_PTR));
+	}
+
+	//a set of mapped buffers, poisoned once it is unmapped
+	struct Mapping
+	{
+		std::vector<OSR_COMM_MAPPED_BUFFER> buffers;
+		ULONG generation;
+	};
+
+	void test_races(ULONG rounds)
+	{
+		OSR_COMM_BUFFER_REGISTRY registry;
+		std::mutex lock;
+		int owners[2];
+		bool done = false;
+
+		OsrCommBufferRegistryInit(&registry);
+
+		//the service registers and unregisters through either handle
+		std::thread service([&] {
+			for (ULONG round = 0; round < rounds; ++round) {
+				Mapping* pMapping = new Mapping;
+				ULONG count = 1 + round % OSR_COMM_MAX_REGISTERED_BUFFERS;
+
+				pMapping->generation = round;
+				pMapping->buffers.resize(count);
+
+				for (ULONG i = 0; i < count; ++i) {
+					pMapping->buffers[i].Mdl = NULL;
+					pMapping->buffers[i].SystemAddress = pMapping;
+					pMapping->buffers[i].Length = round;
+				}
+
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					CHECK(OsrCommBufferRegistryAttach(&registry, &owners[round % 2], pMapping->buffers.data(), count));
+				}
+
+				SwitchToThread();
+
+				POSR_COMM_MAPPED_BUFFER buffers;
+
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					buffers = OsrCommBufferRegistryDetach(&registry, &owners[round % 2], &count);
+				}
+
+				CHECK(buffers == pMapping->buffers.data());
+
+				//unmapped: whoever still looks at it fails the checks below
+				for (ULONG i = 0; i < count; ++i) {
+					buffers[i].SystemAddress = NULL;
+					buffers[i].Length = ~0U;
+				}
+
+				delete pMapping;
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			done = true;
+		});
+
+		//writes coming in on the owner handles, naming any index
+		std::vector<std::thread> writers;
+		ULONG64 found[2] = {0, 0};
+
+		for (ULONG w = 0; w < 2; ++w) {
+			writers.emplace_back([&, w] {
+				for (ULONG i = 0;; ++i) {
+					std::lock_guard<std::mutex> guard(lock);
+
+					if (done)
+						return;
+
+					POSR_COMM_MAPPED_BUFFER pBuffer = OsrCommBufferRegistryLookup(&registry, &owners[w], i % OSR_COMM_MAX_REGISTERED_BUFFERS);
+
+					if (pBuffer) {
+						Mapping* pMapping = (Mapping*)pBuffer->SystemAddress;
+
+						CHECK(pMapping);
+						CHECK_EQUAL(pBuffer->Length, pMapping->generation);
+						CHECK(i % OSR_COMM_MAX_REGISTERED_BUFFERS < pMapping->buffers.size());
+						CHECK_EQUAL(pMapping->generation % 2, w);
+						++found[w];
+					}
+				}
+			});
+		}
+
+		service.join();
+		for (auto& writer : writers)
+			writer.join();
+
+		std::printf("%u registrations: %llu and %llu lookups found a buffer\n", rounds,
+			(unsigned long long)found[0], (unsigned long long)found[1]);
+	}
+}
+
+int main()
+{
+	test_validation();
+	test_ownership();
+	test_names();
+	test_races(500);
+
+	std::printf("buffer_registry_test: passed\n");
+	return 0;
+}
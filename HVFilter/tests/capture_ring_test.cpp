@@ -0,0 +1,276 @@
+#include <Windows.h>
+#include "../samples/passthrough/CaptureRing.h"
+#include "check.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//
+// CaptureRing.h: records wrap behind pads, a full ring drops and counts, and
+// concurrent producers with a concurrent drain lose or tear nothing.
+//
+
+namespace
+{
+	struct TestRing
+	{
+		std::vector<BYTE> data;
+		CaptureRing* pRing;
+
+		explicit TestRing(ULONG seed) : data(CAPTURE_RING_SIZE), pRing(new CaptureRing)
+		{
+			capture_ring_init(pRing, data.data(), seed);
+		}
+
+		~TestRing() { delete pRing; }
+	};
+
+	//payload byte i of record sequence of producer
+	BYTE pattern(ULONG producer, ULONG sequence, ULONG i)
+	{
+		return (BYTE)(producer * 31 + sequence * 7 + i);
+	}
+
+	ULONG record_length_of(ULONG captured)
+	{
+		return (ULONG)ALIGN_UP_BY(sizeof(HV_CAPTURE_RECORD) + captured, HV_CAPTURE_RECORD_ALIGNMENT);
+	}
+
+	//what the driver's write_record does, with the sequence in PortId
+	BOOLEAN write(CaptureRing* pRing, ULONG producer, ULONG sequence, ULONG captured)
+	{
+		LONG64 position;
+		ULONG record_length = record_length_of(captured);
+
+		PHV_CAPTURE_RECORD pRecord = capture_ring_reserve(pRing, record_length, &position);
+		if (!pRecord)
+			return FALSE;
+
+		BYTE* pData = (BYTE*)(pRecord + 1);
+		for (ULONG i = 0; i < captured; ++i)
+			pData[i] = pattern(producer, sequence, i);
+
+		pRecord->Timestamp = sequence;
+		pRecord->PortId = sequence;
+		pRecord->Direction = 0;
+		pRecord->Flags = 0;
+		pRecord->OriginalLength = captured;
+		pRecord->CapturedLength = captured;
+		pRecord->RecordLength = record_length;
+		pRecord->Cpu = producer;
+
+		++pRing->captured;
+		capture_ring_publish(pRing, position + record_length);
+		return TRUE;
+	}
+
+	//checks the records of a drained batch; next is the lowest sequence still expected from each producer
+	void check_batch(const std::vector<BYTE>& batch, const HV_CAPTURE_BATCH& header, std::vector<ULONG>& next)
+	{
+		ULONG offset = 0;
+
+		for (ULONG i = 0; i < header.Count; ++i) {
+			CHECK(offset + sizeof(HV_CAPTURE_RECORD) <= header.Length);
+
+			const HV_CAPTURE_RECORD* pRecord = (const HV_CAPTURE_RECORD*)(batch.data() + offset);
+			const BYTE* pData = (const BYTE*)(pRecord + 1);
+
+			CHECK(pRecord->Flags == 0);
+			CHECK(pRecord->Cpu < next.size());
+			CHECK_EQUAL(pRecord->RecordLength, record_length_of(pRecord->CapturedLength));
+
+			//in order; gaps are records dropped on a full ring
+			CHECK(pRecord->PortId >= next[pRecord->Cpu]);
+			next[pRecord->Cpu] = pRecord->PortId + 1;
+
+			for (ULONG b = 0; b < pRecord->CapturedLength; ++b)
+				CHECK_EQUAL(pData[b], pattern(pRecord->Cpu, pRecord->PortId, b));
+
+			offset += pRecord->RecordLength;
+		}
+
+		CHECK_EQUAL(offset, header.Length);
+	}
+
+	ULONG drain(CaptureRing* pRing, std::vector<BYTE>& batch, HV_CAPTURE_BATCH& header, BOOLEAN* pHasSpace = NULL)
+	{
+		RtlZeroMemory(&header, sizeof(header));
+
+		BYTE* pOut = batch.data();
+		ULONG space = (ULONG)batch.size();
+
+		BOOLEAN has_space = capture_ring_drain(pRing, &header, pOut, space);
+		if (pHasSpace)
+			*pHasSpace = has_space;
+
+		CHECK_EQUAL(header.Length + space, batch.size());
+		return header.Count;
+	}
+
+	void test_wrap()
+	{
+		TestRing ring(1);
+		std::vector<BYTE> batch(CAPTURE_RING_SIZE);
+		std::vector<ULONG> next(1, 0);
+		HV_CAPTURE_BATCH header;
+		ULONG sequence = 0;
+
+		//odd sizes walk the head over every alignment of the end, including rests shorter than a header
+		for (ULONG round = 0; round < 200; ++round) {
+			ULONG written = 0;
+
+			for (ULONG i = 0; i < 50; ++i) {
+				ULONG captured = (round * 131 + i * 977) % 4000;
+
+				CHECK(write(ring.pRing, 0, sequence, captured));
+				++sequence;
+				++written;
+			}
+
+			CHECK_EQUAL(drain(ring.pRing, batch, header), written);
+			check_batch(batch, header, next);
+			CHECK_EQUAL(next[0], sequence);
+		}
+
+		CHECK_EQUAL(ring.pRing->dropped, 0);
+		CHECK_EQUAL(ring.pRing->head, ring.pRing->tail);
+	}
+
+	void test_full()
+	{
+		TestRing ring(1);
+		std::vector<BYTE> batch(CAPTURE_RING_SIZE);
+		std::vector<ULONG> next(1, 0);
+		HV_CAPTURE_BATCH header;
+		ULONG captured = 1000;
+		ULONG fit = CAPTURE_RING_SIZE / record_length_of(captured);
+
+		ULONG written = 0;
+		for (ULONG sequence = 0; sequence < fit + 10; ++sequence)
+			written += write(ring.pRing, 0, sequence, captured);
+
+		CHECK_EQUAL(written, fit);
+		CHECK_EQUAL(ring.pRing->dropped, 10);
+
+		//the drain stops at the first record that does not fit, and goes on from there
+		std::vector<BYTE> small(record_length_of(captured) * 3 + 8);
+		BOOLEAN has_space;
+
+		CHECK_EQUAL(drain(ring.pRing, small, header, &has_space), 3);
+		CHECK(!has_space);
+		check_batch(small, header, next);
+
+		CHECK_EQUAL(drain(ring.pRing, batch, header, &has_space), fit - 3);
+		CHECK(has_space);
+		check_batch(batch, header, next);
+
+		//the space is back
+		CHECK(write(ring.pRing, 0, fit + 10, captured));
+	}
+
+	void test_sampling()
+	{
+		TestRing ring(0x2545F491u);
+		ULONG sample_rate = 16;
+		ULONG frames = 1600000;
+		ULONG sampled = 0;
+
+		for (ULONG i = 0; i < frames; ++i)
+			sampled += capture_ring_sample(ring.pRing, sample_rate);
+
+		CHECK_EQUAL(sampled + ring.pRing->sampled_out, frames);
+
+		//the gaps average sample_rate: within 2%
+		CHECK(sampled > frames / sample_rate * 98 / 100);
+		CHECK(sampled < frames / sample_rate * 102 / 100);
+
+		//a rate of 1 takes every frame
+		TestRing every(1);
+		for (ULONG i = 0; i < 1000; ++i)
+			CHECK(capture_ring_sample(every.pRing, 1));
+	}
+
+	//one producer per ring, like the processors, and one drain thread over all of them
+	void test_concurrent_producers()
+	{
+		const ULONG producers = 4;
+		const ULONG records = 200000;
+
+		std::vector<TestRing*> rings;
+		for (ULONG p = 0; p < producers; ++p)
+			rings.push_back(new TestRing(p + 1));
+
+		std::atomic<ULONG> running(producers);
+		std::vector<std::thread> threads;
+
+		for (ULONG p = 0; p < producers; ++p) {
+			threads.push_back(std::thread([&, p] {
+				for (ULONG sequence = 0; sequence < records; ++sequence) {
+					//on a full ring, let the drain run on machines with fewer processors than threads
+					if (!write(rings[p]->pRing, p, sequence, (sequence * 37 + p * 11) % 300))
+						std::this_thread::yield();
+				}
+
+				--running;
+			}));
+		}
+
+		//a small batch keeps the drain slower than the producers, so rings fill up and drop
+		std::vector<BYTE> batch(16 * 1024);
+		std::vector<ULONG> next(producers, 0);
+		ULONG64 drained = 0;
+		HV_CAPTURE_BATCH header;
+
+		for (;;) {
+			BOOLEAN done = running == 0;
+
+			for (ULONG p = 0; p < producers; ++p) {
+				drained += drain(rings[p]->pRing, batch, header);
+				check_batch(batch, header, next);
+			}
+
+			//one more pass after the producers stopped takes what they left
+			if (done) {
+				BOOLEAN empty = TRUE;
+
+				for (ULONG p = 0; p < producers; ++p)
+					empty = empty && rings[p]->pRing->head == rings[p]->pRing->tail;
+
+				if (empty)
+					break;
+			}
+		}
+
+		for (ULONG p = 0; p < producers; ++p)
+			threads[p].join();
+
+		ULONG64 captured = 0;
+
+		for (ULONG p = 0; p < producers; ++p) {
+			CaptureRing* pRing = rings[p]->pRing;
+
+			//every attempt was either captured or dropped
+			CHECK_EQUAL(pRing->captured + pRing->dropped, records);
+			captured += pRing->captured;
+
+			delete rings[p];
+		}
+
+		CHECK_EQUAL(drained, captured);
+
+		std::printf("concurrent producers: %llu of %llu records drained\n",
+			(unsigned long long)drained, (unsigned long long)producers * records);
+	}
+}
+
+int main()
+{
+	test_wrap();
+	test_full();
+	test_sampling();
+	test_concurrent_producers();
+
+	std::printf("capture_ring_test: passed\n");
+	return 0;
+}
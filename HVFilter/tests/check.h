@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+//
+// Test assertions: a failed CHECK reports the expression and ends the test.
+//
+
+#define CHECK(e) \
+	do { \
+		if (!(e)) { \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #e); \
+			std::exit(1); \
+		} \
+	} while (0)
+
+#define CHECK_EQUAL(a, b) \
+	do { \
+		unsigned long long _a = (unsigned long long)(a), _b = (unsigned long long)(b); \
+		if (_a != _b) { \
+			std::fprintf(stderr, "%s:%d: CHECK_EQUAL(%s, %s) failed: %llu != %llu\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+			std::exit(1); \
+		} \
+	} while (0)
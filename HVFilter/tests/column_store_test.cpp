@@ -0,0 +1,299 @@
+#include <Windows.h>
+#include "../HVTool/ColumnStore.h"
+#include "../HVTool/QueryParse.h"
+#include "check.h"
+
+#include <cstdio>
+#include <vector>
+
+//
+// ColumnStore: the records a writer adds come back from the reader, column by
+// column, with the ranges of their block right; a query scans to the records a
+// plain loop over them matches, and a block MayMatch rules out holds none.  A
+// block claiming more than STORE_BLOCK_RECORDS records is refused, and so is a
+// store shorter than its header says.  Then the arguments of hvtool query:
+// ports past 65535, signs and trailing characters are refused.
+//
+
+namespace
+{
+	const char* kPath = "column_store_test.store";
+
+	ULONG next_random(ULONG64& state)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		return (ULONG)(state >> 33);
+	}
+
+	//packets over a few hosts, ports and vPorts, in time order; addresses and ports in network byte order
+	std::vector<HV_RECORD_PACKET_DATA> make_packets(ULONG count)
+	{
+		std::vector<HV_RECORD_PACKET_DATA> packets(count);
+		ULONG64 state = 1;
+
+		for (ULONG i = 0; i < count; ++i) {
+			HV_RECORD_PACKET_DATA& packet = packets[i];
+
+			memset(&packet, 0, sizeof(packet));
+			packet.Header.Type = HV_RECORD_PACKET;
+			packet.Header.Length = (USHORT)HV_RECORD_ALIGN(HV_RECORD_PACKET_LENGTH(0));
+			packet.Header.PortId = 10 + next_random(state) % 4;
+			packet.Header.Timestamp = 1000000 + i * 10ull;
+			packet.Direction = (USHORT)(next_random(state) % 2);
+			packet.IpProtocol = next_random(state) % 2 ? 6 : 17;
+			packet.FrameLength = 64 + next_random(state) % 1450;
+			packet.SourceAddress = _byteswap_ulong(0x0A000000 | next_random(state) % 512);
+			packet.DestinationAddress = _byteswap_ulong(0xC0A80000 | next_random(state) % 64);
+			packet.SourcePort = _byteswap_ushort((USHORT)(1024 + next_random(state) % 8));
+			packet.DestinationPort = _byteswap_ushort(next_random(state) % 2 ? 443 : 65535);
+		}
+
+		return packets;
+	}
+
+	void write_store(const std::vector<HV_RECORD_PACKET_DATA>& packets)
+	{
+		ColumnStoreWriter writer;
+
+		CHECK(writer.Create(kPath));
+
+		for (const HV_RECORD_PACKET_DATA& packet : packets)
+			CHECK(writer.Add(&packet));
+
+		CHECK_EQUAL(writer.GetRecordCount(), packets.size());
+		CHECK(writer.Close());
+	}
+
+	bool matches(const HV_RECORD_PACKET_DATA& packet, const StoreQuery& query)
+	{
+		ULONG mask = query.ulPrefix ? 0xFFFFFFFF << (32 - query.ulPrefix) : 0;
+
+		if (query.bTime && (packet.Header.Timestamp < query.ullFrom || packet.Header.Timestamp > query.ullTo))
+			return false;
+
+		if (query.bPortId && packet.Header.PortId != query.ulPortId)
+			return false;
+
+		if (query.bNetwork &&
+			((_byteswap_ulong(packet.SourceAddress) ^ query.ulNetwork) & mask) &&
+			((_byteswap_ulong(packet.DestinationAddress) ^ query.ulNetwork) & mask))
+			return false;
+
+		if (query.bPort &&
+			_byteswap_ushort(packet.SourcePort) != query.usPort &&
+			_byteswap_ushort(packet.DestinationPort) != query.usPort)
+			return false;
+
+		return true;
+	}
+
+	void test_round_trip()
+	{
+		const ULONG count = 2 * STORE_BLOCK_RECORDS + 100;
+		std::vector<HV_RECORD_PACKET_DATA> packets = make_packets(count);
+		ColumnStore store;
+
+		write_store(packets);
+
+		CHECK(store.Open(kPath));
+		CHECK_EQUAL(store.GetRecordCount(), count);
+		CHECK_EQUAL(store.GetBlockCount(), 3);
+		CHECK(!store.GetBlock(3));
+
+		for (ULONG64 index = 0; index < store.GetBlockCount(); ++index) {
+			const STORE_BLOCK* pBlock = store.GetBlock(index);
+			const STORE_BLOCK_HEADER& header = pBlock->Header;
+			ULONG first = (ULONG)index * STORE_BLOCK_RECORDS;
+
+			CHECK(pBlock);
+			CHECK_EQUAL(header.RecordCount, index < 2 ? STORE_BLOCK_RECORDS : 100);
+			CHECK_EQUAL(header.MinTimestamp, packets[first].Header.Timestamp);
+			CHECK_EQUAL(header.MaxTimestamp, packets[first + header.RecordCount - 1].Header.Timestamp);
+
+			for (ULONG i = 0; i < header.RecordCount; ++i) {
+				const HV_RECORD_PACKET_DATA& packet = packets[first + i];
+
+				CHECK_EQUAL(pBlock->Timestamp[i], packet.Header.Timestamp);
+				CHECK_EQUAL(pBlock->PortId[i], packet.Header.PortId);
+				CHECK_EQUAL(pBlock->SourceAddress[i], packet.SourceAddress);
+				CHECK_EQUAL(pBlock->DestinationAddress[i], packet.DestinationAddress);
+				CHECK_EQUAL(pBlock->FrameLength[i], packet.FrameLength);
+				CHECK_EQUAL(pBlock->SourcePort[i], packet.SourcePort);
+				CHECK_EQUAL(pBlock->DestinationPort[i], packet.DestinationPort);
+				CHECK_EQUAL(pBlock->IpProtocol[i], packet.IpProtocol);
+				CHECK_EQUAL(pBlock->Direction[i], packet.Direction);
+
+				CHECK(header.MinPortId <= packet.Header.PortId && packet.Header.PortId <= header.MaxPortId);
+				CHECK(header.MinSourceAddress <= _byteswap_ulong(packet.SourceAddress));
+				CHECK(header.MaxDestinationAddress >= _byteswap_ulong(packet.DestinationAddress));
+				CHECK(header.MinDestinationPort <= _byteswap_ushort(packet.DestinationPort));
+			}
+
+			//the slots past the last record are zero
+			for (ULONG i = header.RecordCount; i < STORE_BLOCK_RECORDS; ++i)
+				CHECK_EQUAL(pBlock->Timestamp[i] | pBlock->PortId[i] | pBlock->SourcePort[i], 0);
+		}
+
+		//the first one has no filter
+		StoreQuery queries[8];
+
+		queries[1].bPort = true;
+		queries[1].usPort = 443;
+
+		queries[2].bPort = true;
+		queries[2].usPort = 65535;
+
+		queries[3].bNetwork = true;
+		queries[3].ulNetwork = 0x0A000100;
+		queries[3].ulPrefix = 24;
+
+		queries[4].bNetwork = true;
+		queries[4].ulNetwork = 0xC0A80005;
+		queries[4].ulPrefix = 32;
+
+		queries[5].bPortId = true;
+		queries[5].ulPortId = 12;
+		queries[5].bPort = true;
+		queries[5].usPort = 1027;
+
+		//splits the second block
+		queries[6].bTime = true;
+		queries[6].ullFrom = packets[STORE_BLOCK_RECORDS + 17].Header.Timestamp;
+		queries[6].ullTo = packets[STORE_BLOCK_RECORDS + 3000].Header.Timestamp;
+
+		//nothing there
+		queries[7].bNetwork = true;
+		queries[7].ulNetwork = 0x08080808;
+		queries[7].ulPrefix = 32;
+
+		std::vector<BYTE> match(STORE_BLOCK_RECORDS);
+
+		for (const StoreQuery& query : queries) {
+			ULONG64 expected = 0, found = 0;
+
+			for (const HV_RECORD_PACKET_DATA& packet : packets)
+				expected += matches(packet, query);
+
+			for (ULONG64 index = 0; index < store.GetBlockCount(); ++index) {
+				const STORE_BLOCK* pBlock = store.GetBlock(index);
+				ULONG first = (ULONG)index * STORE_BLOCK_RECORDS;
+				ULONG count = ColumnStore::Scan(pBlock, query, match.data());
+				ULONG listed = 0;
+
+				for (ULONG i = 0; i < STORE_BLOCK_RECORDS; ++i) {
+					bool hit = i < pBlock->Header.RecordCount && matches(packets[first + i], query);
+
+					CHECK_EQUAL(match[i] != 0, hit);
+					listed += hit;
+				}
+
+				CHECK_EQUAL(count, listed);
+				CHECK(count == 0 || ColumnStore::MayMatch(pBlock, query));
+
+				found += count;
+			}
+
+			CHECK_EQUAL(found, expected);
+		}
+	}
+
+	void patch(long offset, const void* pData, size_t length)
+	{
+		FILE* file = std::fopen(kPath, "r+b");
+
+		CHECK(file);
+		CHECK(std::fseek(file, offset, SEEK_SET) == 0);
+		CHECK_EQUAL(std::fwrite(pData, 1, length, file), length);
+		std::fclose(file);
+	}
+
+	void test_oversized_block()
+	{
+		write_store(make_packets(2 * STORE_BLOCK_RECORDS));
+
+		//the second block claims a record more than a block holds
+		ULONG records = STORE_BLOCK_RECORDS + 1;
+		patch(STORE_HEADER_LENGTH + sizeof(STORE_BLOCK) + FIELD_OFFSET(STORE_BLOCK_HEADER, RecordCount), &records, sizeof(records));
+
+		ColumnStore store;
+
+		CHECK(store.Open(kPath));
+		CHECK(store.GetBlock(0));
+
+		SetLastError(0);
+		CHECK(!store.GetBlock(1));
+		CHECK_EQUAL(GetLastError(), ERROR_FILE_CORRUPT);
+
+		//still refused once its window is mapped
+		CHECK(store.GetBlock(0));
+		CHECK(!store.GetBlock(1));
+		store.Close();
+
+		//a store shorter than its blocks
+		ULONG64 blocks = 3;
+		patch(FIELD_OFFSET(STORE_HEADER, BlockCount), &blocks, sizeof(blocks));
+		CHECK(!store.Open(kPath));
+
+		//and one of another block layout
+		ULONG blockRecords = STORE_BLOCK_RECORDS * 2;
+		blocks = 2;
+		patch(FIELD_OFFSET(STORE_HEADER, BlockCount), &blocks, sizeof(blocks));
+		patch(FIELD_OFFSET(STORE_HEADER, BlockRecords), &blockRecords, sizeof(blockRecords));
+		CHECK(!store.Open(kPath));
+	}
+
+	void test_empty()
+	{
+		ColumnStore store;
+
+		write_store(std::vector<HV_RECORD_PACKET_DATA>());
+
+		CHECK(store.Open(kPath));
+		CHECK_EQUAL(store.GetBlockCount(), 0);
+		CHECK(!store.GetBlock(0));
+	}
+
+	void test_arguments()
+	{
+		ULONG value = 7;
+
+		CHECK(parse_unsigned("0", 0xFFFF, &value) && value == 0);
+		CHECK(parse_unsigned("65535", 0xFFFF, &value) && value == 65535);
+		CHECK(parse_unsigned("4294967295", 0xFFFFFFFF, &value) && value == 0xFFFFFFFF);
+
+		value = 7;
+		CHECK(!parse_unsigned("65536", 0xFFFF, &value));
+		CHECK(!parse_unsigned("70000", 0xFFFF, &value));
+		CHECK(!parse_unsigned("4294967296", 0xFFFFFFFF, &value));
+		CHECK(!parse_unsigned("99999999999999999999999", 0xFFFFFFFF, &value));
+		CHECK(!parse_unsigned("-1", 0xFFFF, &value));
+		CHECK(!parse_unsigned("+80", 0xFFFF, &value));
+		CHECK(!parse_unsigned(" 80", 0xFFFF, &value));
+		CHECK(!parse_unsigned("80x", 0xFFFF, &value));
+		CHECK(!parse_unsigned("", 0xFFFF, &value));
+		CHECK_EQUAL(value, 7);
+
+		ULONG network = 0, prefix = 0;
+
+		CHECK(parse_network("10.1.2.3", &network, &prefix) && network == 0x0A010203 && prefix == 32);
+		CHECK(parse_network("192.168.0.0/16", &network, &prefix) && network == 0xC0A80000 && prefix == 16);
+		CHECK(!parse_network("10.1.2", &network, &prefix));
+		CHECK(!parse_network("10.1.2.256", &network, &prefix));
+		CHECK(!parse_network("10.1.2.3/33", &network, &prefix));
+
+		CHECK_EQUAL(parse_time("1.5"), 15000000);
+	}
+}
+
+int main()
+{
+	test_round_trip();
+	test_oversized_block();
+	test_empty();
+	test_arguments();
+
+	std::remove(kPath);
+
+	std::printf("column_store_test: passed\n");
+	return 0;
+}
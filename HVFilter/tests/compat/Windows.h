@@ -0,0 +1,331 @@
+#pragma once
+
+//
+// The few Windows types, macros and functions the portable headers of the
+// extension and the service use, on top of the GCC / Clang builtins, so the
+// tests under tests/ build on Linux.  Only what the tested headers and sources
+// need is here; it is not a general purpose emulation of the Windows API.  min
+// and max are templates: as macros they break the C++ standard headers.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef unsigned char BYTE, UCHAR, BOOLEAN, *PBYTE, *PUCHAR;
+typedef unsigned short WORD, USHORT, *PUSHORT;
+typedef int LONG, BOOL, *PLONG;
+typedef unsigned int ULONG, DWORD, UINT, *PULONG, *PDWORD;
+typedef long long LONGLONG, LONG64, *PLONG64;
+typedef unsigned long long ULONGLONG, ULONG64, DWORD64, *PULONG64;
+typedef size_t SIZE_T, ULONG_PTR;
+typedef void VOID, *PVOID, *LPVOID;
+typedef char CHAR;
+typedef LONG NTSTATUS;
+
+//only passed around by the portable headers
+typedef struct _MDL MDL, *PMDL;
+
+#define MAXULONG_PTR (~(ULONG_PTR)0)
+
+#define TRUE 1
+#define FALSE 0
+
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(status) (((NTSTATUS)(status)) >= 0)
+
+#define C_ASSERT(e) static_assert(e, #e)
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define RTL_FIELD_SIZE(type, field) (sizeof(((type*)0)->field))
+#define RTL_SIZEOF_THROUGH_FIELD(type, field) (FIELD_OFFSET(type, field) + RTL_FIELD_SIZE(type, field))
+#define ALIGN_UP_BY(length, alignment) (((ULONG_PTR)(length) + (alignment) - 1) & ~((ULONG_PTR)(alignment) - 1))
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define FORCEINLINE inline __attribute__((always_inline))
+
+#define RtlCopyMemory(destination, source, length) memcpy((destination), (source), (length))
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+
+//the Interlocked functions are full barriers, like on Windows
+inline LONG InterlockedIncrement(LONG volatile* target) { return __atomic_add_fetch(target, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(LONG volatile* target) { return __atomic_sub_fetch(target, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchange(LONG volatile* target, LONG value) { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchangeAdd(LONG volatile* target, LONG value) { return __atomic_fetch_add(target, value, __ATOMIC_SEQ_CST); }
+
+inline LONG InterlockedCompareExchange(LONG volatile* target, LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline LONG64 InterlockedIncrement64(LONG64 volatile* target) { return __atomic_add_fetch(target, 1, __ATOMIC_SEQ_CST); }
+inline LONG64 InterlockedExchange64(LONG64 volatile* target, LONG64 value) { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+inline LONG64 InterlockedExchangeAdd64(LONG64 volatile* target, LONG64 value) { return __atomic_fetch_add(target, value, __ATOMIC_SEQ_CST); }
+
+inline LONG64 InterlockedCompareExchange64(LONG64 volatile* target, LONG64 exchange, LONG64 comparand)
+{
+	__atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile* target, PVOID value) { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* target, PVOID exchange, PVOID comparand)
+{
+	__atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor() __builtin_ia32_pause()
+#else
+#define YieldProcessor() __asm__ __volatile__("" ::: "memory")
+#endif
+inline BOOL SwitchToThread() { return sched_yield() == 0; }
+
+inline DWORD GetTickCount()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (DWORD)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+//recursive, like on Windows
+typedef pthread_mutex_t CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+inline VOID InitializeCriticalSection(LPCRITICAL_SECTION section)
+{
+	pthread_mutexattr_t attributes;
+
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(section, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+}
+
+inline VOID DeleteCriticalSection(LPCRITICAL_SECTION section) { pthread_mutex_destroy(section); }
+inline VOID EnterCriticalSection(LPCRITICAL_SECTION section) { pthread_mutex_lock(section); }
+inline VOID LeaveCriticalSection(LPCRITICAL_SECTION section) { pthread_mutex_unlock(section); }
+
+#define PAGE_SIZE 4096
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+//interlocked singly linked lists: the head and a depth and sequence swapped together, as on x64 Windows (needs -mcx16)
+typedef struct _SLIST_ENTRY
+{
+	struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef union __attribute__((aligned(16))) _SLIST_HEADER
+{
+	struct
+	{
+		PSLIST_ENTRY Next;
+
+		//depth in the low 16 bits, a sequence above, so a pop racing a pop and a push fails
+		ULONG64 DepthAndSequence;
+	} Header;
+
+	unsigned __int128 Value;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+inline VOID InitializeSListHead(PSLIST_HEADER head) { head->Value = 0; }
+
+inline USHORT QueryDepthSList(PSLIST_HEADER head) { return (USHORT)__atomic_load_n(&head->Header.DepthAndSequence, __ATOMIC_RELAXED); }
+
+inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry)
+{
+	SLIST_HEADER current, next;
+
+	do {
+		current.Header.Next = __atomic_load_n(&head->Header.Next, __ATOMIC_RELAXED);
+		current.Header.DepthAndSequence = __atomic_load_n(&head->Header.DepthAndSequence, __ATOMIC_RELAXED);
+
+		entry->Next = current.Header.Next;
+		next.Header.Next = entry;
+		next.Header.DepthAndSequence = current.Header.DepthAndSequence + 0x10001;
+	} while (!__sync_bool_compare_and_swap(&head->Value, current.Value, next.Value));
+
+	return current.Header.Next;
+}
+
+//the entries' memory must stay mapped: a racing pop may read the link of an entry already taken
+inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head)
+{
+	SLIST_HEADER current, next;
+
+	do {
+		current.Header.Next = __atomic_load_n(&head->Header.Next, __ATOMIC_RELAXED);
+		current.Header.DepthAndSequence = __atomic_load_n(&head->Header.DepthAndSequence, __ATOMIC_RELAXED);
+
+		if (!current.Header.Next)
+			return NULL;
+
+		next.Header.Next = __atomic_load_n(&current.Header.Next->Next, __ATOMIC_RELAXED);
+		next.Header.DepthAndSequence = current.Header.DepthAndSequence - 1 + 0x10000;
+	} while (!__sync_bool_compare_and_swap(&head->Value, current.Value, next.Value));
+
+	return current.Header.Next;
+}
+
+template <typename T> inline T min(T a, T b) { return b < a ? b : a; }
+template <typename T> inline T max(T a, T b) { return a < b ? b : a; }
+
+#define _countof(array) (sizeof(array) / sizeof((array)[0]))
+#define _byteswap_ushort(value) __builtin_bswap16(value)
+#define _byteswap_ulong(value) __builtin_bswap32(value)
+#define sscanf_s sscanf
+
+//files, their mappings and VirtualAlloc: the ones ColumnStore.cpp uses
+typedef void* HANDLE;
+typedef union _LARGE_INTEGER { LONGLONG QuadPart; } LARGE_INTEGER, *PLARGE_INTEGER;
+typedef struct _SECURITY_ATTRIBUTES* LPSECURITY_ATTRIBUTES;
+typedef struct _OVERLAPPED* LPOVERLAPPED;
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+#define ERROR_FILE_CORRUPT 1392L
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_BEGIN 0
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_READ 0x4
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+
+inline DWORD& compat_last_error()
+{
+	static thread_local DWORD error;
+	return error;
+}
+
+inline DWORD GetLastError() { return compat_last_error(); }
+inline VOID SetLastError(DWORD error) { compat_last_error() = error; }
+
+//a handle is a file descriptor plus one, so that none is NULL
+inline HANDLE compat_handle(int fd) { return (HANDLE)(intptr_t)(fd + 1); }
+inline int compat_fd(HANDLE handle) { return (int)(intptr_t)handle - 1; }
+
+inline BOOL compat_result(bool success)
+{
+	if (!success)
+		SetLastError((DWORD)errno);
+	return success;
+}
+
+inline HANDLE CreateFileA(const char* path, DWORD access, DWORD, LPSECURITY_ATTRIBUTES, DWORD disposition, DWORD, HANDLE)
+{
+	int flags = (access & GENERIC_WRITE) ? ((access & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+	int fd = open(path, flags | (disposition == CREATE_ALWAYS ? O_CREAT | O_TRUNC : 0), 0644);
+
+	return compat_result(fd >= 0) ? compat_handle(fd) : INVALID_HANDLE_VALUE;
+}
+
+inline BOOL CloseHandle(HANDLE handle) { return compat_result(close(compat_fd(handle)) == 0); }
+
+inline BOOL ReadFile(HANDLE file, PVOID buffer, DWORD length, PDWORD read, LPOVERLAPPED)
+{
+	ssize_t result = ::read(compat_fd(file), buffer, length);
+
+	*read = result > 0 ? (DWORD)result : 0;
+	return compat_result(result >= 0);
+}
+
+inline BOOL WriteFile(HANDLE file, const VOID* buffer, DWORD length, PDWORD written, LPOVERLAPPED)
+{
+	ssize_t result = ::write(compat_fd(file), buffer, length);
+
+	*written = result > 0 ? (DWORD)result : 0;
+	return compat_result(result >= 0);
+}
+
+inline BOOL SetFilePointerEx(HANDLE file, LARGE_INTEGER distance, PLARGE_INTEGER, DWORD)
+{
+	return compat_result(lseek(compat_fd(file), distance.QuadPart, SEEK_SET) >= 0);
+}
+
+inline BOOL GetFileSizeEx(HANDLE file, PLARGE_INTEGER size)
+{
+	struct stat status;
+
+	if (!compat_result(fstat(compat_fd(file), &status) == 0))
+		return FALSE;
+
+	size->QuadPart = status.st_size;
+	return TRUE;
+}
+
+//the mapping is the file again; views are mmap'ed from it, read only
+inline HANDLE CreateFileMapping(HANDLE file, LPSECURITY_ATTRIBUTES, DWORD, DWORD, DWORD, const VOID*)
+{
+	int fd = dup(compat_fd(file));
+
+	return compat_result(fd >= 0) ? compat_handle(fd) : NULL;
+}
+
+//munmap wants the length back: a view starts a page after the one that keeps it
+inline PVOID MapViewOfFile(HANDLE mapping, DWORD, DWORD offsetHigh, DWORD offsetLow, SIZE_T length)
+{
+	off_t offset = (off_t)((ULONG64)offsetHigh << 32 | offsetLow);
+	void* area = mmap(NULL, length + PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (!compat_result(area != MAP_FAILED))
+		return NULL;
+
+	if (!compat_result(mmap((BYTE*)area + PAGE_SIZE, length, PROT_READ, MAP_SHARED | MAP_FIXED, compat_fd(mapping), offset) != MAP_FAILED) ||
+		!compat_result(mprotect(area, PAGE_SIZE, PROT_READ | PROT_WRITE) == 0)) {
+		munmap(area, length + PAGE_SIZE);
+		return NULL;
+	}
+
+	*(SIZE_T*)area = length;
+	return (BYTE*)area + PAGE_SIZE;
+}
+
+inline BOOL UnmapViewOfFile(const VOID* view)
+{
+	BYTE* area = (BYTE*)view - PAGE_SIZE;
+
+	return compat_result(munmap(area, *(SIZE_T*)area + PAGE_SIZE) == 0);
+}
+
+//zeroed, 64KB aligned like the allocation granularity
+inline PVOID VirtualAlloc(PVOID, SIZE_T length, DWORD, DWORD)
+{
+	void* memory = aligned_alloc(64 * 1024, (length + 64 * 1024 - 1) & ~(SIZE_T)(64 * 1024 - 1));
+
+	if (memory)
+		memset(memory, 0, length);
+	return memory;
+}
+
+inline BOOL VirtualFree(PVOID memory, SIZE_T, DWORD)
+{
+	free(memory);
+	return TRUE;
+}
@@ -0,0 +1,158 @@
+#include <Windows.h>
+#include <cstring>
+#include "../HVService/HVService/HVStats.h"
+#include "../HVService/HVService/HVCounters.h"
+#include "check.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//
+// HVCounters.h: HvCountersSnapshot gives up on a page that was never
+// written, and on one the driver stays halfway through; then one writer
+// publishing the page the way the driver does (samples/passthrough/
+// CountersPage.cpp), every counter set to the number of the publish, and
+// readers taking snapshots meanwhile with HV_COUNTERS_BARRIER as it is built
+// here: no snapshot mixes two publishes, its Sequence is that of its counters,
+// and a reader's snapshots never go back.  Nobody yields, so that threads are
+// preempted halfway through their copies even on a single processor.
+//
+
+namespace
+{
+	const ULONG kAttempts = 64;
+
+	//every counter of the page, through a callback
+	template<typename F>
+	void for_each_counter(HV_COUNTERS_PAGE* pPage, F f)
+	{
+		for (ULONG slot = 0; slot < HV_STATS_PORT_SLOTS; ++slot) {
+			for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+				f(pPage->Ports[slot].Direction[direction].Frames);
+				f(pPage->Ports[slot].Direction[direction].Bytes);
+			}
+		}
+
+		for (ULONG protocol = 0; protocol < HV_COUNTERS_PROTOCOLS; ++protocol) {
+			for (ULONG direction = 0; direction < HV_STATS_DIRECTIONS; ++direction) {
+				f(pPage->Protocols[protocol][direction].Frames);
+				f(pPage->Protocols[protocol][direction].Bytes);
+			}
+		}
+
+		f(pPage->Drops.RingRecords);
+		f(pPage->Drops.CaptureRecords);
+	}
+
+	//CountersPage.cpp's publish: odd for the copy only, interlocked on both sides
+	void publish(HV_COUNTERS_PAGE* pPage, HV_COUNTERS_PAGE* pTotals, LONG* pSequence, ULONG64 number)
+	{
+		pTotals->Timestamp = number;
+		for_each_counter(pTotals, [number](ULONG64& counter) { counter = number; });
+
+		InterlockedExchange(&pPage->Sequence, ++*pSequence);
+
+		memcpy((BYTE*)pPage + sizeof(LONG), (BYTE*)pTotals + sizeof(LONG), sizeof(HV_COUNTERS_PAGE) - sizeof(LONG));
+
+		InterlockedExchange(&pPage->Sequence, ++*pSequence);
+	}
+
+	void test_unwritten()
+	{
+		std::unique_ptr<HV_COUNTERS_PAGE> page(new HV_COUNTERS_PAGE());
+		std::unique_ptr<HV_COUNTERS_PAGE> snapshot(new HV_COUNTERS_PAGE());
+
+		//never published
+		CHECK(!HvCountersSnapshot(page.get(), snapshot.get(), kAttempts));
+
+		//a writer that stopped halfway
+		page->Sequence = 3;
+		CHECK(!HvCountersSnapshot(page.get(), snapshot.get(), kAttempts));
+
+		page->Sequence = 4;
+		page->Timestamp = 2;
+		CHECK(HvCountersSnapshot(page.get(), snapshot.get(), 1));
+		CHECK_EQUAL(snapshot->Sequence, 4);
+		CHECK_EQUAL(snapshot->Timestamp, 2);
+	}
+
+	void reader(const HV_COUNTERS_PAGE* pPage, std::atomic<bool>* pDone, ULONG64* pSnapshots, ULONG64* pFailed)
+	{
+		std::unique_ptr<HV_COUNTERS_PAGE> snapshot(new HV_COUNTERS_PAGE());
+		ULONG64 last = 0, snapshots = 0, failed = 0;
+
+		while (!pDone->load()) {
+			if (!HvCountersSnapshot(pPage, snapshot.get(), kAttempts)) {
+				++failed;
+				continue;
+			}
+
+			ULONG64 number = snapshot->Timestamp;
+
+			CHECK_EQUAL(snapshot->Sequence, 2 * number);
+			CHECK(number >= last);
+			last = number;
+
+			for_each_counter(snapshot.get(), [number](ULONG64& counter) { CHECK_EQUAL(counter, number); });
+
+			++snapshots;
+		}
+
+		*pSnapshots = snapshots;
+		*pFailed = failed;
+	}
+
+	void test_readers(ULONG readers, double seconds)
+	{
+		std::unique_ptr<HV_COUNTERS_PAGE> page(new HV_COUNTERS_PAGE());
+		std::unique_ptr<HV_COUNTERS_PAGE> totals(new HV_COUNTERS_PAGE());
+		std::atomic<bool> done(false);
+		std::vector<ULONG64> snapshots(readers), failed(readers);
+		std::vector<std::thread> threads;
+		LONG sequence = 0;
+		ULONG64 publishes = 0;
+
+		publish(page.get(), totals.get(), &sequence, ++publishes);
+
+		for (ULONG i = 0; i < readers; ++i)
+			threads.emplace_back(reader, page.get(), &done, &snapshots[i], &failed[i]);
+
+		auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+
+		while (std::chrono::steady_clock::now() < end)
+			publish(page.get(), totals.get(), &sequence, ++publishes);
+
+		done = true;
+
+		ULONG64 total = 0, total_failed = 0;
+
+		for (ULONG i = 0; i < readers; ++i) {
+			threads[i].join();
+			total += snapshots[i];
+			total_failed += failed[i];
+		}
+
+		std::unique_ptr<HV_COUNTERS_PAGE> snapshot(new HV_COUNTERS_PAGE());
+
+		CHECK(HvCountersSnapshot(page.get(), snapshot.get(), 1));
+		CHECK_EQUAL(snapshot->Timestamp, publishes);
+
+		std::printf("%u readers, %llu publishes: %llu snapshots, none torn, %llu gave up\n", readers,
+			(unsigned long long)publishes, (unsigned long long)total, (unsigned long long)total_failed);
+	}
+}
+
+int main()
+{
+	test_unwritten();
+
+	test_readers(1, 0.3);
+	test_readers(4, 0.3);
+	test_readers(16, 0.3);
+
+	std::printf("counters_page_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,194 @@
+#include <Windows.h>
+#include "../Pipes/PipeServer.h"
+#include "standin_transport.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//
+// Fan-out of the counter stream over Unix domain sockets: one producer
+// writing records as fast as it can for a while, to 1 to PIPE_MAX_CLIENTS
+// readers.  Reports records written per second, the cost of a Write to the
+// producer, frames per reader, and the share of the records the readers got
+// and lost to drop-oldest.
+//
+// usage: pipe_fanout_bench [seconds per run]
+//
+
+namespace
+{
+	const char* kPath = "pipe_fanout_bench.sock";
+
+	//one flow frame per reader, so it knows when the server has it
+	struct Exporter
+	{
+		bool sent;
+		BYTE frame[sizeof(PIPE_FRAME_HEADER)];
+	};
+
+	void* open_flows(void*)
+	{
+		Exporter* pExporter = new Exporter;
+
+		pExporter->sent = false;
+		return pExporter;
+	}
+
+	void* export_flows(void* exporter, unsigned long* pLength)
+	{
+		Exporter* pExporter = (Exporter*)exporter;
+
+		if (pExporter->sent)
+			return NULL;
+
+		pExporter->sent = true;
+		*pLength = sizeof(pExporter->frame);
+		return pExporter->frame;
+	}
+
+	void close_flows(void* exporter)
+	{
+		delete (Exporter*)exporter;
+	}
+
+	bool read_exact(int fd, void* pBuffer, size_t length)
+	{
+		BYTE* pTarget = (BYTE*)pBuffer;
+
+		while (length) {
+			ssize_t received = recv(fd, pTarget, length, 0);
+
+			if (received <= 0)
+				return false;
+
+			pTarget += received;
+			length -= received;
+		}
+
+		return true;
+	}
+
+	struct ReaderResult
+	{
+		ULONG64 received;
+		ULONG64 dropped;
+		ULONG64 frames;
+	};
+
+	//reads until the record of count last
+	void reader(int fd, ULONG64 last, ReaderResult* pResult)
+	{
+		PIPE_FRAME_HEADER header;
+		PIPE_COUNTERS records[PIPE_FRAME_MAX_RECORDS];
+		ULONG64 latest = 0;
+
+		pResult->received = pResult->dropped = pResult->frames = 0;
+
+		while (latest != last) {
+			if (!read_exact(fd, &header, sizeof(header)) ||
+				header.Magic != PIPE_FRAME_MAGIC || header.RecordCount > PIPE_FRAME_MAX_RECORDS ||
+				!read_exact(fd, records, header.RecordCount * sizeof(PIPE_COUNTERS))) {
+				std::fprintf(stderr, "bad frame\n");
+				std::exit(1);
+			}
+
+			latest = records[header.RecordCount - 1].Count;
+			pResult->received += header.RecordCount;
+			pResult->dropped += header.Dropped;
+			++pResult->frames;
+		}
+
+		close(fd);
+	}
+
+	void run(ULONG readers, double seconds)
+	{
+		PIPE_FLOW_EXPORT flows = {open_flows, export_flows, close_flows, NULL};
+		standin::SocketTransport transport(kPath);
+
+		if (!transport.open()) {
+			std::fprintf(stderr, "could not listen on %s\n", kPath);
+			std::exit(1);
+		}
+
+		std::unique_ptr<PipeServer> server(new PipeServer(transport, &flows));
+		std::thread thread(&PipeServer::Run, server.get());
+		std::vector<int> fds;
+
+		for (ULONG i = 0; i < readers; ++i) {
+			PIPE_FRAME_HEADER header;
+			int fd = standin::SocketTransport::connect_reader(kPath);
+
+			if (fd < 0 || !read_exact(fd, &header, sizeof(header))) {
+				std::fprintf(stderr, "could not connect\n");
+				std::exit(1);
+			}
+
+			fds.push_back(fd);
+		}
+
+		//the readers learn the last count once the producer is done
+		std::vector<ReaderResult> results(readers);
+		std::vector<std::thread> threads;
+		std::atomic<ULONG64> last{0};
+		ULONG64 count = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::duration<double>(seconds);
+
+		for (ULONG i = 0; i < readers; ++i)
+			threads.emplace_back([&, i] {
+				while (!last)
+					SwitchToThread();
+				reader(fds[i], last, &results[i]);
+			});
+
+		while (std::chrono::steady_clock::now() < end) {
+			for (int i = 0; i < 64; ++i) {
+				PIPE_COUNTERS record = {++count, count, count * 100};
+
+				server->Write(record);
+			}
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		last = count;
+
+		for (auto& thread : threads)
+			thread.join();
+
+		transport.Stop();
+		thread.join();
+
+		ULONG64 received = 0, dropped = 0, frames = 0;
+
+		for (const ReaderResult& result : results) {
+			received += result.received;
+			dropped += result.dropped;
+			frames += result.frames;
+		}
+
+		std::printf("%8u %14.2f %12.1f %14.0f %11.2f%% %11.2f%%\n", readers,
+			count / elapsed.count() / 1e6, elapsed.count() * 1e9 / count,
+			(double)frames / readers,
+			100.0 * received / (count * readers), 100.0 * dropped / (count * readers));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+
+	std::printf("%u processors, %.1f s per run\n", std::thread::hardware_concurrency(), seconds);
+	std::printf("%8s %14s %12s %14s %12s %12s\n", "readers", "written M/s", "ns/write", "frames/reader", "received", "dropped");
+
+	for (ULONG readers = 1; readers <= PIPE_MAX_CLIENTS; readers *= 2)
+		run(readers, seconds);
+
+	return 0;
+}
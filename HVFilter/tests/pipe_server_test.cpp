@@ -0,0 +1,314 @@
+#include <Windows.h>
+#include "../Pipes/PipeServer.h"
+#include "standin_transport.h"
+#include "check.h"
+
+#include <sys/time.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//
+// PipeServer over Unix domain sockets.  Readers that keep up, and one that
+// reads nothing until the producer is done, get every record either in a
+// frame or counted as dropped, in order, with the gap before a frame equal
+// to its Dropped, and always the latest record.  With no records at all the
+// flows still go out every PIPE_FLOW_INTERVAL ms.  Readers that come and go
+// reuse the slots, and every flow exporter opened is closed.
+//
+
+namespace
+{
+	const char* kPath = "pipe_server_test.sock";
+
+	//a flow exporter whose frames carry how many it exported
+	struct FlowCounts
+	{
+		std::atomic<int> opened{0};
+		std::atomic<int> closed{0};
+	};
+
+	struct Exporter
+	{
+		FlowCounts* counts;
+		ULONG64 exports;
+		BYTE frame[sizeof(PIPE_FRAME_HEADER) + sizeof(ULONG64)];
+	};
+
+	void* open_flows(void* context)
+	{
+		Exporter* pExporter = new Exporter;
+
+		pExporter->counts = (FlowCounts*)context;
+		pExporter->exports = 0;
+		++pExporter->counts->opened;
+		return pExporter;
+	}
+
+	void* export_flows(void* exporter, unsigned long* pLength)
+	{
+		Exporter* pExporter = (Exporter*)exporter;
+		ULONG64 exports = ++pExporter->exports;
+
+		memcpy(pExporter->frame + sizeof(PIPE_FRAME_HEADER), &exports, sizeof(exports));
+		*pLength = sizeof(pExporter->frame);
+		return pExporter->frame;
+	}
+
+	void close_flows(void* exporter)
+	{
+		Exporter* pExporter = (Exporter*)exporter;
+
+		++pExporter->counts->closed;
+		delete pExporter;
+	}
+
+	//the server and its thread, for one test
+	class Server
+	{
+	public:
+		explicit Server(FlowCounts* pCounts) : m_transport(kPath)
+		{
+			PIPE_FLOW_EXPORT flows = {open_flows, export_flows, close_flows, pCounts};
+
+			CHECK(m_transport.open());
+			m_server.reset(new PipeServer(m_transport, &flows));
+			m_thread = std::thread(&PipeServer::Run, m_server.get());
+		}
+
+		~Server()
+		{
+			m_transport.Stop();
+			m_thread.join();
+			m_server.reset();
+		}
+
+		void write(ULONG64 count)
+		{
+			PIPE_COUNTERS record = {count * 10, count, count * 100};
+
+			m_server->Write(record);
+		}
+
+	private:
+		standin::SocketTransport m_transport;
+		std::unique_ptr<PipeServer> m_server;
+		std::thread m_thread;
+	};
+
+	bool read_exact(int fd, void* pBuffer, size_t length)
+	{
+		BYTE* pTarget = (BYTE*)pBuffer;
+
+		while (length) {
+			ssize_t received = recv(fd, pTarget, length, 0);
+
+			if (received <= 0)
+				return false;
+
+			pTarget += received;
+			length -= received;
+		}
+
+		return true;
+	}
+
+	//the next frame; flow frames return their export number in *pExport, records in records
+	bool read_frame(int fd, PIPE_FRAME_HEADER* pHeader, std::vector<PIPE_COUNTERS>& records, ULONG64* pExport)
+	{
+		if (!read_exact(fd, pHeader, sizeof(*pHeader)))
+			return false;
+
+		records.clear();
+
+		if (pHeader->Magic == PIPE_FLOW_FRAME_MAGIC) {
+			CHECK_EQUAL(pHeader->Length, sizeof(*pHeader) + sizeof(ULONG64));
+			return read_exact(fd, pExport, sizeof(*pExport));
+		}
+
+		CHECK_EQUAL(pHeader->Magic, PIPE_FRAME_MAGIC);
+		CHECK(pHeader->RecordCount >= 1 && pHeader->RecordCount <= PIPE_FRAME_MAX_RECORDS);
+		CHECK_EQUAL(pHeader->Length, sizeof(*pHeader) + pHeader->RecordCount * sizeof(PIPE_COUNTERS));
+
+		records.resize(pHeader->RecordCount);
+		return read_exact(fd, records.data(), pHeader->RecordCount * sizeof(PIPE_COUNTERS));
+	}
+
+	//connected once the first flow frame is in: the server has the reader by then
+	int connect_reader()
+	{
+		PIPE_FRAME_HEADER header;
+		std::vector<PIPE_COUNTERS> records;
+		ULONG64 exported = 0;
+		int fd = standin::SocketTransport::connect_reader(kPath);
+
+		CHECK(fd >= 0);
+		CHECK(read_frame(fd, &header, records, &exported));
+		CHECK_EQUAL(header.Magic, PIPE_FLOW_FRAME_MAGIC);
+		CHECK_EQUAL(exported, 1);
+
+		return fd;
+	}
+
+	struct ReaderResult
+	{
+		ULONG64 received;
+		ULONG64 dropped;
+	};
+
+	//reads until record last; every record is in a frame or counted as dropped, in order
+	void reader(int fd, ULONG64 last, ReaderResult* pResult)
+	{
+		PIPE_FRAME_HEADER header;
+		std::vector<PIPE_COUNTERS> records;
+		ULONG64 exported = 0, previous = 0;
+
+		pResult->received = pResult->dropped = 0;
+
+		while (previous != last) {
+			CHECK(read_frame(fd, &header, records, &exported));
+
+			if (header.Magic == PIPE_FLOW_FRAME_MAGIC)
+				continue;
+
+			//the records dropped are the ones between the previous frame and this one
+			CHECK_EQUAL(records[0].Count - previous - 1, header.Dropped);
+
+			for (const PIPE_COUNTERS& record : records) {
+				CHECK(record.Count > previous);
+				CHECK_EQUAL(record.Size, record.Count * 100);
+				CHECK(record.Count == previous + 1 || &record == &records[0]);
+				previous = record.Count;
+			}
+
+			pResult->received += records.size();
+			pResult->dropped += header.Dropped;
+		}
+
+		CHECK_EQUAL(pResult->received + pResult->dropped, last);
+		close(fd);
+	}
+
+	void test_fan_out(ULONG readers, ULONG64 records)
+	{
+		FlowCounts counts;
+
+		{
+			Server server(&counts);
+			std::vector<ReaderResult> results(readers + 1);
+			std::vector<std::thread> threads;
+
+			for (ULONG i = 0; i < readers; ++i)
+				threads.emplace_back(reader, connect_reader(), records, &results[i]);
+
+			//connected, but reads nothing until the producer is done
+			int slow = connect_reader();
+
+			for (ULONG64 count = 1; count <= records; ++count) {
+				server.write(count);
+
+				//one processor is enough: let the server and the readers run
+				if (count % 32 == 0)
+					SwitchToThread();
+			}
+
+			reader(slow, records, &results[readers]);
+
+			for (auto& thread : threads)
+				thread.join();
+
+			for (ULONG i = 0; i < readers; ++i)
+				std::printf("reader %u: %llu records, %llu dropped\n", i,
+					(unsigned long long)results[i].received, (unsigned long long)results[i].dropped);
+
+			std::printf("slow reader: %llu records, %llu dropped\n",
+				(unsigned long long)results[readers].received, (unsigned long long)results[readers].dropped);
+
+			//its socket and its queue hold far less than that
+			CHECK(results[readers].dropped > 0);
+		}
+
+		CHECK_EQUAL(counts.opened, readers + 1);
+		CHECK_EQUAL(counts.closed, readers + 1);
+	}
+
+	//no records: the flows go out on the clock
+	void test_flow_interval()
+	{
+		FlowCounts counts;
+		Server server(&counts);
+		int fd = connect_reader();
+		timeval timeout = {3 * PIPE_FLOW_INTERVAL / 1000, 0};
+		PIPE_FRAME_HEADER header;
+		std::vector<PIPE_COUNTERS> records;
+		ULONG64 exported = 0;
+
+		//a server waiting for records only would never send them
+		CHECK(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0);
+
+		for (ULONG64 expected = 2; expected <= 3; ++expected) {
+			auto start = std::chrono::steady_clock::now();
+
+			CHECK(read_frame(fd, &header, records, &exported));
+			CHECK_EQUAL(header.Magic, PIPE_FLOW_FRAME_MAGIC);
+			CHECK_EQUAL(exported, expected);
+
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+			CHECK(elapsed.count() >= PIPE_FLOW_INTERVAL / 2 && elapsed.count() < 2 * PIPE_FLOW_INTERVAL);
+		}
+
+		close(fd);
+	}
+
+	//readers that come and go: the slots are reused, and their exporters closed
+	void test_reconnect()
+	{
+		FlowCounts counts;
+
+		{
+			Server server(&counts);
+			std::vector<int> held;
+
+			//every slot taken, then given back and taken again
+			for (int round = 0; round < 3; ++round) {
+				for (int i = 0; i < PIPE_MAX_CLIENTS; ++i)
+					held.push_back(connect_reader());
+
+				for (int fd : held)
+					close(fd);
+
+				held.clear();
+
+				while (counts.closed != (round + 1) * PIPE_MAX_CLIENTS)
+					SwitchToThread();
+			}
+
+			//and records still reach a reader
+			ReaderResult result;
+			int fd = connect_reader();
+
+			for (ULONG64 count = 1; count <= 100; ++count)
+				server.write(count);
+
+			reader(fd, 100, &result);
+		}
+
+		CHECK_EQUAL(counts.opened, 3 * PIPE_MAX_CLIENTS + 1);
+		CHECK_EQUAL(counts.closed, counts.opened);
+	}
+}
+
+int main()
+{
+	test_fan_out(1, 20000);
+	test_fan_out(4, 50000);
+	test_flow_interval();
+	test_reconnect();
+
+	std::printf("pipe_server_test: passed\n");
+	return 0;
+}
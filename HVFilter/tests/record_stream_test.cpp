@@ -0,0 +1,260 @@
+#include <Windows.h>
+#include "../HVService/HVService/HVRecord.h"
+#include "../HVService/HVService/HVStats.h"
+#include "check.h"
+
+#include <cstring>
+#include <vector>
+
+//
+// HVRecord.h: what the writer appends comes back from the reader as it was
+// written, records a reader does not know are skipped by their length, a
+// record that does not fit is refused, and a stream cut short, a bad header
+// or a bad record length never reads past the buffer.  Type 2, the flow
+// records the driver no longer writes, is one of the unknown ones.
+//
+
+namespace
+{
+	//a stream of every record type, and a record of a type no reader knows in the middle
+	ULONG write_stream(std::vector<ULONG64>& storage)
+	{
+		HV_RECORD_WRITER writer;
+		const UCHAR payload[5] = {1, 2, 3, 4, 5};
+
+		CHECK(HvRecordWriterInit(&writer, storage.data(), (ULONG)(storage.size() * sizeof(ULONG64))));
+
+		PHV_RECORD_PACKET_DATA pPacket = (PHV_RECORD_PACKET_DATA)HvRecordAppend(&writer, HV_RECORD_PACKET,
+			HV_RECORD_PACKET_LENGTH(sizeof(payload)), 7, 1000);
+		CHECK(pPacket);
+		pPacket->Direction = HV_STATS_DIRECTION_OUTBOUND;
+		pPacket->EtherType = 0x0800;
+		pPacket->IpProtocol = 6;
+		pPacket->FrameLength = 1514;
+		pPacket->SourcePort = 80;
+		pPacket->PayloadLength = sizeof(payload);
+		std::memcpy(pPacket->Payload, payload, sizeof(payload));
+
+		//the flow records of version 1 drivers
+		CHECK(HvRecordAppend(&writer, 2, sizeof(HV_RECORD_HEADER) + 40, 7, 1001));
+
+		PHV_RECORD_COUNTERS_DATA pCounters = (PHV_RECORD_COUNTERS_DATA)HvRecordAppend(&writer, HV_RECORD_COUNTERS,
+			sizeof(HV_RECORD_COUNTERS_DATA), HV_STATS_UNKNOWN_PORT_ID, 1002);
+		CHECK(pCounters);
+		pCounters->Direction = HV_RECORD_DIRECTION_SWITCH;
+		pCounters->Dropped = 12;
+
+		PHV_RECORD_HISTOGRAM_DATA pHistogram = (PHV_RECORD_HISTOGRAM_DATA)HvRecordAppend(&writer, HV_RECORD_HISTOGRAM,
+			HV_RECORD_HISTOGRAM_LENGTH(3), 8, 1003);
+		CHECK(pHistogram);
+		pHistogram->Direction = HV_STATS_DIRECTION_INBOUND;
+		pHistogram->Kind = HV_RECORD_HISTOGRAM_GAP;
+		pHistogram->BucketCount = 3;
+		pHistogram->Buckets[2] = 99;
+
+		PHV_RECORD_EVENT_DATA pEvent = (PHV_RECORD_EVENT_DATA)HvRecordAppend(&writer, HV_RECORD_EVENT,
+			sizeof(HV_RECORD_EVENT_DATA), 8, 1004);
+		CHECK(pEvent);
+		pEvent->Code = HV_RECORD_EVENT_MICROBURST;
+		pEvent->Value[0] = 64000;
+		pEvent->Value[1] = 42;
+
+		return HvRecordWriterFinish(&writer);
+	}
+
+	//the records the reader returns, by type; 0 if the stream was refused
+	std::vector<USHORT> read_types(const void* pStream, ULONG length)
+	{
+		HV_RECORD_READER reader;
+		std::vector<USHORT> types;
+
+		if (!HvRecordReaderInit(&reader, pStream, length))
+			return types;
+
+		for (const HV_RECORD_HEADER* pRecord = HvRecordNext(&reader); pRecord; pRecord = HvRecordNext(&reader)) {
+			CHECK((const UCHAR*)pRecord + pRecord->Length <= (const UCHAR*)pStream + length);
+			types.push_back(pRecord->Type);
+		}
+
+		return types;
+	}
+
+	void test_round_trip()
+	{
+		std::vector<ULONG64> storage(128);
+		ULONG length = write_stream(storage);
+		const HV_RECORD_STREAM* pHeader = (const HV_RECORD_STREAM*)storage.data();
+
+		CHECK_EQUAL(pHeader->Length, length);
+		CHECK_EQUAL(pHeader->RecordCount, 5);
+		CHECK_EQUAL(length % HV_RECORD_ALIGNMENT, 0);
+
+		HV_RECORD_READER reader;
+		const HV_RECORD_HEADER* pRecord;
+
+		CHECK(HvRecordReaderInit(&reader, storage.data(), (ULONG)(storage.size() * sizeof(ULONG64))));
+
+		pRecord = HvRecordNext(&reader);
+		CHECK(pRecord && pRecord->Type == HV_RECORD_PACKET);
+		CHECK_EQUAL(pRecord->Length, HV_RECORD_ALIGN(HV_RECORD_PACKET_LENGTH(5)));
+		CHECK_EQUAL(pRecord->PortId, 7);
+		CHECK_EQUAL(pRecord->Timestamp, 1000);
+		CHECK(HV_RECORD_HOLDS(pRecord, HV_RECORD_PACKET_DATA, PayloadLength));
+
+		const HV_RECORD_PACKET_DATA* pPacket = (const HV_RECORD_PACKET_DATA*)pRecord;
+		CHECK_EQUAL(pPacket->Direction, HV_STATS_DIRECTION_OUTBOUND);
+		CHECK_EQUAL(pPacket->EtherType, 0x0800);
+		CHECK_EQUAL(pPacket->IpProtocol, 6);
+		CHECK_EQUAL(pPacket->FrameLength, 1514);
+		CHECK_EQUAL(pPacket->SourcePort, 80);
+		CHECK_EQUAL(pPacket->DestinationPort, 0);
+		CHECK_EQUAL(pPacket->PayloadLength, 5);
+		CHECK_EQUAL(pPacket->Payload[4], 5);
+
+		//not known: skipped by its length, the next record is where it should be
+		pRecord = HvRecordNext(&reader);
+		CHECK(pRecord && pRecord->Type == 2);
+		CHECK_EQUAL(pRecord->Length, sizeof(HV_RECORD_HEADER) + 40);
+
+		pRecord = HvRecordNext(&reader);
+		CHECK(pRecord && pRecord->Type == HV_RECORD_COUNTERS);
+		CHECK(HV_RECORD_HOLDS(pRecord, HV_RECORD_COUNTERS_DATA, Dropped));
+		CHECK_EQUAL(((const HV_RECORD_COUNTERS_DATA*)pRecord)->Direction, HV_RECORD_DIRECTION_SWITCH);
+		CHECK_EQUAL(((const HV_RECORD_COUNTERS_DATA*)pRecord)->Frames, 0);
+		CHECK_EQUAL(((const HV_RECORD_COUNTERS_DATA*)pRecord)->Dropped, 12);
+
+		pRecord = HvRecordNext(&reader);
+		CHECK(pRecord && pRecord->Type == HV_RECORD_HISTOGRAM);
+		CHECK_EQUAL(((const HV_RECORD_HISTOGRAM_DATA*)pRecord)->Kind, HV_RECORD_HISTOGRAM_GAP);
+		CHECK_EQUAL(((const HV_RECORD_HISTOGRAM_DATA*)pRecord)->BucketCount, 3);
+		CHECK_EQUAL(((const HV_RECORD_HISTOGRAM_DATA*)pRecord)->Buckets[0], 0);
+		CHECK_EQUAL(((const HV_RECORD_HISTOGRAM_DATA*)pRecord)->Buckets[2], 99);
+
+		pRecord = HvRecordNext(&reader);
+		CHECK(pRecord && pRecord->Type == HV_RECORD_EVENT);
+		CHECK_EQUAL(((const HV_RECORD_EVENT_DATA*)pRecord)->Code, HV_RECORD_EVENT_MICROBURST);
+		CHECK_EQUAL(((const HV_RECORD_EVENT_DATA*)pRecord)->Value[1], 42);
+
+		//the stream ends at its Length, not at the end of the buffer
+		CHECK(!HvRecordNext(&reader));
+		CHECK(!HvRecordNext(&reader));
+	}
+
+	void test_full()
+	{
+		std::vector<ULONG64> storage(9);
+		HV_RECORD_WRITER writer;
+
+		CHECK(!HvRecordWriterInit(&writer, storage.data(), sizeof(HV_RECORD_STREAM) - 1));
+		CHECK(HvRecordWriterInit(&writer, storage.data(), (ULONG)(storage.size() * sizeof(ULONG64))));
+
+		//too short for a header, too long for a record length
+		CHECK(!HvRecordAppend(&writer, HV_RECORD_EVENT, sizeof(HV_RECORD_HEADER) - 1, 0, 0));
+		CHECK(!HvRecordAppend(&writer, HV_RECORD_PACKET, HV_RECORD_PACKET_LENGTH(0x10000), 0, 0));
+
+		//56 bytes after the stream header: an event record, then only a bare header fits
+		CHECK(HvRecordAppend(&writer, HV_RECORD_EVENT, sizeof(HV_RECORD_EVENT_DATA), 0, 0));
+		CHECK(!HvRecordAppend(&writer, HV_RECORD_EVENT, sizeof(HV_RECORD_EVENT_DATA), 0, 0));
+		CHECK(HvRecordAppend(&writer, HV_RECORD_EVENT, sizeof(HV_RECORD_HEADER), 0, 0));
+		CHECK(!HvRecordAppend(&writer, HV_RECORD_EVENT, sizeof(HV_RECORD_HEADER), 0, 0));
+
+		ULONG length = HvRecordWriterFinish(&writer);
+		CHECK(length <= storage.size() * sizeof(ULONG64));
+		CHECK_EQUAL(read_types(storage.data(), length).size(), 2);
+	}
+
+	void test_truncated()
+	{
+		std::vector<ULONG64> storage(128);
+		ULONG length = write_stream(storage);
+		PHV_RECORD_STREAM pHeader = (PHV_RECORD_STREAM)storage.data();
+
+		//a read shorter than the stream says: refused whole
+		for (ULONG cut = 0; cut < length; ++cut) {
+			std::vector<UCHAR> copy((const UCHAR*)storage.data(), (const UCHAR*)storage.data() + cut);
+
+			CHECK(read_types(copy.data(), cut).empty());
+		}
+
+		//a stream header cut short: the records it still covers, never one past it
+		ULONG records = 0;
+
+		for (ULONG cut = sizeof(HV_RECORD_STREAM); cut <= length; ++cut) {
+			pHeader->Length = cut;
+
+			size_t count = read_types(storage.data(), length).size();
+			CHECK(count >= records);
+			records = (ULONG)count;
+		}
+
+		CHECK_EQUAL(records, 5);
+		pHeader->Length = length;
+
+		//bad stream headers
+		pHeader->Magic = 0;
+		CHECK(read_types(storage.data(), length).empty());
+		pHeader->Magic = HV_RECORD_MAGIC;
+
+		pHeader->Version = HV_RECORD_VERSION + 1;
+		CHECK(read_types(storage.data(), length).empty());
+		pHeader->Version = HV_RECORD_VERSION;
+
+		pHeader->HeaderLength = sizeof(HV_RECORD_STREAM) - 1;
+		CHECK(read_types(storage.data(), length).empty());
+		pHeader->HeaderLength = (USHORT)(length + 1);
+		CHECK(read_types(storage.data(), length).empty());
+		pHeader->HeaderLength = sizeof(HV_RECORD_STREAM);
+
+		CHECK_EQUAL(read_types(storage.data(), length).size(), 5);
+	}
+
+	void test_bad_lengths()
+	{
+		std::vector<ULONG64> storage(128);
+		ULONG length = write_stream(storage);
+		PHV_RECORD_HEADER pSecond = (PHV_RECORD_HEADER)((PUCHAR)storage.data() + sizeof(HV_RECORD_STREAM) +
+			HV_RECORD_ALIGN(HV_RECORD_PACKET_LENGTH(5)));
+		USHORT good = pSecond->Length;
+
+		//a bad record length ends the stream at that record
+		const USHORT lengths[] = {0, sizeof(HV_RECORD_HEADER) - 8, (USHORT)(good + 1), (USHORT)(good - 4), 0xFFF8};
+
+		for (USHORT bad : lengths) {
+			pSecond->Length = bad;
+
+			std::vector<USHORT> types = read_types(storage.data(), length);
+			CHECK_EQUAL(types.size(), 1);
+			CHECK_EQUAL(types[0], HV_RECORD_PACKET);
+		}
+
+		pSecond->Length = good;
+
+		//a record grown by a newer driver: skipped over whole, and still holds the fields this header knows
+		PHV_RECORD_HEADER pLast = (PHV_RECORD_HEADER)((PUCHAR)storage.data() + length - sizeof(HV_RECORD_EVENT_DATA));
+		PHV_RECORD_STREAM pHeader = (PHV_RECORD_STREAM)storage.data();
+
+		CHECK_EQUAL(pLast->Type, HV_RECORD_EVENT);
+		pLast->Length += 16;
+		pHeader->Length += 16;
+
+		std::vector<USHORT> types = read_types(storage.data(), (ULONG)(storage.size() * sizeof(ULONG64)));
+		CHECK_EQUAL(types.size(), 5);
+		CHECK(HV_RECORD_HOLDS(pLast, HV_RECORD_EVENT_DATA, Value));
+
+		//and a record an older driver wrote shorter does not hold them
+		pLast->Length = sizeof(HV_RECORD_HEADER) + 8;
+		CHECK(!HV_RECORD_HOLDS(pLast, HV_RECORD_EVENT_DATA, Value));
+		CHECK(HV_RECORD_HOLDS(pLast, HV_RECORD_EVENT_DATA, Reserved));
+	}
+}
+
+int main()
+{
+	test_round_trip();
+	test_full();
+	test_truncated();
+	test_bad_lengths();
+
+	std::printf("record_stream_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include "standin_engine.h"
+#include "check.h"
+
+#include <vector>
+
+//
+// RequestBufferPool: a buffer with no Retain goes straight back down, a
+// retained one is replaced by a spare, and without a spare the exchange waits
+// for the last Release.  Then standin::Engine with handlers that retain the
+// writes and read their payload only when they answer, from another thread,
+// while the exchanges go on: no payload is overwritten under them.
+//
+
+namespace
+{
+	void test_pool()
+	{
+		std::vector<BYTE> slots(4 * 100);
+		RequestBufferPool pool;
+		const BYTE* base = slots.data();
+
+		CHECK(!pool.Init(base, 100, REQUEST_BUFFER_POOL_MAX_SLOTS + 1, 1));
+		CHECK(!pool.Init(base, 100, 4, 5));
+
+		//slots 0 and 1 in flight, 2 and 3 spares
+		CHECK(pool.Init(base, 100, 4, 2));
+		pool.Posted(0);
+		pool.Posted(1);
+
+		//nothing retained
+		CHECK_EQUAL(pool.Recycle(0), 0);
+		pool.Posted(0);
+
+		//retained: the answers go down in a spare
+		pool.Retain(base + 10);
+		pool.Retain(base + 99);
+		CHECK_EQUAL(pool.Recycle(0), 2);
+		pool.Posted(2);
+
+		pool.Retain(base + 100);
+		CHECK_EQUAL(pool.Recycle(1), 3);
+		pool.Posted(3);
+
+		//no spare left: the exchange waits
+		pool.Retain(base + 250);
+		CHECK_EQUAL(pool.Recycle(2), REQUEST_BUFFER_POOL_NONE);
+		CHECK_EQUAL(pool.GetStarved(), 1);
+
+		//until the last Release of a buffer, which goes to it
+		CHECK_EQUAL(pool.Release(base + 10), REQUEST_BUFFER_POOL_NONE);
+		CHECK_EQUAL(pool.Release(base + 99), 0);
+		pool.Posted(0);
+
+		//the others go back to the spares
+		CHECK_EQUAL(pool.Release(base + 100), REQUEST_BUFFER_POOL_NONE);
+		CHECK_EQUAL(pool.Release(base + 250), REQUEST_BUFFER_POOL_NONE);
+
+		pool.Retain(base + 300);
+		CHECK_EQUAL(pool.Recycle(3), 2);
+		pool.Posted(2);
+		pool.Retain(base + 0);
+		CHECK_EQUAL(pool.Recycle(0), 1);
+		CHECK_EQUAL(pool.GetStarved(), 1);
+	}
+
+	//retained writes, answered from another thread with their payload's first byte, read then
+	class Holder
+	{
+	public:
+		explicit Holder(standin::Engine& engine) : m_engine(engine), m_done(false), m_thread(&Holder::run, this)
+		{
+		}
+
+		void add(const OSR_COMM_BATCH_ENTRY* pEntry)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			m_held.push_back(pEntry);
+			m_ready.notify_one();
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+
+				m_done = true;
+				m_ready.notify_one();
+			}
+
+			m_thread.join();
+		}
+
+	private:
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			for (;;) {
+				m_ready.wait(lock, [this] { return m_done || !m_held.empty(); });
+				if (m_held.empty())
+					return;
+
+				const OSR_COMM_BATCH_ENTRY* pEntry = m_held.front();
+				m_held.pop_front();
+
+				lock.unlock();
+
+				//give the workers time to post exchanges over a buffer released too early
+				SwitchToThread();
+
+				const BYTE* pPayload = (const BYTE*)(pEntry + 1);
+				OSR_COMM_BATCH_COMPLETION completion = {pEntry->RequestID, OSR_COMM_WRITE_RESPONSE, pPayload[0], 0};
+
+				for (ULONG i = 1; i < pEntry->RequestBufferLength; ++i)
+					CHECK_EQUAL(pPayload[i], pPayload[0]);
+
+				m_engine.complete(&completion);
+				m_engine.release(pEntry);
+
+				lock.lock();
+			}
+		}
+
+		standin::Engine& m_engine;
+		std::mutex m_lock;
+		std::condition_variable m_ready;
+		std::deque<const OSR_COMM_BATCH_ENTRY*> m_held;
+		bool m_done;
+		std::thread m_thread;
+	};
+
+	struct Context
+	{
+		standin::Engine* engine;
+		Holder* holder;
+	};
+
+	BOOL retain_writes(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		Context* pState = (Context*)pContext;
+
+		if (OSR_COMM_WRITE_REQUEST == pEntry->RequestType) {
+			pState->engine->retain(pEntry);
+			pState->holder->add(pEntry);
+			return FALSE;
+		}
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_READ_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+		return TRUE;
+	}
+
+	void client(standin::Device* pDevice, ULONG index, ULONG requests)
+	{
+		standin::DataRequest request;
+		BYTE payload[200];
+
+		for (ULONG i = 0; i < requests; ++i) {
+			BOOL write = (index + i) % 4 != 0;
+			BYTE tag = (BYTE)(index * 31 + i);
+
+			std::memset(payload, tag, sizeof(payload));
+
+			request.type = write ? OSR_COMM_WRITE_REQUEST : OSR_COMM_READ_REQUEST;
+			request.length = write ? 1 + (index + i) % sizeof(payload) : 1000 + tag;
+			request.payload = payload;
+
+			CHECK(pDevice->submit(&request));
+			pDevice->wait(&request);
+
+			CHECK(!request.failed);
+			CHECK_EQUAL(request.response_length, write ? tag : 1000 + tag);
+		}
+	}
+
+	void test_engine(ULONG clients, ULONG requests, ULONG outstanding, ULONG workers)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+		Holder holder(engine);
+		Context context = {&engine, &holder};
+
+		//small buffers: many exchanges per second, so buffers come around fast
+		engine.start(outstanding, 2048, workers, retain_writes, &context);
+
+		std::vector<std::thread> threads;
+
+		for (ULONG i = 0; i < clients; ++i)
+			threads.emplace_back(client, &device, i, requests);
+
+		for (auto& thread : threads)
+			thread.join();
+
+		holder.stop();
+
+		standin::Statistics stats = device.statistics();
+
+		CHECK_EQUAL(stats.completed, clients * requests);
+		CHECK_EQUAL(stats.rejected, 0);
+
+		std::printf("%u clients, %u exchanges, %u workers: %llu exchanges for %llu requests, %u waited for a buffer\n",
+			clients, outstanding, workers, (unsigned long long)stats.exchanges, (unsigned long long)stats.completed,
+			engine.starved());
+
+		engine.stop();
+	}
+}
+
+int main()
+{
+	test_pool();
+
+	test_engine(1, 2000, 1, 1);
+	test_engine(16, 500, 2, 2);
+	test_engine(64, 200, 4, 4);
+
+	std::printf("request_buffer_pool_test: passed\n");
+	return 0;
+}
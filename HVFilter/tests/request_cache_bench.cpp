@@ -0,0 +1,146 @@
+#include <Windows.h>
+#include "../base/RequestCache.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+//
+// Allocation churn on data request records: RequestCache.h's magazines
+// against malloc and free, from 1 to 32 threads.  Each thread keeps up to 64
+// records and allocates or frees one at random, the way requests come and go
+// on a processor; the cache's processor is the thread's current CPU.
+// Reports millions of allocate and free pairs per second.
+//
+// usage: request_cache_bench [seconds per run]
+//
+
+namespace
+{
+	//the size of DeviceOp.c's OSR_COMM_DATA_REQUEST on x64
+	const size_t kRecordSize = 56;
+	const ULONG kHeld = 64;
+
+	OSR_COMM_REQUEST_CACHE g_cache;
+	std::vector<OSR_COMM_CACHE_MAGAZINE> g_magazines;
+	std::atomic<bool> g_stop;
+
+	struct Malloc
+	{
+		static PVOID allocate()
+		{
+			return std::malloc(kRecordSize);
+		}
+
+		static void free(PVOID record)
+		{
+			std::free(record);
+		}
+	};
+
+	struct Magazines
+	{
+		static PVOID allocate()
+		{
+			PVOID record = OsrCommRequestCacheAllocate(&g_cache, sched_getcpu());
+
+			if (!record)
+				record = OsrCommRequestCacheAddSlab(&g_cache, std::aligned_alloc(MEMORY_ALLOCATION_ALIGNMENT, OSR_COMM_CACHE_SLAB_SIZE));
+
+			return record;
+		}
+
+		static void free(PVOID record)
+		{
+			OsrCommRequestCacheFree(&g_cache, sched_getcpu(), record);
+		}
+	};
+
+	template <class Allocator>
+	void churn(ULONG index, ULONG64* pPairs)
+	{
+		PVOID held[kHeld];
+		ULONG count = 0;
+		ULONG seed = index * 7919 + 1;
+		ULONG64 pairs = 0;
+
+		while (!g_stop.load(std::memory_order_relaxed)) {
+			for (ULONG i = 0; i < 1024; ++i) {
+				seed = seed * 1103515245 + 12345;
+
+				if (count == kHeld || (count && (seed >> 16) % 2)) {
+					ULONG victim = (seed >> 20) % count;
+
+					Allocator::free(held[victim]);
+					held[victim] = held[--count];
+					++pairs;
+				} else {
+					held[count] = Allocator::allocate();
+
+					//the request is filled in
+					*(volatile ULONG*)held[count] = index;
+					++count;
+				}
+			}
+		}
+
+		while (count)
+			Allocator::free(held[--count]);
+
+		*pPairs = pairs;
+	}
+
+	template <class Allocator>
+	double run(ULONG threads, double seconds)
+	{
+		std::vector<std::thread> workers;
+		std::vector<ULONG64> pairs(threads);
+
+		g_stop = false;
+
+		for (ULONG i = 0; i < threads; ++i)
+			workers.emplace_back(churn<Allocator>, i, &pairs[i]);
+
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+		g_stop = true;
+
+		ULONG64 total = 0;
+
+		for (ULONG i = 0; i < threads; ++i) {
+			workers[i].join();
+			total += pairs[i];
+		}
+
+		return total / seconds / 1e6;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+	const ULONG threads[] = {1, 2, 4, 8, 16, 32};
+	ULONG processors = std::thread::hardware_concurrency();
+
+	g_magazines.resize(processors ? processors : 1);
+	OsrCommRequestCacheInit(&g_cache, g_magazines.data(), (ULONG)g_magazines.size(), kRecordSize);
+
+	std::printf("%u processors, %u byte records, %.1f s per run\n", processors, (ULONG)kRecordSize, seconds);
+	std::printf("%8s %14s %14s\n", "threads", "malloc M/s", "magazines M/s");
+
+	for (ULONG t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+		double heap = run<Malloc>(threads[t], seconds);
+		double cache = run<Magazines>(threads[t], seconds);
+
+		std::printf("%8u %14.2f %14.2f\n", threads[t], heap, cache);
+	}
+
+	PVOID slab;
+
+	while (NULL != (slab = OsrCommRequestCacheTakeSlab(&g_cache)))
+		std::free(slab);
+
+	return 0;
+}
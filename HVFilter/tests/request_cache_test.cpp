@@ -0,0 +1,206 @@
+#include <Windows.h>
+#include "../base/RequestCache.h"
+#include "check.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+//
+// RequestCache.h: a slab is carved into aligned records that do not overlap
+// its link, records go back to the processor's magazine until it is full and
+// then to the depot, and every slab comes back at the end.  Then threads that
+// allocate and free on changing processors, checking that no record is ever
+// handed out twice and that none is lost.
+//
+
+namespace
+{
+	//the layout of DeviceOp.c's OSR_COMM_DATA_REQUEST
+	struct Record
+	{
+		PVOID list_entry[2];
+		PVOID service_list_entry[2];
+		ULONG request_id;
+		PVOID irp;
+		BOOLEAN service_queued;
+	};
+
+	const ULONG kMagazines = 4;
+
+	//what DeviceOp.c's AllocateDataRequest does, with aligned_alloc for the pool
+	struct Cache
+	{
+		OSR_COMM_REQUEST_CACHE cache;
+		OSR_COMM_CACHE_MAGAZINE magazines[kMagazines];
+		std::atomic<ULONG> slabs{0};
+
+		Cache()
+		{
+			OsrCommRequestCacheInit(&cache, magazines, kMagazines, sizeof(Record));
+		}
+
+		~Cache()
+		{
+			PVOID slab;
+
+			while (NULL != (slab = OsrCommRequestCacheTakeSlab(&cache)))
+				std::free(slab);
+		}
+
+		PVOID allocate(ULONG processor)
+		{
+			PVOID record = OsrCommRequestCacheAllocate(&cache, processor);
+
+			if (!record) {
+				++slabs;
+				record = OsrCommRequestCacheAddSlab(&cache, std::aligned_alloc(MEMORY_ALLOCATION_ALIGNMENT, OSR_COMM_CACHE_SLAB_SIZE));
+			}
+
+			return record;
+		}
+	};
+
+	void test_slab()
+	{
+		Cache cache;
+		ULONG size = cache.cache.ObjectSize;
+		ULONG per_slab = OSR_COMM_CACHE_SLAB_SIZE / size - 1;
+		std::vector<PUCHAR> records;
+
+		CHECK_EQUAL(size % MEMORY_ALLOCATION_ALIGNMENT, 0);
+		CHECK(size >= sizeof(Record));
+
+		CHECK(!OsrCommRequestCacheAllocate(&cache.cache, 0));
+
+		//all but the first record's worth, once each
+		for (ULONG i = 0; i < per_slab; ++i)
+			records.push_back((PUCHAR)cache.allocate(i));
+
+		CHECK_EQUAL(cache.slabs, 1);
+		CHECK(!OsrCommRequestCacheAllocate(&cache.cache, 0));
+
+		std::sort(records.begin(), records.end());
+
+		PUCHAR slab = records[0] - size;
+
+		for (ULONG i = 0; i < per_slab; ++i) {
+			CHECK_EQUAL((ULONG_PTR)records[i] % MEMORY_ALLOCATION_ALIGNMENT, 0);
+			CHECK(records[i] == slab + (i + 1) * size);
+			CHECK(records[i] + size <= slab + OSR_COMM_CACHE_SLAB_SIZE);
+		}
+
+		//processor 1's magazine fills up, the rest spills into the depot
+		for (ULONG i = 0; i < per_slab; ++i)
+			OsrCommRequestCacheFree(&cache.cache, 1 + kMagazines, records[i]);
+
+		CHECK_EQUAL(QueryDepthSList(&cache.magazines[1].Free), OSR_COMM_CACHE_MAGAZINE_DEPTH);
+		CHECK_EQUAL(QueryDepthSList(&cache.cache.Depot), per_slab - OSR_COMM_CACHE_MAGAZINE_DEPTH);
+
+		//another processor only sees the depot, last freed first
+		CHECK(OsrCommRequestCacheAllocate(&cache.cache, 2) == records[per_slab - 1]);
+
+		for (ULONG i = 1; i < per_slab - OSR_COMM_CACHE_MAGAZINE_DEPTH; ++i)
+			CHECK(OsrCommRequestCacheAllocate(&cache.cache, 2));
+
+		CHECK(!OsrCommRequestCacheAllocate(&cache.cache, 2));
+
+		//processor 1 has its magazine to itself
+		CHECK(OsrCommRequestCacheAllocate(&cache.cache, 1) == records[OSR_COMM_CACHE_MAGAZINE_DEPTH - 1]);
+		CHECK_EQUAL(QueryDepthSList(&cache.magazines[1].Free), OSR_COMM_CACHE_MAGAZINE_DEPTH - 1);
+
+		CHECK(OsrCommRequestCacheTakeSlab(&cache.cache) == slab);
+		CHECK(!OsrCommRequestCacheTakeSlab(&cache.cache));
+		std::free(slab);
+	}
+
+	void churn(Cache* pCache, ULONG index, ULONG rounds, std::mutex* pLock, std::set<PVOID>* pSeen)
+	{
+		std::vector<Record*> held;
+		std::set<PVOID> seen;
+		ULONG seed = index * 7919 + 1;
+
+		for (ULONG round = 0; round < rounds; ++round) {
+			seed = seed * 1103515245 + 12345;
+
+			//a few records at a time, on whatever processor the thread is on now
+			ULONG count = 1 + (seed >> 16) % 24;
+			ULONG processor = (seed >> 8) % (2 * kMagazines);
+
+			for (ULONG i = 0; i < count; ++i) {
+				Record* pRecord = (Record*)pCache->allocate(processor);
+
+				CHECK(pRecord);
+				std::fill((ULONG*)pRecord, (ULONG*)(pRecord + 1), index);
+				held.push_back(pRecord);
+				seen.insert(pRecord);
+			}
+
+			if (round % 16 == 0)
+				SwitchToThread();
+
+			//nobody else wrote over them
+			for (Record* pRecord : held)
+				for (ULONG* p = (ULONG*)pRecord; p < (ULONG*)(pRecord + 1); ++p)
+					CHECK_EQUAL(*p, index);
+
+			//freed on another processor: the thread migrated
+			processor = (processor + 1) % (2 * kMagazines);
+
+			for (ULONG i = 0; i < count; ++i) {
+				OsrCommRequestCacheFree(&pCache->cache, processor, held.back());
+				held.pop_back();
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(*pLock);
+
+		pSeen->insert(seen.begin(), seen.end());
+	}
+
+	void test_threads(ULONG threads, ULONG rounds)
+	{
+		Cache cache;
+		std::mutex lock;
+		std::set<PVOID> seen;
+		std::vector<std::thread> workers;
+
+		for (ULONG i = 0; i < threads; ++i)
+			workers.emplace_back(churn, &cache, i, rounds, &lock, &seen);
+
+		for (auto& worker : workers)
+			worker.join();
+
+		//every record of every slab is back, once
+		ULONG per_slab = OSR_COMM_CACHE_SLAB_SIZE / cache.cache.ObjectSize - 1;
+		std::set<PVOID> free;
+
+		for (ULONG processor = 0; processor < kMagazines; ++processor) {
+			PVOID record;
+
+			while (NULL != (record = OsrCommRequestCacheAllocate(&cache.cache, processor)))
+				CHECK(free.insert(record).second);
+		}
+
+		CHECK_EQUAL(free.size(), cache.slabs * per_slab);
+		CHECK(std::includes(free.begin(), free.end(), seen.begin(), seen.end()));
+
+		std::printf("%u threads, %u rounds: %u slabs\n", threads, rounds, (ULONG)cache.slabs);
+	}
+}
+
+int main()
+{
+	test_slab();
+
+	test_threads(1, 20000);
+	test_threads(8, 20000);
+	test_threads(32, 5000);
+
+	std::printf("request_cache_test: passed\n");
+	return 0;
+}
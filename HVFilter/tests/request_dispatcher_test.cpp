@@ -0,0 +1,288 @@
+#include "standin_engine.h"
+#include "check.h"
+
+#include <cstring>
+#include <vector>
+
+//
+// RequestDispatcher: handler answers go first, deferred answers fill the room
+// left, the first deferral since the last take asks for a flush, a full or
+// closed dispatcher refuses answers.  Then RequestEngine's loop over the
+// stand-in device (standin::Engine): thousands of requests pending on two
+// exchanges, and a third of the requests answered late from another thread;
+// every request is answered once, with its own answer.
+//
+
+namespace
+{
+	//answers reads, defers writes
+	BOOL answer_reads(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		std::vector<ULONG>* pDeferred = (std::vector<ULONG>*)pContext;
+
+		if (OSR_COMM_WRITE_REQUEST == pEntry->RequestType) {
+			pDeferred->push_back(pEntry->RequestID);
+			return FALSE;
+		}
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_READ_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+		return TRUE;
+	}
+
+	OSR_COMM_BATCH_COMPLETION write_answer(ULONG id)
+	{
+		OSR_COMM_BATCH_COMPLETION completion = {id, OSR_COMM_WRITE_RESPONSE, 0, 0};
+		return completion;
+	}
+
+	//a batch of count requests, every write-th one a write; IDs from first
+	ULONG write_batch(std::vector<ULONG64>& buffer, ULONG first, ULONG count, ULONG write)
+	{
+		OSR_COMM_BATCH_WRITER writer;
+
+		buffer.assign(65536 / sizeof(ULONG64), 0);
+		OsrCommBatchWriterInit(&writer, buffer.data(), 65536);
+
+		for (ULONG i = 0; i < count; ++i) {
+			if (write && 0 == i % write) {
+				OsrCommBatchWriterAppend(&writer, first + i, OSR_COMM_WRITE_REQUEST, 0, 0);
+			} else {
+				OsrCommBatchWriterAppend(&writer, first + i, OSR_COMM_READ_REQUEST, 100 + i, 0);
+			}
+		}
+
+		return OsrCommBatchWriterLength(&writer);
+	}
+
+	void test_deferred()
+	{
+		RequestDispatcher dispatcher;
+		std::vector<ULONG> deferred;
+		std::vector<ULONG64> batch;
+		std::vector<ULONG64> storage;
+		POSR_COMM_BATCH_RESPONSE pResponse = standin::allocate_response(storage, OSR_COMM_BATCH_MAX_REQUESTS);
+
+		//closed until opened
+		OSR_COMM_BATCH_COMPLETION completion = write_answer(1);
+		CHECK_EQUAL(dispatcher.Defer(&completion), DeferClosed);
+
+		dispatcher.Open(answer_reads, &deferred);
+
+		//every other one is a write: 5 answers now, 5 later
+		ULONG length = write_batch(batch, 1, 10, 2);
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), length, pResponse), OSR_COMM_BATCH_RESPONSE_LENGTH(5));
+		CHECK_EQUAL(pResponse->Count, 5);
+		for (ULONG i = 0; i < 5; ++i) {
+			CHECK_EQUAL(pResponse->Completions[i].RequestID, 2 + 2 * i);
+			CHECK_EQUAL(pResponse->Completions[i].ResponseBufferLength, 101 + 2 * i);
+		}
+		CHECK_EQUAL(deferred.size(), 5);
+
+		//the first late answer asks for a flush, the others ride along
+		for (size_t i = 0; i < deferred.size(); ++i) {
+			completion = write_answer(deferred[i]);
+			CHECK_EQUAL(dispatcher.Defer(&completion), i ? DeferQueued : DeferFlushNeeded);
+		}
+
+		//they follow the next batch's own answers, oldest first
+		deferred.clear();
+		length = write_batch(batch, 100, 3, 0);
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), length, pResponse), OSR_COMM_BATCH_RESPONSE_LENGTH(8));
+		CHECK_EQUAL(pResponse->Completions[2].RequestID, 102);
+		for (ULONG i = 0; i < 5; ++i) {
+			CHECK_EQUAL(pResponse->Completions[3 + i].RequestID, 1 + 2 * i);
+			CHECK_EQUAL(pResponse->Completions[3 + i].ResponseType, OSR_COMM_WRITE_RESPONSE);
+		}
+
+		//all taken: the next one asks for a flush again
+		CHECK_EQUAL(dispatcher.Defer(&completion), DeferFlushNeeded);
+		CHECK_EQUAL(dispatcher.TakeDeferred(pResponse->Completions, OSR_COMM_BATCH_MAX_REQUESTS), 1);
+
+		//a batch that fills the response leaves them queued; a malformed one only carries them
+		for (ULONG i = 0; i < 10; ++i) {
+			completion = write_answer(1000 + i);
+			dispatcher.Defer(&completion);
+		}
+
+		length = write_batch(batch, 1, OSR_COMM_BATCH_MAX_REQUESTS, 0);
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), length, pResponse), OSR_COMM_BATCH_RESPONSE_LENGTH(OSR_COMM_BATCH_MAX_REQUESTS));
+		CHECK_EQUAL(pResponse->Completions[OSR_COMM_BATCH_MAX_REQUESTS - 1].RequestID, OSR_COMM_BATCH_MAX_REQUESTS);
+
+		length = write_batch(batch, 1, OSR_COMM_BATCH_MAX_REQUESTS - 4, 0);
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), length, pResponse), OSR_COMM_BATCH_RESPONSE_LENGTH(OSR_COMM_BATCH_MAX_REQUESTS));
+		CHECK_EQUAL(pResponse->Completions[OSR_COMM_BATCH_MAX_REQUESTS - 1].RequestID, 1003);
+
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), sizeof(OSR_COMM_BATCH_REQUEST) - 1, pResponse), OSR_COMM_BATCH_RESPONSE_LENGTH(6));
+		CHECK_EQUAL(pResponse->Completions[0].RequestID, 1004);
+		CHECK_EQUAL(dispatcher.HandleBatch(batch.data(), 0, pResponse), 0);
+
+		//full
+		for (ULONG i = 0; i < REQUEST_DISPATCHER_MAX_DEFERRED; ++i) {
+			completion = write_answer(i);
+			CHECK(DeferFull != dispatcher.Defer(&completion));
+		}
+		CHECK_EQUAL(dispatcher.Defer(&completion), DeferFull);
+		CHECK_EQUAL(dispatcher.TakeDeferred(pResponse->Completions, 1), 1);
+		CHECK_EQUAL(pResponse->Completions[0].RequestID, 0);
+		CHECK_EQUAL(dispatcher.Defer(&completion), DeferQueued);
+
+		//closing drops them
+		dispatcher.Close();
+		CHECK_EQUAL(dispatcher.TakeDeferred(pResponse->Completions, OSR_COMM_BATCH_MAX_REQUESTS), 0);
+		CHECK_EQUAL(dispatcher.Defer(&completion), DeferClosed);
+	}
+
+	//requests whose IDs are a multiple of 3 are answered late
+	BOOL answer_some_late(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		standin::LateAnswers* pLate = (standin::LateAnswers*)pContext;
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_WRITE_REQUEST == pEntry->RequestType ? OSR_COMM_WRITE_RESPONSE : OSR_COMM_READ_RESPONSE;
+
+		//echoes the write payload's first byte, so an answer given to the wrong request shows
+		pCompletion->ResponseBufferLength = OSR_COMM_WRITE_REQUEST == pEntry->RequestType ?
+			(pEntry->RequestBufferLength ? *(const BYTE*)(pEntry + 1) : 0) : pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+
+		if (pEntry->RequestID % 3)
+			return TRUE;
+
+		pLate->add(*pCompletion);
+		return FALSE;
+	}
+
+	void client(standin::Device* pDevice, ULONG index, ULONG requests)
+	{
+		standin::DataRequest request;
+		BYTE payload[64];
+
+		for (ULONG i = 0; i < requests; ++i) {
+			BOOL write = (index + i) % 2;
+			BYTE tag = (BYTE)(index * 31 + i);
+
+			std::memset(payload, tag, sizeof(payload));
+
+			request.type = write ? OSR_COMM_WRITE_REQUEST : OSR_COMM_READ_REQUEST;
+			request.length = write ? sizeof(payload) : 1000 + tag;
+			request.payload = payload;
+
+			CHECK(pDevice->submit(&request));
+			pDevice->wait(&request);
+
+			CHECK(!request.failed);
+			CHECK_EQUAL(request.response_type, write ? OSR_COMM_WRITE_RESPONSE : OSR_COMM_READ_RESPONSE);
+			CHECK_EQUAL(request.response_length, write ? tag : 1000 + tag);
+		}
+	}
+
+	void test_engine(ULONG clients, ULONG requests, ULONG outstanding, ULONG workers)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+		standin::LateAnswers late(engine);
+
+		engine.start(outstanding, 8192, workers, answer_some_late, &late);
+
+		std::vector<std::thread> threads;
+
+		for (ULONG i = 0; i < clients; ++i)
+			threads.emplace_back(client, &device, i, requests);
+
+		for (auto& thread : threads)
+			thread.join();
+
+		late.stop();
+
+		standin::Statistics stats = device.statistics();
+
+		CHECK_EQUAL(stats.submitted, clients * requests);
+		CHECK_EQUAL(stats.completed, clients * requests);
+		CHECK_EQUAL(stats.rejected, 0);
+
+		std::printf("%u clients, %u exchanges, %u workers: %llu exchanges for %llu requests, %llu flushes\n",
+			clients, outstanding, workers, (unsigned long long)stats.exchanges, (unsigned long long)stats.completed,
+			(unsigned long long)engine.flushes());
+
+		engine.stop();
+	}
+
+	//the handler keeps every request; nothing is answered until all of them are pending
+	struct Keeper
+	{
+		std::mutex lock;
+		std::vector<OSR_COMM_BATCH_COMPLETION> kept;
+	};
+
+	BOOL keep(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		Keeper* pKeeper = (Keeper*)pContext;
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_READ_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+
+		std::lock_guard<std::mutex> lock(pKeeper->lock);
+		pKeeper->kept.push_back(*pCompletion);
+		return FALSE;
+	}
+
+	//many more requests pending than exchanges in flight, from one thread, without a thread per request
+	void test_many_pending(ULONG requests)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+		std::vector<standin::DataRequest> data(requests);
+		Keeper keeper;
+
+		engine.start(2, 65536, 2, keep, &keeper);
+
+		for (ULONG i = 0; i < requests; ++i) {
+			data[i].type = OSR_COMM_READ_REQUEST;
+			data[i].length = i;
+			data[i].payload = NULL;
+
+			CHECK(device.submit(&data[i]));
+		}
+
+		for (size_t kept = 0; kept < requests; SwitchToThread()) {
+			std::lock_guard<std::mutex> lock(keeper.lock);
+			kept = keeper.kept.size();
+		}
+
+		CHECK_EQUAL(device.statistics().completed, 0);
+
+		//answered out of order, past the deferred queue's capacity
+		for (ULONG i = requests; i-- > 0;)
+			engine.complete(&keeper.kept[i]);
+
+		for (ULONG i = 0; i < requests; ++i) {
+			device.wait(&data[i]);
+			CHECK(!data[i].failed);
+			CHECK_EQUAL(data[i].response_length, i);
+		}
+
+		CHECK_EQUAL(device.statistics().rejected, 0);
+
+		engine.stop();
+	}
+}
+
+int main()
+{
+	test_deferred();
+	test_many_pending(3 * REQUEST_DISPATCHER_MAX_DEFERRED);
+
+	test_engine(1, 2000, 1, 1);
+	test_engine(16, 500, 4, 2);
+	test_engine(64, 200, 2, 4);
+
+	std::printf("request_dispatcher_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "standin_engine.h"
+
+#include <algorithm>
+
+//
+// Latency and throughput of data requests through standin::Engine, for 1 to
+// 4096 requests in flight from a single client thread.  "inline" answers in
+// the handler; "deferred" returns FALSE and answers from another thread
+// through Complete, the way HVService answers held reads: the pending
+// requests hold no thread and no exchange.  Reports requests per second and
+// the 50th and 99th percentile of the time from submit to answer.
+//
+// usage: request_latency_bench [requests] [exchanges in flight]
+//
+
+namespace
+{
+	const ULONG kWorkers = 2;
+
+	BOOL answer(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_READ_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+
+		if (!pContext)
+			return TRUE;
+
+		((standin::LateAnswers*)pContext)->add(*pCompletion);
+		return FALSE;
+	}
+
+	void run(ULONG in_flight, ULONG requests, ULONG outstanding, bool deferred)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+		standin::LateAnswers late(engine);
+		std::vector<standin::DataRequest> window(in_flight);
+		std::vector<double> latencies;
+
+		latencies.reserve(requests);
+
+		engine.start(outstanding, 65536, kWorkers, answer, deferred ? &late : NULL);
+
+		auto start = std::chrono::steady_clock::now();
+
+		//the window is kept full: each answered request goes out again
+		for (ULONG i = 0; i < in_flight; ++i) {
+			window[i].type = OSR_COMM_READ_REQUEST;
+			window[i].length = 1500;
+			window[i].payload = NULL;
+
+			device.submit(&window[i]);
+		}
+
+		for (ULONG i = 0; i < requests; ++i) {
+			standin::DataRequest& request = window[i % in_flight];
+
+			device.wait(&request);
+
+			std::chrono::duration<double, std::micro> latency = request.answered - request.submitted;
+			latencies.push_back(latency.count());
+
+			if (i + in_flight < requests)
+				device.submit(&request);
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		late.stop();
+		engine.stop();
+
+		std::sort(latencies.begin(), latencies.end());
+
+		std::printf("%10u %9s %14.0f %12.1f %12.1f\n", in_flight, deferred ? "deferred" : "inline",
+			requests / elapsed.count(), latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	ULONG requests = argc > 1 ? std::atoi(argv[1]) : 200000;
+	ULONG outstanding = argc > 2 ? std::atoi(argv[2]) : 4;
+	const ULONG in_flight[] = {1, 16, 256, 4096};
+
+	std::printf("%u requests, %u exchanges in flight, %u workers\n", requests, outstanding, kWorkers);
+	std::printf("%10s %9s %14s %12s %12s\n", "in flight", "answer", "requests/s", "p50 us", "p99 us");
+
+	for (ULONG f = 0; f < sizeof(in_flight) / sizeof(in_flight[0]); ++f) {
+		run(in_flight[f], std::max(requests, in_flight[f] * 4), outstanding, false);
+		run(in_flight[f], std::max(requests, in_flight[f] * 4), outstanding, true);
+	}
+
+	return 0;
+}
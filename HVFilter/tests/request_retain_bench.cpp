@@ -0,0 +1,132 @@
+#include "standin_engine.h"
+
+#include <cstdlib>
+
+//
+// Writes answered after their handler returned, through standin::Engine: the
+// handler either copies the payload out ("copy", one allocation and one copy
+// per write) or retains the entry in place ("retain", RequestEngine::Retain).
+// 16 client threads with one write outstanding each, 1 KB payloads, 4
+// exchanges in flight with a spare each.  Reports writes per second, bytes
+// copied and allocations per write, and exchanges that had to wait for a
+// retained buffer.
+//
+// usage: request_retain_bench [writes per client]
+//
+
+namespace
+{
+	const ULONG kClients = 16;
+	const ULONG kPayload = 1024;
+
+	struct Mode
+	{
+		standin::Engine* engine;
+		standin::LateAnswers* late;
+		bool retain;
+
+		//copies and allocations made by the handler
+		std::atomic<ULONG64> copied;
+		std::atomic<ULONG64> allocations;
+	};
+
+	//stands for the work the late answer does with the payload
+	std::atomic<ULONG64> g_checksum(0);
+
+	BOOL hold(const OSR_COMM_BATCH_ENTRY* pEntry, POSR_COMM_BATCH_COMPLETION pCompletion, PVOID pContext)
+	{
+		Mode* pMode = (Mode*)pContext;
+		const BYTE* pPayload = (const BYTE*)(pEntry + 1);
+
+		pCompletion->RequestID = pEntry->RequestID;
+		pCompletion->ResponseType = OSR_COMM_WRITE_RESPONSE;
+		pCompletion->ResponseBufferLength = pEntry->RequestBufferLength;
+		pCompletion->Reserved = 0;
+
+		if (pMode->retain) {
+			pMode->engine->retain(pEntry);
+			g_checksum += pPayload[pEntry->RequestBufferLength - 1];
+			pMode->late->add(*pCompletion, pEntry);
+			return FALSE;
+		}
+
+		BYTE* pCopy = (BYTE*)std::malloc(pEntry->RequestBufferLength);
+
+		std::memcpy(pCopy, pPayload, pEntry->RequestBufferLength);
+		pMode->copied += pEntry->RequestBufferLength;
+		++pMode->allocations;
+
+		g_checksum += pCopy[pEntry->RequestBufferLength - 1];
+		std::free(pCopy);
+
+		pMode->late->add(*pCompletion);
+		return FALSE;
+	}
+
+	void client(standin::Device* pDevice, ULONG writes)
+	{
+		standin::DataRequest request;
+		BYTE payload[kPayload];
+
+		std::memset(payload, 0x5A, sizeof(payload));
+
+		request.type = OSR_COMM_WRITE_REQUEST;
+		request.length = kPayload;
+		request.payload = payload;
+
+		for (ULONG i = 0; i < writes; ++i) {
+			if (!pDevice->submit(&request))
+				return;
+
+			pDevice->wait(&request);
+		}
+	}
+
+	void run(ULONG writes, bool retain)
+	{
+		standin::CompletionQueue port;
+		standin::Device device(port);
+		standin::Engine engine(device, port);
+		standin::LateAnswers late(engine);
+		Mode mode;
+
+		mode.engine = &engine;
+		mode.late = &late;
+		mode.retain = retain;
+		mode.copied = 0;
+		mode.allocations = 0;
+
+		engine.start(4, 65536, 2, hold, &mode);
+
+		auto start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> threads;
+		for (ULONG i = 0; i < kClients; ++i)
+			threads.emplace_back(client, &device, writes);
+
+		for (auto& thread : threads)
+			thread.join();
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		ULONG64 completed = device.statistics().completed;
+
+		late.stop();
+		engine.stop();
+
+		std::printf("%8s %14.0f %16.1f %16.3f %10u\n", retain ? "retain" : "copy", completed / elapsed.count(),
+			(double)mode.copied / completed, (double)mode.allocations / completed, engine.starved());
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	ULONG writes = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+	std::printf("%u clients, %u writes each, %u byte payloads\n", kClients, writes, kPayload);
+	std::printf("%8s %14s %16s %16s %10s\n", "mode", "writes/s", "copied/write", "allocs/write", "starved");
+
+	run(writes, false);
+	run(writes, true);
+
+	return g_checksum == 1;
+}
@@ -0,0 +1,130 @@
+#include <Windows.h>
+#include "../base/RequestTable.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <vector>
+
+//
+// Cost of matching a response to its pending request, with 10, 1k and 100k
+// requests pending: the slot table of RequestTable.h against the walk of the
+// FIFO queue comparing request IDs that ProcessResponse used to do.  Every
+// response takes a random pending request off the queue and a new one takes
+// its place at the tail, so the number pending stays the same.
+//
+// usage: request_table_bench [seconds per run]
+//
+
+namespace
+{
+	struct Request
+	{
+		ULONG id;
+		std::list<Request*>::iterator entry;
+	};
+
+	struct Model
+	{
+		OSR_COMM_REQUEST_TABLE table;
+		std::list<Request*> queue;
+		std::vector<Request> requests;
+		ULONG next_id;
+
+		explicit Model(ULONG pending) : requests(pending), next_id(0)
+		{
+			OsrCommRequestTableInit(&table, 0);
+
+			for (ULONG i = 0; i < pending; ++i)
+				enqueue(&requests[i]);
+		}
+
+		~Model() { std::free(table.Slots); }
+
+		void enqueue(Request* pRequest)
+		{
+			if (OSR_COMM_REQUEST_NO_SLOT == table.FreeHead) {
+				ULONG capacity = OsrCommRequestTableGrowCapacity(&table);
+				if (!capacity) {
+					std::fprintf(stderr, "more than %u requests pending\n", OSR_COMM_REQUEST_MAX_SLOTS);
+					std::exit(1);
+				}
+
+				std::free(OsrCommRequestTableGrow(&table, (POSR_COMM_REQUEST_SLOT)std::malloc(capacity * sizeof(OSR_COMM_REQUEST_SLOT))));
+			}
+
+			OsrCommRequestTableInsert(&table, pRequest, &pRequest->id);
+			pRequest->entry = queue.insert(queue.end(), pRequest);
+		}
+
+		Request* find_indexed(ULONG id)
+		{
+			return (Request*)OsrCommRequestTableLookup(&table, id);
+		}
+
+		Request* find_linear(ULONG id)
+		{
+			for (std::list<Request*>::iterator it = queue.begin(); it != queue.end(); ++it) {
+				if ((*it)->id == id)
+					return *it;
+			}
+
+			return NULL;
+		}
+
+		void respond(Request* pRequest)
+		{
+			queue.erase(pRequest->entry);
+			OsrCommRequestTableRemove(&table, pRequest->id);
+			enqueue(pRequest);
+		}
+	};
+
+	//nanoseconds per response
+	double run(ULONG pending, bool indexed, double seconds)
+	{
+		Model model(pending);
+		ULONG64 responses = 0;
+		ULONG random = 0x2545F491u;
+
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::duration<double>(seconds);
+
+		while (std::chrono::steady_clock::now() < end) {
+			for (ULONG i = 0; i < 64; ++i) {
+				random ^= random << 13;
+				random ^= random >> 17;
+				random ^= random << 5;
+
+				ULONG id = model.requests[random % pending].id;
+				Request* pRequest = indexed ? model.find_indexed(id) : model.find_linear(id);
+
+				if (!pRequest) {
+					std::fprintf(stderr, "request %08X not found\n", id);
+					std::exit(1);
+				}
+
+				model.respond(pRequest);
+				++responses;
+			}
+		}
+
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / responses;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+	const ULONG pending[] = {10, 1000, 100000};
+
+	std::printf("%10s %16s %16s\n", "pending", "table ns/resp", "linear ns/resp");
+
+	for (ULONG i = 0; i < sizeof(pending) / sizeof(pending[0]); ++i) {
+		std::printf("%10u %16.1f %16.1f\n", pending[i], run(pending[i], true, seconds), run(pending[i], false, seconds));
+	}
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+#include <Windows.h>
+#include "../base/RequestTable.h"
+#include "check.h"
+
+#include <cstdlib>
+#include <list>
+#include <vector>
+
+//
+// RequestTable.h: IDs find their request in any order, stale and foreign IDs
+// find nothing, the table grows without moving slots, and the pending queue
+// the table sits next to keeps its FIFO dispatch order.  New requests go on
+// their processor's queue and responses find that queue from the ID alone.
+//
+
+namespace
+{
+	struct Request
+	{
+		ULONG id;
+		ULONG number;
+		std::list<Request*>::iterator entry;
+	};
+
+	//what DeviceOp.c's GrowRequestTable does, with malloc for the pool
+	BOOLEAN grow(POSR_COMM_REQUEST_TABLE Table)
+	{
+		ULONG capacity = OsrCommRequestTableGrowCapacity(Table);
+		if (!capacity)
+			return FALSE;
+
+		std::free(OsrCommRequestTableGrow(Table, (POSR_COMM_REQUEST_SLOT)std::malloc(capacity * sizeof(OSR_COMM_REQUEST_SLOT))));
+		return TRUE;
+	}
+
+	BOOLEAN insert(POSR_COMM_REQUEST_TABLE Table, Request* pRequest)
+	{
+		if (OSR_COMM_REQUEST_NO_SLOT == Table->FreeHead && !grow(Table))
+			return FALSE;
+
+		return OsrCommRequestTableInsert(Table, pRequest, &pRequest->id);
+	}
+
+	void test_lookup()
+	{
+		OSR_COMM_REQUEST_TABLE table;
+		ULONG flags = OSR_COMM_REQUEST_WRITE_ID | (5 << OSR_COMM_REQUEST_QUEUE_SHIFT);
+		std::vector<Request> requests(1000);
+
+		OsrCommRequestTableInit(&table, flags);
+
+		//nothing in an empty table, not even slot 0
+		CHECK(!OsrCommRequestTableLookup(&table, flags));
+
+		for (ULONG i = 0; i < requests.size(); ++i) {
+			requests[i].number = i;
+			CHECK(insert(&table, &requests[i]));
+
+			CHECK_EQUAL(requests[i].id & ~(OSR_COMM_REQUEST_MAX_SLOTS - 1) & ~(OSR_COMM_REQUEST_GENERATION_MASK << OSR_COMM_REQUEST_GENERATION_SHIFT), flags);
+		}
+
+		//64, doubled four times
+		CHECK_EQUAL(table.Capacity, 1024);
+
+		//growing kept the slots: every ID still finds its request
+		for (ULONG i = 0; i < requests.size(); ++i)
+			CHECK(OsrCommRequestTableLookup(&table, requests[i].id) == &requests[i]);
+
+		//the same slot in another queue, or the read queue, is not ours
+		CHECK(!OsrCommRequestTableLookup(&table, requests[7].id ^ (1 << OSR_COMM_REQUEST_QUEUE_SHIFT)));
+		CHECK(!OsrCommRequestTableLookup(&table, requests[7].id & ~OSR_COMM_REQUEST_WRITE_ID));
+
+		//beyond the capacity
+		CHECK(!OsrCommRequestTableLookup(&table, flags | (OSR_COMM_REQUEST_MAX_SLOTS - 1)));
+
+		//a removed request's ID goes stale, and stays stale when its slot is reused
+		ULONG stale = requests[10].id;
+		OsrCommRequestTableRemove(&table, stale);
+		CHECK(!OsrCommRequestTableLookup(&table, stale));
+
+		Request reuse;
+		CHECK(insert(&table, &reuse));
+		CHECK_EQUAL(reuse.id & (OSR_COMM_REQUEST_MAX_SLOTS - 1), stale & (OSR_COMM_REQUEST_MAX_SLOTS - 1));
+		CHECK(reuse.id != stale);
+		CHECK(!OsrCommRequestTableLookup(&table, stale));
+		CHECK(OsrCommRequestTableLookup(&table, reuse.id) == &reuse);
+
+		std::free(table.Slots);
+	}
+
+	void test_generation_wraps()
+	{
+		OSR_COMM_REQUEST_TABLE table;
+		Request request;
+
+		OsrCommRequestTableInit(&table, 0);
+		CHECK(insert(&table, &request));
+
+		ULONG first = request.id;
+
+		//the free list is LIFO: the same slot comes back every time
+		for (ULONG i = 0; i <= OSR_COMM_REQUEST_GENERATION_MASK; ++i) {
+			OsrCommRequestTableRemove(&table, request.id);
+			CHECK(insert(&table, &request));
+		}
+
+		//after 256 reuses the generation is back where it started
+		CHECK_EQUAL(request.id, first);
+		CHECK((request.id & OSR_COMM_REQUEST_WRITE_ID) == 0);
+
+		std::free(table.Slots);
+	}
+
+	void test_full()
+	{
+		OSR_COMM_REQUEST_TABLE table;
+		Request request;
+		ULONG count = 0;
+
+		OsrCommRequestTableInit(&table, 0);
+
+		while (insert(&table, &request))
+			++count;
+
+		CHECK_EQUAL(count, OSR_COMM_REQUEST_MAX_SLOTS);
+		CHECK_EQUAL(OsrCommRequestTableGrowCapacity(&table), 0);
+
+		std::free(table.Slots);
+	}
+
+	//responses come in any order, the service is handed the oldest pending request first
+	void test_fifo_dispatch()
+	{
+		OSR_COMM_REQUEST_TABLE table;
+		std::list<Request*> queue;
+		std::vector<Request> requests(5000);
+
+		OsrCommRequestTableInit(&table, 0);
+		std::srand(1);
+
+		for (ULONG i = 0; i < requests.size(); ++i) {
+			requests[i].number = i;
+			CHECK(insert(&table, &requests[i]));
+			requests[i].entry = queue.insert(queue.end(), &requests[i]);
+		}
+
+		//answer a random third of them through their IDs
+		std::vector<bool> answered(requests.size(), false);
+
+		for (ULONG i = 0; i < requests.size() / 3; ++i) {
+			ULONG id = requests[std::rand() % requests.size()].id;
+			Request* pRequest = (Request*)OsrCommRequestTableLookup(&table, id);
+
+			//already answered: the ID is stale
+			if (!pRequest)
+				continue;
+
+			CHECK(!answered[pRequest->number]);
+			answered[pRequest->number] = true;
+
+			queue.erase(pRequest->entry);
+			OsrCommRequestTableRemove(&table, id);
+		}
+
+		//the rest is dispatched in arrival order
+		ULONG last = 0;
+		BOOLEAN first = TRUE;
+
+		while (!queue.empty()) {
+			Request* pRequest = queue.front();
+			queue.pop_front();
+
+			CHECK(!answered[pRequest->number]);
+			CHECK(first || pRequest->number > last);
+
+			last = pRequest->number;
+			first = FALSE;
+
+			CHECK(OsrCommRequestTableLookup(&table, pRequest->id) == pRequest);
+			OsrCommRequestTableRemove(&table, pRequest->id);
+		}
+
+		//every slot is free again
+		ULONG free_slots = 0;
+		for (ULONG index = table.FreeHead; index != OSR_COMM_REQUEST_NO_SLOT; index = table.Slots[index].NextFree)
+			++free_slots;
+
+		CHECK_EQUAL(free_slots, table.Capacity);
+
+		std::free(table.Slots);
+	}
+
+	//DeviceOp.c's DataQueueOf: new requests by processor, the others by the queue their ID names
+	void test_queue_index()
+	{
+		for (ULONG processor = 0; processor < 4 * OSR_COMM_DATA_QUEUES; ++processor)
+			CHECK_EQUAL(OsrCommDataQueueIndex(OSR_COMM_REQUEST_NO_SLOT, processor), processor % OSR_COMM_DATA_QUEUES);
+
+		for (ULONG queue = 0; queue < OSR_COMM_DATA_QUEUES; ++queue) {
+			OSR_COMM_REQUEST_TABLE reads, writes;
+			Request read, write;
+
+			OsrCommRequestTableInit(&reads, queue << OSR_COMM_REQUEST_QUEUE_SHIFT);
+			OsrCommRequestTableInit(&writes, OSR_COMM_REQUEST_WRITE_ID | (queue << OSR_COMM_REQUEST_QUEUE_SHIFT));
+
+			CHECK(insert(&reads, &read));
+			CHECK(insert(&writes, &write));
+
+			//answered on any processor
+			for (ULONG processor = 0; processor < 2 * OSR_COMM_DATA_QUEUES; ++processor) {
+				CHECK_EQUAL(OsrCommDataQueueIndex(read.id, processor), queue);
+				CHECK_EQUAL(OsrCommDataQueueIndex(write.id, processor), queue);
+			}
+
+			std::free(reads.Slots);
+			std::free(writes.Slots);
+		}
+	}
+}
+
+int main()
+{
+	test_lookup();
+	test_generation_wraps();
+	test_full();
+	test_fifo_dispatch();
+	test_queue_index();
+
+	std::printf("request_table_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <Windows.h>
+#include "../Client/Seqlock.h"
+#include "check.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//
+// Client/Seqlock.h: nothing published reads back zero at sequence 0; then
+// one writer publishing values whose every field is the number of the
+// publish, and readers that copy them meanwhile: no reader ever sees fields
+// from two publishes (a torn read), the value it gets is the one of the
+// sequence Read returns, and a reader's sequences never go back.  The values
+// are large and nobody yields, so that threads are preempted halfway through
+// their copies even on a single processor.
+//
+
+namespace
+{
+	const ULONG kFields = 4096;
+
+	struct Value
+	{
+		ULONG64 fields[kFields];
+	};
+
+	void test_empty()
+	{
+		Seqlock<Value> seqlock;
+		Value value;
+
+		memset(&value, 0xFF, sizeof(value));
+
+		CHECK_EQUAL(seqlock.Read(value), 0);
+		for (ULONG i = 0; i < kFields; ++i)
+			CHECK_EQUAL(value.fields[i], 0);
+	}
+
+	void reader(Seqlock<Value>* pSeqlock, std::atomic<bool>* pDone, ULONG64* pReads)
+	{
+		LONG last = 0;
+		ULONG64 reads = 0;
+		std::vector<Value> value(1);
+
+		while (!pDone->load()) {
+			LONG sequence = pSeqlock->Read(value[0]);
+
+			CHECK(sequence >= last);
+			last = sequence;
+
+			for (ULONG i = 0; i < kFields; ++i)
+				CHECK_EQUAL(value[0].fields[i], (ULONG64)sequence);
+
+			++reads;
+		}
+
+		*pReads = reads;
+	}
+
+	void test_readers(ULONG readers, double seconds)
+	{
+		std::unique_ptr<Seqlock<Value>> seqlock(new Seqlock<Value>);
+		std::atomic<bool> done(false);
+		std::vector<ULONG64> reads(readers);
+		std::vector<std::thread> threads;
+		std::vector<Value> value(1);
+		ULONG publishes = 0;
+
+		for (ULONG i = 0; i < readers; ++i)
+			threads.emplace_back(reader, seqlock.get(), &done, &reads[i]);
+
+		auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+
+		while (std::chrono::steady_clock::now() < end) {
+			++publishes;
+
+			for (ULONG i = 0; i < kFields; ++i)
+				value[0].fields[i] = publishes;
+
+			seqlock->Publish(value[0]);
+		}
+
+		done = true;
+
+		ULONG64 total = 0;
+
+		for (ULONG i = 0; i < readers; ++i) {
+			threads[i].join();
+			total += reads[i];
+		}
+
+		CHECK_EQUAL(seqlock->Read(value[0]), publishes);
+		CHECK_EQUAL(value[0].fields[kFields - 1], publishes);
+
+		std::printf("%u readers, %u publishes: %llu reads, none torn\n", readers, publishes, (unsigned long long)total);
+	}
+}
+
+int main()
+{
+	test_empty();
+
+	test_readers(1, 0.3);
+	test_readers(4, 0.3);
+	test_readers(16, 0.3);
+
+	std::printf("seqlock_test: passed\n");
+	return 0;
+}
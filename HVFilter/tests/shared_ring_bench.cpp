@@ -0,0 +1,63 @@
+#include "shared_ring_process.h"
+
+#include <chrono>
+
+//
+// Export throughput over the shared rings: a producer process with 1 to N
+// threads (one ring each) against a consumer process, for chains of 1 and 32
+// frames per publish.  Reports records taken per second, the share dropped on
+// full rings and the wakeups (WAIT_RING completions in the driver) per 1000
+// records taken.
+//
+// usage: shared_ring_bench [max producers] [records per producer] [records per ring]
+//
+
+namespace
+{
+	ULONG64 g_checksum = 0;
+
+	void take(const HV_RING_RECORD* pRecord, PVOID pContext)
+	{
+		UNREFERENCED_PARAMETER(pContext);
+
+		g_checksum += pRecord->FrameLength;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	ULONG max_producers = argc > 1 ? std::atoi(argv[1]) : 4;
+	ULONG64 records = argc > 2 ? std::atoll(argv[2]) : 4000000;
+	ULONG records_per_ring = argc > 3 ? std::atoi(argv[3]) : 64 * 1024;
+	const ULONG chains[] = {1, 32};
+
+	std::printf("%llu records per producer, %u records per ring\n", (unsigned long long)records, records_per_ring);
+	std::printf("%10s %8s %16s %10s %16s\n", "producers", "chain", "taken/s", "dropped", "wakeups/1k");
+
+	for (ULONG producers = 1; producers <= max_producers; producers *= 2) {
+		for (ULONG c = 0; c < sizeof(chains) / sizeof(chains[0]); ++c) {
+			shared_ring::Mapping mapping = shared_ring::map_area(producers, records_per_ring);
+
+			auto start = std::chrono::steady_clock::now();
+
+			pid_t pid = shared_ring::fork_producer(mapping, records, chains[c]);
+			shared_ring::ConsumeResult result = shared_ring::consume(mapping, take, NULL);
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			if (!shared_ring::wait_producer(pid)) {
+				std::fprintf(stderr, "producer failed\n");
+				return 1;
+			}
+
+			std::printf("%10u %8u %16.0f %9.2f%% %16.2f\n", producers, chains[c],
+				result.consumed / elapsed.count(),
+				100.0 * HvRingDropped(mapping.area) / (producers * records),
+				result.consumed ? 1000.0 * mapping.pStatus->wakeups / result.consumed : 0.0);
+
+			shared_ring::unmap_area(mapping);
+		}
+	}
+
+	return g_checksum == 0xFFFFFFFFFFFFFFFFull;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <Windows.h>
+#include "../HVService/HVService/RingProtocol.h"
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+//
+// The driver and the service of RingProtocol.h as two processes sharing an
+// anonymous mapping.  The forked child is the driver: one producer thread per
+// ring, like the processors, publishing once per chain.  The parent is the
+// service.  Where the driver completes OSR_COMM_CONTROL_WAIT_RING, the child
+// wakes the parent through a futex on ConsumerWaiting.
+//
+
+namespace shared_ring
+{
+	//what the child tells the parent besides the rings
+	struct Status
+	{
+		volatile LONG done;
+		volatile LONG wakeups;
+	};
+
+	struct Mapping
+	{
+		PHV_RING_AREA area;
+		Status* pStatus;
+		ULONG length;
+		ULONG records_offset;
+		ULONG records_per_ring;
+	};
+
+	inline void* map_shared(size_t length)
+	{
+		void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			std::perror("mmap");
+			std::exit(1);
+		}
+
+		return p;
+	}
+
+	//a buffer of records_per_ring records in each of rings rings, laid out the way the driver does it
+	inline Mapping map_area(ULONG rings, ULONG records_per_ring)
+	{
+		Mapping mapping;
+
+		mapping.length = (ULONG)ALIGN_UP_BY(FIELD_OFFSET(HV_RING_AREA, Rings) + rings * sizeof(HV_RING_CONTROL), HV_RING_CACHE_LINE)
+			+ rings * records_per_ring * sizeof(HV_RING_RECORD);
+
+		mapping.area = (PHV_RING_AREA)map_shared(mapping.length);
+		mapping.pStatus = (Status*)map_shared(sizeof(Status));
+
+		if (!HvRingLayout(mapping.length, rings, &mapping.records_offset, &mapping.records_per_ring)) {
+			std::fprintf(stderr, "no room for %u rings in %u bytes\n", rings, mapping.length);
+			std::exit(1);
+		}
+
+		HvRingInitArea(mapping.area, rings, mapping.records_per_ring, mapping.records_offset);
+		return mapping;
+	}
+
+	inline void unmap_area(const Mapping& mapping)
+	{
+		munmap(mapping.area, mapping.length);
+		munmap(mapping.pStatus, sizeof(Status));
+	}
+
+	inline long futex(volatile LONG* address, int op, LONG value, const timespec* timeout)
+	{
+		return syscall(SYS_futex, (LONG*)address, op, value, timeout, NULL, 0);
+	}
+
+	//every field follows from the ring and the sequence, so a torn record shows
+	inline void fill(PHV_RING_RECORD pRecord, ULONG ring, ULONG64 sequence)
+	{
+		pRecord->Timestamp = sequence;
+		pRecord->PortId = ring;
+		pRecord->FrameLength = (ULONG)(sequence * 2654435761u);
+		pRecord->Direction = (USHORT)(sequence & 1);
+		pRecord->EtherType = 0x800;
+		pRecord->IpProtocol = 0x11;
+		pRecord->Reserved[0] = pRecord->Reserved[1] = pRecord->Reserved[2] = 0;
+		pRecord->SourceAddress = ~(ULONG)sequence;
+		pRecord->DestinationAddress = (ULONG)(sequence >> 32) ^ ring;
+		pRecord->SourcePort = (USHORT)sequence;
+		pRecord->DestinationPort = (USHORT)(sequence >> 16);
+		pRecord->Reserved2 = ring;
+	}
+
+	inline bool intact(const HV_RING_RECORD* pRecord)
+	{
+		HV_RING_RECORD expected;
+		fill(&expected, pRecord->PortId, pRecord->Timestamp);
+
+		return std::memcmp(pRecord, &expected, sizeof(expected)) == 0;
+	}
+
+	//the child: records attempts per ring, chain records per publish
+	inline void produce(const Mapping& mapping, ULONG64 records, ULONG chain)
+	{
+		PHV_RING_AREA area = mapping.area;
+		std::vector<std::thread> threads;
+
+		for (ULONG ring = 0; ring < area->RingCount; ++ring) {
+			threads.push_back(std::thread([&, ring] {
+				HV_RING_PRODUCER producer;
+				HvRingProducerInit(&producer, area, ring, mapping.records_per_ring, mapping.records_offset);
+
+				for (ULONG64 sequence = 0; sequence < records;) {
+					ULONG64 head = producer.Head;
+					ULONG64 tail = HvRingProducerTail(&producer);
+					ULONG dropped = 0;
+
+					for (ULONG n = 0; n < chain && sequence < records; ++n, ++sequence) {
+						PHV_RING_RECORD pRecord = HvRingProducerSlot(&producer, head, tail);
+						if (!pRecord) {
+							++dropped;
+							continue;
+						}
+
+						fill(pRecord, ring, sequence);
+						++head;
+					}
+
+					HvRingProducerPublish(&producer, head, dropped);
+
+					//what shared_ring_end does for an idle consumer
+					if (area->ConsumerWaiting && HvRingClaimWakeup(area)) {
+						InterlockedIncrement(&mapping.pStatus->wakeups);
+						futex(&area->ConsumerWaiting, FUTEX_WAKE, 1, NULL);
+					}
+
+					//on a full ring, let the consumer run on machines with fewer processors than threads
+					if (dropped)
+						sched_yield();
+				}
+			}));
+		}
+
+		for (size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+
+		//set before the wakeup is claimed: a consumer that sets ConsumerWaiting after the claim sees it
+		InterlockedExchange(&mapping.pStatus->done, 1);
+		HvRingClaimWakeup(area);
+		futex(&area->ConsumerWaiting, FUTEX_WAKE, 1, NULL);
+	}
+
+	inline pid_t fork_producer(const Mapping& mapping, ULONG64 records, ULONG chain)
+	{
+		pid_t pid = fork();
+		if (pid < 0) {
+			std::perror("fork");
+			std::exit(1);
+		}
+
+		if (pid == 0) {
+			produce(mapping, records, chain);
+			_exit(0);
+		}
+
+		return pid;
+	}
+
+	struct ConsumeResult
+	{
+		ULONG64 consumed;
+		ULONG64 sleeps;
+		ULONG64 lost_wakeups;
+	};
+
+	//the parent: drains like RingConsumer::Drain, sleeps like RingConsumer::Wait, until the child is done
+	inline ConsumeResult consume(const Mapping& mapping, PHV_RING_RECORD_ROUTINE routine, PVOID context)
+	{
+		PHV_RING_AREA area = mapping.area;
+		ConsumeResult result = {0, 0, 0};
+
+		for (;;) {
+			BOOLEAN done = mapping.pStatus->done != 0;
+			ULONG count = 0;
+
+			for (ULONG ring = 0; ring < area->RingCount; ++ring)
+				count += HvRingConsume(area, ring, routine, context);
+
+			result.consumed += count;
+
+			//records published before done are taken by the pass after it was seen
+			if (done && !count)
+				break;
+
+			if (count || !HvRingPrepareWait(area, 1))
+				continue;
+
+			if (mapping.pStatus->done) {
+				InterlockedExchange(&area->ConsumerWaiting, 0);
+				continue;
+			}
+
+			++result.sleeps;
+
+			//a producer that published after ConsumerWaiting was set must not leave it set
+			timespec timeout = {5, 0};
+			while (area->ConsumerWaiting) {
+				if (futex(&area->ConsumerWaiting, FUTEX_WAIT, 1, &timeout) < 0 && errno == ETIMEDOUT) {
+					if (HvRingPending(area))
+						++result.lost_wakeups;
+
+					InterlockedExchange(&area->ConsumerWaiting, 0);
+				}
+			}
+		}
+
+		return result;
+	}
+
+	inline bool wait_producer(pid_t pid)
+	{
+		int status = 0;
+
+		return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+}
@@ -0,0 +1,189 @@
+#include "shared_ring_process.h"
+#include "check.h"
+
+//
+// RingProtocol.h: the layout fits the buffer, a full ring drops and counts, a
+// Tail moved past Head stops the producer, and a producer process feeding a
+// consumer process over shared memory loses, reorders or tears no record and
+// never leaves the consumer asleep with records waiting.
+//
+
+namespace
+{
+	void test_layout()
+	{
+		ULONG offset = 0;
+		ULONG records = 0;
+
+		//too small for the controls, then for HV_RING_MIN_RECORDS records per ring
+		CHECK(!HvRingLayout(64, 4, &offset, &records));
+		CHECK(!HvRingLayout(64 + 4 * 128 + 4 * (HV_RING_MIN_RECORDS - 1) * sizeof(HV_RING_RECORD), 4, &offset, &records));
+		CHECK(!HvRingLayout(1024 * 1024, 0, &offset, &records));
+
+		for (ULONG rings = 1; rings <= 64; ++rings) {
+			for (ULONG length = 64 * 1024; length <= HV_RING_MAX_BUFFER; length *= 4) {
+				ULONG controls = (ULONG)ALIGN_UP_BY(FIELD_OFFSET(HV_RING_AREA, Rings) + rings * sizeof(HV_RING_CONTROL), HV_RING_CACHE_LINE);
+				BOOLEAN fits = length >= controls + rings * HV_RING_MIN_RECORDS * sizeof(HV_RING_RECORD);
+
+				CHECK_EQUAL(HvRingLayout(length, rings, &offset, &records), fits);
+				if (!fits)
+					continue;
+
+				CHECK_EQUAL(offset % HV_RING_CACHE_LINE, 0);
+				CHECK(offset >= FIELD_OFFSET(HV_RING_AREA, Rings) + rings * sizeof(HV_RING_CONTROL));
+				CHECK_EQUAL(records & (records - 1), 0);
+				CHECK(records >= HV_RING_MIN_RECORDS);
+
+				//fits, and a ring twice as large would not
+				CHECK(offset + (ULONG64)rings * records * sizeof(HV_RING_RECORD) <= length);
+				CHECK(offset + (ULONG64)rings * records * 2 * sizeof(HV_RING_RECORD) > length);
+			}
+		}
+	}
+
+	struct Checker
+	{
+		std::vector<ULONG64> next;
+		ULONG64 torn;
+	};
+
+	void check_record(const HV_RING_RECORD* pRecord, PVOID pContext)
+	{
+		Checker* pChecker = (Checker*)pContext;
+
+		CHECK(pRecord->PortId < pChecker->next.size());
+
+		if (!shared_ring::intact(pRecord)) {
+			++pChecker->torn;
+			return;
+		}
+
+		//in order; gaps are records dropped on a full ring
+		CHECK(pRecord->Timestamp >= pChecker->next[pRecord->PortId]);
+		pChecker->next[pRecord->PortId] = pRecord->Timestamp + 1;
+	}
+
+	void test_full()
+	{
+		shared_ring::Mapping mapping = shared_ring::map_area(2, HV_RING_MIN_RECORDS);
+		HV_RING_PRODUCER producer;
+		Checker checker = {std::vector<ULONG64>(2, 0), 0};
+
+		CHECK_EQUAL(mapping.records_per_ring, HV_RING_MIN_RECORDS);
+
+		HvRingProducerInit(&producer, mapping.area, 1, mapping.records_per_ring, mapping.records_offset);
+
+		//a chain of 100 frames: 64 fit, 36 are dropped
+		ULONG64 head = producer.Head;
+		ULONG64 tail = HvRingProducerTail(&producer);
+		ULONG dropped = 0;
+
+		for (ULONG64 sequence = 0; sequence < 100; ++sequence) {
+			PHV_RING_RECORD pRecord = HvRingProducerSlot(&producer, head, tail);
+			if (!pRecord) {
+				++dropped;
+				continue;
+			}
+
+			shared_ring::fill(pRecord, 1, sequence);
+			++head;
+		}
+
+		//nothing is visible before the publish
+		CHECK_EQUAL(HvRingPending(mapping.area), 0);
+
+		HvRingProducerPublish(&producer, head, dropped);
+
+		CHECK_EQUAL(HvRingPending(mapping.area), HV_RING_MIN_RECORDS);
+		CHECK_EQUAL(HvRingProducerPending(&producer), HV_RING_MIN_RECORDS);
+		CHECK_EQUAL(HvRingDropped(mapping.area), 36);
+
+		CHECK_EQUAL(HvRingConsume(mapping.area, 0, check_record, &checker), 0);
+		CHECK_EQUAL(HvRingConsume(mapping.area, 1, check_record, &checker), HV_RING_MIN_RECORDS);
+		CHECK_EQUAL(checker.torn, 0);
+		CHECK_EQUAL(checker.next[1], HV_RING_MIN_RECORDS);
+
+		//the space is back
+		tail = HvRingProducerTail(&producer);
+		CHECK(HvRingProducerSlot(&producer, head, tail) != NULL);
+
+		//a Tail moved past Head, by a broken or hostile consumer, is never written behind
+		mapping.area->Rings[1].Tail = head + 5;
+		tail = HvRingProducerTail(&producer);
+		CHECK(HvRingProducerSlot(&producer, head, tail) == NULL);
+		CHECK_EQUAL(HvRingProducerPending(&producer), 0);
+
+		shared_ring::unmap_area(mapping);
+	}
+
+	void test_wait()
+	{
+		shared_ring::Mapping mapping = shared_ring::map_area(1, HV_RING_MIN_RECORDS);
+		HV_RING_PRODUCER producer;
+
+		HvRingProducerInit(&producer, mapping.area, 0, mapping.records_per_ring, mapping.records_offset);
+
+		//nothing waiting: the consumer may sleep, and the first publish claims the wakeup once
+		CHECK(HvRingPrepareWait(mapping.area, 1));
+		CHECK_EQUAL(mapping.area->ConsumerWaiting, 1);
+
+		shared_ring::fill(HvRingProducerSlot(&producer, 0, HvRingProducerTail(&producer)), 0, 0);
+		HvRingProducerPublish(&producer, 1, 0);
+
+		CHECK(HvRingClaimWakeup(mapping.area));
+		CHECK(!HvRingClaimWakeup(mapping.area));
+
+		//a record waiting already: no sleep, and the flag stays clear
+		CHECK(!HvRingPrepareWait(mapping.area, 1));
+		CHECK_EQUAL(mapping.area->ConsumerWaiting, 0);
+
+		//unless the consumer holds out for more
+		CHECK(HvRingPrepareWait(mapping.area, 2));
+
+		shared_ring::unmap_area(mapping);
+	}
+
+	//one producer process, one thread per ring, against the consumer in this process
+	void test_two_processes(ULONG rings, ULONG records_per_ring, ULONG64 records, ULONG chain)
+	{
+		shared_ring::Mapping mapping = shared_ring::map_area(rings, records_per_ring);
+		Checker checker = {std::vector<ULONG64>(rings, 0), 0};
+
+		pid_t pid = shared_ring::fork_producer(mapping, records, chain);
+		shared_ring::ConsumeResult result = shared_ring::consume(mapping, check_record, &checker);
+
+		CHECK(shared_ring::wait_producer(pid));
+
+		CHECK_EQUAL(checker.torn, 0);
+		CHECK_EQUAL(result.lost_wakeups, 0);
+
+		//every attempt was either taken by the consumer or counted as dropped
+		CHECK_EQUAL(result.consumed + HvRingDropped(mapping.area), rings * records);
+		CHECK_EQUAL(HvRingPending(mapping.area), 0);
+
+		for (ULONG ring = 0; ring < rings; ++ring)
+			CHECK(checker.next[ring] <= records);
+
+		std::printf("%u rings of %u, chains of %u: %llu of %llu records consumed, %llu sleeps, %d wakeups\n",
+			rings, mapping.records_per_ring, chain,
+			(unsigned long long)result.consumed, (unsigned long long)rings * records,
+			(unsigned long long)result.sleeps, (int)mapping.pStatus->wakeups);
+
+		shared_ring::unmap_area(mapping);
+	}
+}
+
+int main()
+{
+	test_layout();
+	test_full();
+	test_wait();
+
+	//small rings wrap and fill all the time, single frame chains publish the most
+	test_two_processes(4, 256, 250000, 1);
+	test_two_processes(4, 256, 250000, 32);
+	test_two_processes(1, 4096, 1000000, 8);
+
+	std::printf("shared_ring_test: passed\n");
+	return 0;
+}
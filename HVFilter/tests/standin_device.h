@@ -0,0 +1,315 @@
+#pragma once
+
+#include <Windows.h>
+#include "../HVService/HVService/BatchProtocol.h"
+#include "../base/RequestTable.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+//
+// Stand-in for the request path of the control device (DeviceOp.c), for the
+// tests and benchmarks of the service side.  Data requests (the reads and
+// writes of applications) wait in a FIFO queue and are found by ID through
+// RequestTable.h.  An exchange (OSR_COMM_CONTROL_EXCHANGE_BATCH) applies the
+// completions it carries, then takes queued requests with the writer of
+// BatchProtocol.h, or waits on the batch queue until a request is queued.
+// Completed exchanges go to a completion queue, where the driver's would go to
+// the service's I/O completion port.
+//
+
+namespace standin
+{
+	//a read or write IRP of an application
+	struct DataRequest
+	{
+		ULONG type;
+		//read length, or write payload
+		ULONG length;
+		const BYTE* payload;
+
+		//set when the service answers, or the device fails the request
+		ULONG id;
+		ULONG response_type;
+		ULONG response_length;
+		bool queued;
+		bool completed;
+		bool failed;
+		std::condition_variable done;
+
+		//when the device took the request, and when it was answered or failed
+		std::chrono::steady_clock::time_point submitted;
+		std::chrono::steady_clock::time_point answered;
+	};
+
+	//one OVERLAPPED exchange
+	struct Exchange
+	{
+		//output buffer; none for an exchange that only carries completions
+		BYTE* buffer;
+		ULONG length;
+
+		//set at completion: bytes of batch returned, FALSE if the device was closed under it
+		ULONG returned;
+		BOOL status;
+	};
+
+	//what a completion port hands out: the key of a posted packet, or a completed exchange
+	struct Completion
+	{
+		ULONG_PTR key;
+		Exchange* exchange;
+	};
+
+	struct Statistics
+	{
+		ULONG64 exchanges;
+		ULONG64 submitted;
+		ULONG64 completed;
+
+		//completions for IDs that are stale, foreign or of the wrong type
+		ULONG64 rejected;
+	};
+
+	//a response for up to count completions, on the heap: Completions[1] inside a larger object is bounded by it at -O2
+	inline POSR_COMM_BATCH_RESPONSE allocate_response(std::vector<ULONG64>& storage, ULONG count)
+	{
+		storage.assign(OSR_COMM_BATCH_RESPONSE_LENGTH(count) / sizeof(ULONG64) + 1, 0);
+		return (POSR_COMM_BATCH_RESPONSE)storage.data();
+	}
+
+	class CompletionQueue
+	{
+	public:
+		void post(ULONG_PTR key, Exchange* exchange)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			Completion completion = {key, exchange};
+			m_queue.push_back(completion);
+			m_ready.notify_one();
+		}
+
+		Completion get()
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			m_ready.wait(lock, [this] { return !m_queue.empty(); });
+
+			Completion completion = m_queue.front();
+			m_queue.pop_front();
+			return completion;
+		}
+
+	private:
+		std::mutex m_lock;
+		std::condition_variable m_ready;
+		std::deque<Completion> m_queue;
+	};
+
+	class Device
+	{
+	public:
+		explicit Device(CompletionQueue& port) : m_port(port), m_closed(false)
+		{
+			OsrCommRequestTableInit(&m_table, 0);
+			m_stats = Statistics();
+		}
+
+		~Device()
+		{
+			close();
+			std::free(m_table.Slots);
+		}
+
+		//queues a data request, or hands it to an exchange waiting for one; FALSE once closed
+		bool submit(DataRequest* pRequest)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			pRequest->completed = false;
+			pRequest->failed = false;
+
+			if (m_closed || !insert(pRequest))
+				return false;
+
+			m_queue.push_back(pRequest);
+			pRequest->queued = true;
+			pRequest->submitted = std::chrono::steady_clock::now();
+			++m_stats.submitted;
+
+			if (!m_waiting.empty()) {
+				Exchange* pExchange = m_waiting.front();
+
+				if (fill(pExchange)) {
+					m_waiting.pop_front();
+					m_port.post(0, pExchange);
+				}
+			}
+
+			return true;
+		}
+
+		//blocks until the request was answered or failed
+		void wait(DataRequest* pRequest)
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			pRequest->done.wait(lock, [pRequest] { return pRequest->completed; });
+		}
+
+		//OSR_COMM_CONTROL_EXCHANGE_BATCH: the exchange completes to the port, now or once a request is queued
+		NTSTATUS exchange(const OSR_COMM_BATCH_RESPONSE* pResponse, ULONG response_length, Exchange* pExchange)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			++m_stats.exchanges;
+
+			if (response_length && !OsrCommBatchResponseValid((POSR_COMM_BATCH_RESPONSE)pResponse, response_length))
+				return STATUS_INVALID_PARAMETER;
+
+			if (pExchange->length && pExchange->length < OSR_COMM_BATCH_MIN_LENGTH)
+				return STATUS_BUFFER_TOO_SMALL;
+
+			for (ULONG i = 0; response_length && i < pResponse->Count; ++i)
+				complete(&pResponse->Completions[i]);
+
+			pExchange->returned = 0;
+			pExchange->status = TRUE;
+
+			if (m_closed) {
+				pExchange->status = FALSE;
+				m_port.post(0, pExchange);
+			} else if (!pExchange->length || fill(pExchange)) {
+				m_port.post(0, pExchange);
+			} else {
+				m_waiting.push_back(pExchange);
+			}
+
+			return STATUS_PENDING;
+		}
+
+		//what closing the control handle does: waiting exchanges come back failed, pending requests are failed
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			if (m_closed)
+				return;
+
+			m_closed = true;
+
+			while (!m_waiting.empty()) {
+				m_waiting.front()->status = FALSE;
+				m_port.post(0, m_waiting.front());
+				m_waiting.pop_front();
+			}
+
+			for (ULONG index = 0; index < m_table.Capacity; ++index) {
+				DataRequest* pRequest = (DataRequest*)m_table.Slots[index].Request;
+
+				if (pRequest) {
+					OsrCommRequestTableRemove(&m_table, pRequest->id);
+					pRequest->answered = std::chrono::steady_clock::now();
+					pRequest->failed = true;
+					pRequest->completed = true;
+					pRequest->done.notify_all();
+				}
+			}
+
+			m_queue.clear();
+		}
+
+		Statistics statistics()
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			return m_stats;
+		}
+
+	private:
+		bool insert(DataRequest* pRequest)
+		{
+			if (OSR_COMM_REQUEST_NO_SLOT == m_table.FreeHead) {
+				ULONG capacity = OsrCommRequestTableGrowCapacity(&m_table);
+				if (!capacity)
+					return false;
+
+				std::free(OsrCommRequestTableGrow(&m_table, (POSR_COMM_REQUEST_SLOT)std::malloc(capacity * sizeof(OSR_COMM_REQUEST_SLOT))));
+			}
+
+			return OsrCommRequestTableInsert(&m_table, pRequest, &pRequest->id);
+		}
+
+		//what FillControlBatch does; m_lock is held
+		ULONG fill(Exchange* pExchange)
+		{
+			OSR_COMM_BATCH_WRITER writer;
+
+			OsrCommBatchWriterInit(&writer, pExchange->buffer, pExchange->length);
+
+			while (!m_queue.empty()) {
+				DataRequest* pRequest = m_queue.front();
+				ULONG payload = OSR_COMM_WRITE_REQUEST == pRequest->type ? pRequest->length : 0;
+
+				if (!OsrCommBatchWriterFit(&writer, &payload))
+					break;
+
+				m_queue.pop_front();
+				pRequest->queued = false;
+
+				BOOLEAN room;
+
+				if (OSR_COMM_WRITE_REQUEST == pRequest->type) {
+					RtlCopyMemory(writer.Next + 1, pRequest->payload, payload);
+					room = OsrCommBatchWriterAppend(&writer, pRequest->id, OSR_COMM_WRITE_REQUEST, payload, payload);
+				} else {
+					room = OsrCommBatchWriterAppend(&writer, pRequest->id, OSR_COMM_READ_REQUEST, pRequest->length, 0);
+				}
+
+				if (!room)
+					break;
+			}
+
+			if (writer.Batch->Count)
+				pExchange->returned = OsrCommBatchWriterLength(&writer);
+
+			return writer.Batch->Count;
+		}
+
+		//what CompleteDataRequest does; m_lock is held
+		void complete(const OSR_COMM_BATCH_COMPLETION* pCompletion)
+		{
+			DataRequest* pRequest = (DataRequest*)OsrCommRequestTableLookup(&m_table, pCompletion->RequestID);
+
+			//still queued (never handed out) or answered with the wrong type: not applied, like a bad single response
+			if (!pRequest || pRequest->queued ||
+				pCompletion->ResponseType != (OSR_COMM_READ_REQUEST == pRequest->type ? OSR_COMM_READ_RESPONSE : OSR_COMM_WRITE_RESPONSE)) {
+				++m_stats.rejected;
+				return;
+			}
+
+			OsrCommRequestTableRemove(&m_table, pCompletion->RequestID);
+
+			pRequest->response_type = pCompletion->ResponseType;
+			pRequest->response_length = pCompletion->ResponseBufferLength;
+			pRequest->answered = std::chrono::steady_clock::now();
+			pRequest->completed = true;
+			++m_stats.completed;
+
+			pRequest->done.notify_all();
+		}
+
+		CompletionQueue& m_port;
+
+		std::mutex m_lock;
+		OSR_COMM_REQUEST_TABLE m_table;
+		std::deque<DataRequest*> m_queue;
+		std::deque<Exchange*> m_waiting;
+		bool m_closed;
+		Statistics m_stats;
+	};
+}
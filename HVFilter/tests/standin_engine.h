@@ -0,0 +1,311 @@
+#pragma once
+
+#include "standin_device.h"
+#include "../HVService/HVService/RequestDispatcher.h"
+#include "../HVService/HVService/RequestBufferPool.h"
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+//
+// RequestEngine's worker loop over the stand-in device: a number of exchanges
+// in flight, workers that take completed ones off the completion queue, answer
+// them through RequestDispatcher and post them again, deferred answers sent by
+// a flush exchange, and request buffers retained through RequestBufferPool,
+// with one spare per exchange in flight.  What differs from RequestEngine is only the
+// transport: Device::exchange for DeviceIoControl, CompletionQueue for the
+// I/O completion port.
+//
+
+namespace standin
+{
+	class Engine
+	{
+	public:
+		//the completion keys of RequestEngine
+		static const ULONG_PTR kExchange = 0;
+		static const ULONG_PTR kFlush = 1;
+		static const ULONG_PTR kQuit = 2;
+
+		Engine(Device& device, CompletionQueue& port) : m_device(device), m_port(port), m_stopping(false)
+		{
+			m_flush_response = allocate_response(m_flush_storage, OSR_COMM_BATCH_MAX_REQUESTS);
+			m_flush = Exchange();
+		}
+
+		~Engine()
+		{
+			stop();
+		}
+
+		void start(ULONG outstanding, ULONG buffer_length, ULONG workers, RequestDispatcher::RequestHandler pfnHandler, PVOID pContext)
+		{
+			ULONG stride = (buffer_length + sizeof(ULONG64) - 1) / sizeof(ULONG64);
+
+			m_stopping = false;
+			m_dispatcher.Open(pfnHandler, pContext);
+
+			//the request buffers of all the slots in one array, spares included
+			m_slots.resize(outstanding * 2);
+			m_buffers.assign(m_slots.size() * stride, 0);
+			m_pool.Init(m_buffers.data(), stride * sizeof(ULONG64), (DWORD)m_slots.size(), outstanding);
+
+			for (ULONG i = 0; i < m_slots.size(); ++i) {
+				Slot& slot = m_slots[i];
+
+				slot.exchange.buffer = (BYTE*)&m_buffers[i * stride];
+				slot.exchange.length = buffer_length;
+				slot.response = allocate_response(slot.response_storage, OSR_COMM_BATCH_MAX_REQUESTS);
+			}
+
+			//without any answers to carry, the first exchanges only fetch requests
+			for (ULONG i = 0; i < outstanding; ++i)
+				post(&m_slots[i], 0);
+
+			for (ULONG i = 0; i < workers; ++i)
+				m_workers.emplace_back(&Engine::work, this);
+		}
+
+		//the device is closed: waiting exchanges come back failed, pending requests are failed
+		void stop()
+		{
+			if (m_workers.empty())
+				return;
+
+			m_stopping = true;
+			m_device.close();
+
+			for (size_t i = 0; i < m_workers.size(); ++i)
+				m_port.post(kQuit, NULL);
+
+			for (auto& worker : m_workers)
+				worker.join();
+
+			m_workers.clear();
+			m_dispatcher.Close();
+		}
+
+		//RequestEngine::Complete
+		void complete(const OSR_COMM_BATCH_COMPLETION* pCompletion)
+		{
+			if (m_stopping)
+				return;
+
+			for (;;) {
+				switch (m_dispatcher.Defer(pCompletion)) {
+				case DeferFull:
+					flush();
+					break;
+
+				case DeferFlushNeeded:
+					m_port.post(kFlush, NULL);
+					return;
+
+				default:
+					return;
+				}
+			}
+		}
+
+		//RequestEngine::Retain and Release
+		void retain(const OSR_COMM_BATCH_ENTRY* pEntry)
+		{
+			m_pool.Retain(pEntry);
+		}
+
+		void release(const OSR_COMM_BATCH_ENTRY* pEntry)
+		{
+			DWORD slot = m_pool.Release(pEntry);
+
+			if (REQUEST_BUFFER_POOL_NONE == slot || m_stopping)
+				return;
+
+			//an exchange went unposted for want of this buffer
+			Slot* pSlot = &m_slots[slot];
+			ULONG count = m_dispatcher.TakeDeferred(pSlot->response->Completions, OSR_COMM_BATCH_MAX_REQUESTS);
+
+			pSlot->response->Count = count;
+			post(pSlot, count ? OSR_COMM_BATCH_RESPONSE_LENGTH(count) : 0);
+		}
+
+		ULONG64 flushes() const
+		{
+			return m_flushes;
+		}
+
+		DWORD starved() const
+		{
+			return m_pool.GetStarved();
+		}
+
+	private:
+		//one exchange in flight; the exchange comes first, the completion hands back a pointer to it
+		struct Slot
+		{
+			Exchange exchange;
+			POSR_COMM_BATCH_RESPONSE response;
+			std::vector<ULONG64> response_storage;
+		};
+
+		void work()
+		{
+			for (;;) {
+				Completion completion = m_port.get();
+
+				if (kQuit == completion.key)
+					return;
+
+				if (kFlush == completion.key) {
+					flush();
+					continue;
+				}
+
+				//flush exchanges complete to the queue too; RequestEngine waits for them on an event
+				if (completion.exchange == &m_flush)
+					continue;
+
+				Slot* pSlot = (Slot*)completion.exchange;
+				if (!pSlot->exchange.status)
+					continue;
+
+				ULONG response_length = m_dispatcher.HandleBatch(pSlot->exchange.buffer, pSlot->exchange.returned, pSlot->response);
+
+				if (m_stopping)
+					continue;
+
+				DWORD slot = m_pool.Recycle((DWORD)(pSlot - m_slots.data()));
+
+				//retained, and no spare: the answers wait for the next exchange, this one for a release
+				if (REQUEST_BUFFER_POOL_NONE == slot) {
+					for (ULONG i = 0; response_length && i < pSlot->response->Count; ++i)
+						complete(&pSlot->response->Completions[i]);
+
+					continue;
+				}
+
+				//only the completions are copied, never a request or its payload
+				if (&m_slots[slot] != pSlot) {
+					std::memcpy(m_slots[slot].response, pSlot->response, response_length);
+					pSlot = &m_slots[slot];
+				}
+
+				post(pSlot, response_length);
+			}
+		}
+
+		void post(Slot* pSlot, ULONG response_length)
+		{
+			m_pool.Posted((DWORD)(pSlot - m_slots.data()));
+			m_device.exchange(pSlot->response, response_length, &pSlot->exchange);
+		}
+
+		//RequestEngine::Flush: no output buffer, the device applies the answers right away
+		void flush()
+		{
+			std::lock_guard<std::mutex> lock(m_flush_lock);
+
+			for (;;) {
+				ULONG count = m_dispatcher.TakeDeferred(m_flush_response->Completions, OSR_COMM_BATCH_MAX_REQUESTS);
+				if (!count)
+					break;
+
+				m_flush_response->Count = count;
+				m_flush_response->RegisteredBuffer = 0;
+
+				m_device.exchange(m_flush_response, OSR_COMM_BATCH_RESPONSE_LENGTH(count), &m_flush);
+				++m_flushes;
+			}
+		}
+
+		Device& m_device;
+		CompletionQueue& m_port;
+		RequestDispatcher m_dispatcher;
+		RequestBufferPool m_pool;
+
+		std::vector<Slot> m_slots;
+		std::vector<ULONG64> m_buffers;
+		std::vector<std::thread> m_workers;
+		std::atomic<bool> m_stopping;
+
+		std::mutex m_flush_lock;
+		Exchange m_flush;
+		POSR_COMM_BATCH_RESPONSE m_flush_response;
+		std::vector<ULONG64> m_flush_storage;
+		std::atomic<ULONG64> m_flushes{0};
+	};
+
+	//answers deferred requests from a thread of its own, the way the I/O a handler started would finish them
+	class LateAnswers
+	{
+	public:
+		explicit LateAnswers(Engine& engine) : m_engine(engine), m_done(false), m_thread(&LateAnswers::run, this)
+		{
+		}
+
+		~LateAnswers()
+		{
+			stop();
+		}
+
+		//from a handler that returned FALSE; a retained entry is released once answered
+		void add(const OSR_COMM_BATCH_COMPLETION& completion, const OSR_COMM_BATCH_ENTRY* pRetained = NULL)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+
+			Answer answer = {completion, pRetained};
+			m_answers.push_back(answer);
+			m_ready.notify_one();
+		}
+
+		//answers what is left, then returns
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+
+				m_done = true;
+				m_ready.notify_one();
+			}
+
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+	private:
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			for (;;) {
+				m_ready.wait(lock, [this] { return m_done || !m_answers.empty(); });
+				if (m_answers.empty())
+					return;
+
+				Answer answer = m_answers.front();
+				m_answers.pop_front();
+
+				lock.unlock();
+
+				m_engine.complete(&answer.completion);
+				if (answer.retained)
+					m_engine.release(answer.retained);
+
+				lock.lock();
+			}
+		}
+
+		struct Answer
+		{
+			OSR_COMM_BATCH_COMPLETION completion;
+			const OSR_COMM_BATCH_ENTRY* retained;
+		};
+
+		Engine& m_engine;
+		std::mutex m_lock;
+		std::condition_variable m_ready;
+		std::deque<Answer> m_answers;
+		bool m_done;
+		std::thread m_thread;
+	};
+}
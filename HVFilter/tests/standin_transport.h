@@ -0,0 +1,279 @@
+#pragma once
+
+#include "../Pipes/PipeTransport.h"
+#include "../Pipes/Pipes.h"
+
+#include <atomic>
+#include <deque>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//
+// PipeTransport over a Unix domain socket, for PipeServer outside Windows:
+// the listening socket stands in for the waiting pipe instances, a connected
+// socket for a connected one, and a nonblocking send finished from poll for
+// an overlapped WriteFile.  A self-pipe stands in for the data and stop
+// events.  Readers connect with connect_reader.
+//
+
+namespace standin
+{
+	class SocketTransport : public PipeTransport
+	{
+	public:
+		explicit SocketTransport(const std::string& path) : m_path(path), m_listen(-1), m_stopped(false)
+		{
+			m_wake[0] = m_wake[1] = -1;
+
+			for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+				m_slots[i].fd = -1;
+				m_slots[i].pending = NULL;
+				m_slots[i].remaining = 0;
+			}
+		}
+
+		~SocketTransport()
+		{
+			for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+				if (m_slots[i].fd >= 0)
+					close(m_slots[i].fd);
+			}
+
+			if (m_listen >= 0) {
+				close(m_listen);
+				unlink(m_path.c_str());
+			}
+
+			if (m_wake[0] >= 0) {
+				close(m_wake[0]);
+				close(m_wake[1]);
+			}
+		}
+
+		bool open()
+		{
+			sockaddr_un address = address_of(m_path);
+
+			unlink(m_path.c_str());
+
+			if (pipe2(m_wake, O_NONBLOCK) != 0)
+				return false;
+
+			m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+			return m_listen >= 0 &&
+				bind(m_listen, (const sockaddr*)&address, sizeof(address)) == 0 &&
+				listen(m_listen, PIPE_MAX_CLIENTS) == 0;
+		}
+
+		PipeTransportEvent Wait(DWORD dwTimeout, int* pSlot) override
+		{
+			DWORD start = GetTickCount();
+
+			for (;;) {
+				if (m_stopped)
+					return PipeTransportEvent_Stop;
+
+				if (!m_events.empty()) {
+					Event event = m_events.front();
+
+					m_events.pop_front();
+					*pSlot = event.slot;
+					return event.event;
+				}
+
+				DWORD elapsed = GetTickCount() - start;
+
+				if (elapsed >= dwTimeout)
+					return PipeTransportEvent_Timeout;
+
+				poll_once(dwTimeout - elapsed);
+			}
+		}
+
+		bool Write(int slot, const void* pData, DWORD dwLength) override
+		{
+			Slot& target = m_slots[slot];
+
+			target.pending = (const BYTE*)pData;
+			target.remaining = dwLength;
+
+			//completes at once if the socket has room, like a pipe write that did not pend
+			return send_pending(slot);
+		}
+
+		void Notify() override
+		{
+			BYTE wake = 0;
+
+			//full: a wakeup is on its way already
+			if (write(m_wake[1], &wake, 1) < 0 && errno != EAGAIN)
+				std::abort();
+		}
+
+		void Stop() override
+		{
+			m_stopped = true;
+			Notify();
+		}
+
+		static sockaddr_un address_of(const std::string& path)
+		{
+			sockaddr_un address;
+
+			memset(&address, 0, sizeof(address));
+			address.sun_family = AF_UNIX;
+			strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+			return address;
+		}
+
+		//a reader, blocking; -1 if the server is not there
+		static int connect_reader(const std::string& path)
+		{
+			sockaddr_un address = address_of(path);
+			int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+			if (fd >= 0 && connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+				close(fd);
+				fd = -1;
+			}
+
+			return fd;
+		}
+
+	private:
+		struct Slot
+		{
+			int fd;
+
+			//the rest of the write in flight
+			const BYTE* pending;
+			DWORD remaining;
+		};
+
+		struct Event
+		{
+			PipeTransportEvent event;
+			int slot;
+		};
+
+		void push(PipeTransportEvent event, int slot)
+		{
+			Event entry = {event, slot};
+
+			m_events.push_back(entry);
+		}
+
+		//the reader is gone, with the write in flight
+		void fail(int slot)
+		{
+			close(m_slots[slot].fd);
+			m_slots[slot].fd = -1;
+			m_slots[slot].pending = NULL;
+			m_slots[slot].remaining = 0;
+		}
+
+		//false if the reader is gone
+		bool send_pending(int slot)
+		{
+			Slot& target = m_slots[slot];
+
+			while (target.remaining) {
+				ssize_t sent = send(target.fd, target.pending, target.remaining, MSG_NOSIGNAL);
+
+				if (sent < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						return true;
+
+					fail(slot);
+					return false;
+				}
+
+				target.pending += sent;
+				target.remaining -= (DWORD)sent;
+			}
+
+			target.pending = NULL;
+			push(PipeTransportEvent_Written, slot);
+			return true;
+		}
+
+		void poll_once(DWORD timeout)
+		{
+			pollfd fds[2 + PIPE_MAX_CLIENTS];
+			int slots[PIPE_MAX_CLIENTS];
+			nfds_t count = 0;
+			bool room = false;
+
+			fds[count].fd = m_wake[0];
+			fds[count++].events = POLLIN;
+
+			for (int i = 0; i < PIPE_MAX_CLIENTS; ++i)
+				room = room || m_slots[i].fd < 0;
+
+			//a reader is only taken when a slot is free, like a pipe with every instance busy
+			fds[count].fd = room ? m_listen : -1;
+			fds[count++].events = POLLIN;
+
+			//readers never send: input is the end of the stream
+			for (int i = 0; i < PIPE_MAX_CLIENTS; ++i) {
+				if (m_slots[i].fd < 0)
+					continue;
+
+				slots[count - 2] = i;
+				fds[count].fd = m_slots[i].fd;
+				fds[count++].events = POLLIN | (m_slots[i].pending ? POLLOUT : 0);
+			}
+
+			if (poll(fds, count, (int)timeout) <= 0)
+				return;
+
+			if (fds[0].revents) {
+				BYTE drain[64];
+
+				while (read(m_wake[0], drain, sizeof(drain)) > 0)
+					;
+
+				push(PipeTransportEvent_Data, -1);
+			}
+
+			if (fds[1].revents & POLLIN) {
+				int fd = accept4(m_listen, NULL, NULL, SOCK_NONBLOCK);
+
+				for (int i = 0; fd >= 0 && i < PIPE_MAX_CLIENTS; ++i) {
+					if (m_slots[i].fd < 0) {
+						m_slots[i].fd = fd;
+						push(PipeTransportEvent_Connected, i);
+						break;
+					}
+				}
+			}
+
+			for (nfds_t f = 2; f < count; ++f) {
+				int slot = slots[f - 2];
+
+				if (fds[f].revents & (POLLIN | POLLHUP | POLLERR)) {
+					fail(slot);
+					push(PipeTransportEvent_Failed, slot);
+				} else if (fds[f].revents & POLLOUT) {
+					if (!send_pending(slot))
+						push(PipeTransportEvent_Failed, slot);
+				}
+			}
+		}
+
+		std::string m_path;
+		int m_listen;
+		int m_wake[2];
+		std::atomic<bool> m_stopped;
+		Slot m_slots[PIPE_MAX_CLIENTS];
+		std::deque<Event> m_events;
+	};
+}